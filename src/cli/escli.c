@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -44,6 +45,9 @@
 #include "log.h"
 
 #include "escli.h"
+#include "eshist.h"
+#include "esloop.h"
+#include "essys.h"
 
 #define ES_CLI_MAGIC          0x20140917
 
@@ -51,155 +55,369 @@
 
 #define ES_CLI_HOSTNAME_STR   PACKAGE_NAME
 
+#define ES_CLI_PROMPT_STR     ES_CLI_HOSTNAME_STR "> "
+
 #define ES_SERVER_PORT        8008
 
+/** Max commands registered by the other modules */
+#define ES_CLI_MAX_COMMANDS   64
+
+/** Max length of a formatted line */
+#define ES_CLI_MAX_LINE_SIZE  1024
+
+/** Max sessions open at the same time, the next ones are refused */
+#define ES_CLI_MAX_SESSIONS   16
+
+/** Session closed after this time without input (s) */
+#define ES_CLI_IDLE_TIMEOUT   300
+
+/** Output not read by the client above which the session is closed */
+#define ES_CLI_MAX_PENDING    (256 * 1024)
+
+struct _es_cli_cmd_s {
+   /* Full command path */
+   char                      *command;
+   /* Last word of the path */
+   char                      *word;
+   /* Help, NULL for a parent word */
+   char                      *help;
+   /* Index of the parent word, -1 for a top command */
+   int                        parent;
+   /* Handler, NULL for a parent word */
+   es_cli_cmd_cb              cb;
+   /* User reference */
+   void                      *arg;
+};
+
+/**
+ * @brief Telnet session, only touched by the CLI thread
+ */
+struct _es_cli_session_s {
+   /* CLI context */
+   struct es_cli_s            *cli;
+   /* Connection */
+   struct bufferevent         *bev;
+   /* libcli state of this session (mode, privilege, ...) */
+   struct cli_def             *def;
+   /* Command answering later: the next lines wait for it */
+   struct event               *deferEv;
+   es_cli_defer_cb            deferCb;
+   void                       *deferArg;
+   /* Sessions list */
+   struct _es_cli_session_s   *next;
+};
+
 struct es_cli_s {
    uint32_t                  magic;
-   /* base loop thread */
+   /* CLI own loop, never the SIP one */
    struct event_base         *base;
    /* */
    struct evconnlistener     *listener;
-   /* Cli Context */
-   struct cli_def            *cliCtx;
    /* CLI thread handler */
    pthread_t                  thread;
+   /* CLI thread is running */
+   int                        running;
+   /* CPU of the CLI thread, -1 for any */
+   int                        cpu;
+   /* Pipe to stop the CLI loop from another thread */
+   int                        wakeFd[2];
+   struct event               *wakeEv;
+   /* Open sessions */
+   struct _es_cli_session_s   *sessions;
+   unsigned int               sessionsNb;
+   /* Registered commands, parents first */
+   struct _es_cli_cmd_s       cmds[ES_CLI_MAX_COMMANDS];
+   /* Number of registered commands */
+   unsigned int               cmdsNb;
 };
 
-struct _es_cli_thd_s {
-   struct es_cli_s *pCtx;
-   evutil_socket_t fd;
-};
+static int _es_cli_dispatch(struct cli_def *pCliCtx, const char *command, char *argv[], int argc);
+
+static void _es_cli_session_event_cb(struct bufferevent *bev, short events, void *pCtx);
 
-#if 0
-void _es_bufferevent_read_data_cb(struct bufferevent *bev, void *pCtx)
+static void * _es_cli_thread(void *pCtx)
 {
    struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
 
-   if (_pCtx == (struct es_cli_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "NULLPTR for Context");
-      return;
+   /* Away from the SIP thread CPU */
+   (void)es_sys_pin_thread("cli", _pCtx->cpu);
+
+   ESIP_TRACE(ESIP_LOG_INFO, "CLI loop started");
+
+   if (event_base_dispatch(_pCtx->base) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "CLI loop failed");
    }
 
-   /* Check Magic */
-   if (_pCtx->magic != ES_CLI_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic: expected(%d) (%d)", ES_CLI_MAGIC, _pCtx->magic);
+   ESIP_TRACE(ESIP_LOG_INFO, "CLI loop stopped");
+   return NULL;
+}
+
+static void _es_cli_wake_cb(evutil_socket_t fd, short event, void *pCtx)
+{
+   struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
+   char c;
+
+   while (read(fd, &c, 1) > 0) {
+   }
+
+   (void)event_base_loopbreak(_pCtx->base);
+}
+
+static void _es_cli_session_free(struct _es_cli_session_s *pSession)
+{
+   struct es_cli_s *_pCtx = pSession->cli;
+   struct _es_cli_session_s **pp = &_pCtx->sessions;
+
+   for (; *pp != NULL; pp = &(*pp)->next) {
+      if (*pp == pSession) {
+         *pp = pSession->next;
+         _pCtx->sessionsNb--;
+         break;
+      }
+   }
+
+   /* A command still waiting releases what it holds */
+   if (pSession->deferCb != NULL) {
+      es_cli_defer_cb cb = pSession->deferCb;
+      pSession->deferCb = NULL;
+      cb(NULL, pSession->deferArg);
+   }
+   if (pSession->deferEv != NULL) {
+      event_free(pSession->deferEv);
+   }
+
+   bufferevent_free(pSession->bev);
+   cli_done(pSession->def);
+   free(pSession);
+}
+
+static void _es_cli_session_flushed_cb(struct bufferevent *bev, void *pCtx)
+{
+   _es_cli_session_free((struct _es_cli_session_s *)pCtx);
+}
+
+/**
+ * @brief Close a session once the client got its pending output
+ */
+static void _es_cli_session_close(struct _es_cli_session_s *pSession)
+{
+   if (evbuffer_get_length(bufferevent_get_output(pSession->bev)) == 0) {
+      _es_cli_session_free(pSession);
       return;
    }
 
-   /* This callback is invoked when there is data to read on bev. */
+   bufferevent_disable(pSession->bev, EV_READ);
+   bufferevent_setcb(pSession->bev, NULL, _es_cli_session_flushed_cb, _es_cli_session_event_cb, pSession);
+}
+
+static void _es_cli_session_print_cb(struct cli_def *pCliCtx, const char *line)
+{
+   struct _es_cli_session_s *pSession = (struct _es_cli_session_s *)cli_get_context(pCliCtx);
+
+   evbuffer_add_printf(bufferevent_get_output(pSession->bev), "%s\r\n", line);
+}
+
+/**
+ * @brief Remove the telnet commands (IAC ...) sent by the client
+ */
+static void _es_cli_strip_telnet(char *line)
+{
+   unsigned char *in = (unsigned char *)line;
+   unsigned char *out = (unsigned char *)line;
+
+   while (*in != '\0') {
+      if (*in == 0xff) {
+         /* IAC <cmd> [<option>] */
+         in++;
+         if ((*in >= 0xfb) && (*in <= 0xfe) && (in[1] != '\0')) {
+            in++;
+         }
+         if (*in != '\0') {
+            in++;
+         }
+         continue;
+      }
+      *out++ = *in++;
+   }
+   *out = '\0';
+}
+
+static void _es_cli_session_read_cb(struct bufferevent *bev, void *pCtx)
+{
+   struct _es_cli_session_s *pSession = (struct _es_cli_session_s *)pCtx;
    struct evbuffer *input = bufferevent_get_input(bev);
    struct evbuffer *output = bufferevent_get_output(bev);
+   char *line = NULL;
+   size_t len = 0;
 
-   size_t len = evbuffer_get_length(input);
-   char *data;
-   data = malloc(len);
-   evbuffer_copyout(input, data, len);
+   while ((pSession->deferCb == NULL) &&
+          ((line = evbuffer_readln(input, &len, EVBUFFER_EOL_CRLF)) != NULL)) {
+      int ret = CLI_OK;
 
-   printf("we got some data: %s\n", data);
+      _es_cli_strip_telnet(line);
+      if (line[0] != '\0') {
+         ret = cli_run_command(pSession->def, line);
+      }
+      free(line);
 
-   /* Copy all the data from the input buffer to the output buffer. */
-   evbuffer_add_buffer(output, input);
-   free(data);
+      if (ret == CLI_QUIT) {
+         _es_cli_session_close(pSession);
+         return;
+      }
+
+      /* Prompt once the command answered */
+      if (pSession->deferCb == NULL) {
+         evbuffer_add_printf(output, ES_CLI_PROMPT_STR);
+      }
+   }
+
+   /* A client sending endless lines or not reading its answers is dropped */
+   if ((evbuffer_get_length(input) > ES_CLI_MAX_LINE_SIZE) ||
+       (evbuffer_get_length(output) > ES_CLI_MAX_PENDING)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Closing CLI session: line too long or client too slow");
+      _es_cli_session_free(pSession);
+   }
 }
-#endif
 
-static void * _es_start_cli_thread(void *pCtx)
+static void _es_cli_session_defer_cb(evutil_socket_t fd, short event, void *pCtx)
 {
-   struct es_cli_s *_pCtx = NULL;
-   int fd = -1;
-   struct _es_cli_thd_s *pThdCtx = (struct _es_cli_thd_s *)pCtx;
-   if (pThdCtx == (struct _es_cli_thd_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "NULLPTR for Context");
-      return NULL;
+   struct _es_cli_session_s *pSession = (struct _es_cli_session_s *)pCtx;
+   es_cli_defer_cb cb = pSession->deferCb;
+   uint64_t cbTs = es_hist_now();
+
+   if (cb == NULL) {
+      return;
    }
 
-   _pCtx = (struct es_cli_s *)pThdCtx->pCtx;
-   if (_pCtx == (struct es_cli_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "NULLPTR for Context");
-      return NULL;
+   pSession->deferCb = NULL;
+   cb(pSession->def, pSession->deferArg);
+   es_loop_cb_done(ES_HIST_CB_CLI, "deferred command", cbTs);
+
+   /* Deferred again, or done: prompt and the lines typed meanwhile */
+   if (pSession->deferCb == NULL) {
+      evbuffer_add_printf(bufferevent_get_output(pSession->bev), ES_CLI_PROMPT_STR);
+      _es_cli_session_read_cb(pSession->bev, pSession);
    }
-   fd = pThdCtx->fd;
-   if (fd == -1) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Socket descriprot is not valid");
-      return NULL;
+}
+
+static void _es_cli_session_event_cb(struct bufferevent *bev, short events, void *pCtx)
+{
+   struct _es_cli_session_s *pSession = (struct _es_cli_session_s *)pCtx;
+
+   if (events & BEV_EVENT_TIMEOUT) {
+      ESIP_TRACE(ESIP_LOG_INFO, "Closing idle CLI session");
+   }
+
+   if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)) {
+      _es_cli_session_free(pSession);
    }
+}
+
+/**
+ * @brief libcli state of a new session, with all the registered commands
+ */
+static struct cli_def *_es_cli_session_def(struct _es_cli_session_s *pSession)
+{
+   struct es_cli_s *_pCtx = pSession->cli;
+   struct cli_command *nodes[ES_CLI_MAX_COMMANDS];
+   struct cli_def *def = cli_init();
+   unsigned int i = 0;
 
-   if (cli_loop(_pCtx->cliCtx, fd) != 0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start CLI for new connection");
+   if (def == NULL) {
       return NULL;
    }
 
-   free(pThdCtx);
-   pThdCtx = NULL;
+   cli_set_context(def, (void *)pSession);
+   cli_set_banner(def, ES_CLI_BANNER_STR);
+   cli_set_hostname(def, ES_CLI_HOSTNAME_STR);
+   cli_print_callback(def, _es_cli_session_print_cb);
+
+   for (i = 0; i < _pCtx->cmdsNb; ++i) {
+      const struct _es_cli_cmd_s *cmd = &_pCtx->cmds[i];
+      nodes[i] = cli_register_command(def, (cmd->parent >= 0) ? nodes[cmd->parent] : NULL, cmd->word,
+                                      (cmd->cb != NULL) ? _es_cli_dispatch : NULL,
+                                      PRIVILEGE_UNPRIVILEGED, MODE_EXEC, cmd->help);
+   }
 
-   return 0;
+   return def;
 }
 
 static void _es_evconnlistener_cb(struct evconnlistener *pListner, evutil_socket_t fd, struct sockaddr *pSock, int sockLen, void *pCtx)
 {
-   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
    struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
+   struct _es_cli_session_s *pSession = NULL;
+   struct timeval idle = { ES_CLI_IDLE_TIMEOUT, 0 };
+
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
 
    if (_pCtx == (struct es_cli_s *)0) {
       ESIP_TRACE(ESIP_LOG_ERROR, "NULLPTR for Context");
+      evutil_closesocket(fd);
       return;
    }
 
    /* Check Magic */
    if (_pCtx->magic != ES_CLI_MAGIC) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic: expected(%d) (%d)", ES_CLI_MAGIC, _pCtx->magic);
+      evutil_closesocket(fd);
       return;
    }
 
-	{
-		if (pSock->sa_family == AF_INET) {
-			ESIP_TRACE(ESIP_LOG_INFO, "new CLI connection from %s:%d",
-					inet_ntoa(((struct sockaddr_in *)pSock)->sin_addr),
-					ntohs(((struct sockaddr_in *)pSock)->sin_port));
-		}
-	}
+   if (pSock->sa_family == AF_INET) {
+      ESIP_TRACE(ESIP_LOG_INFO, "new CLI connection from %s:%d",
+                 inet_ntoa(((struct sockaddr_in *)pSock)->sin_addr),
+                 ntohs(((struct sockaddr_in *)pSock)->sin_port));
+   }
 
-   /* TODO: stop listner for this connection and start cli_loop in another thread */
-   {
-      pthread_t threadNum;
-      struct _es_cli_thd_s *pThdCtx = (struct _es_cli_thd_s *) malloc(sizeof(struct _es_cli_thd_s));
-      if (pThdCtx == (struct _es_cli_thd_s *)0) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Can not create thread context");
-         return;
-      }
+   if (_pCtx->sessionsNb >= ES_CLI_MAX_SESSIONS) {
+      static const char busy[] = "Too many CLI sessions\r\n";
+      ESIP_TRACE(ESIP_LOG_WARNING, "CLI connection refused: %u sessions open", _pCtx->sessionsNb);
+      (void)send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+      evutil_closesocket(fd);
+      return;
+   }
 
-      pThdCtx->pCtx = _pCtx;
-      pThdCtx->fd = fd;
+   pSession = (struct _es_cli_session_s *) calloc(1, sizeof(struct _es_cli_session_s));
+   if (pSession == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create CLI session");
+      evutil_closesocket(fd);
+      return;
+   }
 
-      if (pthread_create(&threadNum, NULL, &_es_start_cli_thread, pThdCtx) != 0) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "pthread_create");
-         return;
-      }
+   pSession->cli = _pCtx;
 
-      //evconnlistener_disable(_pCtx->listener);
+   pSession->bev = bufferevent_socket_new(_pCtx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+   if (pSession->bev == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not allocate new buffer Event");
+      evutil_closesocket(fd);
+      free(pSession);
+      return;
    }
 
-#if 0
-   {
-      /* We got a new connection! Set up a bufferevent for it. */
-      struct bufferevent *bev = bufferevent_socket_new(_pCtx->base, fd, BEV_OPT_CLOSE_ON_FREE);
-      if (bev == (struct bufferevent *)0) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Can not allocate new buffer Event");
-         return;
-      }
+   pSession->def = _es_cli_session_def(pSession);
+   if (pSession->def == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create CLI session");
+      bufferevent_free(pSession->bev);
+      free(pSession);
+      return;
+   }
 
-      bufferevent_setcb(bev,
-                        _es_bufferevent_read_data_cb,  /* Read Callback  */
-                        NULL,  /* Write Callback */
-                        NULL,  /* Event Callback */
-                        (void *) _pCtx); /* Reference */
+   bufferevent_setcb(pSession->bev, _es_cli_session_read_cb, NULL, _es_cli_session_event_cb, pSession);
+   bufferevent_set_timeouts(pSession->bev, &idle, NULL);
 
-      if (bufferevent_enable(bev, EV_READ | EV_WRITE) != 0) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Enabling Socket");
-         return;
-      }
+   if (bufferevent_enable(pSession->bev, EV_READ | EV_WRITE) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Enabling Socket");
+      cli_done(pSession->def);
+      bufferevent_free(pSession->bev);
+      free(pSession);
+      return;
    }
-#endif
+
+   pSession->next = _pCtx->sessions;
+   _pCtx->sessions = pSession;
+   _pCtx->sessionsNb++;
+
+   evbuffer_add_printf(bufferevent_get_output(pSession->bev), "%s\r\n" ES_CLI_PROMPT_STR, ES_CLI_BANNER_STR);
 }
 
 static void _es_accept_error_cb(struct evconnlistener *pListener, void *pCtx)
@@ -221,27 +439,157 @@ static void _es_accept_error_cb(struct evconnlistener *pListener, void *pCtx)
                "Shutting down.\n", err, evutil_socket_error_to_string(err));
 }
 
-static int _es_cli_regular_callback(struct cli_def *pCliCtx)
+static int _es_cli_dispatch(struct cli_def *pCliCtx, const char *command, char *argv[], int argc)
 {
-   if (pCliCtx == (struct cli_def *)0) {
-      return ES_ERROR_INVALID_HANDLE;
+   unsigned int i = 0;
+   struct _es_cli_session_s *pSession = (struct _es_cli_session_s *)cli_get_context(pCliCtx);
+   struct es_cli_s *_pCtx = (pSession != NULL) ? pSession->cli : (struct es_cli_s *)0;
+
+   if (_pCtx == (struct es_cli_s *)0) {
+      return CLI_ERROR;
    }
-   cli_print(pCliCtx, "Regular callback");
-   cli_reprompt(pCliCtx);
-   return 0;
+
+   /* Check Magic */
+   if (_pCtx->magic != ES_CLI_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic: expected(%d) (%d)", ES_CLI_MAGIC, _pCtx->magic);
+      return CLI_ERROR;
+   }
+
+   for (i = 0; i < _pCtx->cmdsNb; ++i) {
+      if ((_pCtx->cmds[i].cb != NULL) && (strcmp(_pCtx->cmds[i].command, command) == 0)) {
+         uint64_t cbTs = es_hist_now();
+         int ret = _pCtx->cmds[i].cb(pCliCtx, argv, argc, _pCtx->cmds[i].arg);
+         es_loop_cb_done(ES_HIST_CB_CLI, _pCtx->cmds[i].command, cbTs);
+         return ret;
+      }
+   }
+
+   cli_print(pCliCtx, "Command \"%s\" has no handler", command);
+   return CLI_ERROR;
 }
 
-static int _es_cli_timeout_callback(struct cli_def *pCliCtx)
+static int _es_cli_find_cmd(struct es_cli_s *pCtx, const char *command)
 {
-   if (pCliCtx == (struct cli_def *)0) {
+   unsigned int i = 0;
+   for (i = 0; i < pCtx->cmdsNb; ++i) {
+      if (strcmp(pCtx->cmds[i].command, command) == 0) {
+         return (int)i;
+      }
+   }
+   return -1;
+}
+
+es_status es_cli_register_cmd(es_cli_t *pCtx, const char *command, const char *help, es_cli_cmd_cb cb, void *arg)
+{
+   struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
+   int parent = -1;
+   const char *word = command;
+
+   if ((_pCtx == (struct es_cli_s *)0) || (command == NULL) || (cb == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad parameters");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CLI_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic: expected(%d) (%d)", ES_CLI_MAGIC, _pCtx->magic);
       return ES_ERROR_INVALID_HANDLE;
    }
-   cli_print(pCliCtx, "Close connection for no activity.");
-   return CLI_QUIT;
+
+   /* The table is read by the CLI thread without lock */
+   if (_pCtx->running) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "CLI already started, \"%s\" not registered", command);
+      return ES_ERROR_ILLEGAL_ACTION;
+   }
+
+   /* Walk each word of the command, creating missing parents */
+   while (*word != '\0') {
+      const char *end = strchr(word, ' ');
+      size_t pathLen = (end == NULL) ? strlen(command) : (size_t)(end - command);
+      struct _es_cli_cmd_s *cmd = (struct _es_cli_cmd_s *)0;
+      char *path = strndup(command, pathLen);
+      int idx = -1;
+
+      if (path == NULL) {
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+
+      idx = _es_cli_find_cmd(_pCtx, path);
+      if (idx < 0) {
+         if (_pCtx->cmdsNb >= ES_CLI_MAX_COMMANDS) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "Too many CLI commands, \"%s\" ignored", command);
+            free(path);
+            return ES_ERROR_OUTOFRANGE;
+         }
+
+         idx = (int)_pCtx->cmdsNb;
+         cmd = &_pCtx->cmds[idx];
+         memset(cmd, 0, sizeof(struct _es_cli_cmd_s));
+         cmd->word = strndup(word, (end == NULL) ? strlen(word) : (size_t)(end - word));
+         if (cmd->word == NULL) {
+            free(path);
+            return ES_ERROR_OUTOFRESOURCES;
+         }
+         cmd->command = path;
+         cmd->parent = parent;
+         _pCtx->cmdsNb++;
+      } else {
+         cmd = &_pCtx->cmds[idx];
+         free(path);
+      }
+
+      if (end == NULL) {
+         free(cmd->help);
+         cmd->help = (help != NULL) ? strdup(help) : NULL;
+         cmd->cb = cb;
+         cmd->arg = arg;
+         break;
+      }
+
+      parent = idx;
+      word = end + 1;
+   }
+
+   return ES_OK;
+}
+
+es_status es_cli_defer(struct cli_def *pCli, unsigned int ms, es_cli_defer_cb cb, void *arg)
+{
+   struct _es_cli_session_s *pSession = (pCli != NULL) ? (struct _es_cli_session_s *)cli_get_context(pCli) : NULL;
+   struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+   if ((pSession == NULL) || (cb == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (pSession->deferEv == NULL) {
+      pSession->deferEv = event_new(pSession->cli->base, -1, 0, _es_cli_session_defer_cb, pSession);
+      if (pSession->deferEv == NULL) {
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   if (event_add(pSession->deferEv, &tv) != 0) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   pSession->deferCb = cb;
+   pSession->deferArg = arg;
+   return ES_OK;
+}
+
+void es_cli_print(struct cli_def *pCli, const char *format, ...)
+{
+   char line[ES_CLI_MAX_LINE_SIZE];
+   va_list ap;
+
+   va_start(ap, format);
+   (void)vsnprintf(line, sizeof(line), format, ap);
+   va_end(ap);
+
+   cli_print(pCli, "%s", line);
 }
 
-es_status es_cli_init(es_cli_t           **ppCtx,
-                       struct event_base  *pBase)
+es_status es_cli_init(es_cli_t **ppCtx, unsigned int port, int listenFd)
 {
    struct es_cli_s *_pCtx = (struct es_cli_s *) malloc(sizeof(struct es_cli_s));
    if (_pCtx == (struct es_cli_s *)0) {
@@ -251,54 +599,60 @@ es_status es_cli_init(es_cli_t           **ppCtx,
 
    memset(_pCtx, 0, sizeof(struct es_cli_s));
 
-   if (pBase == (struct event_base *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "");
-      return ES_ERROR_NULLPTR;
+   _pCtx->magic = ES_CLI_MAGIC;
+   _pCtx->cpu = -1;
+   _pCtx->wakeFd[0] = -1;
+   _pCtx->wakeFd[1] = -1;
+
+   /* Own loop: a slow telnet client never delays the SIP one */
+   _pCtx->base = event_base_new();
+   if (_pCtx->base == (struct event_base *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create CLI loop");
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
    }
 
-   _pCtx->magic = ES_CLI_MAGIC;
-   _pCtx->base = pBase;
+   /* Stop request from the main thread */
+   if ((pipe(_pCtx->wakeFd) != 0) ||
+       (evutil_make_socket_nonblocking(_pCtx->wakeFd[0]) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create CLI wake up pipe");
+      es_cli_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
 
-   /* Init Cli */
-   {
-      _pCtx->cliCtx = cli_init();
-      if (_pCtx->cliCtx == NULL) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "");
-         free(_pCtx);
-         return ES_ERROR_OUTOFRESOURCES;
-      }
+   _pCtx->wakeEv = event_new(_pCtx->base, _pCtx->wakeFd[0], EV_READ | EV_PERSIST, _es_cli_wake_cb, _pCtx);
+   if ((_pCtx->wakeEv == NULL) || (event_add(_pCtx->wakeEv, NULL) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create CLI wake up event");
+      es_cli_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
 
-      cli_set_banner(_pCtx->cliCtx, ES_CLI_BANNER_STR);
-      cli_set_hostname(_pCtx->cliCtx, ES_CLI_HOSTNAME_STR);
-      cli_regular(_pCtx->cliCtx, _es_cli_regular_callback);
-      cli_regular_interval(_pCtx->cliCtx, 10);
-      cli_set_idle_timeout_callback(_pCtx->cliCtx, 30, _es_cli_timeout_callback);
+   if (port == 0) {
+      port = ES_SERVER_PORT;
    }
 
    /* Init Socket and Listener */
    {
       struct sockaddr_in listen_addr;
-      /* Create our listening socket. */
-      int listenfd = socket(AF_INET, SOCK_STREAM, 0);
-      if (listenfd < 0) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "");
-         free(_pCtx);
-         return ES_ERROR_NETWORK_PROBLEM;
-      }
+
       memset(&listen_addr, 0, sizeof(listen_addr));
       listen_addr.sin_family = AF_INET;
       listen_addr.sin_addr.s_addr = INADDR_ANY;
-      listen_addr.sin_port = htons(ES_SERVER_PORT);
-
-      /* Create a new listener */
-      _pCtx->listener = evconnlistener_new_bind(_pCtx->base, _es_evconnlistener_cb, _pCtx,
-                                                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
-                                                (struct sockaddr *) &listen_addr, sizeof(listen_addr));
+      listen_addr.sin_port = htons(port);
+
+      /* Create a new listener, or take the one handed over */
+      if (listenFd >= 0) {
+         _pCtx->listener = evconnlistener_new(_pCtx->base, _es_evconnlistener_cb, _pCtx,
+                                              LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, 0, listenFd);
+      } else {
+         _pCtx->listener = evconnlistener_new_bind(_pCtx->base, _es_evconnlistener_cb, _pCtx,
+                                                   LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+                                                   (struct sockaddr *) &listen_addr, sizeof(listen_addr));
+      }
       if (!_pCtx->listener) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "");
-         close(listenfd);
-         free(_pCtx);
-         return ES_ERROR_UNKNOWN;
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not listen on CLI port %u", port);
+         es_cli_deinit(_pCtx);
+         return ES_ERROR_NETWORK_PROBLEM;
       }
 
       evconnlistener_disable(_pCtx->listener);
@@ -306,7 +660,6 @@ es_status es_cli_init(es_cli_t           **ppCtx,
       evconnlistener_set_error_cb(_pCtx->listener, _es_accept_error_cb);
    }
 
-
    *ppCtx = _pCtx;
    return ES_OK;
 }
@@ -324,9 +677,60 @@ es_status es_cli_start(es_cli_t *pCtx)
       return ES_ERROR_INVALID_HANDLE;
    }
 
+   if (_pCtx->running) {
+      return ES_OK;
+   }
+
    ESIP_TRACE(ESIP_LOG_INFO, "Starting CLI for ESip");
    evconnlistener_enable(_pCtx->listener);
 
+   _pCtx->running = 1;
+   if (pthread_create(&_pCtx->thread, NULL, _es_cli_thread, _pCtx) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start CLI thread");
+      _pCtx->running = 0;
+      evconnlistener_disable(_pCtx->listener);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   return ES_OK;
+}
+
+es_status es_cli_set_cpu(es_cli_t *pCtx, int cpu)
+{
+   struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
+   if (_pCtx == (struct es_cli_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CLI_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (_pCtx->running) {
+      return ES_ERROR_ILLEGAL_ACTION;
+   }
+
+   _pCtx->cpu = cpu;
+   return ES_OK;
+}
+
+es_status es_cli_get_socket(es_cli_t *pCtx, int *fd)
+{
+   struct es_cli_s *_pCtx = (struct es_cli_s *)pCtx;
+   if (_pCtx == (struct es_cli_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CLI_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   /* Set once at init, safe from any thread */
+   *fd = evconnlistener_get_fd(_pCtx->listener);
    return ES_OK;
 }
 
@@ -343,6 +747,19 @@ es_status es_cli_stop(es_cli_t *pCtx)
       return ES_ERROR_INVALID_HANDLE;
    }
 
+   if (!_pCtx->running) {
+      return ES_OK;
+   }
+
+   /* The loop belongs to the CLI thread: ask it to stop, then wait */
+   if (write(_pCtx->wakeFd[1], "q", 1) != 1) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not stop CLI thread");
+      return ES_ERROR_UNKNOWN;
+   }
+
+   pthread_join(_pCtx->thread, NULL);
+   _pCtx->running = 0;
+
    evconnlistener_disable(_pCtx->listener);
 
    return ES_OK;
@@ -361,12 +778,38 @@ es_status es_cli_deinit(es_cli_t *pCtx)
       return ES_ERROR_INVALID_HANDLE;
    }
 
-   cli_done(_pCtx->cliCtx);
+   (void)es_cli_stop(_pCtx);
+
+   while (_pCtx->sessions != NULL) {
+      _es_cli_session_free(_pCtx->sessions);
+   }
+
+   {
+      unsigned int i = 0;
+      for (i = 0; i < _pCtx->cmdsNb; ++i) {
+         free(_pCtx->cmds[i].command);
+         free(_pCtx->cmds[i].word);
+         free(_pCtx->cmds[i].help);
+      }
+      _pCtx->cmdsNb = 0;
+   }
+
+   if (_pCtx->listener != NULL) {
+      evconnlistener_free(_pCtx->listener);
+   }
 
-   close(evconnlistener_get_fd(_pCtx->listener));
+   if (_pCtx->wakeEv != NULL) {
+      event_free(_pCtx->wakeEv);
+   }
 
-   evconnlistener_free(_pCtx->listener);
+   if (_pCtx->wakeFd[0] >= 0) {
+      close(_pCtx->wakeFd[0]);
+      close(_pCtx->wakeFd[1]);
+   }
+
+   event_base_free(_pCtx->base);
 
+   memset(_pCtx, 0, sizeof(struct es_cli_s));
    free(_pCtx);
    return ES_OK;
 }
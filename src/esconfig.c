@@ -0,0 +1,344 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eswork.h"
+#include "esparse.h"
+#include "esrate.h"
+#include "esconfig.h"
+
+/** Max length of a line */
+#define ES_CONFIG_LINE_LEN    256
+
+typedef enum _es_config_type_e {
+   ES_CONFIG_UINT = 0,
+   ES_CONFIG_STRING,
+   ES_CONFIG_LEVEL,
+   /* A CPU number or "none", stored as int */
+   ES_CONFIG_CPU,
+   /* A proxy mode, es_config_mode_t */
+   ES_CONFIG_MODE
+} _es_config_type_t;
+
+struct _es_config_key_s {
+   const char                 *name;
+   _es_config_type_t          type;
+   size_t                     offset;
+   unsigned int               min;
+   unsigned int               max;
+   /* Only read at start */
+   int                        restart;
+};
+
+#define ES_CONFIG_FIELD(_f)   offsetof(struct es_config_s, _f)
+
+static const struct _es_config_key_s _es_config_keys[] = {
+   { "sip.address",        ES_CONFIG_STRING, ES_CONFIG_FIELD(sipAddress),   0,    0,             1 },
+   { "sip.port",           ES_CONFIG_UINT,   ES_CONFIG_FIELD(sipPort),      1,    65535,         1 },
+   { "sip.rcvbuf",         ES_CONFIG_UINT,   ES_CONFIG_FIELD(sipRcvBuf),    0,    1U << 30,      0 },
+   { "sip.sndbuf",         ES_CONFIG_UINT,   ES_CONFIG_FIELD(sipSndBuf),    0,    1U << 30,      0 },
+   { "sip.batch",          ES_CONFIG_UINT,   ES_CONFIG_FIELD(sipBatch),     1,    1024,          0 },
+   { "rate.invite",        ES_CONFIG_UINT,   ES_CONFIG_FIELD(rateInvite),   0,    ES_RATE_MAX,   0 },
+   { "rate.register",      ES_CONFIG_UINT,   ES_CONFIG_FIELD(rateRegister), 0,    ES_RATE_MAX,   0 },
+   { "rate.other",         ES_CONFIG_UINT,   ES_CONFIG_FIELD(rateOther),    0,    ES_RATE_MAX,   0 },
+   { "rate.response",      ES_CONFIG_UINT,   ES_CONFIG_FIELD(rateResponse), 0,    ES_RATE_MAX,   0 },
+   { "rate.burst",         ES_CONFIG_UINT,   ES_CONFIG_FIELD(rateBurst),    1,    60,            0 },
+   { "acl.file",           ES_CONFIG_STRING, ES_CONFIG_FIELD(aclFile),      0,    0,             0 },
+   { "cli.port",           ES_CONFIG_UINT,   ES_CONFIG_FIELD(cliPort),      1,    65535,         1 },
+   { "cli.inject_dir",     ES_CONFIG_STRING, ES_CONFIG_FIELD(cliInjectDir), 0,    0,             0 },
+   { "metrics.port",       ES_CONFIG_UINT,   ES_CONFIG_FIELD(metricsPort),  0,    65535,         1 },
+   { "log.level",          ES_CONFIG_LEVEL,  ES_CONFIG_FIELD(logLevel),     0,    ESIP_LOG_DEBUG, 0 },
+   { "response.invite",    ES_CONFIG_UINT,   ES_CONFIG_FIELD(inviteCode),   200,  699,           0 },
+   { "response.register",  ES_CONFIG_UINT,   ES_CONFIG_FIELD(registerCode), 200,  699,           0 },
+   { "response.bye",       ES_CONFIG_UINT,   ES_CONFIG_FIELD(byeCode),      200,  699,           0 },
+   { "response.scenarios", ES_CONFIG_STRING, ES_CONFIG_FIELD(responseScenarios), 0, 0,           0 },
+   { "upgrade.socket",     ES_CONFIG_STRING, ES_CONFIG_FIELD(upgradeSocket), 0,   0,             1 },
+   { "registrar.min_expires", ES_CONFIG_UINT, ES_CONFIG_FIELD(registrarMinExpires), 0, 86400,        0 },
+   { "registrar.max_expires", ES_CONFIG_UINT, ES_CONFIG_FIELD(registrarMaxExpires), 1, 1U << 30,     0 },
+   { "registrar.default_expires", ES_CONFIG_UINT, ES_CONFIG_FIELD(registrarDefaultExpires), 1, 1U << 30, 0 },
+   { "auth.realm",         ES_CONFIG_STRING, ES_CONFIG_FIELD(authRealm),    0,    0,             0 },
+   { "auth.users",         ES_CONFIG_STRING, ES_CONFIG_FIELD(authUsers),    0,    0,             0 },
+   { "auth.register",      ES_CONFIG_UINT,   ES_CONFIG_FIELD(authRegister), 0,    1,             0 },
+   { "auth.invite",        ES_CONFIG_UINT,   ES_CONFIG_FIELD(authInvite),   0,    1,             0 },
+   { "auth.nonce_ttl",     ES_CONFIG_UINT,   ES_CONFIG_FIELD(authNonceTtl), 1,    86400,         0 },
+   { "db.file",            ES_CONFIG_STRING, ES_CONFIG_FIELD(dbFile),       0,    0,             1 },
+   { "work.threads",       ES_CONFIG_UINT,   ES_CONFIG_FIELD(workThreads),  0,    ES_WORK_MAX_THREADS, 1 },
+   { "parse.threads",      ES_CONFIG_UINT,   ES_CONFIG_FIELD(parseThreads), 0,    ES_PARSE_MAX_THREADS, 1 },
+   { "persist.file",       ES_CONFIG_STRING, ES_CONFIG_FIELD(persistFile),  0,    0,             1 },
+   { "persist.period",     ES_CONFIG_UINT,   ES_CONFIG_FIELD(persistPeriod), 1,   86400,         1 },
+   { "proxy.mode",         ES_CONFIG_MODE,   ES_CONFIG_FIELD(proxyMode),    0,    ES_CONFIG_MODE_STATEFUL, 0 },
+   { "proxy.host",         ES_CONFIG_STRING, ES_CONFIG_FIELD(proxyHost),    0,    0,             0 },
+   { "proxy.routes",       ES_CONFIG_STRING, ES_CONFIG_FIELD(proxyRoutes),  0,    0,             0 },
+   { "sys.cpu.sip",        ES_CONFIG_CPU,    ES_CONFIG_FIELD(sysCpuSip),    0,    CPU_SETSIZE - 1, 1 },
+   { "sys.cpu.cli",        ES_CONFIG_CPU,    ES_CONFIG_FIELD(sysCpuCli),    0,    CPU_SETSIZE - 1, 1 },
+   { "sys.incoming_cpu",   ES_CONFIG_UINT,   ES_CONFIG_FIELD(sysIncomingCpu), 0,  1,             1 },
+   { "sys.mlock",          ES_CONFIG_UINT,   ES_CONFIG_FIELD(sysMlock),     0,    1,             1 },
+   { "sys.pool",           ES_CONFIG_UINT,   ES_CONFIG_FIELD(sysPool),      0,    65536,         1 },
+   { "sys.hugepages",      ES_CONFIG_UINT,   ES_CONFIG_FIELD(sysHugepages), 0,    1,             1 },
+};
+
+#define ES_CONFIG_KEYS_NB     (sizeof(_es_config_keys) / sizeof(_es_config_keys[0]))
+
+static const char * const _es_config_levels[] = {
+   "emerg", "alert", "crit", "error", "warning", "notice", "info", "debug"
+};
+
+/* By es_config_mode_t */
+static const char * const _es_config_modes[] = {
+   "uas", "stateless", "stateful"
+};
+
+void es_config_defaults(struct es_config_s *cfg)
+{
+   memset(cfg, 0, sizeof(struct es_config_s));
+
+   cfg->sipPort = 5060;
+   cfg->sipBatch = 8;
+   cfg->rateBurst = 2;
+   cfg->cliPort = 8008;
+   cfg->logLevel = ESIP_LOG_DEBUG;
+   cfg->inviteCode = 200;
+   cfg->registerCode = 200;
+   cfg->byeCode = 200;
+   strcpy(cfg->upgradeSocket, "/tmp/esip-upgrade.sock");
+   cfg->registrarMinExpires = 60;
+   cfg->registrarMaxExpires = 3600;
+   cfg->registrarDefaultExpires = 3600;
+   cfg->authRegister = 1;
+   cfg->authInvite = 1;
+   cfg->authNonceTtl = 300;
+   cfg->persistPeriod = 60;
+   cfg->sysCpuSip = -1;
+   cfg->sysCpuCli = -1;
+}
+
+static char *_es_config_trim(char *s)
+{
+   char *end = NULL;
+
+   while (isspace((unsigned char)*s)) {
+      s++;
+   }
+
+   end = s + strlen(s);
+   while ((end > s) && isspace((unsigned char)end[-1])) {
+      *--end = '\0';
+   }
+
+   return s;
+}
+
+static const struct _es_config_key_s *_es_config_find(const char *name)
+{
+   unsigned int i = 0;
+
+   for (i = 0; i < ES_CONFIG_KEYS_NB; ++i) {
+      if (strcmp(_es_config_keys[i].name, name) == 0) {
+         return &_es_config_keys[i];
+      }
+   }
+
+   return NULL;
+}
+
+static es_status _es_config_set(struct es_config_s *cfg, const struct _es_config_key_s *key, const char *value)
+{
+   char *field = (char *)cfg + key->offset;
+   unsigned long v = 0;
+   char *end = NULL;
+
+   switch (key->type) {
+   case ES_CONFIG_STRING:
+      if (strlen(value) >= ES_CONFIG_STR_LEN) {
+         return ES_ERROR_OUTOFRANGE;
+      }
+      strcpy(field, value);
+      return ES_OK;
+
+   case ES_CONFIG_LEVEL:
+      for (v = 0; v < sizeof(_es_config_levels) / sizeof(_es_config_levels[0]); ++v) {
+         if (strcasecmp(value, _es_config_levels[v]) == 0) {
+            *(unsigned int *)field = (unsigned int)v;
+            return ES_OK;
+         }
+      }
+      /* Or a number */
+      break;
+
+   case ES_CONFIG_MODE:
+      for (v = 0; v < sizeof(_es_config_modes) / sizeof(_es_config_modes[0]); ++v) {
+         if (strcasecmp(value, _es_config_modes[v]) == 0) {
+            *(unsigned int *)field = (unsigned int)v;
+            return ES_OK;
+         }
+      }
+      return ES_ERROR_BADPARAM;
+
+   case ES_CONFIG_CPU:
+      if ((strcasecmp(value, "none") == 0) || (strcmp(value, "-1") == 0)) {
+         *(int *)field = -1;
+         return ES_OK;
+      }
+      break;
+
+   case ES_CONFIG_UINT:
+   default:
+      break;
+   }
+
+   errno = 0;
+   v = strtoul(value, &end, 0);
+   if ((end == value) || (*end != '\0') || (errno != 0) || (value[0] == '-')) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   if ((v < key->min) || (v > key->max)) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   *(unsigned int *)field = (unsigned int)v;
+   return ES_OK;
+}
+
+es_status es_config_load(const char *path, struct es_config_s *cfg)
+{
+   struct es_config_s tmp;
+   char line[ES_CONFIG_LINE_LEN];
+   unsigned int lineNb = 0;
+   unsigned int errors = 0;
+   FILE *f = NULL;
+
+   if ((path == NULL) || (cfg == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open configuration %s: %s", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   /* All or nothing */
+   tmp = *cfg;
+
+   while (fgets(line, sizeof(line), f) != NULL) {
+      const struct _es_config_key_s *key = NULL;
+      char *name = NULL;
+      char *value = NULL;
+      char *p = NULL;
+      es_status ret = ES_OK;
+
+      lineNb++;
+
+      if ((strchr(line, '\n') == NULL) && !feof(f)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: line too long", path, lineNb);
+         errors++;
+         /* Skip the rest of it */
+         while ((fgets(line, sizeof(line), f) != NULL) && (strchr(line, '\n') == NULL)) {
+         }
+         continue;
+      }
+
+      if ((p = strchr(line, '#')) != NULL) {
+         *p = '\0';
+      }
+
+      name = _es_config_trim(line);
+      if (*name == '\0') {
+         continue;
+      }
+
+      p = strchr(name, '=');
+      if (p == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: expected key = value", path, lineNb);
+         errors++;
+         continue;
+      }
+
+      *p = '\0';
+      name = _es_config_trim(name);
+      value = _es_config_trim(p + 1);
+
+      key = _es_config_find(name);
+      if (key == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: unknown key %s", path, lineNb, name);
+         errors++;
+         continue;
+      }
+
+      ret = _es_config_set(&tmp, key, value);
+      if (ret != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: bad value \"%s\" for %s", path, lineNb, value, name);
+         errors++;
+      }
+   }
+
+   fclose(f);
+
+   if (errors != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Configuration %s not applied: %u error(s)", path, errors);
+      return ES_ERROR_BADPARAM;
+   }
+
+   *cfg = tmp;
+   return ES_OK;
+}
+
+unsigned int es_config_check_restart(const struct es_config_s *running, const struct es_config_s *cfg)
+{
+   unsigned int i = 0;
+   unsigned int changed = 0;
+
+   for (i = 0; i < ES_CONFIG_KEYS_NB; ++i) {
+      const struct _es_config_key_s *key = &_es_config_keys[i];
+      const char *a = (const char *)running + key->offset;
+      const char *b = (const char *)cfg + key->offset;
+      int differ = 0;
+
+      if (!key->restart) {
+         continue;
+      }
+
+      if (key->type == ES_CONFIG_STRING) {
+         differ = (strcmp(a, b) != 0);
+      } else {
+         differ = (*(const unsigned int *)a != *(const unsigned int *)b);
+      }
+
+      if (differ) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "%s changed, applied at the next restart", key->name);
+         changed++;
+      }
+   }
+
+   return changed;
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esmem.h"
+#include "esdb.h"
+
+#define ES_DB_CTX_MAGIC          0x20141126
+
+struct es_db_s {
+   /* Magic */
+   uint32_t                      magic;
+   /* The whole file */
+   const uint8_t                 *map;
+   size_t                        size;
+   const struct es_db_header_s   *hdr;
+   const uint32_t                *displacements;
+   const struct es_db_record_s   *slots;
+   char                          path[256];
+   /* Counters, read by the CLI */
+   uint64_t                      lookups;
+   uint64_t                      misses;
+};
+
+es_status es_db_open(es_db_t **ppCtx, const char *path)
+{
+   struct es_db_s *_pCtx = NULL;
+   const struct es_db_header_s *hdr = NULL;
+   struct stat st;
+   void *map = NULL;
+   size_t size = 0;
+   int fd = -1;
+
+   if ((ppCtx == NULL) || (path == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open database %s: %s", path, strerror(errno));
+      return (errno == ENOENT) ? ES_ERROR_NOT_FOUND : ES_ERROR_UNKNOWN;
+   }
+
+   if (fstat(fd, &st) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not stat database %s: %s", path, strerror(errno));
+      close(fd);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if ((size_t)st.st_size < sizeof(struct es_db_header_s)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Database %s too short", path);
+      close(fd);
+      return ES_ERROR_BADPARAM;
+   }
+   size = (size_t)st.st_size;
+
+   /* Shared: the pages are the ones of the page cache, for all processes */
+   map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not map database %s: %s", path, strerror(errno));
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   hdr = (const struct es_db_header_s *)map;
+   if ((memcmp(hdr->magic, ES_DB_MAGIC_STR, sizeof(hdr->magic)) != 0) || (hdr->version != ES_DB_VERSION) ||
+       (hdr->recordSize != sizeof(struct es_db_record_s)) || (hdr->nbBuckets == 0) ||
+       (hdr->nbSlots < hdr->nbRecords) || (hdr->nbSlots == 0) ||
+       (size != es_db_slots_offset(hdr->nbBuckets) + (size_t)hdr->nbSlots * sizeof(struct es_db_record_s)) ||
+       (memchr(hdr->realm, '\0', sizeof(hdr->realm)) == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Database %s is not one of esip-mkdb version %u", path, ES_DB_VERSION);
+      munmap(map, size);
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* One line per lookup, anywhere */
+   (void)madvise(map, size, MADV_RANDOM);
+
+   _pCtx = (struct es_db_s *) es_mem_calloc(ES_MEM_AUTH, 1, sizeof(struct es_db_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open database: no more memory");
+      munmap(map, size);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_DB_CTX_MAGIC;
+   _pCtx->map = (const uint8_t *)map;
+   _pCtx->size = size;
+   _pCtx->hdr = hdr;
+   _pCtx->displacements = (const uint32_t *)(_pCtx->map + sizeof(struct es_db_header_s));
+   _pCtx->slots = (const struct es_db_record_s *)(_pCtx->map + es_db_slots_offset(hdr->nbBuckets));
+   snprintf(_pCtx->path, sizeof(_pCtx->path), "%s", path);
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Database %s: %u subscriber(s), %zu bytes mapped", path, hdr->nbRecords, size);
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_db_close(es_db_t *pCtx)
+{
+   struct es_db_s *_pCtx = (struct es_db_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_DB_CTX_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   munmap((void *)_pCtx->map, _pCtx->size);
+
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+const struct es_db_record_s *es_db_lookup(es_db_t *pCtx, const char *user, size_t len)
+{
+   struct es_db_s *_pCtx = (struct es_db_s *)pCtx;
+   const struct es_db_header_s *hdr = NULL;
+   const struct es_db_record_s *rec = NULL;
+   uint32_t hash = 0;
+
+   if ((_pCtx == NULL) || (user == NULL)) {
+      return NULL;
+   }
+
+   __atomic_add_fetch(&_pCtx->lookups, 1, __ATOMIC_RELAXED);
+
+   hdr = _pCtx->hdr;
+   if ((len != 0) && (len <= ES_DB_USER_LEN)) {
+      hash = es_db_hash(hdr->seed, user, len);
+      rec = &_pCtx->slots[es_db_slot(hash, _pCtx->displacements[hash % hdr->nbBuckets], hdr->nbSlots)];
+
+      /* Any user lands on a slot, the one of another or a free one */
+      if ((rec->userLen == len) && (memcmp(rec->user, user, len) == 0)) {
+         return rec;
+      }
+   }
+
+   __atomic_add_fetch(&_pCtx->misses, 1, __ATOMIC_RELAXED);
+   return NULL;
+}
+
+const char *es_db_realm(const es_db_t *pCtx)
+{
+   const struct es_db_s *_pCtx = (const struct es_db_s *)pCtx;
+
+   return (_pCtx != NULL) ? _pCtx->hdr->realm : "";
+}
+
+static int _es_db_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_db_s *_pCtx = (struct es_db_s *)arg;
+   const struct es_db_header_s *hdr = _pCtx->hdr;
+
+   es_cli_print(pCli, "Database %s, realm %s", _pCtx->path, (hdr->realm[0] != '\0') ? hdr->realm : "-");
+   es_cli_print(pCli, "Subscribers %u, slots %u (%u bytes each), buckets %u, %zu bytes mapped",
+                hdr->nbRecords, hdr->nbSlots, hdr->recordSize, hdr->nbBuckets, _pCtx->size);
+   es_cli_print(pCli, "%12s %12s", "lookups", "misses");
+   es_cli_print(pCli, "%12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->lookups, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->misses, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_db_cli_register(es_db_t *pCtx, es_cli_t *pCli)
+{
+   struct es_db_s *_pCtx = (struct es_db_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_DB_CTX_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show db", "Show the subscribers database", _es_db_cli_show, _pCtx);
+}
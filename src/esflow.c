@@ -0,0 +1,388 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshash.h"
+#include "esflow.h"
+
+#define ES_FLOW_CACHE_LINE       64
+
+/** 64 bits words of an event */
+#define ES_FLOW_EVENT_WORDS      8
+
+/**
+ * @brief One step of a call, one cache line
+ * Copied word by word with atomic accesses: the dump runs in the CLI
+ * thread while the owner thread may overwrite the oldest events.
+ */
+union _es_flow_event_u {
+   struct {
+      uint64_t                ts;
+      uint64_t                dur;
+      uint32_t                hash;
+      uint16_t                kind;
+      uint16_t                pad;
+      int32_t                 arg;
+      char                    callId[ES_FLOW_CALLID_LEN];
+   } e;
+   uint64_t                   words[ES_FLOW_EVENT_WORDS];
+};
+
+/**
+ * @brief Events ring of one thread
+ */
+struct _es_flow_shard_s {
+   union _es_flow_event_u           events[ES_FLOW_EVENTS];
+   /* Events written since start, only the last ES_FLOW_EVENTS are kept */
+   uint64_t                         head;
+   struct _es_flow_shard_s          *next;
+} __attribute__((aligned(ES_FLOW_CACHE_LINE)));
+
+unsigned int es_flow_sampling = 0;
+
+static __thread struct _es_flow_shard_s *_es_flow_local = NULL;
+
+/** Registered shards, new ones are pushed in front */
+static struct _es_flow_shard_s *_es_flow_shards = NULL;
+
+static pthread_mutex_t _es_flow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char const *_es_flow_names[ES_FLOW_KIND_MAX] = {
+   "recv",
+   "parse",
+   "transaction",
+   "callback",
+   "send",
+   "kill"
+};
+
+static const char const *_es_flow_args[ES_FLOW_KIND_MAX] = {
+   "len",
+   "len",
+   "id",
+   "type",
+   "len",
+   "id"
+};
+
+uint32_t es_flow_call_hash(const char *number, const char *host)
+{
+   uint32_t h = ES_HASH_FNV1A_INIT;
+
+   /* Hash of the header value "number@host", as the capture does */
+   if (number != NULL) {
+      h = es_hash_fnv1a_update(h, number, strlen(number));
+   }
+   if (host != NULL) {
+      h = es_hash_fnv1a_update(h, "@", 1);
+      h = es_hash_fnv1a_update(h, host, strlen(host));
+   }
+
+   return h;
+}
+
+static struct _es_flow_shard_s *_es_flow_local_init(void)
+{
+   struct _es_flow_shard_s *shard = NULL;
+
+   /* No abort here: a lost trace is not worth the process */
+   if (posix_memalign((void **)&shard, ES_FLOW_CACHE_LINE, sizeof(struct _es_flow_shard_s)) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not allocate call flow buffer");
+      return NULL;
+   }
+
+   memset(shard, 0, sizeof(struct _es_flow_shard_s));
+
+   pthread_mutex_lock(&_es_flow_lock);
+   shard->next = _es_flow_shards;
+   __atomic_store_n(&_es_flow_shards, shard, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&_es_flow_lock);
+
+   _es_flow_local = shard;
+   return shard;
+}
+
+void es_flow_record(uint32_t hash, const char *callId, es_flow_kind_t kind, uint64_t ts, uint64_t dur, int arg)
+{
+   struct _es_flow_shard_s *shard = _es_flow_local;
+   union _es_flow_event_u ev;
+   union _es_flow_event_u *slot = NULL;
+   unsigned int i = 0;
+
+   if (shard == NULL) {
+      shard = _es_flow_local_init();
+      if (shard == NULL) {
+         return;
+      }
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   ev.e.ts = ts;
+   ev.e.dur = dur;
+   ev.e.hash = hash;
+   ev.e.kind = (uint16_t)kind;
+   ev.e.arg = arg;
+   if (callId != NULL) {
+      strncpy(ev.e.callId, callId, ES_FLOW_CALLID_LEN - 1);
+   }
+
+   slot = &shard->events[shard->head % ES_FLOW_EVENTS];
+   for (i = 0; i < ES_FLOW_EVENT_WORDS; ++i) {
+      __atomic_store_n(&slot->words[i], ev.words[i], __ATOMIC_RELAXED);
+   }
+
+   __atomic_store_n(&shard->head, shard->head + 1, __ATOMIC_RELEASE);
+}
+
+static int _es_flow_cmp(const void *a, const void *b)
+{
+   const union _es_flow_event_u *ea = (const union _es_flow_event_u *)a;
+   const union _es_flow_event_u *eb = (const union _es_flow_event_u *)b;
+
+   if (ea->e.hash != eb->e.hash) {
+      return (ea->e.hash < eb->e.hash) ? -1 : 1;
+   }
+   if (ea->e.ts != eb->e.ts) {
+      return (ea->e.ts < eb->e.ts) ? -1 : 1;
+   }
+   return 0;
+}
+
+/**
+ * @brief Copy the valid events of a shard
+ * @return number of events copied
+ */
+static unsigned int _es_flow_copy(struct _es_flow_shard_s *shard, union _es_flow_event_u *out)
+{
+   uint64_t head = __atomic_load_n(&shard->head, __ATOMIC_ACQUIRE);
+   uint64_t first = (head > ES_FLOW_EVENTS) ? (head - ES_FLOW_EVENTS) : 0;
+   uint64_t idx = 0;
+   unsigned int n = 0;
+   unsigned int i = 0;
+
+   for (idx = first; idx < head; ++idx) {
+      const union _es_flow_event_u *slot = &shard->events[idx % ES_FLOW_EVENTS];
+      for (i = 0; i < ES_FLOW_EVENT_WORDS; ++i) {
+         out[n].words[i] = __atomic_load_n(&slot->words[i], __ATOMIC_RELAXED);
+      }
+      n++;
+   }
+
+   /* Drop what the owner overwrote while copying */
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   head = __atomic_load_n(&shard->head, __ATOMIC_RELAXED);
+   if (head > ES_FLOW_EVENTS) {
+      uint64_t valid = head - ES_FLOW_EVENTS;
+      if (valid > first) {
+         unsigned int lost = (unsigned int)ES_MIN(valid - first, (uint64_t)n);
+         memmove(out, out + lost, (n - lost) * sizeof(union _es_flow_event_u));
+         n -= lost;
+      }
+   }
+
+   return n;
+}
+
+/**
+ * @brief Write a string as JSON
+ */
+static void _es_flow_json_str(FILE *f, const char *str, size_t max)
+{
+   size_t i = 0;
+
+   fputc('"', f);
+   for (i = 0; (i < max) && (str[i] != '\0'); ++i) {
+      unsigned char c = (unsigned char)str[i];
+      if ((c == '"') || (c == '\\')) {
+         fprintf(f, "\\%c", c);
+      } else if (c < 0x20) {
+         fprintf(f, "\\u%04x", c);
+      } else {
+         fputc(c, f);
+      }
+   }
+   fputc('"', f);
+}
+
+es_status es_flow_dump(const char *path, unsigned int *count)
+{
+   struct _es_flow_shard_s *first = __atomic_load_n(&_es_flow_shards, __ATOMIC_ACQUIRE);
+   struct _es_flow_shard_s *shard = NULL;
+   union _es_flow_event_u *events = NULL;
+   unsigned int shards = 0;
+   unsigned int n = 0;
+   unsigned int i = 0;
+   FILE *f = NULL;
+   int fd = -1;
+
+   for (shard = first; shard != NULL; shard = shard->next) {
+      shards++;
+   }
+
+   if (shards != 0) {
+      events = (union _es_flow_event_u *) malloc((size_t)shards * ES_FLOW_EVENTS * sizeof(union _es_flow_event_u));
+      if (events == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not dump call flows: no more memory");
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+
+      /* Shards are pushed in front: the list after the first one read never changes */
+      for (shard = first; shard != NULL; shard = shard->next) {
+         n += _es_flow_copy(shard, &events[n]);
+      }
+
+      qsort(events, n, sizeof(union _es_flow_event_u), _es_flow_cmp);
+   }
+
+   /* Not through a link planted in a shared directory */
+   fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+   if ((fd < 0) || ((f = fdopen(fd, "w")) == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open %s", path);
+      if (fd >= 0) {
+         close(fd);
+      }
+      free(events);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   /* One row (tid) per call, named after its Call-ID */
+   fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+   fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"" PACKAGE "\"}}");
+   for (i = 0; i < n; ++i) {
+      const union _es_flow_event_u *ev = &events[i];
+      unsigned int kind = (ev->e.kind < ES_FLOW_KIND_MAX) ? ev->e.kind : ES_FLOW_CALLBACK;
+
+      if ((i == 0) || (events[i - 1].e.hash != ev->e.hash)) {
+         fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", ev->e.hash);
+         _es_flow_json_str(f, ev->e.callId, ES_FLOW_CALLID_LEN);
+         fprintf(f, "}}");
+      }
+
+      fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"sip\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,",
+              _es_flow_names[kind], ev->e.hash, (double)ev->e.ts / 1000.0);
+      if (ev->e.dur != 0) {
+         fprintf(f, "\"ph\":\"X\",\"dur\":%.3f,", (double)ev->e.dur / 1000.0);
+      } else {
+         fprintf(f, "\"ph\":\"i\",\"s\":\"t\",");
+      }
+      fprintf(f, "\"args\":{\"%s\":%d}}", _es_flow_args[kind], ev->e.arg);
+   }
+   fprintf(f, "\n]}\n");
+
+   fclose(f);
+   free(events);
+
+   if (count != NULL) {
+      *count = n;
+   }
+
+   return ES_OK;
+}
+
+static int _es_flow_cli_sample(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   char *end = NULL;
+   unsigned long rate = 0;
+
+   if (argc != 1) {
+      es_cli_print(pCli, "Usage: flow sample <N> (1 Call-ID out of N, 0 to stop)");
+      return CLI_ERROR;
+   }
+
+   rate = strtoul(argv[0], &end, 10);
+   if ((end == argv[0]) || (*end != '\0')) {
+      es_cli_print(pCli, "Bad rate %s", argv[0]);
+      return CLI_ERROR;
+   }
+
+   __atomic_store_n(&es_flow_sampling, (unsigned int)rate, __ATOMIC_RELAXED);
+   return CLI_OK;
+}
+
+static int _es_flow_cli_dump(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   const char *path = ES_FLOW_DUMP_FILE;
+   unsigned int count = 0;
+
+   /* The CLI has no login: it never chooses where the daemon writes */
+   if (argc != 0) {
+      es_cli_print(pCli, "Usage: flow dump (written to %s)", path);
+      return CLI_ERROR;
+   }
+
+   if (es_flow_dump(path, &count) != ES_OK) {
+      es_cli_print(pCli, "Can not write %s", path);
+      return CLI_ERROR;
+   }
+
+   es_cli_print(pCli, "%u events written to %s", count, path);
+   return CLI_OK;
+}
+
+static int _es_flow_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct _es_flow_shard_s *shard = __atomic_load_n(&_es_flow_shards, __ATOMIC_ACQUIRE);
+   unsigned int n = __atomic_load_n(&es_flow_sampling, __ATOMIC_RELAXED);
+   unsigned long long total = 0;
+   unsigned int threads = 0;
+
+   for (; shard != NULL; shard = shard->next) {
+      total += __atomic_load_n(&shard->head, __ATOMIC_RELAXED);
+      threads++;
+   }
+
+   if (n == 0) {
+      es_cli_print(pCli, "Sampling:   off");
+   } else {
+      es_cli_print(pCli, "Sampling:   1/%u", n);
+   }
+   es_cli_print(pCli, "Threads:    %u (%u events kept each)", threads, ES_FLOW_EVENTS);
+   es_cli_print(pCli, "Recorded:   %llu", total);
+   return CLI_OK;
+}
+
+es_status es_flow_cli_register(es_cli_t *pCli)
+{
+   es_status ret = ES_OK;
+
+   ret = es_cli_register_cmd(pCli, "flow sample", "Trace 1 Call-ID out of N (0 to stop)", _es_flow_cli_sample, NULL);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   ret = es_cli_register_cmd(pCli, "flow dump", "Write traced calls as Chrome trace JSON to " ES_FLOW_DUMP_FILE, _es_flow_cli_dump, NULL);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return es_cli_register_cmd(pCli, "show flow", "Show call flow tracing state", _es_flow_cli_show, NULL);
+}
@@ -0,0 +1,245 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+
+#define ES_HIST_CACHE_LINE       64
+
+/** Values of one histogram in a thread block: buckets, count, sum */
+#define ES_HIST_STRIDE           (ES_HIST_BUCKETS + 2)
+
+/**
+ * @brief Histograms of one thread
+ */
+struct _es_hist_shard_s {
+   uint64_t                         values[ES_HIST_MAX * ES_HIST_STRIDE];
+   struct _es_hist_shard_s          *next;
+} __attribute__((aligned(ES_HIST_CACHE_LINE)));
+
+__thread uint64_t *es_hist_local = NULL;
+
+/** Registered shards, new ones are pushed in front */
+static struct _es_hist_shard_s *_es_hist_shards = NULL;
+
+static pthread_mutex_t _es_hist_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Values at the last "clear latency", only the CLI view is reset */
+static struct es_hist_snapshot_s *_es_hist_baseline = NULL;
+
+static const char const *_es_hist_names[ES_HIST_MAX] = {
+   "recv",
+   "parse",
+   "queue",
+   "fsm",
+   "resp_build",
+   "send",
+   "recv_to_send",
+   "loop_lag",
+   "cb_transport",
+   "cb_osip",
+   "cb_cli",
+   "work",
+   "post"
+};
+
+uint64_t *es_hist_local_init(void)
+{
+   struct _es_hist_shard_s *shard = NULL;
+
+   if (posix_memalign((void **)&shard, ES_HIST_CACHE_LINE, sizeof(struct _es_hist_shard_s)) != 0) {
+      ES_EMERG("Can not allocate latency histograms");
+      abort();
+   }
+
+   memset(shard, 0, sizeof(struct _es_hist_shard_s));
+
+   pthread_mutex_lock(&_es_hist_lock);
+   shard->next = _es_hist_shards;
+   __atomic_store_n(&_es_hist_shards, shard, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&_es_hist_lock);
+
+   es_hist_local = shard->values;
+   return es_hist_local;
+}
+
+uint64_t es_hist_bucket_upper(unsigned int idx)
+{
+   unsigned int group = idx >> ES_HIST_SUB_BITS;
+   unsigned int shift = 0;
+
+   if (group == 0) {
+      return idx;
+   }
+
+   shift = group - 1;
+   return ((uint64_t)(ES_HIST_SUB_COUNT + (idx & (ES_HIST_SUB_COUNT - 1))) << shift) + ((1ULL << shift) - 1);
+}
+
+const char *es_hist_name(es_hist_id_t id)
+{
+   return (id < ES_HIST_MAX) ? _es_hist_names[id] : "unknown";
+}
+
+void es_hist_snapshot(es_hist_id_t id, struct es_hist_snapshot_s *snap)
+{
+   struct _es_hist_shard_s *shard = __atomic_load_n(&_es_hist_shards, __ATOMIC_ACQUIRE);
+   unsigned int i = 0;
+
+   memset(snap, 0, sizeof(struct es_hist_snapshot_s));
+
+   for (; shard != NULL; shard = shard->next) {
+      const uint64_t *h = &shard->values[(size_t)id * ES_HIST_STRIDE];
+      for (i = 0; i < ES_HIST_BUCKETS; ++i) {
+         snap->counts[i] += __atomic_load_n(&h[i], __ATOMIC_RELAXED);
+      }
+      snap->count += __atomic_load_n(&h[ES_HIST_BUCKETS], __ATOMIC_RELAXED);
+      snap->sum += __atomic_load_n(&h[ES_HIST_BUCKETS + 1], __ATOMIC_RELAXED);
+   }
+}
+
+uint64_t es_hist_percentile(const struct es_hist_snapshot_s *snap, double ratio)
+{
+   uint64_t total = 0;
+   uint64_t rank = 0;
+   uint64_t seen = 0;
+   unsigned int i = 0;
+
+   /* Buckets are read one by one, their sum is the exact total */
+   for (i = 0; i < ES_HIST_BUCKETS; ++i) {
+      total += snap->counts[i];
+   }
+
+   if (total == 0) {
+      return 0;
+   }
+
+   rank = (uint64_t)(ratio * (double)total + 0.5);
+   if (rank < 1) {
+      rank = 1;
+   }
+
+   for (i = 0; i < ES_HIST_BUCKETS; ++i) {
+      seen += snap->counts[i];
+      if (seen >= rank) {
+         return es_hist_bucket_upper(i);
+      }
+   }
+
+   return es_hist_bucket_upper(ES_HIST_BUCKETS - 1);
+}
+
+static int _es_hist_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_hist_snapshot_s *snap = (struct es_hist_snapshot_s *) malloc(sizeof(struct es_hist_snapshot_s));
+   unsigned int id = 0;
+   unsigned int i = 0;
+
+   if (snap == NULL) {
+      es_cli_print(pCli, "No more memory");
+      return CLI_ERROR;
+   }
+
+   es_cli_print(pCli, "%-14s %12s %10s %10s %10s %10s %10s %10s", "stage (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+   pthread_mutex_lock(&_es_hist_lock);
+   for (id = 0; id < ES_HIST_MAX; ++id) {
+      uint64_t max = 0;
+
+      es_hist_snapshot((es_hist_id_t)id, snap);
+
+      /* Remove what was there at the last clear */
+      if (_es_hist_baseline != NULL) {
+         const struct es_hist_snapshot_s *base = &_es_hist_baseline[id];
+         for (i = 0; i < ES_HIST_BUCKETS; ++i) {
+            snap->counts[i] -= ES_MIN(snap->counts[i], base->counts[i]);
+         }
+         snap->count -= ES_MIN(snap->count, base->count);
+         snap->sum -= ES_MIN(snap->sum, base->sum);
+      }
+
+      for (i = ES_HIST_BUCKETS; i > 0; --i) {
+         if (snap->counts[i - 1] != 0) {
+            max = es_hist_bucket_upper(i - 1);
+            break;
+         }
+      }
+
+      es_cli_print(pCli, "%-14s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f",
+                   _es_hist_names[id],
+                   (unsigned long long)snap->count,
+                   (snap->count != 0) ? ((double)snap->sum / (double)snap->count) / 1000.0 : 0.0,
+                   (double)es_hist_percentile(snap, 0.50) / 1000.0,
+                   (double)es_hist_percentile(snap, 0.90) / 1000.0,
+                   (double)es_hist_percentile(snap, 0.99) / 1000.0,
+                   (double)es_hist_percentile(snap, 0.999) / 1000.0,
+                   (double)max / 1000.0);
+   }
+   pthread_mutex_unlock(&_es_hist_lock);
+
+   free(snap);
+   return CLI_OK;
+}
+
+static int _es_hist_cli_clear(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   unsigned int id = 0;
+
+   pthread_mutex_lock(&_es_hist_lock);
+   if (_es_hist_baseline == NULL) {
+      _es_hist_baseline = (struct es_hist_snapshot_s *) malloc(ES_HIST_MAX * sizeof(struct es_hist_snapshot_s));
+   }
+   if (_es_hist_baseline != NULL) {
+      for (id = 0; id < ES_HIST_MAX; ++id) {
+         es_hist_snapshot((es_hist_id_t)id, &_es_hist_baseline[id]);
+      }
+   }
+   pthread_mutex_unlock(&_es_hist_lock);
+
+   if (_es_hist_baseline == NULL) {
+      es_cli_print(pCli, "No more memory");
+      return CLI_ERROR;
+   }
+
+   es_cli_print(pCli, "Latency histograms cleared");
+   return CLI_OK;
+}
+
+es_status es_hist_cli_register(es_cli_t *pCli)
+{
+   es_status ret = ES_OK;
+
+   ret = es_cli_register_cmd(pCli, "show latency", "Show latency percentiles per processing stage", _es_hist_cli_show, NULL);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return es_cli_register_cmd(pCli, "clear latency", "Reset the latency percentiles shown", _es_hist_cli_clear, NULL);
+}
@@ -20,6 +20,8 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/signal.h>
 #include <getopt.h>
 
@@ -28,8 +30,25 @@
 
 #include "eserror.h"
 #include "log.h"
-#include "esosip.h"
 #include "escli.h"
+#include "esstats.h"
+#include "eshist.h"
+#include "esloop.h"
+#include "esflow.h"
+#include "esmem.h"
+#include "esosip.h"
+#include "esmetrics.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "essnap.h"
+#include "esregistrar.h"
+#include "esauth.h"
+#include "esdb.h"
+#include "eswork.h"
+#include "esparse.h"
+#include "espersist.h"
+#include "esproxy.h"
+#include "essys.h"
 
 /**
  * @brief
@@ -38,17 +57,57 @@ typedef struct app_s {
    struct event_config  *cfg;            //!< LibEvent configuration
    struct event_base    *base;           //!< LibEvent Base loop
    struct event         *evsig;          //!< LibEvent Signal
+   struct event         *evhup;          //!< Configuration reload signal
    es_log_t             *logger;         //!< Logger handler
    es_osip_t            *osipCtx;        //!< OSip stack context
+   es_registrar_t       *registrarCtx;   //!< Bindings of REGISTER
+   es_auth_t            *authCtx;        //!< Digest authentication
+   es_db_t              *dbCtx;          //!< Subscribers database, NULL if none
+   es_work_t            *workCtx;        //!< Offload pool, NULL if none
+   es_parse_t           *parseCtx;       //!< Parser threads, NULL if none
+   es_proxy_t           *proxyCtx;       //!< Forwarding of requests
    es_cli_t             *cliCtx;         //!< Telnet Interface
+   es_loop_t            *loopCtx;        //!< Event loop monitor
+   es_metrics_t         *metricsCtx;     //!< Metrics HTTP endpoint
+   unsigned short       metricsPort;     //!< Metrics TCP port, 0 to disable
+   const char           *configPath;     //!< Configuration file, NULL for none
+   struct es_config_s   config;          //!< Settings in use
+   es_upgrade_t         *upgradeCtx;     //!< Handoff to a new process
+   int                  takeOver;        //!< Started to replace the running process
+   struct es_upgrade_fd_s upgradeFds[ES_UPGRADE_MAX_FDS]; //!< Sockets taken over
+   unsigned int         upgradeNbFds;    //!< Number of sockets taken over
+   es_persist_t         *persistCtx;     //!< State kept across restarts
+   struct event         *evdrain;        //!< Drain after a handoff
+   uint64_t             drainTs;         //!< Drain start
 } app_t;
 
+/**
+ * @brief Sockets handed over on upgrade
+ */
+enum esip_fd_e {
+   ESIP_FD_SIP = 1,
+   ESIP_FD_CLI,
+   ESIP_FD_METRICS
+};
+
+/** Drain check period, in ms */
+#define ESIP_DRAIN_PERIOD_MS           100
+
+/** Longest drain, a non INVITE transaction lifetime (64*T1) */
+#define ESIP_DRAIN_MAX_NS              (32ULL * 1000000000ULL)
+
 #define ESIP_SHORT_OPT_VERSION_CHAR    "v"
 #define ESIP_SHORT_OPT_HELP_CHAR       "h"
+#define ESIP_SHORT_OPT_METRICS_CHAR    "m"
+#define ESIP_SHORT_OPT_CONFIG_CHAR     "c"
+#define ESIP_SHORT_OPT_UPGRADE_CHAR    "u"
 
 #define ESIP_SHORT_OPTS_STR \
    ESIP_SHORT_OPT_VERSION_CHAR \
-   ESIP_SHORT_OPT_HELP_CHAR
+   ESIP_SHORT_OPT_HELP_CHAR \
+   ESIP_SHORT_OPT_METRICS_CHAR ":" \
+   ESIP_SHORT_OPT_CONFIG_CHAR ":" \
+   ESIP_SHORT_OPT_UPGRADE_CHAR
 
 #define ESIP_USAGE_MSG_TEXT_STR \
    "Usage: " PACKAGE " [OPTs]\n" \
@@ -62,6 +121,18 @@ typedef struct app_s {
          ESIP_SHORT_OPT_VERSION_CHAR \
          "\tPrint version information and then exit." \
          "\n" \
+   "  --" \
+         ESIP_SHORT_OPT_METRICS_CHAR \
+         " <port>\tServe OpenMetrics at http://<host>:<port>/metrics." \
+         "\n" \
+   "  --" \
+         ESIP_SHORT_OPT_CONFIG_CHAR \
+         " <file>\tRead the settings from file, again on SIGHUP." \
+         "\n" \
+   "  --" \
+         ESIP_SHORT_OPT_UPGRADE_CHAR \
+         "\tTake over the sockets and dialogs of the running process." \
+         "\n" \
    "\n" \
    "For more information, contact me " PACKAGE_BUGREPORT "\n" \
    "\n"
@@ -77,7 +148,210 @@ static void signal_cb(evutil_socket_t fd, short event, void * arg)
    ESIP_TRACE(ESIP_LOG_INFO, "Terminate %s", PACKAGE);
    (void)event_base_loopexit(ctx->base, NULL);
 
-   /* TODO: free all allocated mem */
+   /* Everything is released by main() once the loop is out, leaks are reported then */
+}
+
+static void esip_config_apply(app_t *ctx, const struct es_config_s *cfg)
+{
+   es_log_set_loglevel(&es_log_default_handler, cfg->logLevel);
+
+   if ((ctx->osipCtx != NULL) && (es_osip_configure(ctx->osipCtx, cfg) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Stack settings partly applied");
+   }
+
+   if (ctx->registrarCtx != NULL) {
+      (void)es_registrar_configure(ctx->registrarCtx, cfg);
+   }
+
+   if ((ctx->authCtx != NULL) && (es_auth_configure(ctx->authCtx, cfg) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Authentication settings not applied");
+   }
+
+   if ((ctx->proxyCtx != NULL) && (es_proxy_configure(ctx->proxyCtx, cfg) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Proxy settings not applied");
+   }
+}
+
+static void sighup_cb(evutil_socket_t fd, short event, void * arg)
+{
+   app_t * ctx = (app_t *)arg;
+   struct es_config_s cfg;
+
+   if (ctx->configPath == NULL) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "No configuration file to reload");
+      return;
+   }
+
+   /* Read over the defaults: a key removed from the file gets its default back */
+   es_config_defaults(&cfg);
+   if (es_config_load(ctx->configPath, &cfg) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reload of %s failed, settings unchanged", ctx->configPath);
+      return;
+   }
+
+   /* Sockets stay open: listeners are only changed by a restart */
+   (void)es_config_check_restart(&ctx->config, &cfg);
+
+   esip_config_apply(ctx, &cfg);
+
+   /* Keep the running listeners, so the next reload reports them again */
+   strcpy(cfg.sipAddress, ctx->config.sipAddress);
+   strcpy(cfg.upgradeSocket, ctx->config.upgradeSocket);
+   strcpy(cfg.persistFile, ctx->config.persistFile);
+   strcpy(cfg.dbFile, ctx->config.dbFile);
+   cfg.workThreads = ctx->config.workThreads;
+   cfg.parseThreads = ctx->config.parseThreads;
+   cfg.persistPeriod = ctx->config.persistPeriod;
+   cfg.sipPort = ctx->config.sipPort;
+   cfg.cliPort = ctx->config.cliPort;
+   cfg.metricsPort = ctx->config.metricsPort;
+   cfg.sysCpuSip = ctx->config.sysCpuSip;
+   cfg.sysCpuCli = ctx->config.sysCpuCli;
+   cfg.sysIncomingCpu = ctx->config.sysIncomingCpu;
+   cfg.sysMlock = ctx->config.sysMlock;
+   cfg.sysPool = ctx->config.sysPool;
+   cfg.sysHugepages = ctx->config.sysHugepages;
+   ctx->config = cfg;
+
+   ESIP_TRACE(ESIP_LOG_NOTICE, "Configuration %s reloaded", ctx->configPath);
+}
+
+static void esip_drain_cb(evutil_socket_t fd, short event, void * arg)
+{
+   app_t * ctx = (app_t *)arg;
+   unsigned int left = es_osip_transactions(ctx->osipCtx);
+
+   /* Only timers run them now: nothing is read, so the ones waiting for
+      a message (a response, an ACK) end by timeout */
+   if ((left != 0) && ((es_hist_now() - ctx->drainTs) < ESIP_DRAIN_MAX_NS)) {
+      return;
+   }
+
+   ESIP_TRACE(ESIP_LOG_NOTICE, "Drained, %u transaction(s) left: terminate %s", left, PACKAGE);
+   (void)event_base_loopexit(ctx->base, NULL);
+}
+
+static es_status esip_upgrade_give(void *arg, struct es_upgrade_fd_s *fds, unsigned int *nb)
+{
+   app_t * ctx = (app_t *)arg;
+
+   *nb = 0;
+
+   fds[*nb].id = ESIP_FD_SIP;
+   if (es_osip_get_socket(ctx->osipCtx, &fds[*nb].fd) != ES_OK) {
+      return ES_ERROR_UNINITIALIZED;
+   }
+   (*nb)++;
+
+   fds[*nb].id = ESIP_FD_CLI;
+   if (es_cli_get_socket(ctx->cliCtx, &fds[*nb].fd) == ES_OK) {
+      (*nb)++;
+   }
+
+   fds[*nb].id = ESIP_FD_METRICS;
+   if ((ctx->metricsCtx != NULL) && (es_metrics_get_socket(ctx->metricsCtx, &fds[*nb].fd) == ES_OK)) {
+      (*nb)++;
+   }
+
+   return ES_OK;
+}
+
+static void esip_upgrade_pause(void *arg)
+{
+   app_t * ctx = (app_t *)arg;
+   es_osip_pause(ctx->osipCtx, 1);
+
+   /* The new process writes the files from now on */
+   if (ctx->persistCtx != NULL) {
+      (void)es_persist_pause(ctx->persistCtx, 1);
+   }
+}
+
+static es_status esip_upgrade_save(void *arg, struct es_upgrade_buf_s *state)
+{
+   app_t * ctx = (app_t *)arg;
+   es_status ret = es_osip_save(ctx->osipCtx, state);
+
+   if ((ret == ES_OK) && (ctx->registrarCtx != NULL)) {
+      ret = es_registrar_save(ctx->registrarCtx, state);
+   }
+
+   return ret;
+}
+
+/**
+ * @brief State handed to the new process: the persisted one, and the nonce
+ * key its challenges were signed with
+ */
+static es_status esip_upgrade_state(void *arg, struct es_upgrade_buf_s *state)
+{
+   app_t * ctx = (app_t *)arg;
+   es_status ret = esip_upgrade_save(arg, state);
+
+   if ((ret == ES_OK) && (ctx->authCtx != NULL)) {
+      ret = es_auth_save(ctx->authCtx, state);
+   }
+
+   return ret;
+}
+
+static void esip_upgrade_resume(void *arg)
+{
+   app_t * ctx = (app_t *)arg;
+   es_osip_pause(ctx->osipCtx, 0);
+
+   if (ctx->persistCtx != NULL) {
+      (void)es_persist_pause(ctx->persistCtx, 0);
+   }
+}
+
+/**
+ * @brief State read from the persist files, each module takes its records
+ */
+static es_status esip_persist_restore(void *arg, const uint8_t *data, size_t len, unsigned int elapsed)
+{
+   app_t * ctx = (app_t *)arg;
+   es_status ret = es_osip_restore(ctx->osipCtx, data, len, elapsed);
+
+   if (es_registrar_restore(ctx->registrarCtx, data, len, elapsed) != ES_OK) {
+      ret = ES_ERROR_BADPARAM;
+   }
+
+   return ret;
+}
+
+static void esip_upgrade_done(void *arg)
+{
+   app_t * ctx = (app_t *)arg;
+   struct timeval tv = { 0, ESIP_DRAIN_PERIOD_MS * 1000 };
+
+   /* Our transactions end here, the new ones go to the new process. So do
+      the responses, ACKs and CANCELs of ours: it has no transaction for
+      them, the UAs retransmit to it or the calls fail on timeout. */
+   ctx->drainTs = es_hist_now();
+   ctx->evdrain = event_new(ctx->base, -1, EV_PERSIST, esip_drain_cb, ctx);
+   if ((ctx->evdrain == NULL) || (event_add(ctx->evdrain, &tv) != 0)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not drain, terminate %s now", PACKAGE);
+      (void)event_base_loopexit(ctx->base, NULL);
+   }
+}
+
+/**
+ * @brief Take a socket handed over, -1 if none
+ */
+static int esip_upgrade_fd(app_t *ctx, uint32_t id)
+{
+   unsigned int i = 0;
+
+   for (i = 0; i < ctx->upgradeNbFds; ++i) {
+      if ((ctx->upgradeFds[i].id == id) && (ctx->upgradeFds[i].fd >= 0)) {
+         int fd = ctx->upgradeFds[i].fd;
+         ctx->upgradeFds[i].fd = -1;
+         return fd;
+      }
+   }
+
+   return -1;
 }
 
 static void esip_usage(void)
@@ -113,6 +387,24 @@ static es_status esip_getopt(app_t *_pCtx, const int argc, char *argv[])
             fprintf(stdout, "Copyright (C) 2014 %s\n", PACKAGE_BUGREPORT);
             exit(EXIT_SUCCESS);
             break;
+         case 'm':
+            {
+               char *end = NULL;
+               long port = strtol(optarg, &end, 10);
+               if ((end == optarg) || (*end != '\0') || (port <= 0) || (port > 65535)) {
+                  ESIP_TRACE(ESIP_LOG_ERROR, "Bad metrics port %s", optarg);
+                  esip_usage();
+                  return ES_ERROR_BADPARAM;
+               }
+               _pCtx->metricsPort = (unsigned short)port;
+            }
+            break;
+         case 'c':
+            _pCtx->configPath = optarg;
+            break;
+         case 'u':
+            _pCtx->takeOver = 1;
+            break;
          case -1:
             break;
          default:
@@ -130,12 +422,40 @@ int main(const int argc, char *argv[])
 {
    app_t ctx;
    int ret = EXIT_SUCCESS;
+   int upgradeConn = -1;
+   unsigned int i = 0;
+
+   memset(&ctx, 0, sizeof(app_t));
 
    if (esip_getopt(&ctx, argc, argv) != ES_OK) {
       ESIP_TRACE(ESIP_LOG_CRIT, "Bad configuration");
       return EXIT_FAILURE;
    }
 
+   es_config_defaults(&ctx.config);
+   if ((ctx.configPath != NULL) && (es_config_load(ctx.configPath, &ctx.config) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_CRIT, "Bad configuration file %s", ctx.configPath);
+      return EXIT_FAILURE;
+   }
+
+   /* The command line wins over the file */
+   if (ctx.metricsPort == 0) {
+      ctx.metricsPort = (unsigned short)ctx.config.metricsPort;
+   }
+
+   esip_config_apply(&ctx, &ctx.config);
+
+   /* Before any oSIP or libevent allocation, on the node of the SIP CPU */
+   if ((ctx.config.sysPool != 0) &&
+       (es_mem_pool_init((size_t)ctx.config.sysPool << 20, ctx.config.sysHugepages,
+                         es_sys_cpu_node(ctx.config.sysCpuSip)) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Memory pool not available");
+   }
+
+   if (es_mem_init() != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Memory accounting not available");
+   }
+
    event_set_log_callback(libevent_log_cb);
 
    ctx.cfg = event_config_new();
@@ -165,51 +485,360 @@ int main(const int argc, char *argv[])
       goto ERROR_EXIT;
    }
 
+   ctx.evhup = evsignal_new(ctx.base, SIGHUP, &sighup_cb, (void *)&ctx);
+   if ((ctx.evhup == NULL) || (evsignal_add(ctx.evhup, NULL) != 0)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Configuration reload on SIGHUP not available");
+   }
+
+   if (es_loop_init(&ctx.loopCtx, ctx.base) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not start event loop monitor");
+   }
+
    /* Init OSip Stack */
    if (es_osip_init(&ctx.osipCtx, ctx.base) != ES_OK) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize OSip stack");
       goto ERROR_EXIT;
    }
 
+   if ((es_registrar_init(&ctx.registrarCtx, ctx.base) != ES_OK) ||
+       (es_registrar_configure(ctx.registrarCtx, &ctx.config) != ES_OK) ||
+       (es_osip_set_registrar(ctx.osipCtx, ctx.registrarCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize registrar");
+      goto ERROR_EXIT;
+   }
+
+   /* Mapped once, for the life of the process */
+   if ((ctx.config.dbFile[0] != '\0') && (es_db_open(&ctx.dbCtx, ctx.config.dbFile) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open subscribers database");
+      goto ERROR_EXIT;
+   }
+
+   /* A realm refused does not stop the start: requests are not challenged */
+   if ((es_auth_init(&ctx.authCtx) != ES_OK) ||
+       (es_auth_set_db(ctx.authCtx, ctx.dbCtx) != ES_OK) ||
+       (es_osip_set_auth(ctx.osipCtx, ctx.authCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize authentication");
+      goto ERROR_EXIT;
+   }
+
+   if (es_auth_configure(ctx.authCtx, &ctx.config) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Authentication settings not applied, requests are not challenged");
+   }
+
+   if ((ctx.config.workThreads != 0) &&
+       ((es_work_init(&ctx.workCtx, ctx.base, ctx.config.workThreads) != ES_OK) ||
+        (es_osip_set_work(ctx.osipCtx, ctx.workCtx) != ES_OK))) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start the work pool");
+      goto ERROR_EXIT;
+   }
+
+   if ((ctx.config.parseThreads != 0) &&
+       ((es_parse_init(&ctx.parseCtx, ctx.base, ctx.config.parseThreads) != ES_OK) ||
+        (es_osip_set_parse(ctx.osipCtx, ctx.parseCtx) != ES_OK))) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start the parser threads");
+      goto ERROR_EXIT;
+   }
+
+   /* The registrar is its location service */
+   if ((es_proxy_init(&ctx.proxyCtx) != ES_OK) ||
+       (es_proxy_set_registrar(ctx.proxyCtx, ctx.registrarCtx) != ES_OK) ||
+       (es_proxy_set_db(ctx.proxyCtx, ctx.dbCtx) != ES_OK) ||
+       (es_osip_set_proxy(ctx.osipCtx, ctx.proxyCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize proxy");
+      goto ERROR_EXIT;
+   }
+
+   if (es_proxy_configure(ctx.proxyCtx, &ctx.config) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Proxy settings not applied, requests are answered");
+   }
+
+   /* Warm restart: the state of the previous run, the running process
+      gives its own on upgrade */
+   if (ctx.config.persistFile[0] != '\0') {
+      if (!ctx.takeOver) {
+         es_status rc = es_persist_load(ctx.config.persistFile, esip_persist_restore, &ctx);
+
+         if ((rc != ES_OK) && (rc != ES_ERROR_NOT_FOUND)) {
+            ESIP_TRACE(ESIP_LOG_WARNING, "State partly restored");
+         }
+      }
+
+      if (es_persist_init(&ctx.persistCtx, ctx.base, ctx.config.persistFile, ctx.config.persistPeriod,
+                          esip_upgrade_save, &ctx) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize persist");
+         goto ERROR_EXIT;
+      }
+   }
+
+   /* Sockets of the running process: it stops its loop until we are
+      ready, only what needs them is done from here */
+   if (ctx.takeOver) {
+      if (es_upgrade_connect(ctx.config.upgradeSocket, &upgradeConn, ctx.upgradeFds, &ctx.upgradeNbFds) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not take over from %s", ctx.config.upgradeSocket);
+         goto ERROR_EXIT;
+      }
+   }
+
+   if (ctx.takeOver && (es_osip_adopt_socket(ctx.osipCtx, esip_upgrade_fd(&ctx, ESIP_FD_SIP)) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "No SIP socket taken over");
+      goto ERROR_EXIT;
+   }
+
+   /* Before the socket is bound, on the one taken over */
+   if (es_osip_configure(ctx.osipCtx, &ctx.config) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Stack settings partly applied");
+   }
+
    /* Init CLI */
-   if (es_cli_init(&ctx.cliCtx, ctx.base) != ES_OK) {
+   if (es_cli_init(&ctx.cliCtx, ctx.config.cliPort, esip_upgrade_fd(&ctx, ESIP_FD_CLI)) != ES_OK) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize CLI");
       goto ERROR_EXIT;
    }
 
+   if (es_osip_cli_register(ctx.osipCtx, ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register OSip stack commands");
+   }
+
+   if (es_stats_cli_register(ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register statistics commands");
+   }
+
+   if (es_hist_cli_register(ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register latency commands");
+   }
+
+   if (es_mem_cli_register(ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register memory commands");
+   }
+
+   if (es_flow_cli_register(ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register call flow commands");
+   }
+
+   if ((ctx.loopCtx != NULL) && (es_loop_cli_register(ctx.loopCtx, ctx.cliCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register event loop commands");
+   }
+
+   if (es_registrar_cli_register(ctx.registrarCtx, ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register registrar commands");
+   }
+
+   if (es_proxy_cli_register(ctx.proxyCtx, ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register proxy commands");
+   }
+
+   if (es_auth_cli_register(ctx.authCtx, ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register authentication commands");
+   }
+
+   if ((ctx.dbCtx != NULL) && (es_db_cli_register(ctx.dbCtx, ctx.cliCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register database commands");
+   }
+
+   if ((ctx.workCtx != NULL) && (es_work_cli_register(ctx.workCtx, ctx.cliCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register work pool commands");
+   }
+
+   if ((ctx.parseCtx != NULL) && (es_parse_cli_register(ctx.parseCtx, ctx.cliCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register parser commands");
+   }
+
+   if ((ctx.persistCtx != NULL) && (es_persist_cli_register(ctx.persistCtx, ctx.cliCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register persist commands");
+   }
+
+   if (es_sys_cli_register(ctx.cliCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not register system commands");
+   }
+
+   (void)es_cli_set_cpu(ctx.cliCtx, ctx.config.sysCpuCli);
+
    if (es_cli_start(ctx.cliCtx) != ES_OK) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Can not Start CLI");
       goto ERROR_EXIT;
    }
 
+   /* Once the CLI thread is created, it does not inherit it */
+   if (es_sys_pin_thread("sip", ctx.config.sysCpuSip) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "SIP thread not pinned");
+   }
+
+   /* The old process stops reading now, its dialogs are ours before we read */
+   if (upgradeConn >= 0) {
+      struct es_upgrade_buf_s state;
+
+      if (es_upgrade_receive(upgradeConn, &state) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "No state from the running process");
+         goto ERROR_EXIT;
+      }
+
+      if (esip_persist_restore(&ctx, state.data, state.len, 0) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "State partly restored");
+      }
+      if (es_auth_restore(ctx.authCtx, state.data, state.len) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Nonce key not taken over, pending challenges fail once");
+      }
+      es_upgrade_buf_free(&state);
+   }
+
+   /* Restored: the files start over from this state, then follow it */
+   if (ctx.persistCtx != NULL) {
+      struct es_upgrade_journal_s journal;
+
+      if ((es_persist_start(ctx.persistCtx) != ES_OK) ||
+          (es_persist_journal(ctx.persistCtx, &journal) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start persist");
+         goto ERROR_EXIT;
+      }
+
+      (void)es_osip_set_journal(ctx.osipCtx, &journal);
+      (void)es_registrar_set_journal(ctx.registrarCtx, &journal);
+   }
+
    if (es_osip_start(ctx.osipCtx) != ES_OK) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Can not Start OSip stack");
       goto ERROR_EXIT;
    }
 
+   {
+      int sipFd = -1;
+
+      if (es_osip_get_socket(ctx.osipCtx, &sipFd) == ES_OK) {
+         /* Packets of the socket handled where the SIP thread runs */
+         if (ctx.config.sysIncomingCpu && (ctx.config.sysCpuSip >= 0)) {
+            (void)es_sys_set_incoming_cpu(sipFd, ctx.config.sysCpuSip);
+         }
+         (void)es_sys_watch_socket("sip", sipFd);
+      }
+   }
+
+   /* Metrics are served by the SIP loop, at low priority */
+   if (ctx.metricsPort != 0) {
+      if (es_metrics_init(&ctx.metricsCtx, ctx.base, NULL, ctx.metricsPort,
+                          esip_upgrade_fd(&ctx, ESIP_FD_METRICS)) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start metrics endpoint");
+         goto ERROR_EXIT;
+      }
+   }
+
+   /* The running process drains and exits */
+   if (upgradeConn >= 0) {
+      if (es_upgrade_finish(upgradeConn) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Previous process not told, it may still read");
+      }
+      upgradeConn = -1;
+   }
+
+   /* Ready for the next upgrade */
+   if (ctx.config.upgradeSocket[0] != '\0') {
+      struct es_upgrade_handler_s handler = {
+         esip_upgrade_give,
+         esip_upgrade_pause,
+         esip_upgrade_state,
+         esip_upgrade_resume,
+         esip_upgrade_done,
+         &ctx
+      };
+
+      if (es_upgrade_init(&ctx.upgradeCtx, ctx.base, ctx.config.upgradeSocket,
+                          esip_upgrade_fd(&ctx, ES_UPGRADE_FD_SELF), &handler) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Upgrade without restart not available");
+      }
+   }
+
+   /* Taken over but not used with this configuration */
+   for (i = 0; i < ctx.upgradeNbFds; ++i) {
+      if (ctx.upgradeFds[i].fd >= 0) {
+         close(ctx.upgradeFds[i].fd);
+      }
+   }
+   ctx.upgradeNbFds = 0;
+
+   /* Everything is mapped: no page fault from now on */
+   if (ctx.config.sysMlock && (es_sys_lock_memory() != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Memory not locked, page faults may delay messages");
+   }
+
    ESIP_TRACE(ESIP_LOG_DEBUG, "Starting %s v%s main loop", PACKAGE, VERSION);
    if (event_base_dispatch(ctx.base) != 0) {
       ESIP_TRACE(ESIP_LOG_EMERG, "Can not start main event lopp");
       goto ERROR_EXIT;
    }
 
+   if (ctx.upgradeCtx != NULL) {
+      es_upgrade_deinit(ctx.upgradeCtx);
+   }
+
+   if (ctx.evdrain != NULL) {
+      event_free(ctx.evdrain);
+   }
+
+   if (ctx.metricsCtx != NULL) {
+      es_metrics_deinit(ctx.metricsCtx);
+   }
+
+   /* Last snapshot, while the state is complete */
+   if (ctx.persistCtx != NULL) {
+      (void)es_osip_set_journal(ctx.osipCtx, NULL);
+      (void)es_registrar_set_journal(ctx.registrarCtx, NULL);
+      es_persist_deinit(ctx.persistCtx);
+   }
+
    es_osip_stop(ctx.osipCtx);
    es_cli_stop(ctx.cliCtx);
 
+   (void)es_osip_set_proxy(ctx.osipCtx, NULL);
+   es_proxy_deinit(ctx.proxyCtx);
+
+   /* Messages parsed and not handled yet are dropped */
+   if (ctx.parseCtx != NULL) {
+      (void)es_osip_set_parse(ctx.osipCtx, NULL);
+      es_parse_deinit(ctx.parseCtx);
+   }
+
+   /* Checks running complete before their context goes */
+   if (ctx.workCtx != NULL) {
+      (void)es_osip_set_work(ctx.osipCtx, NULL);
+      es_work_deinit(ctx.workCtx);
+   }
+
+   (void)es_osip_set_auth(ctx.osipCtx, NULL);
+   es_auth_deinit(ctx.authCtx);
+
+   if (ctx.dbCtx != NULL) {
+      es_db_close(ctx.dbCtx);
+   }
+
+   /* Its rows go before the snapshots of the stack */
+   (void)es_osip_set_registrar(ctx.osipCtx, NULL);
+   es_registrar_deinit(ctx.registrarCtx);
+
    es_osip_deinit(ctx.osipCtx);
    es_cli_deinit(ctx.cliCtx);
 
+   if (ctx.loopCtx != NULL) {
+      es_loop_deinit(ctx.loopCtx);
+   }
+
    goto EXIT;
 
 ERROR_EXIT:
    ESIP_TRACE(ESIP_LOG_EMERG, "%s fatal error: stoped.", PACKAGE);
    ret = EXIT_FAILURE;
 
+   /* The running process goes on if we did not tell it we run */
+   if (upgradeConn >= 0) {
+      close(upgradeConn);
+   }
+
 EXIT:
   /* free cfg */
   event_config_free(ctx.cfg);
   ctx.cfg = NULL;
 
+  if (ctx.evhup != NULL) {
+    event_free(ctx.evhup);
+  }
   event_free(ctx.evsig);
   event_base_free(ctx.base);
 
@@ -112,7 +112,8 @@ es_status es_log_set_loglevel(es_log_t *handler, unsigned int level)
       return ES_ERROR_NULLPTR;
    }
 
-   handler->loglevel = level;
+   /* Changed at run time while other threads log */
+   __atomic_store_n(&handler->loglevel, level, __ATOMIC_RELAXED);
    return ES_OK;
 }
 
@@ -123,7 +124,7 @@ es_status es_log_get_loglevel(es_log_t *handler, unsigned int *level)
       return ES_ERROR_NULLPTR;
    }
 
-   *level = handler->loglevel;
+   *level = __atomic_load_n(&handler->loglevel, __ATOMIC_RELAXED);
    return ES_OK;
 }
 
@@ -147,7 +148,7 @@ static void es_log_vprintf(es_log_t *handler, const char *function, const int li
       return;
    }
 
-   if (level > handler->loglevel) {
+   if (level > __atomic_load_n(&handler->loglevel, __ATOMIC_RELAXED)) {
       return;
    }
 
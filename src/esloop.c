@@ -0,0 +1,250 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esloop.h"
+
+#define ES_LOOP_MAGIC            0x20141026
+
+/** Period of the lag probe (ms) */
+#define ES_LOOP_PROBE_MS         50
+
+/** Min time between two slow callback warnings of a thread (ns) */
+#define ES_LOOP_WARN_INTERVAL    1000000000ULL
+
+struct es_loop_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* Event loop */
+   struct event_base         *base;
+   /* Probe timer */
+   struct event              *probe;
+   /* Time the probe should fire at (ns) */
+   uint64_t                  expected;
+};
+
+/** Slow callback threshold (ns), set from the CLI thread */
+static uint64_t _es_loop_slow_ns = ES_LOOP_SLOW_DEFAULT_MS * 1000000ULL;
+
+/** Slow callbacks seen, all threads */
+static uint64_t _es_loop_slow_count = 0;
+
+/** Last warning of the thread, and warnings skipped since */
+static __thread uint64_t _es_loop_last_warn = 0;
+static __thread unsigned int _es_loop_skipped = 0;
+
+static void _es_loop_slow(const char *name, uint64_t elapsed, uint64_t now)
+{
+   __atomic_add_fetch(&_es_loop_slow_count, 1, __ATOMIC_RELAXED);
+
+   /* Logging is itself slow: do not let a storm of slow callbacks make it worse */
+   if ((_es_loop_last_warn != 0) && ((now - _es_loop_last_warn) < ES_LOOP_WARN_INTERVAL)) {
+      _es_loop_skipped++;
+      return;
+   }
+
+   ESIP_TRACE(ESIP_LOG_WARNING, "Slow callback %s: %.3f ms (%u more not reported)",
+              name, (double)elapsed / 1e6, _es_loop_skipped);
+
+   _es_loop_last_warn = now;
+   _es_loop_skipped = 0;
+}
+
+void es_loop_cb_done(es_hist_id_t id, const char *name, uint64_t start)
+{
+   uint64_t now = es_hist_now();
+   uint64_t elapsed = now - start;
+
+   es_hist_record(id, elapsed);
+
+   if (elapsed > __atomic_load_n(&_es_loop_slow_ns, __ATOMIC_RELAXED)) {
+      _es_loop_slow(name, elapsed, now);
+   }
+}
+
+static void _es_loop_probe_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_loop_s *_pCtx = (struct es_loop_s *)arg;
+   struct timeval tv = { 0, ES_LOOP_PROBE_MS * 1000 };
+   uint64_t now = es_hist_now();
+   uint64_t lag = 0;
+
+   if ((_pCtx == (struct es_loop_s *)0) || (_pCtx->magic != ES_LOOP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Loop Ctx not valid");
+      return;
+   }
+
+   lag = (now > _pCtx->expected) ? (now - _pCtx->expected) : 0;
+   es_hist_record(ES_HIST_LOOP_LAG, lag);
+
+   if (lag > __atomic_load_n(&_es_loop_slow_ns, __ATOMIC_RELAXED)) {
+      _es_loop_slow("loop lag", lag, now);
+   }
+
+   /* Re-armed from now, so one stall is counted once */
+   _pCtx->expected = now + ES_LOOP_PROBE_MS * 1000000ULL;
+   if (event_add(_pCtx->probe, &tv) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not re-arm loop probe");
+   }
+}
+
+es_status es_loop_init(es_loop_t **ppCtx, struct event_base *pBase)
+{
+   struct es_loop_s *_pCtx = NULL;
+   struct timeval tv = { 0, ES_LOOP_PROBE_MS * 1000 };
+
+   if (pBase == (struct event_base *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Loop not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_loop_s *) malloc(sizeof(struct es_loop_s));
+   if (_pCtx == (struct es_loop_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize loop monitor: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_loop_s));
+
+   _pCtx->magic = ES_LOOP_MAGIC;
+   _pCtx->base = pBase;
+
+   _pCtx->probe = evtimer_new(pBase, _es_loop_probe_cb, _pCtx);
+   if (_pCtx->probe == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create loop probe");
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Same priority as SIP: measure the stalls, not the scheduling */
+   if (event_priority_set(_pCtx->probe, 0) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set priority of loop probe");
+   }
+
+   _pCtx->expected = es_hist_now() + ES_LOOP_PROBE_MS * 1000000ULL;
+   if (event_add(_pCtx->probe, &tv) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start loop probe");
+      event_free(_pCtx->probe);
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_loop_deinit(es_loop_t *pCtx)
+{
+   struct es_loop_s *_pCtx = (struct es_loop_s *)pCtx;
+
+   if (_pCtx == (struct es_loop_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Loop Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_LOOP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Loop Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   event_free(_pCtx->probe);
+
+   memset(_pCtx, 0, sizeof(struct es_loop_s));
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+static int _es_loop_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_hist_snapshot_s *snap = (struct es_hist_snapshot_s *) malloc(sizeof(struct es_hist_snapshot_s));
+
+   if (snap == NULL) {
+      es_cli_print(pCli, "No more memory");
+      return CLI_ERROR;
+   }
+
+   es_hist_snapshot(ES_HIST_LOOP_LAG, snap);
+
+   es_cli_print(pCli, "Probe period:          %d ms", ES_LOOP_PROBE_MS);
+   es_cli_print(pCli, "Slow threshold:        %.1f ms", (double)__atomic_load_n(&_es_loop_slow_ns, __ATOMIC_RELAXED) / 1e6);
+   es_cli_print(pCli, "Slow callbacks:        %llu", (unsigned long long)__atomic_load_n(&_es_loop_slow_count, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "Lag p50/p99/p99.9:     %.3f / %.3f / %.3f ms",
+                (double)es_hist_percentile(snap, 0.50) / 1e6,
+                (double)es_hist_percentile(snap, 0.99) / 1e6,
+                (double)es_hist_percentile(snap, 0.999) / 1e6);
+
+   free(snap);
+   return CLI_OK;
+}
+
+static int _es_loop_cli_threshold(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   char *end = NULL;
+   double ms = 0.0;
+
+   if (argc != 1) {
+      es_cli_print(pCli, "Usage: set loop threshold <ms>");
+      return CLI_ERROR;
+   }
+
+   ms = strtod(argv[0], &end);
+   if ((end == argv[0]) || (*end != '\0') || (ms <= 0.0)) {
+      es_cli_print(pCli, "Bad threshold %s", argv[0]);
+      return CLI_ERROR;
+   }
+
+   __atomic_store_n(&_es_loop_slow_ns, (uint64_t)(ms * 1e6), __ATOMIC_RELAXED);
+   es_cli_print(pCli, "Slow callback threshold set to %.1f ms", ms);
+   return CLI_OK;
+}
+
+es_status es_loop_cli_register(es_loop_t *pCtx, es_cli_t *pCli)
+{
+   struct es_loop_s *_pCtx = (struct es_loop_s *)pCtx;
+   es_status ret = ES_OK;
+
+   if (_pCtx == (struct es_loop_s *)0) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_LOOP_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   ret = es_cli_register_cmd(pCli, "show loop", "Show event loop lag and slow callbacks", _es_loop_cli_show, _pCtx);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return es_cli_register_cmd(pCli, "set loop threshold", "Set the slow callback threshold (ms)", _es_loop_cli_threshold, _pCtx);
+}
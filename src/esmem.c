@@ -0,0 +1,439 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include <osipparser2/osip_port.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esmem.h"
+#include "essys.h"
+
+#define ES_MEM_MAGIC             0x20141027
+
+#define ES_MEM_CACHE_LINE        64
+
+/**
+ * @brief Header in front of each counted block
+ * 16 bytes, the block keeps the malloc() alignment.
+ */
+struct _es_mem_hdr_s {
+   uint32_t                         magic;
+   uint32_t                         cat;
+   uint64_t                         size;
+};
+
+/**
+ * @brief Counters of a category, one cache line each
+ */
+struct _es_mem_counters_s {
+   int64_t                          bytes;
+   int64_t                          objects;
+   int64_t                          peakBytes;
+   int64_t                          peakObjects;
+   int64_t                          allocs;
+} __attribute__((aligned(ES_MEM_CACHE_LINE)));
+
+/** Block sizes of the pool, header included */
+static const uint32_t _es_mem_pool_sizes[] = { 64, 128, 256, 512, 1024, 2048, ES_MEM_POOL_MAX_BLOCK };
+
+#define ES_MEM_POOL_CLASSES      (sizeof(_es_mem_pool_sizes) / sizeof(_es_mem_pool_sizes[0]))
+
+/**
+ * @brief Free blocks of one size, one cache line each
+ * The lock is only contended when the CLI thread allocates.
+ */
+struct _es_mem_pool_class_s {
+   unsigned char                    lock;
+   void                             *free;
+   int64_t                          total;
+   int64_t                          avail;
+   int64_t                          misses;
+} __attribute__((aligned(ES_MEM_CACHE_LINE)));
+
+__thread int es_mem_scope = -1;
+
+static struct _es_mem_pool_class_s _es_mem_pool[ES_MEM_POOL_CLASSES];
+
+/* Set once before es_mem_init(), never released: blocks can be freed at exit */
+static char *_es_mem_pool_base = NULL;
+static size_t _es_mem_pool_region = 0;
+static size_t _es_mem_pool_len = 0;
+
+static struct _es_mem_counters_s _es_mem_counters[ES_MEM_CAT_MAX];
+
+static const char const *_es_mem_names[ES_MEM_CAT_MAX] = {
+   "osip",
+   "libevent",
+   "message",
+   "transaction",
+   "dialog",
+   "event",
+   "registrar",
+   "proxy",
+   "scenario",
+   "auth",
+   "work"
+};
+
+static void _es_mem_peak(int64_t *peak, int64_t value)
+{
+   int64_t cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+   while ((value > cur) &&
+          !__atomic_compare_exchange_n(peak, &cur, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+   }
+}
+
+static void _es_mem_account(uint32_t cat, int64_t bytes, int64_t objects)
+{
+   struct _es_mem_counters_s *c = &_es_mem_counters[cat];
+   int64_t b = __atomic_add_fetch(&c->bytes, bytes, __ATOMIC_RELAXED);
+   int64_t o = __atomic_add_fetch(&c->objects, objects, __ATOMIC_RELAXED);
+
+   if (objects > 0) {
+      __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+      _es_mem_peak(&c->peakObjects, o);
+   }
+   if (bytes > 0) {
+      _es_mem_peak(&c->peakBytes, b);
+   }
+}
+
+static int _es_mem_pool_owns(const void *ptr)
+{
+   return (_es_mem_pool_base != NULL) &&
+          ((const char *)ptr >= _es_mem_pool_base) &&
+          ((const char *)ptr < _es_mem_pool_base + _es_mem_pool_len);
+}
+
+static unsigned int _es_mem_pool_class_of(const void *ptr)
+{
+   return (unsigned int)(((const char *)ptr - _es_mem_pool_base) / _es_mem_pool_region);
+}
+
+static void *_es_mem_pool_get(size_t size)
+{
+   struct _es_mem_pool_class_s *c = NULL;
+   unsigned int i = 0;
+   void *blk = NULL;
+
+   if (_es_mem_pool_base == NULL) {
+      return NULL;
+   }
+
+   for (i = 0; (i < ES_MEM_POOL_CLASSES) && (size > _es_mem_pool_sizes[i]); ++i) {
+   }
+
+   if (i == ES_MEM_POOL_CLASSES) {
+      return NULL;
+   }
+
+   c = &_es_mem_pool[i];
+   while (__atomic_test_and_set(&c->lock, __ATOMIC_ACQUIRE)) {
+   }
+
+   blk = c->free;
+   if (blk != NULL) {
+      c->free = *(void **)blk;
+   }
+
+   __atomic_clear(&c->lock, __ATOMIC_RELEASE);
+
+   /* Empty: malloc() takes over */
+   __atomic_add_fetch((blk != NULL) ? &c->avail : &c->misses, (blk != NULL) ? -1 : 1, __ATOMIC_RELAXED);
+
+   return blk;
+}
+
+static void _es_mem_pool_put(void *blk)
+{
+   struct _es_mem_pool_class_s *c = &_es_mem_pool[_es_mem_pool_class_of(blk)];
+
+   while (__atomic_test_and_set(&c->lock, __ATOMIC_ACQUIRE)) {
+   }
+
+   *(void **)blk = c->free;
+   c->free = blk;
+
+   __atomic_clear(&c->lock, __ATOMIC_RELEASE);
+   __atomic_add_fetch(&c->avail, 1, __ATOMIC_RELAXED);
+}
+
+static void *_es_mem_alloc(uint32_t cat, size_t size)
+{
+   struct _es_mem_hdr_s *hdr = (struct _es_mem_hdr_s *) _es_mem_pool_get(sizeof(struct _es_mem_hdr_s) + size);
+
+   if (hdr == NULL) {
+      hdr = (struct _es_mem_hdr_s *) malloc(sizeof(struct _es_mem_hdr_s) + size);
+   }
+
+   if (hdr == NULL) {
+      return NULL;
+   }
+
+   hdr->magic = ES_MEM_MAGIC;
+   hdr->cat = cat;
+   hdr->size = size;
+
+   _es_mem_account(cat, (int64_t)size, 1);
+
+   return hdr + 1;
+}
+
+static void _es_mem_release(void *ptr)
+{
+   struct _es_mem_hdr_s *hdr = NULL;
+
+   if (ptr == NULL) {
+      return;
+   }
+
+   /* The hooks are set before oSIP and libevent allocate: all blocks are ours */
+   hdr = ((struct _es_mem_hdr_s *)ptr) - 1;
+   _es_mem_account(hdr->cat, -(int64_t)hdr->size, -1);
+
+   hdr->magic = 0;
+   if (_es_mem_pool_owns(hdr)) {
+      _es_mem_pool_put(hdr);
+   } else {
+      free(hdr);
+   }
+}
+
+static void *_es_mem_resize(uint32_t cat, void *ptr, size_t size)
+{
+   struct _es_mem_hdr_s *hdr = NULL;
+   struct _es_mem_hdr_s *newHdr = NULL;
+
+   if (ptr == NULL) {
+      return _es_mem_alloc(cat, size);
+   }
+
+   hdr = ((struct _es_mem_hdr_s *)ptr) - 1;
+
+   if (_es_mem_pool_owns(hdr)) {
+      void *newPtr = NULL;
+
+      /* Still fits the block */
+      if (sizeof(struct _es_mem_hdr_s) + size <= _es_mem_pool_sizes[_es_mem_pool_class_of(hdr)]) {
+         _es_mem_account(hdr->cat, (int64_t)size - (int64_t)hdr->size, 0);
+         hdr->size = size;
+         return ptr;
+      }
+
+      newPtr = _es_mem_alloc(hdr->cat, size);
+      if (newPtr == NULL) {
+         return NULL;
+      }
+
+      memcpy(newPtr, ptr, (hdr->size < size) ? hdr->size : size);
+      _es_mem_release(ptr);
+      return newPtr;
+   }
+
+   newHdr = (struct _es_mem_hdr_s *) realloc(hdr, sizeof(struct _es_mem_hdr_s) + size);
+   if (newHdr == NULL) {
+      return NULL;
+   }
+
+   /* The block stays in its category */
+   _es_mem_account(newHdr->cat, (int64_t)size - (int64_t)newHdr->size, 0);
+   newHdr->size = size;
+
+   return newHdr + 1;
+}
+
+static void *_es_mem_osip_malloc(size_t size)
+{
+   return _es_mem_alloc((es_mem_scope >= 0) ? (uint32_t)es_mem_scope : ES_MEM_OSIP, size);
+}
+
+static void *_es_mem_osip_realloc(void *ptr, size_t size)
+{
+   return _es_mem_resize((es_mem_scope >= 0) ? (uint32_t)es_mem_scope : ES_MEM_OSIP, ptr, size);
+}
+
+static void *_es_mem_event_malloc(size_t size)
+{
+   return _es_mem_alloc((es_mem_scope >= 0) ? (uint32_t)es_mem_scope : ES_MEM_LIBEVENT, size);
+}
+
+static void *_es_mem_event_realloc(void *ptr, size_t size)
+{
+   return _es_mem_resize((es_mem_scope >= 0) ? (uint32_t)es_mem_scope : ES_MEM_LIBEVENT, ptr, size);
+}
+
+es_status es_mem_pool_init(size_t size, int huge, int node)
+{
+   size_t mapped = 0;
+   unsigned int i = 0;
+   char *ptr = NULL;
+
+   if (_es_mem_pool_base != NULL) {
+      return ES_ERROR_ILLEGAL_ACTION;
+   }
+
+   /* Each size gets the same share */
+   _es_mem_pool_region = (size / ES_MEM_POOL_CLASSES) & ~((size_t)ES_MEM_POOL_MAX_BLOCK - 1);
+   if (_es_mem_pool_region == 0) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   ptr = (char *) es_sys_map(_es_mem_pool_region * ES_MEM_POOL_CLASSES, huge, node, &mapped);
+   if (ptr == NULL) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   for (i = 0; i < ES_MEM_POOL_CLASSES; ++i) {
+      char *region = ptr + i * _es_mem_pool_region;
+      size_t off = _es_mem_pool_region;
+
+      /* Lowest addresses first out */
+      while (off >= _es_mem_pool_sizes[i]) {
+         off -= _es_mem_pool_sizes[i];
+         *(void **)(region + off) = _es_mem_pool[i].free;
+         _es_mem_pool[i].free = region + off;
+         _es_mem_pool[i].total++;
+      }
+      _es_mem_pool[i].avail = _es_mem_pool[i].total;
+   }
+
+   _es_mem_pool_len = _es_mem_pool_region * ES_MEM_POOL_CLASSES;
+   _es_mem_pool_base = ptr;
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Memory pool of %lu bytes on node %d", (unsigned long)mapped, node);
+
+   return ES_OK;
+}
+
+es_status es_mem_init(void)
+{
+   osip_set_allocators(_es_mem_osip_malloc, _es_mem_osip_realloc, _es_mem_release);
+   event_set_mem_functions(_es_mem_event_malloc, _es_mem_event_realloc, _es_mem_release);
+
+   return ES_OK;
+}
+
+void *es_mem_malloc(es_mem_cat_t cat, size_t size)
+{
+   return _es_mem_alloc((cat < ES_MEM_CAT_MAX) ? (uint32_t)cat : ES_MEM_OSIP, size);
+}
+
+void *es_mem_calloc(es_mem_cat_t cat, size_t nb, size_t size)
+{
+   void *ptr = NULL;
+
+   if ((size != 0) && (nb > ((size_t)-1 - sizeof(struct _es_mem_hdr_s)) / size)) {
+      return NULL;
+   }
+
+   ptr = es_mem_malloc(cat, nb * size);
+   if (ptr != NULL) {
+      memset(ptr, 0, nb * size);
+   }
+
+   return ptr;
+}
+
+void es_mem_free(void *ptr)
+{
+   _es_mem_release(ptr);
+}
+
+const char *es_mem_name(es_mem_cat_t cat)
+{
+   return (cat < ES_MEM_CAT_MAX) ? _es_mem_names[cat] : "unknown";
+}
+
+void es_mem_get(es_mem_cat_t cat, struct es_mem_usage_s *usage)
+{
+   const struct _es_mem_counters_s *c = &_es_mem_counters[cat];
+
+   usage->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+   usage->objects = __atomic_load_n(&c->objects, __ATOMIC_RELAXED);
+   usage->peakBytes = __atomic_load_n(&c->peakBytes, __ATOMIC_RELAXED);
+   usage->peakObjects = __atomic_load_n(&c->peakObjects, __ATOMIC_RELAXED);
+   usage->allocs = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+}
+
+int64_t es_mem_report_leaks(unsigned int mask)
+{
+   struct es_mem_usage_s usage;
+   int64_t total = 0;
+   unsigned int cat = 0;
+
+   for (cat = 0; cat < ES_MEM_CAT_MAX; ++cat) {
+      if ((mask & (1U << cat)) == 0) {
+         continue;
+      }
+
+      es_mem_get((es_mem_cat_t)cat, &usage);
+      if (usage.objects != 0) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Memory leak: %lld %s objects (%lld bytes) still allocated",
+                    (long long)usage.objects, _es_mem_names[cat], (long long)usage.bytes);
+         total += usage.objects;
+      }
+   }
+
+   return total;
+}
+
+static int _es_mem_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_mem_usage_s usage;
+   unsigned int cat = 0;
+
+   es_cli_print(pCli, "%-12s %12s %10s %12s %10s %12s", "category", "bytes", "objects", "peak bytes", "peak objs", "allocs");
+   for (cat = 0; cat < ES_MEM_CAT_MAX; ++cat) {
+      es_mem_get((es_mem_cat_t)cat, &usage);
+      es_cli_print(pCli, "%-12s %12lld %10lld %12lld %10lld %12lld",
+                   _es_mem_names[cat],
+                   (long long)usage.bytes, (long long)usage.objects,
+                   (long long)usage.peakBytes, (long long)usage.peakObjects,
+                   (long long)usage.allocs);
+   }
+
+   if (_es_mem_pool_base != NULL) {
+      es_cli_print(pCli, "%-12s %12s %10s %10s", "pool block", "total", "free", "misses");
+      for (cat = 0; cat < ES_MEM_POOL_CLASSES; ++cat) {
+         es_cli_print(pCli, "%-12u %12lld %10lld %10lld", _es_mem_pool_sizes[cat],
+                      (long long)_es_mem_pool[cat].total,
+                      (long long)__atomic_load_n(&_es_mem_pool[cat].avail, __ATOMIC_RELAXED),
+                      (long long)__atomic_load_n(&_es_mem_pool[cat].misses, __ATOMIC_RELAXED));
+      }
+   }
+
+   return CLI_OK;
+}
+
+es_status es_mem_cli_register(es_cli_t *pCli)
+{
+   return es_cli_register_cmd(pCli, "show memory", "Show memory used per object type", _es_mem_cli_show, NULL);
+}
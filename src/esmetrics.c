@@ -0,0 +1,390 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esstats.h"
+#include "eshist.h"
+#include "esmetrics.h"
+
+#define ES_METRICS_MAGIC         0x20141025
+
+#define ES_METRICS_PATH          "/metrics"
+
+#define ES_METRICS_CONTENT_TYPE  "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#define ES_METRICS_PREFIX        "esip_"
+
+/**
+ * Lowest priority of the loop: a chunk is built only when no SIP event
+ * is active, so a scrape is spread between SIP events instead of
+ * delaying them.
+ */
+#define ES_METRICS_PRIORITY      1
+
+struct es_metrics_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* Event loop */
+   struct event_base         *base;
+   /* HTTP server */
+   struct evhttp             *http;
+   /* Listening socket */
+   struct evhttp_bound_socket *bound;
+};
+
+/**
+ * @brief Parts of a scrape, one part is built per loop iteration
+ */
+enum _es_metrics_part_e {
+   ES_METRICS_PART_COUNTERS = 0,
+   ES_METRICS_PART_REQUESTS,
+   ES_METRICS_PART_RESPONSES,
+   ES_METRICS_PART_HIST_FIRST,
+   ES_METRICS_PART_EOF = ES_METRICS_PART_HIST_FIRST + ES_HIST_MAX,
+   ES_METRICS_PART_DONE
+};
+
+/**
+ * @brief An ongoing scrape
+ */
+struct _es_metrics_job_s {
+   /* Request, NULL once the connection is gone */
+   struct evhttp_request     *req;
+   /* Next part to send */
+   unsigned int              part;
+   /* Counters, read once at the beginning of the scrape */
+   int64_t                   values[ES_STATS_MAX];
+   /* Chunk scheduling */
+   struct event              *ev;
+};
+
+/**
+ * @brief Help of the counters exported as is
+ */
+static const char const *_es_metrics_counters_help[ES_STATS_REQ_INVITE] = {
+   "Datagrams received",
+   "Bytes received",
+   "Datagrams sent",
+   "Bytes sent",
+   "Datagrams that could not be sent",
+   "Datagrams that could not be parsed as SIP",
+   "Transactions created",
+   "Transactions terminated",
+   "Dialogs active"
+};
+
+static void _es_metrics_counters(struct evbuffer *out, const int64_t *values)
+{
+   unsigned int i = 0;
+
+   for (i = ES_STATS_RX_DATAGRAMS; i < ES_STATS_REQ_INVITE; ++i) {
+      const char *name = es_stats_name((es_stats_id_t)i);
+      if (i == ES_STATS_DIALOGS) {
+         evbuffer_add_printf(out, "# TYPE " ES_METRICS_PREFIX "%s gauge\n", name);
+         evbuffer_add_printf(out, "# HELP " ES_METRICS_PREFIX "%s %s.\n", name, _es_metrics_counters_help[i]);
+         evbuffer_add_printf(out, ES_METRICS_PREFIX "%s %lld\n", name, (long long)values[i]);
+      } else {
+         evbuffer_add_printf(out, "# TYPE " ES_METRICS_PREFIX "%s counter\n", name);
+         evbuffer_add_printf(out, "# HELP " ES_METRICS_PREFIX "%s %s.\n", name, _es_metrics_counters_help[i]);
+         evbuffer_add_printf(out, ES_METRICS_PREFIX "%s_total %lld\n", name, (long long)values[i]);
+      }
+   }
+}
+
+static void _es_metrics_requests(struct evbuffer *out, const int64_t *values)
+{
+   unsigned int i = 0;
+
+   evbuffer_add_printf(out, "# TYPE " ES_METRICS_PREFIX "requests counter\n");
+   evbuffer_add_printf(out, "# HELP " ES_METRICS_PREFIX "requests SIP requests handled by method.\n");
+   for (i = ES_STATS_REQ_INVITE; i <= ES_STATS_REQ_OTHER; ++i) {
+      evbuffer_add_printf(out, ES_METRICS_PREFIX "requests_total{method=\"%s\"} %lld\n",
+                          es_stats_name((es_stats_id_t)i), (long long)values[i]);
+   }
+}
+
+static void _es_metrics_responses(struct evbuffer *out, const int64_t *values)
+{
+   unsigned int i = 0;
+
+   evbuffer_add_printf(out, "# TYPE " ES_METRICS_PREFIX "responses counter\n");
+   evbuffer_add_printf(out, "# HELP " ES_METRICS_PREFIX "responses SIP responses handled by code.\n");
+   for (i = ES_STATS_RESP_FIRST; i <= ES_STATS_RESP_LAST; ++i) {
+      /* Only the codes seen, a code never goes back to 0 */
+      if (values[i] != 0) {
+         evbuffer_add_printf(out, ES_METRICS_PREFIX "responses_total{code=\"%d\"} %lld\n",
+                             ES_STATS_RESP_CODE_MIN + (int)(i - ES_STATS_RESP_FIRST), (long long)values[i]);
+      }
+   }
+}
+
+static void _es_metrics_histogram(struct evbuffer *out, es_hist_id_t id)
+{
+   struct es_hist_snapshot_s *snap = (struct es_hist_snapshot_s *) malloc(sizeof(struct es_hist_snapshot_s));
+   const char *name = es_hist_name(id);
+   uint64_t cumul = 0;
+   unsigned int i = 0;
+
+   if (snap == NULL) {
+      return;
+   }
+
+   es_hist_snapshot(id, snap);
+
+   /* One family, the stage is a label */
+   if (id == 0) {
+      evbuffer_add_printf(out, "# TYPE " ES_METRICS_PREFIX "latency_seconds histogram\n");
+      evbuffer_add_printf(out, "# UNIT " ES_METRICS_PREFIX "latency_seconds seconds\n");
+      evbuffer_add_printf(out, "# HELP " ES_METRICS_PREFIX "latency_seconds Latency per processing stage.\n");
+   }
+
+   /* Exported with one bucket per power of 2 of the internal histogram */
+   for (i = 0; i < ES_HIST_BUCKETS; ++i) {
+      cumul += snap->counts[i];
+      if ((i & (ES_HIST_SUB_COUNT - 1)) == (ES_HIST_SUB_COUNT - 1)) {
+         evbuffer_add_printf(out, ES_METRICS_PREFIX "latency_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                             name, (double)es_hist_bucket_upper(i) / 1e9, (unsigned long long)cumul);
+      }
+   }
+   evbuffer_add_printf(out, ES_METRICS_PREFIX "latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name, (unsigned long long)cumul);
+   /* Count is the sum of the buckets, so it always matches +Inf */
+   evbuffer_add_printf(out, ES_METRICS_PREFIX "latency_seconds_count{stage=\"%s\"} %llu\n", name, (unsigned long long)cumul);
+   evbuffer_add_printf(out, ES_METRICS_PREFIX "latency_seconds_sum{stage=\"%s\"} %.9f\n", name, (double)snap->sum / 1e9);
+
+   free(snap);
+}
+
+/**
+ * @brief End the reply if the client is still there, then release the job
+ */
+static void _es_metrics_job_free(struct _es_metrics_job_s *job)
+{
+   if (job->req != NULL) {
+      evhttp_connection_set_closecb(evhttp_request_get_connection(job->req), NULL, NULL);
+      evhttp_send_reply_end(job->req);
+      job->req = NULL;
+   }
+   event_free(job->ev);
+   free(job);
+}
+
+static void _es_metrics_conn_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+   struct _es_metrics_job_s *job = (struct _es_metrics_job_s *)arg;
+
+   /* The request is released with the connection, finish on next chunk */
+   job->req = NULL;
+}
+
+static void _es_metrics_chunk_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct _es_metrics_job_s *job = (struct _es_metrics_job_s *)arg;
+   struct evbuffer *out = NULL;
+
+   if (job->req == NULL) {
+      _es_metrics_job_free(job);
+      return;
+   }
+
+   out = evbuffer_new();
+   if (out == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not allocate metrics buffer");
+      _es_metrics_job_free(job);
+      return;
+   }
+
+   switch (job->part) {
+   case ES_METRICS_PART_COUNTERS:
+      _es_metrics_counters(out, job->values);
+      break;
+   case ES_METRICS_PART_REQUESTS:
+      _es_metrics_requests(out, job->values);
+      break;
+   case ES_METRICS_PART_RESPONSES:
+      _es_metrics_responses(out, job->values);
+      break;
+   case ES_METRICS_PART_EOF:
+      evbuffer_add_printf(out, "# EOF\n");
+      break;
+   default:
+      _es_metrics_histogram(out, (es_hist_id_t)(job->part - ES_METRICS_PART_HIST_FIRST));
+      break;
+   }
+
+   evhttp_send_reply_chunk(job->req, out);
+   evbuffer_free(out);
+
+   job->part++;
+   if (job->part == ES_METRICS_PART_DONE) {
+      _es_metrics_job_free(job);
+      return;
+   }
+
+   /* Next part after the pending SIP events */
+   event_active(job->ev, EV_TIMEOUT, 0);
+}
+
+static void _es_metrics_request_cb(struct evhttp_request *req, void *arg)
+{
+   struct es_metrics_s *_pCtx = (struct es_metrics_s *)arg;
+   struct _es_metrics_job_s *job = NULL;
+
+   if ((_pCtx == (struct es_metrics_s *)0) || (_pCtx->magic != ES_METRICS_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Metrics Ctx not valid");
+      evhttp_send_error(req, HTTP_INTERNAL, NULL);
+      return;
+   }
+
+   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+      evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+      return;
+   }
+
+   job = (struct _es_metrics_job_s *) calloc(1, sizeof(struct _es_metrics_job_s));
+   if (job == NULL) {
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+      return;
+   }
+
+   job->ev = event_new(_pCtx->base, -1, 0, _es_metrics_chunk_cb, job);
+   if (job->ev == NULL) {
+      free(job);
+      evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+      return;
+   }
+
+   if (event_priority_set(job->ev, ES_METRICS_PRIORITY) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set priority of metrics event");
+   }
+
+   /* Counters are consistent across the families of one scrape */
+   es_stats_snapshot(job->values);
+
+   job->req = req;
+   evhttp_connection_set_closecb(evhttp_request_get_connection(req), _es_metrics_conn_close_cb, job);
+
+   evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", ES_METRICS_CONTENT_TYPE);
+   evhttp_send_reply_start(req, HTTP_OK, "OK");
+
+   event_active(job->ev, EV_TIMEOUT, 0);
+}
+
+es_status es_metrics_init(es_metrics_t **ppCtx, struct event_base *pBase, const char *address, unsigned short port,
+                          int listenFd)
+{
+   struct es_metrics_s *_pCtx = NULL;
+
+   if (pBase == (struct event_base *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Metrics Loop not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_metrics_s *) malloc(sizeof(struct es_metrics_s));
+   if (_pCtx == (struct es_metrics_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize metrics: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_metrics_s));
+
+   _pCtx->magic = ES_METRICS_MAGIC;
+   _pCtx->base = pBase;
+
+   _pCtx->http = evhttp_new(pBase);
+   if (_pCtx->http == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create HTTP server");
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   evhttp_set_allowed_methods(_pCtx->http, EVHTTP_REQ_GET);
+
+   if (evhttp_set_cb(_pCtx->http, ES_METRICS_PATH, _es_metrics_request_cb, _pCtx) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not set metrics handler");
+      evhttp_free(_pCtx->http);
+      free(_pCtx);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (listenFd >= 0) {
+      _pCtx->bound = evhttp_accept_socket_with_handle(_pCtx->http, listenFd);
+   } else {
+      _pCtx->bound = evhttp_bind_socket_with_handle(_pCtx->http, (address != NULL) ? address : "0.0.0.0", port);
+   }
+
+   if (_pCtx->bound == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not bind metrics on port %u", port);
+      evhttp_free(_pCtx->http);
+      free(_pCtx);
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Metrics available on http://%s:%u" ES_METRICS_PATH,
+              (address != NULL) ? address : "0.0.0.0", port);
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_metrics_get_socket(es_metrics_t *pCtx, int *fd)
+{
+   struct es_metrics_s *_pCtx = (struct es_metrics_s *)pCtx;
+
+   if ((_pCtx == (struct es_metrics_s *)0) || (_pCtx->magic != ES_METRICS_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Metrics Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   *fd = evhttp_bound_socket_get_fd(_pCtx->bound);
+   return ES_OK;
+}
+
+es_status es_metrics_deinit(es_metrics_t *pCtx)
+{
+   struct es_metrics_s *_pCtx = (struct es_metrics_s *)pCtx;
+
+   if (_pCtx == (struct es_metrics_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Metrics Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_METRICS_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Metrics Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   evhttp_free(_pCtx->http);
+
+   memset(_pCtx, 0, sizeof(struct es_metrics_s));
+   free(_pCtx);
+
+   return ES_OK;
+}
@@ -0,0 +1,475 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/**
+ * @brief esip-mkdb: compile a subscribers CSV into the file esip maps
+ * (esdb.h). A line is "user,HA1[,host[:port]]", HA1 in 32 hex digits,
+ * the route an IPv4 address; '#' starts a comment. The file is written
+ * aside and renamed over the previous one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esdb.h"
+
+#define ES_MKDB_LINE_LEN         512
+
+/** Subscribers per bucket, on average */
+#define ES_MKDB_BUCKET_LOAD      4
+
+/** Largest bucket placed, a seed giving a larger one is dropped */
+#define ES_MKDB_MAX_BUCKET       256
+
+/** Seeds tried before giving up, displacements tried per bucket */
+#define ES_MKDB_MAX_SEEDS        64
+#define ES_MKDB_MAX_DISPLACEMENT (1U << 24)
+
+#define ES_MKDB_USAGE_MSG_TEXT_STR \
+   "Usage: esip-mkdb [-r realm] users.csv users.db\n" \
+   "\n" \
+   "  -r realm\tRealm of the HA1, checked by esip against auth.realm.\n" \
+   "\n" \
+   "A line of users.csv is user,HA1[,host[:port]].\n"
+
+/**
+ * @brief A subscriber read, its hash for the seed tried
+ */
+struct _es_mkdb_entry_s {
+   struct es_db_record_s     rec;
+   uint32_t                  hash;
+   unsigned int              line;
+};
+
+struct _es_mkdb_s {
+   struct _es_mkdb_entry_s   *entries;
+   uint32_t                  nb;
+   uint32_t                  nbBuckets;
+   uint32_t                  nbSlots;
+   uint32_t                  seed;
+   /* Entries by bucket: first of a bucket in order[start[b]] */
+   uint32_t                  *start;
+   uint32_t                  *order;
+   /* Buckets by size, largest first */
+   uint32_t                  *buckets;
+   uint32_t                  *displacements;
+   struct es_db_record_s     *slots;
+};
+
+static int _es_mkdb_hex(char c)
+{
+   if ((c >= '0') && (c <= '9')) {
+      return c - '0';
+   }
+   c = (char)tolower((unsigned char)c);
+   return ((c >= 'a') && (c <= 'f')) ? c - 'a' + 10 : -1;
+}
+
+static char *_es_mkdb_trim(char *s)
+{
+   char *end = NULL;
+
+   while (isspace((unsigned char)*s)) {
+      s++;
+   }
+
+   end = s + strlen(s);
+   while ((end > s) && isspace((unsigned char)end[-1])) {
+      end--;
+   }
+   *end = '\0';
+
+   return s;
+}
+
+/**
+ * @brief One line into a record, 0 if empty, -1 if not valid
+ */
+static int _es_mkdb_parse(char *line, struct es_db_record_s *rec)
+{
+   char *fields[3] = { NULL, NULL, NULL };
+   char *p = NULL;
+   size_t len = 0;
+   unsigned int nb = 0;
+   unsigned int i = 0;
+
+   if ((p = strchr(line, '#')) != NULL) {
+      *p = '\0';
+   }
+
+   line = _es_mkdb_trim(line);
+   if (*line == '\0') {
+      return 0;
+   }
+
+   for (p = line; (p != NULL) && (nb < 3); ++nb) {
+      fields[nb] = p;
+      p = strchr(p, ',');
+      if (p != NULL) {
+         *p++ = '\0';
+      }
+      fields[nb] = _es_mkdb_trim(fields[nb]);
+   }
+
+   if ((p != NULL) || (nb < 2)) {
+      return -1;
+   }
+
+   memset(rec, 0, sizeof(*rec));
+
+   len = strlen(fields[0]);
+   if ((len == 0) || (len > ES_DB_USER_LEN) || (strpbrk(fields[0], " \t") != NULL)) {
+      return -1;
+   }
+   memcpy(rec->user, fields[0], len);
+   rec->userLen = (uint8_t)len;
+
+   if (strlen(fields[1]) != 2 * sizeof(rec->ha1)) {
+      return -1;
+   }
+   for (i = 0; i < sizeof(rec->ha1); ++i) {
+      int hi = _es_mkdb_hex(fields[1][2 * i]);
+      int lo = _es_mkdb_hex(fields[1][2 * i + 1]);
+      if ((hi < 0) || (lo < 0)) {
+         return -1;
+      }
+      rec->ha1[i] = (uint8_t)((hi << 4) | lo);
+   }
+
+   if ((nb == 3) && (fields[2][0] != '\0')) {
+      struct in_addr addr;
+      unsigned long port = 5060;
+      char *end = NULL;
+
+      if ((p = strchr(fields[2], ':')) != NULL) {
+         *p++ = '\0';
+         port = strtoul(p, &end, 10);
+         if ((end == p) || (*end != '\0') || (port == 0) || (port > 65535)) {
+            return -1;
+         }
+      }
+      if ((inet_pton(AF_INET, fields[2], &addr) != 1) || (addr.s_addr == 0)) {
+         return -1;
+      }
+      rec->routeAddr = addr.s_addr;
+      rec->routePort = htons((uint16_t)port);
+   }
+
+   return 1;
+}
+
+static es_status _es_mkdb_read(struct _es_mkdb_s *db, const char *path)
+{
+   char line[ES_MKDB_LINE_LEN];
+   unsigned int lines = 0;
+   unsigned int lineNb = 0;
+   unsigned int errors = 0;
+   FILE *f = NULL;
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      fprintf(stderr, "esip-mkdb: can not open %s: %s\n", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   while (fgets(line, sizeof(line), f) != NULL) {
+      lines++;
+   }
+   rewind(f);
+
+   db->entries = (struct _es_mkdb_entry_s *) calloc((lines != 0) ? lines : 1, sizeof(struct _es_mkdb_entry_s));
+   if (db->entries == NULL) {
+      fprintf(stderr, "esip-mkdb: no more memory for %u lines\n", lines);
+      fclose(f);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   while ((fgets(line, sizeof(line), f) != NULL) && (lineNb < lines)) {
+      struct _es_mkdb_entry_s *e = &db->entries[db->nb];
+      int ret = 0;
+
+      lineNb++;
+
+      ret = _es_mkdb_parse(line, &e->rec);
+      if (ret < 0) {
+         fprintf(stderr, "%s:%u: expected user,HA1[,IPv4 address[:port]]\n", path, lineNb);
+         errors++;
+      } else if (ret > 0) {
+         e->line = lineNb;
+         db->nb++;
+      }
+   }
+
+   fclose(f);
+
+   return (errors == 0) ? ES_OK : ES_ERROR_BADPARAM;
+}
+
+static int _es_mkdb_bucket_cmp(const void *a, const void *b, void *arg)
+{
+   const struct _es_mkdb_s *db = (const struct _es_mkdb_s *)arg;
+   uint32_t sa = db->start[*(const uint32_t *)a + 1] - db->start[*(const uint32_t *)a];
+   uint32_t sb = db->start[*(const uint32_t *)b + 1] - db->start[*(const uint32_t *)b];
+
+   return (sa < sb) - (sa > sb);
+}
+
+/**
+ * @brief Place all the entries for a seed
+ * @return ES_OK, ES_ERROR_TRY_AGAIN if two hashes collide or a bucket has
+ * no displacement, ES_ERROR_BADPARAM for a user given twice
+ */
+static es_status _es_mkdb_place(struct _es_mkdb_s *db)
+{
+   uint32_t placed[ES_MKDB_MAX_BUCKET];
+   uint32_t i = 0;
+   uint32_t b = 0;
+
+   memset(db->start, 0, (db->nbBuckets + 1) * sizeof(uint32_t));
+   memset(db->displacements, 0, db->nbBuckets * sizeof(uint32_t));
+   memset(db->slots, 0, db->nbSlots * sizeof(struct es_db_record_s));
+
+   /* Entries grouped by bucket */
+   for (i = 0; i < db->nb; ++i) {
+      struct _es_mkdb_entry_s *e = &db->entries[i];
+      e->hash = es_db_hash(db->seed, e->rec.user, e->rec.userLen);
+      db->start[e->hash % db->nbBuckets + 1]++;
+   }
+   for (b = 0; b < db->nbBuckets; ++b) {
+      db->start[b + 1] += db->start[b];
+      db->buckets[b] = b;
+   }
+   /* start[b] moves to the end of b while filled, then back */
+   for (i = 0; i < db->nb; ++i) {
+      db->order[db->start[db->entries[i].hash % db->nbBuckets]++] = i;
+   }
+   for (b = db->nbBuckets; b > 0; --b) {
+      db->start[b] = db->start[b - 1];
+   }
+   db->start[0] = 0;
+
+   qsort_r(db->buckets, db->nbBuckets, sizeof(uint32_t), _es_mkdb_bucket_cmp, db);
+
+   for (b = 0; b < db->nbBuckets; ++b) {
+      uint32_t bucket = db->buckets[b];
+      uint32_t first = db->start[bucket];
+      uint32_t nb = db->start[bucket + 1] - first;
+      uint32_t d = 0;
+      uint32_t j = 0;
+
+      if (nb == 0) {
+         break;
+      }
+
+      if (nb > ES_MKDB_MAX_BUCKET) {
+         return ES_ERROR_TRY_AGAIN;
+      }
+
+      /* No displacement separates the same hash */
+      for (i = 0; i < nb; ++i) {
+         const struct _es_mkdb_entry_s *ei = &db->entries[db->order[first + i]];
+         for (j = i + 1; j < nb; ++j) {
+            const struct _es_mkdb_entry_s *ej = &db->entries[db->order[first + j]];
+            if (ei->hash != ej->hash) {
+               continue;
+            }
+            if ((ei->rec.userLen == ej->rec.userLen) && (memcmp(ei->rec.user, ej->rec.user, ei->rec.userLen) == 0)) {
+               fprintf(stderr, "esip-mkdb: user %.*s on lines %u and %u\n", (int)ei->rec.userLen, ei->rec.user,
+                       (ei->line < ej->line) ? ei->line : ej->line, (ei->line < ej->line) ? ej->line : ei->line);
+               return ES_ERROR_BADPARAM;
+            }
+            return ES_ERROR_TRY_AGAIN;
+         }
+      }
+
+      for (d = 0; d < ES_MKDB_MAX_DISPLACEMENT; ++d) {
+         for (i = 0; i < nb; ++i) {
+            placed[i] = es_db_slot(db->entries[db->order[first + i]].hash, d, db->nbSlots);
+            if (db->slots[placed[i]].userLen != 0) {
+               break;
+            }
+            for (j = 0; (j < i) && (placed[j] != placed[i]); ++j) {
+            }
+            if (j < i) {
+               break;
+            }
+         }
+         if (i == nb) {
+            break;
+         }
+      }
+
+      if (d == ES_MKDB_MAX_DISPLACEMENT) {
+         return ES_ERROR_TRY_AGAIN;
+      }
+
+      db->displacements[bucket] = d;
+      for (i = 0; i < nb; ++i) {
+         db->slots[placed[i]] = db->entries[db->order[first + i]].rec;
+      }
+   }
+
+   return ES_OK;
+}
+
+static es_status _es_mkdb_write(const struct _es_mkdb_s *db, const char *path, const char *realm)
+{
+   static const uint8_t zeros[ES_DB_ALIGN];
+   struct es_db_header_s hdr;
+   char tmp[4096];
+   size_t pad = 0;
+   FILE *f = NULL;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, ES_DB_MAGIC_STR, sizeof(hdr.magic));
+   hdr.version = ES_DB_VERSION;
+   hdr.seed = db->seed;
+   hdr.nbRecords = db->nb;
+   hdr.nbBuckets = db->nbBuckets;
+   hdr.nbSlots = db->nbSlots;
+   hdr.recordSize = sizeof(struct es_db_record_s);
+   snprintf(hdr.realm, sizeof(hdr.realm), "%s", realm);
+
+   pad = es_db_slots_offset(db->nbBuckets) - sizeof(hdr) - db->nbBuckets * sizeof(uint32_t);
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+   f = fopen(tmp, "wb");
+   if (f == NULL) {
+      fprintf(stderr, "esip-mkdb: can not create %s: %s\n", tmp, strerror(errno));
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if ((fwrite(&hdr, sizeof(hdr), 1, f) != 1) ||
+       (fwrite(db->displacements, sizeof(uint32_t), db->nbBuckets, f) != db->nbBuckets) ||
+       (fwrite(zeros, 1, pad, f) != pad) ||
+       (fwrite(db->slots, sizeof(struct es_db_record_s), db->nbSlots, f) != db->nbSlots) ||
+       (fflush(f) != 0) || (fsync(fileno(f)) != 0)) {
+      fprintf(stderr, "esip-mkdb: can not write %s: %s\n", tmp, strerror(errno));
+      fclose(f);
+      unlink(tmp);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   fclose(f);
+
+   /* A process mapping the previous one keeps it */
+   if (rename(tmp, path) != 0) {
+      fprintf(stderr, "esip-mkdb: can not replace %s: %s\n", path, strerror(errno));
+      unlink(tmp);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   return ES_OK;
+}
+
+int main(int argc, char *argv[])
+{
+   struct _es_mkdb_s db;
+   const char *realm = "";
+   es_status ret = ES_OK;
+   int opt = 0;
+
+   while ((opt = getopt(argc, argv, "hr:")) != -1) {
+      switch (opt) {
+      case 'r':
+         if (strlen(optarg) >= ES_DB_REALM_LEN) {
+            fprintf(stderr, "esip-mkdb: realm longer than %u\n", ES_DB_REALM_LEN - 1);
+            return EXIT_FAILURE;
+         }
+         realm = optarg;
+         break;
+      case 'h':
+         fprintf(stdout, ES_MKDB_USAGE_MSG_TEXT_STR);
+         return EXIT_SUCCESS;
+      default:
+         fprintf(stderr, ES_MKDB_USAGE_MSG_TEXT_STR);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (argc - optind != 2) {
+      fprintf(stderr, ES_MKDB_USAGE_MSG_TEXT_STR);
+      return EXIT_FAILURE;
+   }
+
+   memset(&db, 0, sizeof(db));
+
+   if (_es_mkdb_read(&db, argv[optind]) != ES_OK) {
+      free(db.entries);
+      return EXIT_FAILURE;
+   }
+
+   db.nbBuckets = db.nb / ES_MKDB_BUCKET_LOAD + 1;
+   db.nbSlots = db.nb + db.nb / 8 + 1;
+   db.start = (uint32_t *) calloc(db.nbBuckets + 1, sizeof(uint32_t));
+   db.order = (uint32_t *) calloc(db.nb + 1, sizeof(uint32_t));
+   db.buckets = (uint32_t *) calloc(db.nbBuckets, sizeof(uint32_t));
+   db.displacements = (uint32_t *) calloc(db.nbBuckets, sizeof(uint32_t));
+   db.slots = (struct es_db_record_s *) calloc(db.nbSlots, sizeof(struct es_db_record_s));
+
+   if ((db.start == NULL) || (db.order == NULL) || (db.buckets == NULL) || (db.displacements == NULL) ||
+       (db.slots == NULL)) {
+      fprintf(stderr, "esip-mkdb: no more memory for %u users\n", db.nb);
+      ret = ES_ERROR_OUTOFRESOURCES;
+   }
+
+   for (db.seed = 0; (ret == ES_OK) && (db.seed < ES_MKDB_MAX_SEEDS); ++db.seed) {
+      ret = _es_mkdb_place(&db);
+      if (ret == ES_ERROR_TRY_AGAIN) {
+         ret = ES_OK;
+         continue;
+      }
+      break;
+   }
+
+   if ((ret == ES_OK) && (db.seed == ES_MKDB_MAX_SEEDS)) {
+      fprintf(stderr, "esip-mkdb: no perfect hash found in %u seeds\n", ES_MKDB_MAX_SEEDS);
+      ret = ES_ERROR_UNKNOWN;
+   }
+
+   if (ret == ES_OK) {
+      ret = _es_mkdb_write(&db, argv[optind + 1], realm);
+   }
+
+   if (ret == ES_OK) {
+      fprintf(stdout, "%u users, %u slots, %u buckets, seed %u\n", db.nb, db.nbSlots, db.nbBuckets, db.seed);
+   }
+
+   free(db.slots);
+   free(db.displacements);
+   free(db.buckets);
+   free(db.order);
+   free(db.start);
+   free(db.entries);
+
+   return (ret == ES_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,829 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <event2/event.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esupgrade.h"
+#include "espersist.h"
+
+#define ES_PERSIST_MAGIC         0x20141105
+
+/** Format of the files, both start with it */
+#define ES_PERSIST_VERSION       1
+
+/** The log grows by it */
+#define ES_PERSIST_LOG_CHUNK     (4U * 1024U * 1024U)
+
+/** Record header: type (2) and length (4), as esupgrade */
+#define ES_PERSIST_TLV_HDR       6
+
+/** Max path, with ".log" or ".tmp" */
+#define ES_PERSIST_PATH_LEN      256
+
+/**
+ * Low priority: a snapshot is taken when no SIP event is waiting
+ */
+#define ES_PERSIST_PRIORITY      1
+
+/**
+ * @brief Records of the files themselves, out of the upgrade ones
+ */
+typedef enum _es_persist_rec_e {
+   /* First of both files: version */
+   ES_PERSIST_REC_VERSION = 0xff01,
+   /* Snapshot the log applies to */
+   ES_PERSIST_REC_GENERATION,
+   /* Wall clock (s) of what follows */
+   ES_PERSIST_REC_TIME
+} _es_persist_rec_t;
+
+struct es_persist_s {
+   /* Magic */
+   uint32_t                     magic;
+   /* Snapshots, pending once started */
+   struct event                 *ev;
+   struct timeval               period;
+   int                          started;
+   es_persist_save_cb           cb;
+   void                         *arg;
+   /* The files belong to another process */
+   int                          paused;
+   /* Generation of the current snapshot and log */
+   uint32_t                     generation;
+   /* Appends, from any thread and under the locks of what they change:
+      never held while the state is written */
+   pthread_mutex_t              lock;
+   /* Log file, mapped on size bytes, len written */
+   int                          logFd;
+   uint8_t                      *log;
+   size_t                       logSize;
+   size_t                       logLen;
+   /* Wall clock of the last time record in the log */
+   uint32_t                     logTime;
+   /* Counters, read by the CLI */
+   uint64_t                     snapshots;
+   uint64_t                     snapshotBytes;
+   uint64_t                     snapshotNs;
+   uint64_t                     appended;
+   uint64_t                     lost;
+   /* Snapshot file */
+   char                         path[ES_PERSIST_PATH_LEN];
+   char                         logPath[ES_PERSIST_PATH_LEN];
+};
+
+/*******************************************************************************
+                              Files
+ ******************************************************************************/
+
+static uint32_t _es_persist_time(void)
+{
+   return (uint32_t)time(NULL);
+}
+
+/**
+ * @brief Map a whole file read only, NULL and ES_ERROR_NOT_FOUND if none
+ */
+static es_status _es_persist_map(const char *path, uint8_t **pMap, size_t *pLen)
+{
+   struct stat st;
+   void *map = NULL;
+   int fd = -1;
+
+   *pMap = NULL;
+   *pLen = 0;
+
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      return (errno == ENOENT) ? ES_ERROR_NOT_FOUND : ES_ERROR_UNKNOWN;
+   }
+
+   if (fstat(fd, &st) != 0) {
+      close(fd);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (st.st_size == 0) {
+      close(fd);
+      return ES_OK;
+   }
+
+   map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Read once, in order */
+   (void)madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+   *pMap = (uint8_t *)map;
+   *pLen = (size_t)st.st_size;
+   return ES_OK;
+}
+
+/**
+ * @brief Check the header of a file and move past it
+ */
+static es_status _es_persist_header(const uint8_t *data, size_t len, size_t *offset, uint32_t *pGeneration,
+                                    uint32_t *pTime)
+{
+   struct es_upgrade_tlv_s tlv;
+   uint32_t version = 0;
+
+   *offset = 0;
+
+   if ((es_upgrade_tlv_next(data, len, offset, &tlv) <= 0) || (tlv.type != ES_PERSIST_REC_VERSION)) {
+      return ES_ERROR_BADPARAM;
+   }
+   version = es_upgrade_tlv_u32(&tlv);
+
+   if ((es_upgrade_tlv_next(data, len, offset, &tlv) <= 0) || (tlv.type != ES_PERSIST_REC_GENERATION)) {
+      return ES_ERROR_BADPARAM;
+   }
+   *pGeneration = es_upgrade_tlv_u32(&tlv);
+
+   if (pTime != NULL) {
+      if ((es_upgrade_tlv_next(data, len, offset, &tlv) <= 0) || (tlv.type != ES_PERSIST_REC_TIME)) {
+         return ES_ERROR_BADPARAM;
+      }
+      *pTime = es_upgrade_tlv_u32(&tlv);
+   }
+
+   return (version == ES_PERSIST_VERSION) ? ES_OK : ES_ERROR_NOTSUPPORTED;
+}
+
+/**
+ * @brief Write path through a mapping of path.tmp renamed over it
+ * The file is size bytes long, the ones past len are zeros.
+ * @param pFd Left open on the file and mapped if not NULL
+ */
+static es_status _es_persist_write(const char *path, const struct es_upgrade_buf_s *hdr,
+                                   const struct es_upgrade_buf_s *body, size_t size, int *pFd, uint8_t **pMap)
+{
+   char tmp[ES_PERSIST_PATH_LEN + 4];
+   size_t len = hdr->len + ((body != NULL) ? body->len : 0);
+   uint8_t *map = NULL;
+   int fd = -1;
+
+   if (size < len) {
+      size = len;
+   }
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+   fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create %s: %s", tmp, strerror(errno));
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (ftruncate(fd, (off_t)size) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not size %s: %s", tmp, strerror(errno));
+      goto ERROR;
+   }
+
+   map = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not map %s: %s", tmp, strerror(errno));
+      map = NULL;
+      goto ERROR;
+   }
+
+   memcpy(map, hdr->data, hdr->len);
+   if ((body != NULL) && (body->len != 0)) {
+      memcpy(map + hdr->len, body->data, body->len);
+   }
+
+   /* The process may die, the host is not expected to: no sync */
+   if (rename(tmp, path) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not replace %s: %s", path, strerror(errno));
+      goto ERROR;
+   }
+
+   if (pFd != NULL) {
+      *pFd = fd;
+      *pMap = map;
+   } else {
+      munmap(map, size);
+      close(fd);
+   }
+
+   return ES_OK;
+
+ERROR:
+   if (map != NULL) {
+      munmap(map, size);
+   }
+   close(fd);
+   (void)unlink(tmp);
+   return ES_ERROR_UNKNOWN;
+}
+
+static es_status _es_persist_file_header(struct es_upgrade_buf_s *hdr, uint32_t generation, uint32_t now)
+{
+   es_status ret = ES_OK;
+
+   ret |= es_upgrade_buf_put_u32(hdr, ES_PERSIST_REC_VERSION, ES_PERSIST_VERSION);
+   ret |= es_upgrade_buf_put_u32(hdr, ES_PERSIST_REC_GENERATION, generation);
+   ret |= es_upgrade_buf_put_u32(hdr, ES_PERSIST_REC_TIME, now);
+
+   return (ret == ES_OK) ? ES_OK : ES_ERROR_OUTOFRESOURCES;
+}
+
+/*******************************************************************************
+                              Log
+ ******************************************************************************/
+
+static void _es_persist_log_close(struct es_persist_s *pCtx)
+{
+   if (pCtx->log != NULL) {
+      munmap(pCtx->log, pCtx->logSize);
+      pCtx->log = NULL;
+   }
+
+   if (pCtx->logFd >= 0) {
+      close(pCtx->logFd);
+      pCtx->logFd = -1;
+   }
+
+   pCtx->logSize = 0;
+   pCtx->logLen = 0;
+}
+
+/**
+ * @brief Start an empty log of the current generation, lock held
+ */
+static es_status _es_persist_log_reset(struct es_persist_s *pCtx, uint32_t now)
+{
+   struct es_upgrade_buf_s hdr;
+   es_status ret = ES_OK;
+
+   _es_persist_log_close(pCtx);
+
+   memset(&hdr, 0, sizeof(hdr));
+   ret = _es_persist_file_header(&hdr, pCtx->generation, now);
+   if (ret == ES_OK) {
+      ret = _es_persist_write(pCtx->logPath, &hdr, NULL, ES_PERSIST_LOG_CHUNK, &pCtx->logFd, &pCtx->log);
+   }
+
+   if (ret == ES_OK) {
+      pCtx->logSize = ES_PERSIST_LOG_CHUNK;
+      pCtx->logLen = hdr.len;
+      pCtx->logTime = now;
+   }
+
+   es_upgrade_buf_free(&hdr);
+   return ret;
+}
+
+/**
+ * @brief Make room for len more bytes, lock held
+ */
+static es_status _es_persist_log_reserve(struct es_persist_s *pCtx, size_t len)
+{
+   size_t size = pCtx->logSize;
+   void *map = NULL;
+
+   if (pCtx->log == NULL) {
+      return ES_ERROR_UNINITIALIZED;
+   }
+
+   if (pCtx->logLen + len <= pCtx->logSize) {
+      return ES_OK;
+   }
+
+   while (pCtx->logLen + len > size) {
+      size += ES_PERSIST_LOG_CHUNK;
+   }
+
+   if (ftruncate(pCtx->logFd, (off_t)size) != 0) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   map = mremap(pCtx->log, pCtx->logSize, size, MREMAP_MAYMOVE);
+   if (map == MAP_FAILED) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   pCtx->log = (uint8_t *)map;
+   pCtx->logSize = size;
+   return ES_OK;
+}
+
+static void _es_persist_log_put(struct es_persist_s *pCtx, uint16_t type, const void *value, size_t len)
+{
+   uint16_t t = htons(type);
+   uint32_t l = htonl((uint32_t)len);
+   uint8_t *p = pCtx->log + pCtx->logLen;
+
+   /* Value first: a record is complete once its type is not 0 */
+   memcpy(p + sizeof(t), &l, sizeof(l));
+   if (len != 0) {
+      memcpy(p + ES_PERSIST_TLV_HDR, value, len);
+   }
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   memcpy(p, &t, sizeof(t));
+
+   pCtx->logLen += ES_PERSIST_TLV_HDR + len;
+}
+
+static void _es_persist_append(void *arg, uint16_t type, const uint8_t *value, size_t len)
+{
+   struct es_persist_s *pCtx = (struct es_persist_s *)arg;
+   uint32_t now = _es_persist_time();
+   uint32_t t = htonl(now);
+   size_t need = ES_PERSIST_TLV_HDR + len;
+
+   pthread_mutex_lock(&pCtx->lock);
+
+   if (pCtx->paused) {
+      pthread_mutex_unlock(&pCtx->lock);
+      return;
+   }
+
+   /* Changes of the same second share one time record */
+   if (now != pCtx->logTime) {
+      need += ES_PERSIST_TLV_HDR + sizeof(t);
+   }
+
+   if (_es_persist_log_reserve(pCtx, need) != ES_OK) {
+      /* The next snapshot has it */
+      __atomic_add_fetch(&pCtx->lost, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&pCtx->lock);
+      return;
+   }
+
+   if (now != pCtx->logTime) {
+      _es_persist_log_put(pCtx, ES_PERSIST_REC_TIME, &t, sizeof(t));
+      pCtx->logTime = now;
+   }
+   _es_persist_log_put(pCtx, type, value, len);
+
+   pthread_mutex_unlock(&pCtx->lock);
+
+   __atomic_add_fetch(&pCtx->appended, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Replay the log of a generation, one call per time record
+ */
+static es_status _es_persist_replay(const char *path, uint32_t generation, es_persist_restore_cb cb, void *arg)
+{
+   struct es_upgrade_tlv_s tlv;
+   uint8_t *map = NULL;
+   size_t len = 0;
+   size_t offset = 0;
+   size_t first = 0;
+   size_t run = 0;
+   uint32_t logGeneration = 0;
+   uint32_t when = 0;
+   uint32_t now = _es_persist_time();
+   unsigned int runs = 0;
+   es_status ret = ES_OK;
+
+   ret = _es_persist_map(path, &map, &len);
+   if (ret == ES_ERROR_NOT_FOUND) {
+      return ES_OK;
+   }
+   if ((ret != ES_OK) || (map == NULL)) {
+      return ret;
+   }
+
+   if ((_es_persist_header(map, len, &offset, &logGeneration, &when) != ES_OK) || (logGeneration != generation)) {
+      /* Older than the snapshot, all in it */
+      ESIP_TRACE(ESIP_LOG_INFO, "Log %s not of snapshot %u, skipped", path, generation);
+      munmap(map, len);
+      return ES_OK;
+   }
+
+   first = offset;
+   run = offset;
+   for (;;) {
+      size_t next = offset;
+      int rc = es_upgrade_tlv_next(map, len, &next, &tlv);
+
+      /* Zeros past the last append, or one cut short */
+      if ((rc <= 0) || (tlv.type == 0) || (tlv.type == ES_PERSIST_REC_TIME)) {
+         if (offset > run) {
+            (void)cb(arg, map + run, offset - run, (now > when) ? now - when : 0);
+            runs++;
+         }
+         if ((rc <= 0) || (tlv.type == 0)) {
+            break;
+         }
+         when = es_upgrade_tlv_u32(&tlv);
+         run = next;
+      }
+      offset = next;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Log %s replayed: %lu bytes in %u run(s)", path, (unsigned long)(offset - first), runs);
+
+   munmap(map, len);
+   return ES_OK;
+}
+
+/*******************************************************************************
+                              Snapshot
+ ******************************************************************************/
+
+static es_status _es_persist_snapshot(struct es_persist_s *pCtx)
+{
+   struct es_upgrade_buf_s hdr;
+   struct es_upgrade_buf_s state;
+   struct es_upgrade_buf_s tail;
+   struct es_upgrade_tlv_s tlv;
+   uint64_t start = es_hist_now();
+   uint32_t now = _es_persist_time();
+   uint32_t generation = 0;
+   uint32_t markTime = 0;
+   uint32_t lastTime = 0;
+   size_t mark = 0;
+   size_t offset = 0;
+   es_status ret = ES_OK;
+
+   memset(&hdr, 0, sizeof(hdr));
+   memset(&state, 0, sizeof(state));
+   memset(&tail, 0, sizeof(tail));
+
+   /* Where the log is before the state is written */
+   pthread_mutex_lock(&pCtx->lock);
+   generation = pCtx->generation;
+   mark = (pCtx->log != NULL) ? pCtx->logLen : 0;
+   markTime = pCtx->logTime;
+   pthread_mutex_unlock(&pCtx->lock);
+
+   /* Without the lock: cb takes the locks of the state, appends come under them */
+   ret = pCtx->cb(pCtx->arg, &state);
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "State not saved, no snapshot");
+      es_upgrade_buf_free(&state);
+      return ret;
+   }
+
+   pthread_mutex_lock(&pCtx->lock);
+
+   /* Another snapshot meanwhile, or the files handed over */
+   if ((pCtx->generation != generation) || pCtx->paused) {
+      pthread_mutex_unlock(&pCtx->lock);
+      ESIP_TRACE(ESIP_LOG_INFO, "Snapshot %u dropped, generation %u", generation + 1, pCtx->generation);
+      es_upgrade_buf_free(&state);
+      return ES_OK;
+   }
+
+   /* Appended while the state was written, maybe not in it: kept for the
+      new log, replayed over the new snapshot */
+   lastTime = pCtx->logTime;
+   if (pCtx->log != NULL) {
+      offset = mark;
+      while ((ret == ES_OK) && (es_upgrade_tlv_next(pCtx->log, pCtx->logLen, &offset, &tlv) > 0)) {
+         ret = es_upgrade_buf_put(&tail, tlv.type, tlv.value, tlv.len);
+      }
+   }
+
+   /* The new log goes with the new snapshot: a crash in between keeps the
+      new snapshot and skips the old log */
+   if (ret == ES_OK) {
+      ret = _es_persist_file_header(&hdr, pCtx->generation + 1, now);
+   }
+   if (ret == ES_OK) {
+      ret = _es_persist_write(pCtx->path, &hdr, &state, 0, NULL, NULL);
+   }
+
+   if (ret == ES_OK) {
+      uint32_t t = htonl(markTime);
+
+      pCtx->generation++;
+      ret = _es_persist_log_reset(pCtx, now);
+      if ((ret == ES_OK) && (tail.len != 0)) {
+         ret = _es_persist_log_reserve(pCtx, ES_PERSIST_TLV_HDR + sizeof(t) + tail.len);
+      }
+      if ((ret == ES_OK) && (tail.len != 0)) {
+         _es_persist_log_put(pCtx, ES_PERSIST_REC_TIME, &t, sizeof(t));
+         for (offset = 0; es_upgrade_tlv_next(tail.data, tail.len, &offset, &tlv) > 0; ) {
+            _es_persist_log_put(pCtx, tlv.type, tlv.value, tlv.len);
+         }
+         pCtx->logTime = lastTime;
+      }
+      if (ret != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "No log, changes kept at the next snapshot only");
+      }
+   }
+
+   pthread_mutex_unlock(&pCtx->lock);
+
+   if (ret == ES_OK) {
+      __atomic_add_fetch(&pCtx->snapshots, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&pCtx->snapshotBytes, hdr.len + state.len, __ATOMIC_RELAXED);
+      __atomic_store_n(&pCtx->snapshotNs, es_hist_now() - start, __ATOMIC_RELAXED);
+   }
+
+   es_upgrade_buf_free(&hdr);
+   es_upgrade_buf_free(&state);
+   es_upgrade_buf_free(&tail);
+   return ret;
+}
+
+static void _es_persist_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_persist_s *pCtx = (struct es_persist_s *)arg;
+
+   if (pCtx->paused) {
+      return;
+   }
+
+   (void)_es_persist_snapshot(pCtx);
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_persist_load(const char *path, es_persist_restore_cb cb, void *arg)
+{
+   char logPath[ES_PERSIST_PATH_LEN + 4];
+   uint8_t *map = NULL;
+   size_t len = 0;
+   size_t offset = 0;
+   uint32_t generation = 0;
+   uint32_t when = 0;
+   uint32_t now = _es_persist_time();
+   uint64_t start = es_hist_now();
+   es_status ret = ES_OK;
+
+   if ((path == NULL) || (cb == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   ret = _es_persist_map(path, &map, &len);
+   if (ret == ES_ERROR_NOT_FOUND) {
+      ESIP_TRACE(ESIP_LOG_INFO, "No snapshot %s, nothing restored", path);
+      return ret;
+   }
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not read snapshot %s: %s", path, strerror(errno));
+      return ret;
+   }
+
+   if ((map == NULL) || (_es_persist_header(map, len, &offset, &generation, &when) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Snapshot %s not valid, nothing restored", path);
+      if (map != NULL) {
+         munmap(map, len);
+      }
+      return ES_ERROR_BADPARAM;
+   }
+
+   ret = cb(arg, map + offset, len - offset, (now > when) ? now - when : 0);
+   munmap(map, len);
+
+   snprintf(logPath, sizeof(logPath), "%s.log", path);
+   if (_es_persist_replay(logPath, generation, cb, arg) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not read log %s, changes since the snapshot lost", logPath);
+   }
+
+   ESIP_TRACE(ESIP_LOG_NOTICE, "Snapshot %s %u of %us ago restored in %llums", path, generation,
+              (now > when) ? now - when : 0, (unsigned long long)((es_hist_now() - start) / 1000000ULL));
+
+   return ret;
+}
+
+es_status es_persist_init(es_persist_t **ppCtx, struct event_base *pBase, const char *path, unsigned int period,
+                          es_persist_save_cb cb, void *arg)
+{
+   struct es_persist_s *_pCtx = NULL;
+   uint8_t *map = NULL;
+   size_t len = 0;
+   size_t offset = 0;
+
+   if ((ppCtx == NULL) || (pBase == NULL) || (path == NULL) || (cb == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Persist parameters not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((period == 0) || (strlen(path) + sizeof(".log") > ES_PERSIST_PATH_LEN)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Persist parameters out of range");
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   _pCtx = (struct es_persist_s *) malloc(sizeof(struct es_persist_s));
+   if (_pCtx == (struct es_persist_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize persist: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_persist_s));
+
+   _pCtx->magic = ES_PERSIST_MAGIC;
+   _pCtx->cb = cb;
+   _pCtx->arg = arg;
+   _pCtx->logFd = -1;
+   _pCtx->period.tv_sec = (time_t)period;
+   pthread_mutex_init(&_pCtx->lock, NULL);
+   strcpy(_pCtx->path, path);
+   snprintf(_pCtx->logPath, sizeof(_pCtx->logPath), "%s.log", path);
+
+   /* Generations go on from the previous run */
+   if ((_es_persist_map(path, &map, &len) == ES_OK) && (map != NULL)) {
+      (void)_es_persist_header(map, len, &offset, &_pCtx->generation, NULL);
+      munmap(map, len);
+   }
+
+   _pCtx->ev = event_new(pBase, -1, EV_PERSIST, _es_persist_timer_cb, _pCtx);
+   if (_pCtx->ev == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create persist event");
+      es_persist_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   if (event_priority_set(_pCtx->ev, ES_PERSIST_PRIORITY) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set persist event priority");
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_persist_start(es_persist_t *pCtx)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PERSIST_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (_pCtx->started) {
+      return ES_ERROR_ILLEGAL_ACTION;
+   }
+
+   if (_es_persist_snapshot(_pCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not write snapshot %s", _pCtx->path);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (event_add(_pCtx->ev, &_pCtx->period) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not make persist event pending");
+      return ES_ERROR_UNKNOWN;
+   }
+
+   _pCtx->started = 1;
+
+   ESIP_TRACE(ESIP_LOG_INFO, "State persisted to %s every %lus", _pCtx->path, (unsigned long)_pCtx->period.tv_sec);
+   return ES_OK;
+}
+
+es_status es_persist_deinit(es_persist_t *pCtx)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)pCtx;
+
+   if (_pCtx == (struct es_persist_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Persist Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PERSIST_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Persist Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->ev != NULL) {
+      event_free(_pCtx->ev);
+   }
+
+   /* Restart from here, no log to replay */
+   if (_pCtx->started && !_pCtx->paused && (_es_persist_snapshot(_pCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Last snapshot not written, the previous one and its log are kept");
+   }
+
+   _es_persist_log_close(_pCtx);
+   pthread_mutex_destroy(&_pCtx->lock);
+
+   _pCtx->magic = 0;
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_persist_journal(es_persist_t *pCtx, struct es_upgrade_journal_s *pJournal)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)pCtx;
+
+   if ((_pCtx == NULL) || (pJournal == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PERSIST_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   pJournal->append = _es_persist_append;
+   pJournal->arg = _pCtx;
+
+   return ES_OK;
+}
+
+es_status es_persist_pause(es_persist_t *pCtx, int pause)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PERSIST_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   pthread_mutex_lock(&_pCtx->lock);
+   _pCtx->paused = pause;
+   pthread_mutex_unlock(&_pCtx->lock);
+
+   /* Changes missed meanwhile */
+   if (!pause && _pCtx->started) {
+      return _es_persist_snapshot(_pCtx);
+   }
+
+   return ES_OK;
+}
+
+static int _es_persist_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)arg;
+   size_t logLen = 0;
+   size_t logSize = 0;
+   uint32_t generation = 0;
+   int paused = 0;
+
+   pthread_mutex_lock(&_pCtx->lock);
+   logLen = _pCtx->logLen;
+   logSize = _pCtx->logSize;
+   generation = _pCtx->generation;
+   paused = _pCtx->paused;
+   pthread_mutex_unlock(&_pCtx->lock);
+
+   es_cli_print(pCli, "Snapshot %s, generation %u%s", _pCtx->path, generation, paused ? " (paused)" : "");
+   es_cli_print(pCli, "Last snapshot %llu bytes in %llums, %llu taken",
+                (unsigned long long)__atomic_load_n(&_pCtx->snapshotBytes, __ATOMIC_RELAXED),
+                (unsigned long long)(__atomic_load_n(&_pCtx->snapshotNs, __ATOMIC_RELAXED) / 1000000ULL),
+                (unsigned long long)__atomic_load_n(&_pCtx->snapshots, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "Log %s, %lu of %lu bytes, %llu change(s) appended, %llu lost",
+                _pCtx->logPath, (unsigned long)logLen, (unsigned long)logSize,
+                (unsigned long long)__atomic_load_n(&_pCtx->appended, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->lost, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_persist_cli_register(es_persist_t *pCtx, es_cli_t *pCli)
+{
+   struct es_persist_s *_pCtx = (struct es_persist_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PERSIST_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show persist", "Show the snapshot and log of the state",
+                              _es_persist_cli_show, _pCtx);
+}
@@ -0,0 +1,32 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "esprobe.h"
+
+#if defined(HAVE_SYS_SDT_H)
+
+/** Probes semaphores, declared in esprobe.h */
+#define ES_PROBE_SEMAPHORE_DEF(name) \
+   __extension__ unsigned short esip_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+
+ES_PROBE_LIST(ES_PROBE_SEMAPHORE_DEF)
+
+#endif /* HAVE_SYS_SDT_H */
@@ -0,0 +1,627 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "essnap.h"
+
+#define ES_SNAP_MAGIC            0x20141028
+
+/** Period of the refresh check (ms) */
+#define ES_SNAP_TICK_MS          100
+
+/** Min age of a snapshot before it is rebuilt (ns) */
+#define ES_SNAP_PERIOD_NS        1000000000ULL
+
+/** Snapshots stop being rebuilt this long after the last read (ns) */
+#define ES_SNAP_IDLE_NS          60000000000ULL
+
+/** Rows copied per slice, between two SIP events */
+#define ES_SNAP_SLICE            2048
+
+/** Initial number of live rows of a kind */
+#define ES_SNAP_INITIAL_SLOTS    1024
+
+/** Max concurrent readers */
+#define ES_SNAP_READERS          16
+
+/** Max time the CLI waits for a fresh snapshot (ms) */
+#define ES_SNAP_WAIT_MS          2000
+
+/** Period the CLI checks for it (ms) */
+#define ES_SNAP_POLL_MS          10
+
+/** Rows per page, default and max */
+#define ES_SNAP_PAGE             20
+#define ES_SNAP_PAGE_MAX         1000
+
+/** Reader slot taken, no snapshot held yet */
+#define ES_SNAP_CLAIMED          ((struct es_snap_view_s *)1)
+
+struct _es_snap_slot_s {
+   /* Live object, NULL when the slot is free */
+   const void                *obj;
+   /* Next free slot */
+   int                        nextFree;
+   /* Row, fixed fields */
+   struct es_snap_row_s       row;
+};
+
+struct _es_snap_kind_s {
+   /* Owner, for the CLI callbacks */
+   struct es_snap_s           *ctx;
+   es_snap_kind_t             kind;
+   /* Live rows, SIP thread only */
+   struct _es_snap_slot_s     *slots;
+   unsigned int               size;
+   unsigned int               used;
+   unsigned int               count;
+   int                        freeHead;
+   es_snap_refresh_cb         refresh;
+   /* Snapshot being built, SIP thread only */
+   struct es_snap_view_s      *building;
+   unsigned int               cursor;
+   uint64_t                   generation;
+   /* Replaced snapshots, freed once no reader holds them */
+   struct es_snap_view_s      *retired;
+   /* Last complete snapshot */
+   struct es_snap_view_s      *view;
+   /* Last read (es_hist_now()) */
+   uint64_t                   wanted;
+};
+
+struct es_snap_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* SIP loop */
+   struct event_base         *base;
+   /* Refresh check timer */
+   struct event              *tick;
+   /* Copy of the next rows */
+   struct event              *slice;
+   /* Objects */
+   struct _es_snap_kind_s    kinds[ES_SNAP_KIND_MAX];
+   /* Snapshot held by each reader */
+   struct es_snap_view_s     *readers[ES_SNAP_READERS];
+};
+
+static const char const *_es_snap_names[ES_SNAP_KIND_MAX] = {
+   "transactions",
+   "dialogs",
+   "registrations"
+};
+
+static int _es_snap_held(struct es_snap_s *pCtx, const struct es_snap_view_s *view)
+{
+   unsigned int i = 0;
+
+   for (i = 0; i < ES_SNAP_READERS; ++i) {
+      if (__atomic_load_n(&pCtx->readers[i], __ATOMIC_SEQ_CST) == view) {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static void _es_snap_reclaim(struct es_snap_s *pCtx, struct _es_snap_kind_s *k)
+{
+   struct es_snap_view_s **pp = &k->retired;
+
+   while (*pp != NULL) {
+      struct es_snap_view_s *view = *pp;
+      if (_es_snap_held(pCtx, view)) {
+         pp = &view->next;
+         continue;
+      }
+      *pp = view->next;
+      free(view);
+   }
+}
+
+static void _es_snap_publish(struct _es_snap_kind_s *k)
+{
+   struct es_snap_view_s *old = NULL;
+
+   k->building->generation = ++k->generation;
+   k->building->ts = es_hist_now();
+
+   /* Readers check the view again after taking it: see es_snap_acquire() */
+   old = __atomic_exchange_n(&k->view, k->building, __ATOMIC_SEQ_CST);
+   if (old != NULL) {
+      old->next = k->retired;
+      k->retired = old;
+   }
+
+   k->building = NULL;
+}
+
+/**
+ * @brief Copy the next rows of a kind
+ * @return rows left to the budget
+ */
+static unsigned int _es_snap_copy(struct _es_snap_kind_s *k, unsigned int budget)
+{
+   while ((budget > 0) && (k->cursor < k->used)) {
+      const struct _es_snap_slot_s *slot = &k->slots[k->cursor++];
+      budget--;
+
+      if (slot->obj == NULL) {
+         continue;
+      }
+
+      if (k->building->count == k->building->size) {
+         unsigned int size = k->building->size * 2;
+         struct es_snap_view_s *view = (struct es_snap_view_s *)
+            realloc(k->building, sizeof(struct es_snap_view_s) + size * sizeof(struct es_snap_row_s));
+         if (view == NULL) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "No more memory for %s snapshot", _es_snap_names[k->kind]);
+            k->cursor = k->used;
+            break;
+         }
+         view->size = size;
+         k->building = view;
+      }
+
+      k->building->rows[k->building->count] = slot->row;
+      if (k->refresh != NULL) {
+         k->refresh(slot->obj, &k->building->rows[k->building->count]);
+      }
+      k->building->count++;
+   }
+
+   if (k->cursor >= k->used) {
+      _es_snap_publish(k);
+   }
+
+   return budget;
+}
+
+static void _es_snap_slice_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)arg;
+   unsigned int budget = ES_SNAP_SLICE;
+   int more = 0;
+   unsigned int i = 0;
+
+   for (i = 0; i < ES_SNAP_KIND_MAX; ++i) {
+      struct _es_snap_kind_s *k = &_pCtx->kinds[i];
+      if (k->building == NULL) {
+         continue;
+      }
+      budget = _es_snap_copy(k, budget);
+      more |= (k->building != NULL);
+   }
+
+   /* Low priority: pending SIP events run before the next slice */
+   if (more) {
+      event_active(_pCtx->slice, EV_TIMEOUT, 0);
+   }
+}
+
+static void _es_snap_tick_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)arg;
+   uint64_t now = es_hist_now();
+   int start = 0;
+   unsigned int i = 0;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (_pCtx->magic != ES_SNAP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Snapshot Ctx not valid");
+      return;
+   }
+
+   for (i = 0; i < ES_SNAP_KIND_MAX; ++i) {
+      struct _es_snap_kind_s *k = &_pCtx->kinds[i];
+      const struct es_snap_view_s *view = __atomic_load_n(&k->view, __ATOMIC_RELAXED);
+      uint64_t wanted = __atomic_load_n(&k->wanted, __ATOMIC_RELAXED);
+      unsigned int size = k->count + 64;
+
+      _es_snap_reclaim(_pCtx, k);
+
+      /* Nobody reading: nothing to do */
+      if ((k->building != NULL) || (wanted == 0) || ((now > wanted) && ((now - wanted) > ES_SNAP_IDLE_NS))) {
+         continue;
+      }
+
+      if ((view != NULL) && ((now - view->ts) < ES_SNAP_PERIOD_NS)) {
+         continue;
+      }
+
+      k->building = (struct es_snap_view_s *) malloc(sizeof(struct es_snap_view_s) + size * sizeof(struct es_snap_row_s));
+      if (k->building == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "No more memory for %s snapshot", _es_snap_names[i]);
+         continue;
+      }
+
+      memset(k->building, 0, sizeof(struct es_snap_view_s));
+      k->building->size = size;
+      k->cursor = 0;
+      start = 1;
+   }
+
+   if (start) {
+      event_active(_pCtx->slice, EV_TIMEOUT, 0);
+   }
+}
+
+es_status es_snap_init(es_snap_t **ppCtx, struct event_base *pBase)
+{
+   struct es_snap_s *_pCtx = NULL;
+   struct timeval tv = { 0, ES_SNAP_TICK_MS * 1000 };
+   unsigned int i = 0;
+
+   if (pBase == (struct event_base *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Loop not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_snap_s *) malloc(sizeof(struct es_snap_s));
+   if (_pCtx == (struct es_snap_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize snapshots: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_snap_s));
+
+   _pCtx->magic = ES_SNAP_MAGIC;
+   _pCtx->base = pBase;
+
+   for (i = 0; i < ES_SNAP_KIND_MAX; ++i) {
+      _pCtx->kinds[i].ctx = _pCtx;
+      _pCtx->kinds[i].kind = (es_snap_kind_t)i;
+      _pCtx->kinds[i].freeHead = -1;
+   }
+
+   _pCtx->slice = event_new(pBase, -1, 0, _es_snap_slice_cb, _pCtx);
+   _pCtx->tick = event_new(pBase, -1, EV_PERSIST, _es_snap_tick_cb, _pCtx);
+   if ((_pCtx->slice == NULL) || (_pCtx->tick == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create snapshot events");
+      es_snap_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Below the SIP events */
+   if ((event_priority_set(_pCtx->slice, 1) != 0) ||
+       (event_priority_set(_pCtx->tick, 1) != 0)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set priority of snapshot events");
+   }
+
+   if (event_add(_pCtx->tick, &tv) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start snapshot timer");
+      es_snap_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_snap_deinit(es_snap_t *pCtx)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+   unsigned int i = 0;
+
+   if (_pCtx == (struct es_snap_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Snapshot Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_SNAP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Snapshot Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (_pCtx->tick != NULL) {
+      event_free(_pCtx->tick);
+   }
+
+   if (_pCtx->slice != NULL) {
+      event_free(_pCtx->slice);
+   }
+
+   for (i = 0; i < ES_SNAP_KIND_MAX; ++i) {
+      struct _es_snap_kind_s *k = &_pCtx->kinds[i];
+      while (k->retired != NULL) {
+         struct es_snap_view_s *view = k->retired;
+         k->retired = view->next;
+         free(view);
+      }
+      free(k->view);
+      free(k->building);
+      free(k->slots);
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_snap_s));
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_snap_set_refresh(es_snap_t *pCtx, es_snap_kind_t kind, es_snap_refresh_cb cb)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (kind >= ES_SNAP_KIND_MAX)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   _pCtx->kinds[kind].refresh = cb;
+   return ES_OK;
+}
+
+es_status es_snap_add(es_snap_t *pCtx, es_snap_kind_t kind, const void *obj, const struct es_snap_row_s *row, int *slot)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+   struct _es_snap_kind_s *k = NULL;
+   int idx = -1;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (kind >= ES_SNAP_KIND_MAX) || (obj == NULL) || (row == NULL)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   k = &_pCtx->kinds[kind];
+
+   if (k->freeHead >= 0) {
+      idx = k->freeHead;
+      k->freeHead = k->slots[idx].nextFree;
+   } else {
+      if (k->used == k->size) {
+         unsigned int size = (k->size == 0) ? ES_SNAP_INITIAL_SLOTS : k->size * 2;
+         struct _es_snap_slot_s *slots = (struct _es_snap_slot_s *) realloc(k->slots, size * sizeof(struct _es_snap_slot_s));
+         if (slots == NULL) {
+            return ES_ERROR_OUTOFRESOURCES;
+         }
+         k->slots = slots;
+         k->size = size;
+      }
+      idx = (int)k->used++;
+   }
+
+   k->slots[idx].obj = obj;
+   k->slots[idx].nextFree = -1;
+   k->slots[idx].row = *row;
+   k->count++;
+
+   *slot = idx;
+   return ES_OK;
+}
+
+void es_snap_remove(es_snap_t *pCtx, es_snap_kind_t kind, int slot)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+   struct _es_snap_kind_s *k = NULL;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (kind >= ES_SNAP_KIND_MAX)) {
+      return;
+   }
+
+   k = &_pCtx->kinds[kind];
+   if ((slot < 0) || ((unsigned int)slot >= k->used) || (k->slots[slot].obj == NULL)) {
+      return;
+   }
+
+   k->slots[slot].obj = NULL;
+   k->slots[slot].nextFree = k->freeHead;
+   k->freeHead = slot;
+   k->count--;
+}
+
+const struct es_snap_view_s *es_snap_acquire(es_snap_t *pCtx, es_snap_kind_t kind, int *ref)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+   struct _es_snap_kind_s *k = NULL;
+   struct es_snap_view_s *view = NULL;
+   unsigned int i = 0;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (kind >= ES_SNAP_KIND_MAX)) {
+      return NULL;
+   }
+
+   k = &_pCtx->kinds[kind];
+
+   /* Keep the snapshots of this kind fresh for a while */
+   __atomic_store_n(&k->wanted, es_hist_now(), __ATOMIC_RELAXED);
+
+   for (i = 0; i < ES_SNAP_READERS; ++i) {
+      struct es_snap_view_s *expected = NULL;
+      if (__atomic_compare_exchange_n(&_pCtx->readers[i], &expected, ES_SNAP_CLAIMED, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+         break;
+      }
+   }
+
+   if (i == ES_SNAP_READERS) {
+      return NULL;
+   }
+
+   /* Once announced, a view still published is not freed */
+   do {
+      view = __atomic_load_n(&k->view, __ATOMIC_SEQ_CST);
+      __atomic_store_n(&_pCtx->readers[i], (view != NULL) ? view : ES_SNAP_CLAIMED, __ATOMIC_SEQ_CST);
+   } while (__atomic_load_n(&k->view, __ATOMIC_SEQ_CST) != view);
+
+   if (view == NULL) {
+      __atomic_store_n(&_pCtx->readers[i], NULL, __ATOMIC_RELEASE);
+      return NULL;
+   }
+
+   *ref = (int)i;
+   return view;
+}
+
+void es_snap_release(es_snap_t *pCtx, int ref)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+
+   if ((_pCtx == (struct es_snap_s *)0) || (ref < 0) || (ref >= ES_SNAP_READERS)) {
+      return;
+   }
+
+   __atomic_store_n(&_pCtx->readers[ref], NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief A "show" command waiting for a snapshot newer than itself
+ */
+struct _es_snap_wait_s {
+   struct _es_snap_kind_s     *kind;
+   unsigned long              start;
+   unsigned long              count;
+   /* When the command was typed (es_hist_now()) */
+   uint64_t                   asked;
+};
+
+static void _es_snap_cli_print(struct cli_def *pCli, const struct _es_snap_wait_s *wait,
+                               const struct es_snap_view_s *view)
+{
+   const char *name = _es_snap_names[wait->kind->kind];
+   uint64_t now = es_hist_now();
+   unsigned long i = 0;
+
+   es_cli_print(pCli, "%u %s (snapshot %llu, %.1f s old)", view->count, name,
+                (unsigned long long)view->generation, (double)(now - view->ts) / 1e9);
+   es_cli_print(pCli, "%8s %-5s %-16s %8s  %-32s %-24s %s", "id", "type", "state", "age(s)", "call-id", "local", "remote");
+
+   for (i = wait->start; (i < view->count) && (i < wait->start + wait->count); ++i) {
+      const struct es_snap_row_s *row = &view->rows[i];
+      es_cli_print(pCli, "%8d %-5s %-16s %8.1f  %-32s %-24s %s",
+                   row->id, row->type, row->state,
+                   (now > row->since) ? (double)(now - row->since) / 1e9 : 0.0,
+                   row->callId, row->local, row->remote);
+   }
+
+   if (i < view->count) {
+      es_cli_print(pCli, "-- %lu-%lu of %u, more with: show %s %lu", wait->start + 1, i, view->count, name, i);
+   }
+}
+
+/**
+ * @brief Print the last snapshot if it is recent enough, else check again
+ * later: the CLI loop serves the other sessions meanwhile
+ */
+static void _es_snap_cli_wait(struct cli_def *pCli, void *arg)
+{
+   struct _es_snap_wait_s *wait = (struct _es_snap_wait_s *)arg;
+   const struct es_snap_view_s *view = NULL;
+   int ref = -1;
+
+   /* Session closed */
+   if (pCli == NULL) {
+      free(wait);
+      return;
+   }
+
+   view = es_snap_acquire(wait->kind->ctx, wait->kind->kind, &ref);
+
+   /* Rebuilt every period while read: older means nobody read it lately */
+   if ((view == NULL) || ((view->ts + 2 * ES_SNAP_PERIOD_NS) < wait->asked)) {
+      if (((es_hist_now() - wait->asked) < ES_SNAP_WAIT_MS * 1000000ULL) &&
+          (es_cli_defer(pCli, ES_SNAP_POLL_MS, _es_snap_cli_wait, wait) == ES_OK)) {
+         if (view != NULL) {
+            es_snap_release(wait->kind->ctx, ref);
+         }
+         return;
+      }
+   }
+
+   if (view == NULL) {
+      es_cli_print(pCli, "No snapshot of %s yet, try again", _es_snap_names[wait->kind->kind]);
+   } else {
+      _es_snap_cli_print(pCli, wait, view);
+      es_snap_release(wait->kind->ctx, ref);
+   }
+
+   free(wait);
+}
+
+static int _es_snap_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct _es_snap_kind_s *k = (struct _es_snap_kind_s *)arg;
+   struct _es_snap_wait_s *wait = NULL;
+
+   if (argc > 2) {
+      es_cli_print(pCli, "Usage: show %s [first] [count]", _es_snap_names[k->kind]);
+      return CLI_ERROR;
+   }
+
+   wait = (struct _es_snap_wait_s *) calloc(1, sizeof(struct _es_snap_wait_s));
+   if (wait == NULL) {
+      return CLI_ERROR;
+   }
+
+   wait->kind = k;
+   wait->count = ES_SNAP_PAGE;
+   wait->asked = es_hist_now();
+
+   if (argc > 0) {
+      wait->start = strtoul(argv[0], NULL, 10);
+   }
+
+   if (argc > 1) {
+      wait->count = strtoul(argv[1], NULL, 10);
+      if ((wait->count == 0) || (wait->count > ES_SNAP_PAGE_MAX)) {
+         wait->count = ES_SNAP_PAGE_MAX;
+      }
+   }
+
+   _es_snap_cli_wait(pCli, wait);
+   return CLI_OK;
+}
+
+es_status es_snap_cli_register(es_snap_t *pCtx, es_cli_t *pCli)
+{
+   struct es_snap_s *_pCtx = (struct es_snap_s *)pCtx;
+   es_status ret = ES_OK;
+
+   if (_pCtx == (struct es_snap_s *)0) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_SNAP_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   ret = es_cli_register_cmd(pCli, "show transactions", "Show the live transactions [first] [count]",
+                             _es_snap_cli_show, &_pCtx->kinds[ES_SNAP_TRANSACTIONS]);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   ret = es_cli_register_cmd(pCli, "show dialogs", "Show the live dialogs [first] [count]",
+                             _es_snap_cli_show, &_pCtx->kinds[ES_SNAP_DIALOGS]);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return es_cli_register_cmd(pCli, "show registrations", "Show the registered contacts [first] [count]",
+                              _es_snap_cli_show, &_pCtx->kinds[ES_SNAP_REGISTRATIONS]);
+}
@@ -0,0 +1,194 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esstats.h"
+
+#define ES_STATS_CACHE_LINE      64
+
+/**
+ * @brief Counters of one thread
+ * Padded to a cache line multiple, so two threads never share a line.
+ */
+struct _es_stats_shard_s {
+   int64_t                          values[ES_STATS_MAX];
+   struct _es_stats_shard_s         *next;
+} __attribute__((aligned(ES_STATS_CACHE_LINE)));
+
+__thread int64_t *es_stats_local = NULL;
+
+/** Registered shards, new ones are pushed in front */
+static struct _es_stats_shard_s *_es_stats_shards = NULL;
+
+static pthread_mutex_t _es_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char const *_es_stats_names[ES_STATS_RESP_FIRST] = {
+   "rx_datagrams",
+   "rx_bytes",
+   "tx_datagrams",
+   "tx_bytes",
+   "tx_errors",
+   "parse_errors",
+   "transactions_created",
+   "transactions_killed",
+   "dialogs_active",
+   "INVITE",
+   "ACK",
+   "BYE",
+   "CANCEL",
+   "REGISTER",
+   "OPTIONS",
+   "INFO",
+   "PRACK",
+   "UPDATE",
+   "SUBSCRIBE",
+   "NOTIFY",
+   "REFER",
+   "MESSAGE",
+   "PUBLISH",
+   "OTHER"
+};
+
+int64_t *es_stats_local_init(void)
+{
+   struct _es_stats_shard_s *shard = NULL;
+
+   if (posix_memalign((void **)&shard, ES_STATS_CACHE_LINE, sizeof(struct _es_stats_shard_s)) != 0) {
+      /* Nowhere to count: abort rather than lose the thread counters silently */
+      ES_EMERG("Can not allocate statistics");
+      abort();
+   }
+
+   memset(shard, 0, sizeof(struct _es_stats_shard_s));
+
+   /* Shards are never released, the counts of an exited thread stay */
+   pthread_mutex_lock(&_es_stats_lock);
+   shard->next = _es_stats_shards;
+   __atomic_store_n(&_es_stats_shards, shard, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&_es_stats_lock);
+
+   es_stats_local = shard->values;
+   return es_stats_local;
+}
+
+es_stats_id_t es_stats_method_id(const char *method)
+{
+   es_stats_id_t id = ES_STATS_REQ_INVITE;
+
+   if (method == NULL) {
+      return ES_STATS_REQ_OTHER;
+   }
+
+   for (id = ES_STATS_REQ_INVITE; id < ES_STATS_REQ_OTHER; ++id) {
+      if (strcasecmp(method, _es_stats_names[id]) == 0) {
+         return id;
+      }
+   }
+
+   return ES_STATS_REQ_OTHER;
+}
+
+es_stats_id_t es_stats_response_id(int code)
+{
+   if ((code < ES_STATS_RESP_CODE_MIN) || (code > ES_STATS_RESP_CODE_MAX)) {
+      return ES_STATS_MAX;
+   }
+
+   return (es_stats_id_t)(ES_STATS_RESP_FIRST + (code - ES_STATS_RESP_CODE_MIN));
+}
+
+const char *es_stats_name(es_stats_id_t id)
+{
+   if (id < ES_STATS_RESP_FIRST) {
+      return _es_stats_names[id];
+   }
+
+   return (id <= ES_STATS_RESP_LAST) ? "response" : "unknown";
+}
+
+void es_stats_snapshot(int64_t *values)
+{
+   struct _es_stats_shard_s *shard = __atomic_load_n(&_es_stats_shards, __ATOMIC_ACQUIRE);
+   unsigned int i = 0;
+
+   memset(values, 0, ES_STATS_MAX * sizeof(int64_t));
+
+   for (; shard != NULL; shard = shard->next) {
+      for (i = 0; i < ES_STATS_MAX; ++i) {
+         values[i] += __atomic_load_n(&shard->values[i], __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static int _es_stats_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   int64_t *values = (int64_t *) malloc(ES_STATS_MAX * sizeof(int64_t));
+   unsigned int i = 0;
+
+   if (values == NULL) {
+      es_cli_print(pCli, "No more memory");
+      return CLI_ERROR;
+   }
+
+   es_stats_snapshot(values);
+
+   es_cli_print(pCli, "Transport:");
+   for (i = ES_STATS_RX_DATAGRAMS; i <= ES_STATS_PARSE_ERRORS; ++i) {
+      es_cli_print(pCli, "  %-22s %lld", _es_stats_names[i], (long long)values[i]);
+   }
+
+   es_cli_print(pCli, "Stack:");
+   for (i = ES_STATS_TR_CREATED; i <= ES_STATS_DIALOGS; ++i) {
+      es_cli_print(pCli, "  %-22s %lld", _es_stats_names[i], (long long)values[i]);
+   }
+
+   es_cli_print(pCli, "Requests:");
+   for (i = ES_STATS_REQ_INVITE; i <= ES_STATS_REQ_OTHER; ++i) {
+      if (values[i] != 0) {
+         es_cli_print(pCli, "  %-22s %lld", _es_stats_names[i], (long long)values[i]);
+      }
+   }
+
+   es_cli_print(pCli, "Responses:");
+   for (i = ES_STATS_RESP_FIRST; i <= ES_STATS_RESP_LAST; ++i) {
+      if (values[i] != 0) {
+         es_cli_print(pCli, "  %-22d %lld", ES_STATS_RESP_CODE_MIN + (int)(i - ES_STATS_RESP_FIRST), (long long)values[i]);
+      }
+   }
+
+   free(values);
+   return CLI_OK;
+}
+
+es_status es_stats_cli_register(es_cli_t *pCli)
+{
+   return es_cli_register_cmd(pCli, "show stats", "Show traffic and stack counters", _es_stats_cli_show, NULL);
+}
@@ -0,0 +1,277 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "essys.h"
+
+/** Hugepage size assumed for MAP_HUGETLB */
+#define ES_SYS_HUGEPAGE_SIZE     (2UL * 1024UL * 1024UL)
+
+/** mbind() policy, not in the libc headers */
+#define ES_SYS_MPOL_PREFERRED    1
+
+/**
+ * @brief A pinned thread or a watched socket
+ */
+struct _es_sys_entry_s {
+   char                    name[16];
+   int                     value;      /* CPU of a thread, fd of a socket */
+   int                     ready;      /* Filled, threads record themselves */
+};
+
+static struct _es_sys_entry_s _es_sys_threads[ES_SYS_MAX_ENTRIES];
+static struct _es_sys_entry_s _es_sys_sockets[ES_SYS_MAX_ENTRIES];
+static unsigned int _es_sys_threads_nb = 0;
+static unsigned int _es_sys_sockets_nb = 0;
+
+/* Written at start, before the CLI thread runs */
+static int _es_sys_locked = 0;
+
+static void _es_sys_record(struct _es_sys_entry_s *entries, unsigned int *nb, const char *name, int value)
+{
+   unsigned int i = __atomic_fetch_add(nb, 1, __ATOMIC_RELAXED);
+
+   if (i >= ES_SYS_MAX_ENTRIES) {
+      return;
+   }
+
+   snprintf(entries[i].name, sizeof(entries[i].name), "%s", name);
+   entries[i].value = value;
+   __atomic_store_n(&entries[i].ready, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int _es_sys_count(unsigned int *nb)
+{
+   unsigned int n = __atomic_load_n(nb, __ATOMIC_RELAXED);
+   return (n < ES_SYS_MAX_ENTRIES) ? n : ES_SYS_MAX_ENTRIES;
+}
+
+es_status es_sys_pin_thread(const char *name, int cpu)
+{
+   cpu_set_t set;
+   int err = 0;
+
+   if (cpu < 0) {
+      _es_sys_record(_es_sys_threads, &_es_sys_threads_nb, name, -1);
+      return ES_OK;
+   }
+
+   if (cpu >= CPU_SETSIZE) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   CPU_ZERO(&set);
+   CPU_SET(cpu, &set);
+
+   err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+   if (err != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not pin %s thread to CPU %d: %s", name, cpu, strerror(err));
+      return ES_ERROR_BADPARAM;
+   }
+
+   _es_sys_record(_es_sys_threads, &_es_sys_threads_nb, name, cpu);
+   ESIP_TRACE(ESIP_LOG_INFO, "%s thread pinned to CPU %d", name, cpu);
+
+   return ES_OK;
+}
+
+int es_sys_cpu_node(int cpu)
+{
+   char path[64];
+   struct dirent *entry = NULL;
+   DIR *dir = NULL;
+   int node = -1;
+
+   if (cpu < 0) {
+      return -1;
+   }
+
+   /* The CPU directory holds a nodeN link to its node */
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+   dir = opendir(path);
+   if (dir == NULL) {
+      return -1;
+   }
+
+   while ((entry = readdir(dir)) != NULL) {
+      if ((strncmp(entry->d_name, "node", 4) == 0) && (entry->d_name[4] >= '0') && (entry->d_name[4] <= '9')) {
+         node = atoi(entry->d_name + 4);
+         break;
+      }
+   }
+
+   closedir(dir);
+   return node;
+}
+
+es_status es_sys_lock_memory(void)
+{
+   if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not lock memory: %s", strerror(errno));
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _es_sys_locked = 1;
+   ESIP_TRACE(ESIP_LOG_INFO, "Memory locked");
+
+   return ES_OK;
+}
+
+void *es_sys_map(size_t size, int huge, int node, size_t *pSize)
+{
+   long pageSize = sysconf(_SC_PAGESIZE);
+   size_t mapped = 0;
+   void *ptr = MAP_FAILED;
+   size_t off = 0;
+
+   if ((size == 0) || (pSize == NULL)) {
+      return NULL;
+   }
+
+#ifdef MAP_HUGETLB
+   if (huge) {
+      mapped = (size + ES_SYS_HUGEPAGE_SIZE - 1) & ~(ES_SYS_HUGEPAGE_SIZE - 1);
+      ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "No hugepage for %lu bytes (%s), normal pages used",
+                    (unsigned long)mapped, strerror(errno));
+      }
+   }
+#endif
+
+   if (ptr == MAP_FAILED) {
+      mapped = (size + (size_t)pageSize - 1) & ~((size_t)pageSize - 1);
+      ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not map %lu bytes: %s", (unsigned long)mapped, strerror(errno));
+         return NULL;
+      }
+#ifdef MADV_HUGEPAGE
+      if (huge) {
+         (void)madvise(ptr, mapped, MADV_HUGEPAGE);
+      }
+#endif
+   }
+
+#ifdef SYS_mbind
+   /* Before the first touch, so the pages come from the node */
+   if ((node >= 0) && (node < (int)(sizeof(unsigned long) * 8))) {
+      unsigned long mask = 1UL << node;
+      if (syscall(SYS_mbind, ptr, mapped, ES_SYS_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Can not place memory on node %d: %s", node, strerror(errno));
+      }
+   }
+#endif
+
+   /* Prefault: no page fault once running */
+   for (off = 0; off < mapped; off += (size_t)pageSize) {
+      ((volatile char *)ptr)[off] = 0;
+   }
+
+   *pSize = mapped;
+   return ptr;
+}
+
+void es_sys_unmap(void *ptr, size_t size)
+{
+   if (ptr != NULL) {
+      munmap(ptr, size);
+   }
+}
+
+es_status es_sys_set_incoming_cpu(int fd, int cpu)
+{
+#ifdef SO_INCOMING_CPU
+   if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set socket CPU to %d: %s", cpu, strerror(errno));
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+   return ES_OK;
+#else
+   return ES_ERROR_NOTSUPPORTED;
+#endif
+}
+
+es_status es_sys_watch_socket(const char *name, int fd)
+{
+   _es_sys_record(_es_sys_sockets, &_es_sys_sockets_nb, name, fd);
+   return ES_OK;
+}
+
+static int _es_sys_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   unsigned int i = 0;
+
+   es_cli_print(pCli, "%-12s %6s %6s", "thread", "cpu", "node");
+   for (i = 0; i < _es_sys_count(&_es_sys_threads_nb); ++i) {
+      int cpu = -1;
+      if (!__atomic_load_n(&_es_sys_threads[i].ready, __ATOMIC_ACQUIRE)) {
+         continue;
+      }
+      cpu = _es_sys_threads[i].value;
+      if (cpu < 0) {
+         es_cli_print(pCli, "%-12s %6s %6s", _es_sys_threads[i].name, "any", "-");
+      } else {
+         es_cli_print(pCli, "%-12s %6d %6d", _es_sys_threads[i].name, cpu, es_sys_cpu_node(cpu));
+      }
+   }
+
+   /* The CPU that handled the last packet, where the RX queue IRQ runs */
+   for (i = 0; i < _es_sys_count(&_es_sys_sockets_nb); ++i) {
+      int cpu = -1;
+      if (!__atomic_load_n(&_es_sys_sockets[i].ready, __ATOMIC_ACQUIRE)) {
+         continue;
+      }
+#ifdef SO_INCOMING_CPU
+      socklen_t len = sizeof(cpu);
+      if (getsockopt(_es_sys_sockets[i].value, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0) {
+         cpu = -1;
+      }
+#endif
+      es_cli_print(pCli, "%-12s packets from CPU %d", _es_sys_sockets[i].name, cpu);
+   }
+
+   es_cli_print(pCli, "Memory %slocked", _es_sys_locked ? "" : "not ");
+
+   return CLI_OK;
+}
+
+es_status es_sys_cli_register(es_cli_t *pCli)
+{
+   return es_cli_register_cmd(pCli, "show system", "Show thread placement and memory locking", _es_sys_cli_show, NULL);
+}
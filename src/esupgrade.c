@@ -0,0 +1,661 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "esupgrade.h"
+
+#define ES_UPGRADE_MAGIC         0x20141101
+
+/** Protocol version, both sides must agree */
+#define ES_UPGRADE_VERSION       1
+
+/** Blocking steps of the handoff give up after it */
+#define ES_UPGRADE_TIMEOUT_SEC   5
+
+/** Larger states are refused */
+#define ES_UPGRADE_MAX_STATE     (256U * 1024U * 1024U)
+
+/** Record header: type (2) and length (4) */
+#define ES_UPGRADE_TLV_HDR       6
+
+#define ES_UPGRADE_READY         'R'
+#define ES_UPGRADE_DONE          'D'
+
+/**
+ * Low priority: a handoff starts when no SIP event is waiting
+ */
+#define ES_UPGRADE_PRIORITY      1
+
+struct es_upgrade_s {
+   /* Magic */
+   uint32_t                     magic;
+   /* Listening Unix socket */
+   int                          listenFd;
+   /* New process connections */
+   struct event                 *ev;
+   /* Handoff steps */
+   struct es_upgrade_handler_s  handler;
+   /* The path belongs to the new process */
+   int                          handedOver;
+   /* Unix socket path */
+   char                         path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+};
+
+/**
+ * @brief First message, with the sockets
+ */
+struct _es_upgrade_hello_s {
+   uint32_t                     magic;
+   uint32_t                     version;
+   uint32_t                     nb;
+   uint32_t                     ids[ES_UPGRADE_MAX_FDS];
+};
+
+static void _es_upgrade_accept_cb(evutil_socket_t fd, short event, void *arg);
+
+/*******************************************************************************
+                              State buffer
+ ******************************************************************************/
+
+es_status es_upgrade_buf_put(struct es_upgrade_buf_s *buf, uint16_t type, const void *value, size_t len)
+{
+   uint16_t t = htons(type);
+   uint32_t l = htonl((uint32_t)len);
+
+   if ((buf == NULL) || ((value == NULL) && (len != 0))) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (len > ES_UPGRADE_MAX_STATE) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   if (buf->len + ES_UPGRADE_TLV_HDR + len > buf->size) {
+      size_t size = (buf->size != 0) ? buf->size : 4096;
+      uint8_t *data = NULL;
+
+      while (buf->len + ES_UPGRADE_TLV_HDR + len > size) {
+         size *= 2;
+      }
+
+      data = (uint8_t *) realloc(buf->data, size);
+      if (data == NULL) {
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+
+      buf->data = data;
+      buf->size = size;
+   }
+
+   memcpy(buf->data + buf->len, &t, sizeof(t));
+   memcpy(buf->data + buf->len + sizeof(t), &l, sizeof(l));
+   if (len != 0) {
+      memcpy(buf->data + buf->len + ES_UPGRADE_TLV_HDR, value, len);
+   }
+   buf->len += ES_UPGRADE_TLV_HDR + len;
+
+   return ES_OK;
+}
+
+es_status es_upgrade_buf_put_str(struct es_upgrade_buf_s *buf, uint16_t type, const char *value)
+{
+   if (value == NULL) {
+      return ES_OK;
+   }
+
+   return es_upgrade_buf_put(buf, type, value, strlen(value) + 1);
+}
+
+es_status es_upgrade_buf_put_u32(struct es_upgrade_buf_s *buf, uint16_t type, uint32_t value)
+{
+   uint32_t v = htonl(value);
+   return es_upgrade_buf_put(buf, type, &v, sizeof(v));
+}
+
+void es_upgrade_buf_free(struct es_upgrade_buf_s *buf)
+{
+   if (buf == NULL) {
+      return;
+   }
+
+   free(buf->data);
+   memset(buf, 0, sizeof(struct es_upgrade_buf_s));
+}
+
+int es_upgrade_tlv_next(const uint8_t *data, size_t len, size_t *offset, struct es_upgrade_tlv_s *tlv)
+{
+   uint16_t t = 0;
+   uint32_t l = 0;
+
+   if (*offset >= len) {
+      return 0;
+   }
+
+   if (len - *offset < ES_UPGRADE_TLV_HDR) {
+      return -1;
+   }
+
+   memcpy(&t, data + *offset, sizeof(t));
+   memcpy(&l, data + *offset + sizeof(t), sizeof(l));
+   l = ntohl(l);
+
+   if (l > len - *offset - ES_UPGRADE_TLV_HDR) {
+      return -1;
+   }
+
+   tlv->type = ntohs(t);
+   tlv->len = l;
+   tlv->value = data + *offset + ES_UPGRADE_TLV_HDR;
+   *offset += ES_UPGRADE_TLV_HDR + l;
+
+   return 1;
+}
+
+const char *es_upgrade_tlv_str(const struct es_upgrade_tlv_s *tlv)
+{
+   if ((tlv->len == 0) || (tlv->value[tlv->len - 1] != '\0')) {
+      return NULL;
+   }
+
+   return (const char *)tlv->value;
+}
+
+uint32_t es_upgrade_tlv_u32(const struct es_upgrade_tlv_s *tlv)
+{
+   uint32_t v = 0;
+
+   if (tlv->len != sizeof(v)) {
+      return 0;
+   }
+
+   memcpy(&v, tlv->value, sizeof(v));
+   return ntohl(v);
+}
+
+/*******************************************************************************
+                              Connection
+ ******************************************************************************/
+
+static void _es_upgrade_set_timeout(int fd)
+{
+   struct timeval tv = { ES_UPGRADE_TIMEOUT_SEC, 0 };
+
+   (void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   (void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static es_status _es_upgrade_write(int fd, const void *data, size_t len)
+{
+   const uint8_t *p = (const uint8_t *)data;
+
+   while (len > 0) {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return ES_ERROR_NETWORK_PROBLEM;
+      }
+      p += n;
+      len -= (size_t)n;
+   }
+
+   return ES_OK;
+}
+
+static es_status _es_upgrade_read(int fd, void *data, size_t len)
+{
+   uint8_t *p = (uint8_t *)data;
+
+   while (len > 0) {
+      ssize_t n = recv(fd, p, len, 0);
+      if (n < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return ES_ERROR_NETWORK_PROBLEM;
+      }
+      if (n == 0) {
+         return ES_ERROR_NETWORK_PROBLEM;
+      }
+      p += n;
+      len -= (size_t)n;
+   }
+
+   return ES_OK;
+}
+
+static es_status _es_upgrade_send_fds(int conn, const struct es_upgrade_fd_s *fds, unsigned int nb)
+{
+   struct _es_upgrade_hello_s hello;
+   union {
+      struct cmsghdr            hdr;
+      char                      buf[CMSG_SPACE(sizeof(int) * ES_UPGRADE_MAX_FDS)];
+   } ctrl;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg = NULL;
+   unsigned int i = 0;
+
+   memset(&hello, 0, sizeof(hello));
+   memset(&ctrl, 0, sizeof(ctrl));
+   memset(&msg, 0, sizeof(msg));
+
+   hello.magic = htonl(ES_UPGRADE_MAGIC);
+   hello.version = htonl(ES_UPGRADE_VERSION);
+   hello.nb = htonl(nb);
+   for (i = 0; i < nb; ++i) {
+      hello.ids[i] = htonl(fds[i].id);
+   }
+
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl.buf;
+   msg.msg_controllen = CMSG_SPACE(sizeof(int) * nb);
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nb);
+   for (i = 0; i < nb; ++i) {
+      memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &fds[i].fd, sizeof(int));
+   }
+
+   if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   return ES_OK;
+}
+
+/**
+ * @brief Hand over to a new process, on the loop of the old one
+ * The steps block, bounded by ES_UPGRADE_TIMEOUT_SEC: until the state is
+ * sent nothing is read anyway.
+ */
+static es_status _es_upgrade_handoff(struct es_upgrade_s *pCtx, int conn)
+{
+   struct es_upgrade_fd_s fds[ES_UPGRADE_MAX_FDS];
+   struct es_upgrade_buf_s state;
+   unsigned int nb = 0;
+   uint32_t len = 0;
+   char reply = 0;
+
+   memset(fds, 0, sizeof(fds));
+   memset(&state, 0, sizeof(state));
+
+   if ((pCtx->handler.give(pCtx->handler.arg, fds, &nb) != ES_OK) || (nb >= ES_UPGRADE_MAX_FDS)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "No socket to hand over");
+      return ES_ERROR_UNKNOWN;
+   }
+
+   fds[nb].id = ES_UPGRADE_FD_SELF;
+   fds[nb].fd = pCtx->listenFd;
+   nb++;
+
+   if (_es_upgrade_send_fds(conn, fds, nb) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not send the sockets: %s", strerror(errno));
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   if ((_es_upgrade_read(conn, &reply, 1) != ES_OK) || (reply != ES_UPGRADE_READY)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "New process not ready");
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   /* From now on the datagrams wait in the kernel for the new process */
+   pCtx->handler.pause(pCtx->handler.arg);
+
+   if (pCtx->handler.save(pCtx->handler.arg, &state) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not save the state");
+      es_upgrade_buf_free(&state);
+      pCtx->handler.resume(pCtx->handler.arg);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   len = htonl((uint32_t)state.len);
+   if ((_es_upgrade_write(conn, &len, sizeof(len)) != ES_OK) ||
+       (_es_upgrade_write(conn, state.data, state.len) != ES_OK) ||
+       (_es_upgrade_read(conn, &reply, 1) != ES_OK) ||
+       (reply != ES_UPGRADE_DONE)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "State not taken by the new process");
+      es_upgrade_buf_free(&state);
+      pCtx->handler.resume(pCtx->handler.arg);
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   ESIP_TRACE(ESIP_LOG_NOTICE, "Handed over to the new process [State:%u bytes]", (unsigned int)state.len);
+   es_upgrade_buf_free(&state);
+
+   return ES_OK;
+}
+
+static void _es_upgrade_accept_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_upgrade_s *_pCtx = (struct es_upgrade_s *)arg;
+   int conn = -1;
+
+   if ((_pCtx == (struct es_upgrade_s *)0) || (_pCtx->magic != ES_UPGRADE_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade Ctx not valid");
+      return;
+   }
+
+   conn = accept(fd, NULL, NULL);
+   if (conn < 0) {
+      return;
+   }
+
+   ESIP_TRACE(ESIP_LOG_NOTICE, "New process taking over");
+
+   /* accept() does not pass O_NONBLOCK on Linux, the steps block */
+   _es_upgrade_set_timeout(conn);
+
+   if (_es_upgrade_handoff(_pCtx, conn) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Upgrade aborted, still running");
+      close(conn);
+      return;
+   }
+
+   close(conn);
+
+   /* The listening socket is the new process one now */
+   _pCtx->handedOver = 1;
+   event_del(_pCtx->ev);
+
+   _pCtx->handler.done(_pCtx->handler.arg);
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_upgrade_init(es_upgrade_t **ppCtx, struct event_base *pBase, const char *path, int listenFd,
+                          const struct es_upgrade_handler_s *pHandler)
+{
+   struct es_upgrade_s *_pCtx = NULL;
+
+   if ((pBase == NULL) || (path == NULL) || (pHandler == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade parameters not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((pHandler->give == NULL) || (pHandler->pause == NULL) || (pHandler->save == NULL) ||
+       (pHandler->resume == NULL) || (pHandler->done == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade handler not complete");
+      return ES_ERROR_BADPARAM;
+   }
+
+   _pCtx = (struct es_upgrade_s *) malloc(sizeof(struct es_upgrade_s));
+   if (_pCtx == (struct es_upgrade_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize upgrade: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_upgrade_s));
+
+   _pCtx->magic = ES_UPGRADE_MAGIC;
+   _pCtx->handler = *pHandler;
+   _pCtx->listenFd = listenFd;
+
+   if (strlen(path) >= sizeof(_pCtx->path)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade socket path too long: %s", path);
+      free(_pCtx);
+      return ES_ERROR_OUTOFRANGE;
+   }
+   strcpy(_pCtx->path, path);
+
+   if (_pCtx->listenFd < 0) {
+      struct sockaddr_un addr;
+
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strcpy(addr.sun_path, path);
+
+      _pCtx->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (_pCtx->listenFd < 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not create upgrade socket");
+         free(_pCtx);
+         return ES_ERROR_NETWORK_PROBLEM;
+      }
+
+      /* Left by a process that did not exit cleanly */
+      (void)unlink(path);
+
+      if ((bind(_pCtx->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) ||
+          (listen(_pCtx->listenFd, 1) != 0)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not listen on %s: %s", path, strerror(errno));
+         close(_pCtx->listenFd);
+         free(_pCtx);
+         return ES_ERROR_NETWORK_PROBLEM;
+      }
+   }
+
+   evutil_make_socket_nonblocking(_pCtx->listenFd);
+
+   _pCtx->ev = event_new(pBase, _pCtx->listenFd, EV_READ | EV_PERSIST, _es_upgrade_accept_cb, _pCtx);
+   if (_pCtx->ev == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create upgrade event");
+      es_upgrade_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   if (event_priority_set(_pCtx->ev, ES_UPGRADE_PRIORITY) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set upgrade event priority");
+   }
+
+   if (event_add(_pCtx->ev, NULL) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not make upgrade event pending");
+      es_upgrade_deinit(_pCtx);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Upgrades accepted on %s", path);
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_upgrade_deinit(es_upgrade_t *pCtx)
+{
+   struct es_upgrade_s *_pCtx = (struct es_upgrade_s *)pCtx;
+
+   if (_pCtx == (struct es_upgrade_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_UPGRADE_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Upgrade Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->ev != NULL) {
+      event_free(_pCtx->ev);
+   }
+
+   if (_pCtx->listenFd >= 0) {
+      close(_pCtx->listenFd);
+   }
+
+   if (!_pCtx->handedOver) {
+      (void)unlink(_pCtx->path);
+   }
+
+   _pCtx->magic = 0;
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_upgrade_connect(const char *path, int *pConn, struct es_upgrade_fd_s *fds, unsigned int *pNb)
+{
+   struct _es_upgrade_hello_s hello;
+   union {
+      struct cmsghdr            hdr;
+      char                      buf[CMSG_SPACE(sizeof(int) * ES_UPGRADE_MAX_FDS)];
+   } ctrl;
+   struct sockaddr_un addr;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg = NULL;
+   unsigned int nb = 0;
+   unsigned int i = 0;
+   int conn = -1;
+
+   if ((path == NULL) || (pConn == NULL) || (fds == NULL) || (pNb == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   conn = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (conn < 0) {
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   _es_upgrade_set_timeout(conn);
+
+   if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "No process to take over on %s: %s", path, strerror(errno));
+      close(conn);
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   memset(&hello, 0, sizeof(hello));
+   memset(&ctrl, 0, sizeof(ctrl));
+   memset(&msg, 0, sizeof(msg));
+
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = ctrl.buf;
+   msg.msg_controllen = sizeof(ctrl.buf);
+
+   if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL) != (ssize_t)sizeof(hello)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "No socket received");
+      close(conn);
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+      nb = (unsigned int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      for (i = 0; (i < nb) && (i < ES_UPGRADE_MAX_FDS); ++i) {
+         memcpy(&fds[i].fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      }
+   }
+
+   if ((ntohl(hello.magic) != ES_UPGRADE_MAGIC) || (ntohl(hello.version) != ES_UPGRADE_VERSION) ||
+       (ntohl(hello.nb) != nb) || (nb == 0) || (nb > ES_UPGRADE_MAX_FDS) ||
+       ((msg.msg_flags & MSG_CTRUNC) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Running process not compatible");
+      for (i = 0; (i < nb) && (i < ES_UPGRADE_MAX_FDS); ++i) {
+         close(fds[i].fd);
+      }
+      close(conn);
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   for (i = 0; i < nb; ++i) {
+      fds[i].id = ntohl(hello.ids[i]);
+   }
+
+   *pConn = conn;
+   *pNb = nb;
+
+   return ES_OK;
+}
+
+es_status es_upgrade_receive(int conn, struct es_upgrade_buf_s *state)
+{
+   char ready = ES_UPGRADE_READY;
+   uint32_t len = 0;
+
+   if (state == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   memset(state, 0, sizeof(struct es_upgrade_buf_s));
+
+   if ((_es_upgrade_write(conn, &ready, 1) != ES_OK) ||
+       (_es_upgrade_read(conn, &len, sizeof(len)) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "No state from the running process");
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   len = ntohl(len);
+   if (len > ES_UPGRADE_MAX_STATE) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "State too large [%u bytes]", len);
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   if (len == 0) {
+      return ES_OK;
+   }
+
+   state->data = (uint8_t *) malloc(len);
+   if (state->data == NULL) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+   state->size = len;
+
+   if (_es_upgrade_read(conn, state->data, len) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "State truncated");
+      es_upgrade_buf_free(state);
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+   state->len = len;
+
+   return ES_OK;
+}
+
+es_status es_upgrade_finish(int conn)
+{
+   char done = ES_UPGRADE_DONE;
+   es_status ret = _es_upgrade_write(conn, &done, 1);
+
+   close(conn);
+   return ret;
+}
@@ -0,0 +1,232 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "eswheel.h"
+
+#define ES_WHEEL_MAGIC        0x20141103
+
+#define ES_WHEEL_SIZE         (1U << ES_WHEEL_BITS)
+#define ES_WHEEL_MASK         (ES_WHEEL_SIZE - 1)
+
+/** Farthest expiry from now */
+#define ES_WHEEL_SPAN         ((1ULL << (ES_WHEEL_BITS * ES_WHEEL_LEVELS)) - 1)
+
+struct es_wheel_s {
+   uint32_t                   magic;
+   /* Next tick to run */
+   uint64_t                   now;
+   /* Pending timers */
+   unsigned int               count;
+   es_wheel_expire_cb         cb;
+   void                       *arg;
+   /* Slot heads, circular lists */
+   struct es_wheel_entry_s    slots[ES_WHEEL_LEVELS][ES_WHEEL_SIZE];
+};
+
+static void _es_wheel_unlink(struct es_wheel_entry_s *entry)
+{
+   entry->prev->next = entry->next;
+   entry->next->prev = entry->prev;
+   entry->next = NULL;
+   entry->prev = NULL;
+}
+
+static void _es_wheel_place(struct es_wheel_s *pCtx, struct es_wheel_entry_s *entry)
+{
+   struct es_wheel_entry_s *head = NULL;
+   unsigned int level = 0;
+   uint64_t delta = 0;
+
+   if (entry->expire < pCtx->now) {
+      entry->expire = pCtx->now;
+   } else if (entry->expire - pCtx->now > ES_WHEEL_SPAN) {
+      entry->expire = pCtx->now + ES_WHEEL_SPAN;
+   }
+
+   /* Lowest wheel whose round covers it */
+   delta = entry->expire - pCtx->now;
+   while ((level < ES_WHEEL_LEVELS - 1) && (delta >= (1ULL << (ES_WHEEL_BITS * (level + 1))))) {
+      level++;
+   }
+
+   head = &pCtx->slots[level][(entry->expire >> (ES_WHEEL_BITS * level)) & ES_WHEEL_MASK];
+
+   entry->next = head;
+   entry->prev = head->prev;
+   head->prev->next = entry;
+   head->prev = entry;
+}
+
+/* Detach a slot into head, which must be free */
+static int _es_wheel_take(struct es_wheel_entry_s *slot, struct es_wheel_entry_s *head)
+{
+   if (slot->next == slot) {
+      return 0;
+   }
+
+   head->next = slot->next;
+   head->prev = slot->prev;
+   head->next->prev = head;
+   head->prev->next = head;
+
+   slot->next = slot;
+   slot->prev = slot;
+   return 1;
+}
+
+es_status es_wheel_init(es_wheel_t **ppCtx, uint64_t now, es_wheel_expire_cb cb, void *arg)
+{
+   struct es_wheel_s *_pCtx = NULL;
+   unsigned int level = 0;
+   unsigned int i = 0;
+
+   if ((ppCtx == NULL) || (cb == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_wheel_s *) malloc(sizeof(struct es_wheel_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create timing wheel: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_wheel_s));
+
+   _pCtx->magic = ES_WHEEL_MAGIC;
+   _pCtx->now = now;
+   _pCtx->cb = cb;
+   _pCtx->arg = arg;
+
+   for (level = 0; level < ES_WHEEL_LEVELS; ++level) {
+      for (i = 0; i < ES_WHEEL_SIZE; ++i) {
+         _pCtx->slots[level][i].next = &_pCtx->slots[level][i];
+         _pCtx->slots[level][i].prev = &_pCtx->slots[level][i];
+      }
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_wheel_deinit(es_wheel_t *pCtx)
+{
+   struct es_wheel_s *_pCtx = (struct es_wheel_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_WHEEL_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   _pCtx->magic = 0;
+   free(_pCtx);
+   return ES_OK;
+}
+
+void es_wheel_add(es_wheel_t *pCtx, struct es_wheel_entry_s *entry, uint64_t expire)
+{
+   struct es_wheel_s *_pCtx = (struct es_wheel_s *)pCtx;
+
+   if (entry->next != NULL) {
+      _es_wheel_unlink(entry);
+   } else {
+      _pCtx->count++;
+   }
+
+   entry->expire = expire;
+   _es_wheel_place(_pCtx, entry);
+}
+
+void es_wheel_remove(es_wheel_t *pCtx, struct es_wheel_entry_s *entry)
+{
+   struct es_wheel_s *_pCtx = (struct es_wheel_s *)pCtx;
+
+   if (entry->next == NULL) {
+      return;
+   }
+
+   _es_wheel_unlink(entry);
+   _pCtx->count--;
+}
+
+unsigned int es_wheel_advance(es_wheel_t *pCtx, uint64_t now)
+{
+   struct es_wheel_s *_pCtx = (struct es_wheel_s *)pCtx;
+   struct es_wheel_entry_s head;
+   unsigned int fired = 0;
+
+   while (_pCtx->now <= now) {
+      uint64_t tick = _pCtx->now;
+      unsigned int level = 0;
+
+      /* Nothing to expire: jump */
+      if (_pCtx->count == 0) {
+         _pCtx->now = now + 1;
+         break;
+      }
+
+      /* A new round of a wheel starts: its slot goes down, the upper ones first */
+      for (level = ES_WHEEL_LEVELS - 1; level > 0; --level) {
+         if ((tick & ((1ULL << (ES_WHEEL_BITS * level)) - 1)) != 0) {
+            continue;
+         }
+
+         if (_es_wheel_take(&_pCtx->slots[level][(tick >> (ES_WHEEL_BITS * level)) & ES_WHEEL_MASK], &head)) {
+            while (head.next != &head) {
+               struct es_wheel_entry_s *entry = head.next;
+               _es_wheel_unlink(entry);
+               _es_wheel_place(_pCtx, entry);
+            }
+         }
+      }
+
+      /* Timers added by the callbacks go to the next tick */
+      _pCtx->now = tick + 1;
+
+      if (!_es_wheel_take(&_pCtx->slots[0][tick & ES_WHEEL_MASK], &head)) {
+         continue;
+      }
+
+      while (head.next != &head) {
+         struct es_wheel_entry_s *entry = head.next;
+         _es_wheel_unlink(entry);
+         _pCtx->count--;
+         fired++;
+         _pCtx->cb(entry, _pCtx->arg);
+      }
+   }
+
+   return fired;
+}
+
+unsigned int es_wheel_count(const es_wheel_t *pCtx)
+{
+   const struct es_wheel_s *_pCtx = (const struct es_wheel_s *)pCtx;
+   return (_pCtx != NULL) ? _pCtx->count : 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esmem.h"
+#include "eswork.h"
+
+#define ES_WORK_MAGIC            0x20141127
+
+/**
+ * @brief A job, in the submission ring then in the completion ring
+ */
+struct _es_work_job_s {
+   es_work_run_cb            run;
+   es_work_done_cb           done;
+   void                      *arg;
+   /* Submission time, es_hist_now() */
+   uint64_t                  ts;
+};
+
+/**
+ * @brief A ring, head and tail are free running
+ */
+struct _es_work_ring_s {
+   struct _es_work_job_s     *jobs;
+   uint32_t                  head;
+   uint32_t                  tail;
+};
+
+struct es_work_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct event_base         *base;
+   pthread_t                 threads[ES_WORK_MAX_THREADS];
+   unsigned int              nbThreads;
+   /* Submissions: loop to workers */
+   pthread_mutex_t           todoLock;
+   pthread_cond_t            todoCond;
+   struct _es_work_ring_s    todo;
+   int                       stopping;
+   /* Completions: workers to loop, eventfd written once until read */
+   pthread_mutex_t           doneLock;
+   struct _es_work_ring_s    done;
+   int                       signaled;
+   int                       efd;
+   struct event              *evDone;
+   /* Submitted and not completed (loop thread) */
+   unsigned int              inFlight;
+   /* Counters, read by the CLI */
+   unsigned int              maxInFlight;
+   uint64_t                  submitted;
+   uint64_t                  completed;
+   uint64_t                  refused;
+   uint64_t                  wakeups;
+};
+
+static inline struct _es_work_job_s *_es_work_slot(struct _es_work_ring_s *ring, uint32_t i)
+{
+   return &ring->jobs[i & (ES_WORK_DEPTH - 1)];
+}
+
+static void * _es_work_thread(void *arg)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)arg;
+   struct _es_work_job_s job;
+   int wake = 0;
+
+   for (;;) {
+      pthread_mutex_lock(&_pCtx->todoLock);
+      while ((_pCtx->todo.head == _pCtx->todo.tail) && !_pCtx->stopping) {
+         pthread_cond_wait(&_pCtx->todoCond, &_pCtx->todoLock);
+      }
+      /* Stopped once the jobs left are run */
+      if (_pCtx->todo.head == _pCtx->todo.tail) {
+         pthread_mutex_unlock(&_pCtx->todoLock);
+         break;
+      }
+      job = *_es_work_slot(&_pCtx->todo, _pCtx->todo.head++);
+      pthread_mutex_unlock(&_pCtx->todoLock);
+
+      job.run(job.arg);
+
+      /* In flight jobs never exceed the ring: no room to check */
+      pthread_mutex_lock(&_pCtx->doneLock);
+      *_es_work_slot(&_pCtx->done, _pCtx->done.tail++) = job;
+      wake = !_pCtx->signaled;
+      _pCtx->signaled = 1;
+      pthread_mutex_unlock(&_pCtx->doneLock);
+
+      if (wake) {
+         uint64_t one = 1;
+         if (write(_pCtx->efd, &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "Can not wake the loop up: %s", strerror(errno));
+         }
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * @brief Completions of the jobs done so far
+ * The slots read are only given back to the workers once read.
+ */
+static void _es_work_complete(struct es_work_s *pCtx)
+{
+   uint32_t head = 0;
+   uint32_t tail = 0;
+
+   pthread_mutex_lock(&pCtx->doneLock);
+   head = pCtx->done.head;
+   tail = pCtx->done.tail;
+   pCtx->signaled = 0;
+   pthread_mutex_unlock(&pCtx->doneLock);
+
+   for (; head != tail; ++head) {
+      struct _es_work_job_s *job = _es_work_slot(&pCtx->done, head);
+
+      /* A completion may submit again */
+      pCtx->inFlight--;
+      __atomic_add_fetch(&pCtx->completed, 1, __ATOMIC_RELAXED);
+      es_hist_record_since(ES_HIST_WORK, job->ts);
+      job->done(job->arg);
+   }
+
+   pthread_mutex_lock(&pCtx->doneLock);
+   pCtx->done.head = head;
+   pthread_mutex_unlock(&pCtx->doneLock);
+}
+
+static void _es_work_done_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)arg;
+   uint64_t value = 0;
+
+   if (read(fd, &value, sizeof(value)) < 0) {
+      return;
+   }
+
+   __atomic_add_fetch(&_pCtx->wakeups, 1, __ATOMIC_RELAXED);
+   _es_work_complete(_pCtx);
+}
+
+es_status es_work_init(es_work_t **ppCtx, struct event_base *base, unsigned int threads)
+{
+   struct es_work_s *_pCtx = NULL;
+   unsigned int i = 0;
+
+   if ((ppCtx == NULL) || (base == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((threads == 0) || (threads > ES_WORK_MAX_THREADS)) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   _pCtx = (struct es_work_s *) es_mem_calloc(ES_MEM_WORK, 1, sizeof(struct es_work_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create work pool: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_WORK_MAGIC;
+   _pCtx->base = base;
+   _pCtx->efd = -1;
+   pthread_mutex_init(&_pCtx->todoLock, NULL);
+   pthread_cond_init(&_pCtx->todoCond, NULL);
+   pthread_mutex_init(&_pCtx->doneLock, NULL);
+
+   _pCtx->todo.jobs = (struct _es_work_job_s *) es_mem_calloc(ES_MEM_WORK, ES_WORK_DEPTH, sizeof(struct _es_work_job_s));
+   _pCtx->done.jobs = (struct _es_work_job_s *) es_mem_calloc(ES_MEM_WORK, ES_WORK_DEPTH, sizeof(struct _es_work_job_s));
+   if ((_pCtx->todo.jobs == NULL) || (_pCtx->done.jobs == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create work rings: no more memory");
+      goto ERROR;
+   }
+
+   _pCtx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_pCtx->efd < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create work eventfd: %s", strerror(errno));
+      goto ERROR;
+   }
+
+   _pCtx->evDone = event_new(base, _pCtx->efd, EV_READ | EV_PERSIST, _es_work_done_cb, _pCtx);
+   if ((_pCtx->evDone == NULL) || (event_add(_pCtx->evDone, NULL) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not watch work completions");
+      goto ERROR;
+   }
+
+   for (i = 0; i < threads; ++i) {
+      if (pthread_create(&_pCtx->threads[i], NULL, _es_work_thread, _pCtx) != 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start worker %u", i);
+         goto ERROR;
+      }
+      _pCtx->nbThreads++;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Work pool of %u thread(s), %u jobs in flight", threads, ES_WORK_DEPTH);
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+
+ERROR:
+   es_work_deinit(_pCtx);
+   return ES_ERROR_OUTOFRESOURCES;
+}
+
+es_status es_work_deinit(es_work_t *pCtx)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)pCtx;
+   unsigned int i = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_WORK_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   pthread_mutex_lock(&_pCtx->todoLock);
+   _pCtx->stopping = 1;
+   pthread_cond_broadcast(&_pCtx->todoCond);
+   pthread_mutex_unlock(&_pCtx->todoLock);
+
+   for (i = 0; i < _pCtx->nbThreads; ++i) {
+      pthread_join(_pCtx->threads[i], NULL);
+   }
+
+   /* Their owners release what the jobs hold */
+   if (_pCtx->done.jobs != NULL) {
+      _es_work_complete(_pCtx);
+   }
+
+   if (_pCtx->evDone != NULL) {
+      event_free(_pCtx->evDone);
+   }
+   if (_pCtx->efd >= 0) {
+      close(_pCtx->efd);
+   }
+
+   pthread_mutex_destroy(&_pCtx->doneLock);
+   pthread_cond_destroy(&_pCtx->todoCond);
+   pthread_mutex_destroy(&_pCtx->todoLock);
+
+   es_mem_free(_pCtx->done.jobs);
+   es_mem_free(_pCtx->todo.jobs);
+
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_work_submit(es_work_t *pCtx, es_work_run_cb run, es_work_done_cb done, void *arg)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)pCtx;
+   struct _es_work_job_s *job = NULL;
+
+   if ((_pCtx == NULL) || (run == NULL) || (done == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->inFlight == ES_WORK_DEPTH) {
+      __atomic_add_fetch(&_pCtx->refused, 1, __ATOMIC_RELAXED);
+      return ES_ERROR_TRY_AGAIN;
+   }
+
+   pthread_mutex_lock(&_pCtx->todoLock);
+   job = _es_work_slot(&_pCtx->todo, _pCtx->todo.tail++);
+   job->run = run;
+   job->done = done;
+   job->arg = arg;
+   job->ts = es_hist_now();
+   pthread_cond_signal(&_pCtx->todoCond);
+   pthread_mutex_unlock(&_pCtx->todoLock);
+
+   _pCtx->inFlight++;
+   if (_pCtx->inFlight > _pCtx->maxInFlight) {
+      __atomic_store_n(&_pCtx->maxInFlight, _pCtx->inFlight, __ATOMIC_RELAXED);
+   }
+   __atomic_add_fetch(&_pCtx->submitted, 1, __ATOMIC_RELAXED);
+
+   return ES_OK;
+}
+
+static int _es_work_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)arg;
+   uint64_t submitted = __atomic_load_n(&_pCtx->submitted, __ATOMIC_RELAXED);
+   uint64_t completed = __atomic_load_n(&_pCtx->completed, __ATOMIC_RELAXED);
+
+   es_cli_print(pCli, "Threads %u, in flight %llu (most %u, ring of %u)", _pCtx->nbThreads,
+                (unsigned long long)(submitted - completed), __atomic_load_n(&_pCtx->maxInFlight, __ATOMIC_RELAXED),
+                ES_WORK_DEPTH);
+   es_cli_print(pCli, "%12s %12s %12s %12s", "submitted", "completed", "refused", "wakeups");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu", (unsigned long long)submitted, (unsigned long long)completed,
+                (unsigned long long)__atomic_load_n(&_pCtx->refused, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->wakeups, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_work_cli_register(es_work_t *pCtx, es_cli_t *pCli)
+{
+   struct es_work_s *_pCtx = (struct es_work_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_WORK_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show work", "Show the work offload pool", _es_work_cli_show, _pCtx);
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_ACL_H_
+#define _ESIP_ACL_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Allow and deny lists of source prefixes, checked before parsing
+ * Read from acl.file, "allow|deny address[/length]" per line, IPv4 or
+ * IPv6. The longest prefix matching a source decides; a /0 sets what
+ * the others get, allow if none. To only let some networks in:
+ *
+ *    allow 10.1.0.0/16
+ *    deny 0.0.0.0/0
+ *
+ * The lists are compiled into a trie of 8 bits per level, a lookup is
+ * at most 4 reads for IPv4. A reload builds a new trie and switches to
+ * it at once, the old one is kept if the file has an error.
+ */
+typedef struct es_acl_s es_acl_t;
+
+struct es_config_s;
+struct sockaddr;
+
+es_status es_acl_init(es_acl_t **ppCtx);
+
+/**
+ * @brief es_acl_deinit
+ */
+es_status es_acl_deinit(es_acl_t *pCtx);
+
+/**
+ * @brief Load acl.file again, at start and on reload, loop thread only
+ * An empty file name lets every source in.
+ */
+es_status es_acl_configure(es_acl_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief A source may send to us, loop thread only
+ * @return 1 if allowed, 0 if denied
+ */
+int es_acl_allow(es_acl_t *pCtx, const struct sockaddr *from);
+
+/**
+ * @brief es_acl_cli_register
+ * Register "show acl" command
+ */
+es_status es_acl_cli_register(es_acl_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_ACL_H_ */
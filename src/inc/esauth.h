@@ -0,0 +1,130 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_AUTH_H_
+#define _ESIP_AUTH_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Digest authentication of REGISTER and INVITE (RFC 2617, qop=auth)
+ * Nonces hold their time and a sequence, signed by an HMAC-MD5 with a key
+ * drawn at start: nothing is kept per challenge. The sequence indexes a
+ * ring of 32-bit words, one bit per nonce-count, so a response is
+ * accepted once. HA1 of the users file are computed at load, in a table
+ * hashed by user; the ones not in it are looked up in the subscribers
+ * database. Off while auth.realm is empty. Runs on the SIP thread.
+ */
+typedef struct es_auth_s es_auth_t;
+
+struct osip_message;
+struct es_config_s;
+struct es_db_s;
+struct es_auth_job_s;
+struct es_upgrade_buf_s;
+
+/**
+ * @brief es_auth_init
+ * Requests are not challenged until configured with a realm.
+ */
+es_status es_auth_init(es_auth_t **ppCtx);
+
+/**
+ * @brief es_auth_deinit
+ */
+es_status es_auth_deinit(es_auth_t *pCtx);
+
+/**
+ * @brief Apply the realm, methods and nonce lifetime, read the users again
+ * The previous settings stay if the new ones are not valid.
+ */
+es_status es_auth_configure(es_auth_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Subscribers database, after the users file, NULL for none
+ * Set before es_auth_configure(), which checks its realm.
+ */
+es_status es_auth_set_db(es_auth_t *pCtx, struct es_db_s *pDb);
+
+/**
+ * @brief Check the credentials of a request
+ * @param pCtx
+ * @param request
+ * @return SIP_OK if it goes on (authenticated, or not challenged), else
+ * the response to send: 401 to challenge, 403 for wrong credentials, 400
+ */
+int es_auth_verify(es_auth_t *pCtx, struct osip_message *request);
+
+/**
+ * @brief es_auth_verify() in three steps, the digests on another thread
+ * begin and end run on the SIP thread, run on any.
+ * @return SIP_OK and a job to run then end, SIP_OK without job if the
+ * request goes on, else the response to send
+ */
+int es_auth_verify_begin(es_auth_t *pCtx, struct osip_message *request, struct es_auth_job_s **ppJob);
+
+/**
+ * @brief Check the nonce and the response of a job, from any thread
+ * It only reads the context, the request may be gone.
+ */
+void es_auth_verify_run(es_auth_t *pCtx, struct es_auth_job_s *pJob);
+
+/**
+ * @brief Nonce lifetime and nonce-count of a job run, release it
+ * @return SIP_OK if the request goes on, else the response to send
+ */
+int es_auth_verify_end(es_auth_t *pCtx, struct es_auth_job_s *pJob);
+
+/**
+ * @brief Release a job not ended, its request dropped
+ */
+void es_auth_job_free(es_auth_t *pCtx, struct es_auth_job_s *pJob);
+
+/**
+ * @brief Add the challenge to a 401, stale if the nonce of the request
+ * was only too old or already used
+ */
+es_status es_auth_answer(es_auth_t *pCtx, struct osip_message *request, struct osip_message *response);
+
+/**
+ * @brief Add the nonce key and sequence to the state handed over on upgrade
+ * Not written to the persist files: a restart draws a new key.
+ */
+es_status es_auth_save(es_auth_t *pCtx, struct es_upgrade_buf_s *state);
+
+/**
+ * @brief Take the nonce key and sequence of the previous process, before
+ * any request. Its nonces stay valid but stale: their nonce-counts were
+ * not handed over, a response to one is challenged again with stale=TRUE.
+ */
+es_status es_auth_restore(es_auth_t *pCtx, const uint8_t *data, size_t len);
+
+/**
+ * @brief es_auth_cli_register
+ * Register "show auth" command
+ */
+es_status es_auth_cli_register(es_auth_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_AUTH_H_ */
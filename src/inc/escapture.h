@@ -0,0 +1,96 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ES_CAPTURE_H_
+#define _ES_CAPTURE_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** @brief SIP traffic capture context */
+typedef struct es_capture_s es_capture_t;
+
+struct sockaddr_in;
+
+/**
+ * @brief es_capture_init
+ * Nothing is captured nor mapped until enabled
+ * @param ppCtx
+ * @param dir Directory of the pcap files (NULL for default)
+ * @return ES_OK on success
+ */
+es_status es_capture_init(es_capture_t **ppCtx, const char *dir);
+
+/**
+ * @brief es_capture_deinit
+ * Stop the writer thread, flush the ring and release it
+ * @param pCtx
+ * @return ES_OK on success
+ */
+es_status es_capture_deinit(es_capture_t *pCtx);
+
+/**
+ * @brief es_capture_enable
+ * Switch capture on or off, the ring is mapped and the writer thread
+ * started on first use
+ * @param pCtx
+ * @param enable
+ * @return ES_OK on success
+ */
+es_status es_capture_enable(es_capture_t *pCtx, int enable);
+
+/**
+ * @brief es_capture_set_sampling
+ * Capture only 1 Call-ID out of rate (0 or 1 capture everything)
+ * @param pCtx
+ * @param rate
+ * @return ES_OK on success
+ */
+es_status es_capture_set_sampling(es_capture_t *pCtx, unsigned int rate);
+
+/**
+ * @brief Capture on: a datagram sent in pieces is worth joining
+ */
+int es_capture_enabled(const es_capture_t *pCtx);
+
+/**
+ * @brief es_capture_packet
+ * Copy a datagram into the ring, called from the event loop thread only:
+ * the ring has a single producer, es_transport_send, es_transport_sendv
+ * and the transport read callback, all of them on the SIP loop
+ * @param pCtx
+ * @param src Source address
+ * @param dst Destination address
+ * @param buf Datagram
+ * @param len Datagram length
+ */
+void es_capture_packet(es_capture_t *pCtx, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *buf, size_t len);
+
+/**
+ * @brief es_capture_cli_register
+ * Register capture commands
+ * @param pCtx
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_capture_cli_register(es_capture_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif /* __cplusplus */
+#endif /* _ES_CAPTURE_H_ */
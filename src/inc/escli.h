@@ -25,7 +25,44 @@ extern "C" {
 /** @brief */
 typedef struct es_cli_s es_cli_t;
 
-es_status es_cli_init(es_cli_t **ppCtx,struct event_base  *pBase);
+struct cli_def;
+
+/**
+ * @brief Command handler registered by other modules
+ * @param pCli libcli session running the command
+ * @param argv Arguments following the command words
+ * @param argc Number of arguments
+ * @param arg User reference given at registration
+ * @return CLI_OK on success
+ */
+typedef int (*es_cli_cmd_cb)(struct cli_def *pCli, char *argv[], int argc, void *arg);
+
+/**
+ * @brief Rest of a command run later, see es_cli_defer()
+ * @param pCli Session, NULL if it closed meanwhile: only release arg
+ * @param arg User reference given to es_cli_defer()
+ */
+typedef void (*es_cli_defer_cb)(struct cli_def *pCli, void *arg);
+
+/**
+ * @brief Create the CLI, with its own loop and listener
+ * Sessions are served by one thread started by es_cli_start(), never by
+ * the SIP loop.
+ * @param ppCtx
+ * @param port TCP port to listen on, 0 for the default one
+ * @param listenFd Socket already listening (handed over), -1 to bind port
+ */
+es_status es_cli_init(es_cli_t **ppCtx, unsigned int port, int listenFd);
+
+/**
+ * @brief CPU to pin the CLI thread to, -1 for any. Before es_cli_start().
+ */
+es_status es_cli_set_cpu(es_cli_t *pCtx, int cpu);
+
+/**
+ * @brief Listening socket, to hand over
+ */
+es_status es_cli_get_socket(es_cli_t *pCtx, int *fd);
 
 es_status es_cli_start(es_cli_t *pCtx);
 
@@ -33,6 +70,34 @@ es_status es_cli_stop(es_cli_t *pCtx);
 
 es_status es_cli_deinit(es_cli_t *pCtx);
 
+/**
+ * @brief Register a command, parent words are created when needed
+ * @param pCtx CLI context
+ * @param command Full command path (ex: "show capture")
+ * @param help Help string
+ * @param cb Handler
+ * @param arg User reference passed to the handler
+ * @return ES_OK on success
+ */
+es_status es_cli_register_cmd(es_cli_t *pCtx, const char *command, const char *help, es_cli_cmd_cb cb, void *arg);
+
+/**
+ * @brief Finish a command later without blocking the other sessions
+ * Called from a handler or a deferred callback; the session prompt and
+ * its next lines wait until a callback returns without deferring again.
+ * @param pCli Session running the command
+ * @param ms Delay before cb runs on the CLI thread
+ * @param cb Rest of the command
+ * @param arg User reference passed to cb
+ * @return ES_OK on success, else cb is never called
+ */
+es_status es_cli_defer(struct cli_def *pCli, unsigned int ms, es_cli_defer_cb cb, void *arg);
+
+/**
+ * @brief Print a formatted line on a CLI session
+ */
+void es_cli_print(struct cli_def *pCli, const char *format, ...);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
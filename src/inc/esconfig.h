@@ -0,0 +1,157 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_CONFIG_H_
+#define _ESIP_CONFIG_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Max length of a string value */
+#define ES_CONFIG_STR_LEN     64
+
+/**
+ * @brief What is done with the requests received
+ */
+typedef enum es_config_mode_e {
+   ES_CONFIG_MODE_UAS = 0,          //!< Answered
+   ES_CONFIG_MODE_STATELESS,        //!< Forwarded by a stateless proxy
+   ES_CONFIG_MODE_STATEFUL          //!< Forked on client transactions
+} es_config_mode_t;
+
+/**
+ * @brief Settings of esip
+ * Loaded from a "key = value" file, '#' starts a comment:
+ *
+ *    sip.address = 0.0.0.0      # restart
+ *    sip.port = 5060            # restart
+ *    sip.rcvbuf = 4194304       # bytes, 0 for the system default
+ *    sip.sndbuf = 0
+ *    sip.batch = 8              # datagrams read per socket wake up
+ *    rate.invite = 0            # datagrams per second from one address, 0 for no limit
+ *    rate.register = 0
+ *    rate.other = 0             # other requests
+ *    rate.response = 0
+ *    rate.burst = 2             # seconds of traffic above the rate let through
+ *    acl.file = /etc/esip/acl   # "allow|deny address[/length]" per line, empty for none
+ *    cli.port = 8008            # restart
+ *    cli.inject_dir = /var/lib/esip/inject  # files "sip inject" may read, empty to disable it
+ *    metrics.port = 0           # restart, 0 to disable
+ *    log.level = info           # emerg ... debug, or 0-7
+ *    response.invite = 200      # final response sent to each method
+ *    response.register = 200
+ *    response.bye = 200
+ *    response.scenarios = /etc/esip/scenarios  # scripted responses, empty for none
+ *    upgrade.socket = /tmp/esip-upgrade.sock   # restart, empty to disable
+ *    registrar.min_expires = 60        # shorter ones get 423 Interval Too Brief
+ *    registrar.max_expires = 3600      # longer ones are cut
+ *    registrar.default_expires = 3600  # without Expires
+ *    auth.realm = example.com   # Digest realm, empty to disable
+ *    auth.users = /etc/esip/users         # "user password" or "user md5:HA1" per line
+ *    auth.register = 1          # challenge REGISTER
+ *    auth.invite = 1            # challenge INVITE
+ *    auth.nonce_ttl = 300       # seconds before a nonce is stale
+ *    db.file = /var/lib/esip/users.db     # restart, built by esip-mkdb, empty for none
+ *    work.threads = 0           # restart, threads checking credentials, 0 on the loop
+ *    parse.threads = 0          # restart, threads parsing datagrams, 0 on the loop
+ *    persist.file = /var/lib/esip/state   # restart, empty to disable
+ *    proxy.mode = uas           # uas answers, stateless forwards, stateful forks
+ *    proxy.host = 192.0.2.10    # address put in Via, sip.address if empty
+ *    proxy.routes = /etc/esip/routes      # "prefix host[:port]" per line, * for default
+ *    persist.period = 60        # restart, seconds between snapshots
+ *    sys.cpu.sip = 2            # restart, CPU of the SIP thread, none to float
+ *    sys.cpu.cli = none         # restart
+ *    sys.incoming_cpu = 1       # restart, steer the SIP socket to its CPU
+ *    sys.mlock = 1              # restart, lock the memory
+ *    sys.pool = 64              # restart, MB of preallocated blocks, 0 for none
+ *    sys.hugepages = 1          # restart, back the pool with hugepages
+ *
+ * Keys marked restart are only read at start, the others are applied
+ * again on SIGHUP.
+ */
+struct es_config_s {
+   char                    sipAddress[ES_CONFIG_STR_LEN];
+   unsigned int            sipPort;
+   unsigned int            sipRcvBuf;
+   unsigned int            sipSndBuf;
+   unsigned int            sipBatch;
+   unsigned int            rateInvite;
+   unsigned int            rateRegister;
+   unsigned int            rateOther;
+   unsigned int            rateResponse;
+   unsigned int            rateBurst;
+   char                    aclFile[ES_CONFIG_STR_LEN];
+   unsigned int            cliPort;
+   char                    cliInjectDir[ES_CONFIG_STR_LEN];
+   unsigned int            metricsPort;
+   unsigned int            logLevel;
+   unsigned int            inviteCode;
+   unsigned int            registerCode;
+   unsigned int            byeCode;
+   char                    responseScenarios[ES_CONFIG_STR_LEN];
+   char                    upgradeSocket[ES_CONFIG_STR_LEN];
+   unsigned int            registrarMinExpires;
+   unsigned int            registrarMaxExpires;
+   unsigned int            registrarDefaultExpires;
+   char                    authRealm[ES_CONFIG_STR_LEN];
+   char                    authUsers[ES_CONFIG_STR_LEN];
+   unsigned int            authRegister;
+   unsigned int            authInvite;
+   unsigned int            authNonceTtl;
+   char                    dbFile[ES_CONFIG_STR_LEN];
+   unsigned int            workThreads;
+   unsigned int            parseThreads;
+   char                    persistFile[ES_CONFIG_STR_LEN];
+   unsigned int            persistPeriod;
+   unsigned int            proxyMode;
+   char                    proxyHost[ES_CONFIG_STR_LEN];
+   char                    proxyRoutes[ES_CONFIG_STR_LEN];
+   int                     sysCpuSip;
+   int                     sysCpuCli;
+   unsigned int            sysIncomingCpu;
+   unsigned int            sysMlock;
+   unsigned int            sysPool;
+   unsigned int            sysHugepages;
+};
+
+/**
+ * @brief Default settings, the ones of a build without file
+ */
+void es_config_defaults(struct es_config_s *cfg);
+
+/**
+ * @brief Load a file over the settings already in cfg
+ * Errors are logged with their line, cfg is left unchanged then.
+ * @param path File to read
+ * @param cfg Settings to update
+ * @return ES_OK on success
+ */
+es_status es_config_load(const char *path, struct es_config_s *cfg);
+
+/**
+ * @brief Log the keys that differ but can not change without a restart
+ * @return number of such keys
+ */
+unsigned int es_config_check_restart(const struct es_config_s *running, const struct es_config_s *cfg);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_CONFIG_H_ */
@@ -0,0 +1,147 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_DB_H_
+#define _ESIP_DB_H_
+
+#include "estypes.h"
+#include "eshash.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Subscribers database, built by esip-mkdb from a CSV file
+ * The file is mapped read only and shared: no load phase, its pages are
+ * the ones of the page cache. A user is found with a static perfect hash
+ * (hash and displace): the hash of the user gives a bucket, the
+ * displacement of the bucket gives the slot, one record of a cache line
+ * compared. esip-mkdb replaces the file by a rename, a mapping in use
+ * keeps the previous one.
+ *
+ * File, in host byte order:
+ *    struct es_db_header_s
+ *    uint32_t displacements[nbBuckets], padded to ES_DB_ALIGN
+ *    struct es_db_record_s slots[nbSlots], userLen 0 when free
+ */
+typedef struct es_db_s es_db_t;
+
+#define ES_DB_MAGIC_STR          "ESIPDB\n"
+#define ES_DB_VERSION            1
+#define ES_DB_ALIGN              64
+
+/** Longest user name of a record */
+#define ES_DB_USER_LEN           40
+#define ES_DB_REALM_LEN          64
+
+struct es_db_header_s {
+   char                      magic[8];
+   uint32_t                  version;
+   /* Start of the hashes, the one that gave no collision */
+   uint32_t                  seed;
+   uint32_t                  nbRecords;
+   uint32_t                  nbBuckets;
+   uint32_t                  nbSlots;
+   uint32_t                  recordSize;
+   /* Realm of the HA1, empty if not given */
+   char                      realm[ES_DB_REALM_LEN];
+   uint8_t                   reserved[32];
+};
+
+/**
+ * @brief A subscriber, one cache line
+ */
+struct es_db_record_s {
+   /* Not terminated when ES_DB_USER_LEN long */
+   char                      user[ES_DB_USER_LEN];
+   /* MD5(user:realm:password) */
+   uint8_t                   ha1[16];
+   /* Route of its calls, 0 if none; network byte order */
+   uint32_t                  routeAddr;
+   uint16_t                  routePort;
+   uint8_t                   userLen;
+   uint8_t                   flags;
+};
+
+/**
+ * @brief Hash of a user name
+ */
+static inline uint32_t es_db_hash(uint32_t seed, const char *user, size_t len)
+{
+   return es_hash_fnv1a_update(ES_HASH_FNV1A_INIT ^ seed, user, len);
+}
+
+/**
+ * @brief Slot of a hash in its bucket displacement (murmur3 finalizer)
+ */
+static inline uint32_t es_db_slot(uint32_t hash, uint32_t displacement, uint32_t nbSlots)
+{
+   uint32_t h = hash ^ displacement;
+
+   h ^= h >> 16;
+   h *= 0x85ebca6bU;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35U;
+   h ^= h >> 16;
+
+   return h % nbSlots;
+}
+
+/**
+ * @brief Offset of the displacements, then of the slots
+ */
+static inline size_t es_db_slots_offset(uint32_t nbBuckets)
+{
+   size_t off = sizeof(struct es_db_header_s) + (size_t)nbBuckets * sizeof(uint32_t);
+
+   return (off + ES_DB_ALIGN - 1) & ~(size_t)(ES_DB_ALIGN - 1);
+}
+
+/**
+ * @brief Map a database built by esip-mkdb
+ * @return ES_ERROR_NOT_FOUND without file, ES_ERROR_BADPARAM if it is not
+ * one of this version
+ */
+es_status es_db_open(es_db_t **ppCtx, const char *path);
+
+/**
+ * @brief es_db_close
+ */
+es_status es_db_close(es_db_t *pCtx);
+
+/**
+ * @brief Record of a user, NULL if none
+ */
+const struct es_db_record_s *es_db_lookup(es_db_t *pCtx, const char *user, size_t len);
+
+/**
+ * @brief Realm of the HA1, empty if not given to esip-mkdb
+ */
+const char *es_db_realm(const es_db_t *pCtx);
+
+/**
+ * @brief es_db_cli_register
+ * Register "show db" command
+ */
+es_status es_db_cli_register(es_db_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_DB_H_ */
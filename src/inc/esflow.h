@@ -0,0 +1,101 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_FLOW_H_
+#define _ESIP_FLOW_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Events kept per thread, the oldest are overwritten */
+#define ES_FLOW_EVENTS        8192
+
+/** Call-ID bytes kept in an event */
+#define ES_FLOW_CALLID_LEN    32
+
+/** Default dump file */
+#define ES_FLOW_DUMP_FILE     "/tmp/esip-flow.json"
+
+/**
+ * @brief Steps of a call recorded in a flow
+ */
+typedef enum es_flow_kind_e {
+   ES_FLOW_RECV = 0,       //!< Datagram handed to the stack (arg: length)
+   ES_FLOW_PARSE,          //!< osip_parse() (arg: length)
+   ES_FLOW_TR_CREATE,      //!< Server transaction created (arg: transaction id)
+   ES_FLOW_CALLBACK,       //!< oSIP message callback (arg: callback type)
+   ES_FLOW_SEND,           //!< Message serialized and sent (arg: length)
+   ES_FLOW_TR_KILL,        //!< Transaction terminated (arg: transaction id)
+
+   ES_FLOW_KIND_MAX
+} es_flow_kind_t;
+
+/** 1 Call-ID out of es_flow_sampling is traced, 0 to disable */
+extern unsigned int es_flow_sampling;
+
+/**
+ * @brief Hash of a Call-ID, the same as the one of the SIP capture
+ * @param number Call-ID number
+ * @param host Call-ID host (may be NULL)
+ */
+uint32_t es_flow_call_hash(const char *number, const char *host);
+
+/**
+ * @brief Is a call traced
+ * @param hash es_flow_call_hash() of the Call-ID
+ */
+static inline int es_flow_sampled(uint32_t hash)
+{
+   unsigned int n = __atomic_load_n(&es_flow_sampling, __ATOMIC_RELAXED);
+   return (n != 0) && ((hash % n) == 0);
+}
+
+/**
+ * @brief Record a step of a traced call, in the current thread buffer
+ * @param hash es_flow_call_hash() of the Call-ID
+ * @param callId Call-ID number, kept for the trace labels
+ * @param kind Step
+ * @param ts Start time (es_hist_now())
+ * @param dur Duration in ns, 0 for an instant
+ * @param arg Step dependant value
+ */
+void es_flow_record(uint32_t hash, const char *callId, es_flow_kind_t kind, uint64_t ts, uint64_t dur, int arg);
+
+/**
+ * @brief Write the recorded flows as Chrome trace JSON
+ * Open it in chrome://tracing or ui.perfetto.dev, one row per call.
+ * @param path Output file, created 0600, not followed if a link
+ * @param count Number of events written (may be NULL)
+ * @return ES_OK on success
+ */
+es_status es_flow_dump(const char *path, unsigned int *count);
+
+/**
+ * @brief es_flow_cli_register
+ * Register "flow sample", "flow dump" and "show flow" commands
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_flow_cli_register(es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_FLOW_H_ */
@@ -0,0 +1,116 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifndef _ESIP_FORK_H_
+#define _ESIP_FORK_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Stateful forking proxy
+ * A request received on a server transaction is sent on to each next hop
+ * of the proxy, each on its own client transaction (ICT/NICT). The
+ * provisional responses and every 2xx go back as they come, the best
+ * final response once all the branches ended (RFC 3261 16.7). The first
+ * 2xx to an INVITE, a CANCEL received or Timer C cancel the branches
+ * still ringing. Forks and branches are small records taken from pools
+ * that only grow, linked by index. Runs on the SIP thread.
+ */
+typedef struct es_fork_s es_fork_t;
+
+struct event_base;
+struct sockaddr_in;
+struct osip_transaction;
+struct osip_message;
+struct es_proxy_s;
+
+/**
+ * @brief What the stack does for the forks
+ */
+struct es_fork_stack_s {
+   /**
+    * Start a client transaction sending a request (given to it) to an
+    * address, its owner as reserved2. NULL on failure, request freed.
+    */
+   struct osip_transaction *(*send)(void *arg, struct osip_message *request, const struct sockaddr_in *to,
+                                    void *owner);
+   /**
+    * Send a response (given to it) on a server transaction, or to its top
+    * Via when NULL.
+    */
+   es_status (*post)(void *arg, struct osip_transaction *tr, struct osip_message *response);
+   void *arg;
+};
+
+/**
+ * @brief es_fork_init
+ * @param ppCtx
+ * @param pBase SIP loop, runs Timer C
+ * @param pStack Transactions of the stack
+ * @return ES_OK on success
+ */
+es_status es_fork_init(es_fork_t **ppCtx, struct event_base *pBase, const struct es_fork_stack_s *pStack);
+
+/**
+ * @brief es_fork_deinit
+ * Transactions are left to the stack.
+ */
+es_status es_fork_deinit(es_fork_t *pCtx);
+
+/**
+ * @brief Next hops and Via, forking while its mode is stateful, NULL for none
+ */
+es_status es_fork_set_proxy(es_fork_t *pCtx, struct es_proxy_s *pProxy);
+
+/**
+ * @brief Handle a message callback of the stack
+ * New requests are forked (REGISTER aside), a CANCEL ends its fork,
+ * responses of branches are gathered.
+ * @param pCtx
+ * @param type osip_message_callback_type_t
+ * @param tr
+ * @param msg
+ * @return ES_OK if handled, ES_ERROR_NOTSUPPORTED for the stack to do it
+ */
+es_status es_fork_handle(es_fork_t *pCtx, int type, struct osip_transaction *tr, struct osip_message *msg);
+
+/**
+ * @brief A transaction ends, its fork forgets it
+ */
+void es_fork_release(es_fork_t *pCtx, struct osip_transaction *tr);
+
+/**
+ * @brief The server transaction was forked, it is not a dialog of ours
+ */
+int es_fork_proxied(const es_fork_t *pCtx, const struct osip_transaction *tr);
+
+/**
+ * @brief es_fork_cli_register
+ * Register "show forks" command
+ */
+es_status es_fork_cli_register(es_fork_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_FORK_H_ */
@@ -0,0 +1,63 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_HASH_H_
+#define _ESIP_HASH_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define ES_HASH_FNV1A_INIT    0x811c9dc5U
+#define ES_HASH_FNV1A_PRIME   0x01000193U
+
+/**
+ * @brief Continue a FNV-1a 32 bits hash with a buffer
+ * @param h Hash so far (ES_HASH_FNV1A_INIT to start)
+ * @param buf Data to hash
+ * @param len Length of the data
+ * @return hash value
+ */
+static inline uint32_t es_hash_fnv1a_update(uint32_t h, const void *buf, size_t len)
+{
+   const unsigned char *p = (const unsigned char *)buf;
+
+   while (len-- > 0) {
+      h ^= *p++;
+      h *= ES_HASH_FNV1A_PRIME;
+   }
+
+   return h;
+}
+
+/**
+ * @brief FNV-1a 32 bits hash of a buffer
+ * @param buf Data to hash
+ * @param len Length of the data
+ * @return hash value
+ */
+static inline uint32_t es_hash_fnv1a(const void *buf, size_t len)
+{
+   return es_hash_fnv1a_update(ES_HASH_FNV1A_INIT, buf, len);
+}
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_HASH_H_ */
@@ -0,0 +1,176 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_HIST_H_
+#define _ESIP_HIST_H_
+
+#include <time.h>
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Sub-buckets per power of 2 (log2), bounds the relative error to 1/16 */
+#define ES_HIST_SUB_BITS      4
+#define ES_HIST_SUB_COUNT     (1 << ES_HIST_SUB_BITS)
+
+/** Highest power of 2 tracked, values above are clamped (~550s in ns) */
+#define ES_HIST_MAX_MSB       39
+
+/** Number of buckets of one histogram */
+#define ES_HIST_BUCKETS       ((ES_HIST_MAX_MSB - ES_HIST_SUB_BITS + 2) * ES_HIST_SUB_COUNT)
+
+/**
+ * @brief Latency histograms identifiers, values are in ns
+ */
+typedef enum es_hist_id_e {
+   ES_HIST_RECV = 0,       //!< recvfrom() on the SIP socket
+   ES_HIST_PARSE,          //!< osip_parse() in es_osip_parse_msg()
+   ES_HIST_QUEUE,          //!< Wait of a stack wake up in the pending list
+   ES_HIST_FSM,            //!< One pass of the oSIP state machines
+   ES_HIST_RESP_BUILD,     //!< es_msg_initResponse()
+   ES_HIST_SEND,           //!< Serialize and send of a message
+   ES_HIST_E2E,            //!< Request received to first response sent
+   ES_HIST_LOOP_LAG,       //!< Delay of the loop probe timer
+   ES_HIST_CB_TRANSPORT,   //!< SIP socket callback
+   ES_HIST_CB_OSIP,        //!< OSip stack wake up callback
+   ES_HIST_CB_CLI,         //!< CLI command handler
+   ES_HIST_WORK,           //!< Offloaded job, submitted to completed
+   ES_HIST_POST,           //!< Call posted to the stack, posted to run
+
+   ES_HIST_MAX
+} es_hist_id_t;
+
+/**
+ * @brief Merged histogram
+ */
+struct es_hist_snapshot_s {
+   uint64_t                counts[ES_HIST_BUCKETS];
+   uint64_t                count;
+   uint64_t                sum;
+};
+
+/** Current thread histograms, allocated on first use */
+extern __thread uint64_t *es_hist_local;
+
+/**
+ * @brief Allocate and register the histograms of the current thread
+ * @return histograms of the current thread
+ */
+uint64_t *es_hist_local_init(void);
+
+/**
+ * @brief Monotonic clock in ns
+ */
+static inline uint64_t es_hist_now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Bucket of a value
+ */
+static inline unsigned int es_hist_bucket(uint64_t value)
+{
+   unsigned int msb = 0;
+
+   if (value < ES_HIST_SUB_COUNT) {
+      return (unsigned int)value;
+   }
+
+   msb = 63 - (unsigned int)__builtin_clzll(value);
+   if (msb > ES_HIST_MAX_MSB) {
+      return ES_HIST_BUCKETS - 1;
+   }
+
+   return ((msb - ES_HIST_SUB_BITS + 1) << ES_HIST_SUB_BITS) +
+          (unsigned int)((value >> (msb - ES_HIST_SUB_BITS)) & (ES_HIST_SUB_COUNT - 1));
+}
+
+/**
+ * @brief Record a value in a histogram of the current thread, no lock involved
+ * Layout of a thread block: for each histogram, buckets then count and sum.
+ * @param id Histogram
+ * @param value Value in ns
+ */
+static inline void es_hist_record(es_hist_id_t id, uint64_t value)
+{
+   uint64_t *h = es_hist_local;
+   uint64_t *b = NULL;
+
+   if (h == NULL) {
+      h = es_hist_local_init();
+   }
+
+   h += (size_t)id * (ES_HIST_BUCKETS + 2);
+   b = &h[es_hist_bucket(value)];
+
+   /* Single writer: plain adds, published atomically for the readers */
+   __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&h[ES_HIST_BUCKETS], h[ES_HIST_BUCKETS] + 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&h[ES_HIST_BUCKETS + 1], h[ES_HIST_BUCKETS + 1] + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record the time elapsed since start
+ */
+static inline void es_hist_record_since(es_hist_id_t id, uint64_t start)
+{
+   es_hist_record(id, es_hist_now() - start);
+}
+
+/**
+ * @brief Highest value counted in a bucket
+ */
+uint64_t es_hist_bucket_upper(unsigned int idx);
+
+/**
+ * @brief Name of a histogram
+ */
+const char *es_hist_name(es_hist_id_t id);
+
+/**
+ * @brief Merge all the threads values of a histogram, since start
+ * @param id Histogram
+ * @param snap Result
+ */
+void es_hist_snapshot(es_hist_id_t id, struct es_hist_snapshot_s *snap);
+
+/**
+ * @brief Value under which a ratio of the samples are
+ * @param snap Histogram
+ * @param ratio 0.0 .. 1.0
+ * @return value (upper bound of the bucket)
+ */
+uint64_t es_hist_percentile(const struct es_hist_snapshot_s *snap, double ratio);
+
+/**
+ * @brief es_hist_cli_register
+ * Register "show latency" and "clear latency" commands
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_hist_cli_register(es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_HIST_H_ */
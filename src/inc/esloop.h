@@ -0,0 +1,71 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_LOOP_H_
+#define _ESIP_LOOP_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** Default duration above which a callback is reported (ms) */
+#define ES_LOOP_SLOW_DEFAULT_MS     20
+
+/** @brief Event loop health monitor */
+typedef struct es_loop_s es_loop_t;
+
+struct event_base;
+
+/**
+ * @brief es_loop_init
+ * Start the loop lag probe: a periodic timer whose delay is recorded in
+ * ES_HIST_LOOP_LAG
+ * @param ppCtx
+ * @param pBase Event loop to watch
+ * @return ES_OK on success
+ */
+es_status es_loop_init(es_loop_t **ppCtx, struct event_base *pBase);
+
+/**
+ * @brief es_loop_deinit
+ * @param pCtx
+ * @return ES_OK on success
+ */
+es_status es_loop_deinit(es_loop_t *pCtx);
+
+/**
+ * @brief Record the duration of a callback, warn if it is too slow
+ * Warnings are limited to one per second and per thread.
+ * @param id Histogram of the callback
+ * @param name Name shown in the warning
+ * @param start es_hist_now() at the callback entry
+ */
+void es_loop_cb_done(es_hist_id_t id, const char *name, uint64_t start);
+
+/**
+ * @brief es_loop_cli_register
+ * Register "show loop" and "set loop threshold" commands
+ * @param pCtx
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_loop_cli_register(es_loop_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_LOOP_H_ */
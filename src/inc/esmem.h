@@ -0,0 +1,146 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_MEM_H_
+#define _ESIP_MEM_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Memory categories
+ * oSIP and libevent allocations are counted in the category of the
+ * current scope, or in ES_MEM_OSIP / ES_MEM_LIBEVENT outside of any.
+ */
+typedef enum es_mem_cat_e {
+   ES_MEM_OSIP = 0,        //!< oSIP, outside of a scope
+   ES_MEM_LIBEVENT,        //!< libevent, outside of a scope
+   ES_MEM_MESSAGE,         //!< SIP messages and their text
+   ES_MEM_TRANSACTION,     //!< Transactions and their esip data
+   ES_MEM_DIALOG,          //!< Dialogs
+   ES_MEM_EVENT,           //!< Pending stack wake up events
+   ES_MEM_REGISTRAR,       //!< Registrar bindings and tables
+   ES_MEM_PROXY,           //!< Proxy routes and branches
+   ES_MEM_SCENARIO,        //!< Scripted responses and their timers
+   ES_MEM_AUTH,            //!< Digest users and nonce-counts
+   ES_MEM_WORK,            //!< Offload and parser pools, their rings
+
+   ES_MEM_CAT_MAX
+} es_mem_cat_t;
+
+/**
+ * @brief Usage of a category
+ */
+struct es_mem_usage_s {
+   int64_t                 bytes;      //!< Live bytes
+   int64_t                 objects;    //!< Live objects
+   int64_t                 peakBytes;  //!< High-water mark of bytes
+   int64_t                 peakObjects;//!< High-water mark of objects
+   int64_t                 allocs;     //!< Allocations since start
+};
+
+/** Category of the allocations of the current thread, -1 for none */
+extern __thread int es_mem_scope;
+
+/**
+ * @brief Count the oSIP and libevent allocations
+ * Must be called before any oSIP or libevent object is allocated.
+ * @return ES_OK on success
+ */
+es_status es_mem_init(void);
+
+/** Largest block served by the pool, header included */
+#define ES_MEM_POOL_MAX_BLOCK    4096
+
+/**
+ * @brief Serve the small blocks from a preallocated pool
+ * The pool is split between a few block sizes, prefaulted, and kept
+ * until exit. A size with no free block left falls back to malloc().
+ * Call it before es_mem_init().
+ * @param size Pool bytes
+ * @param huge Back it with hugepages if available
+ * @param node NUMA node of the pool, -1 for any
+ * @return ES_OK on success
+ */
+es_status es_mem_pool_init(size_t size, int huge, int node);
+
+/**
+ * @brief Count the next allocations of the thread in a category
+ * @return scope to give back to es_mem_scope_leave()
+ */
+static inline int es_mem_scope_enter(es_mem_cat_t cat)
+{
+   int prev = es_mem_scope;
+   es_mem_scope = (int)cat;
+   return prev;
+}
+
+/**
+ * @brief Restore the scope replaced by es_mem_scope_enter()
+ */
+static inline void es_mem_scope_leave(int prev)
+{
+   es_mem_scope = prev;
+}
+
+/**
+ * @brief Counted malloc
+ */
+void *es_mem_malloc(es_mem_cat_t cat, size_t size);
+
+/**
+ * @brief Counted calloc
+ */
+void *es_mem_calloc(es_mem_cat_t cat, size_t nb, size_t size);
+
+/**
+ * @brief Release memory from es_mem_malloc() or es_mem_calloc()
+ */
+void es_mem_free(void *ptr);
+
+/**
+ * @brief Name of a category
+ */
+const char *es_mem_name(es_mem_cat_t cat);
+
+/**
+ * @brief Usage of a category
+ */
+void es_mem_get(es_mem_cat_t cat, struct es_mem_usage_s *usage);
+
+/**
+ * @brief Log the categories with objects still allocated
+ * @param mask Categories to check (1 << es_mem_cat_t)
+ * @return number of objects still allocated
+ */
+int64_t es_mem_report_leaks(unsigned int mask);
+
+/**
+ * @brief es_mem_cli_register
+ * Register "show memory" command
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_mem_cli_register(es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_MEM_H_ */
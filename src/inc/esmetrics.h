@@ -0,0 +1,58 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_METRICS_H_
+#define _ESIP_METRICS_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** @brief OpenMetrics HTTP endpoint */
+typedef struct es_metrics_s es_metrics_t;
+
+struct event_base;
+
+/**
+ * @brief es_metrics_init
+ * Serve counters and histograms at /metrics on the given loop
+ * @param ppCtx
+ * @param pBase Event loop (the SIP one)
+ * @param address Address to listen on (NULL for any)
+ * @param port TCP port
+ * @param listenFd Socket already listening (handed over), -1 to bind
+ * @return ES_OK on success
+ */
+es_status es_metrics_init(es_metrics_t **ppCtx, struct event_base *pBase, const char *address, unsigned short port,
+                          int listenFd);
+
+/**
+ * @brief Listening socket, to hand over
+ */
+es_status es_metrics_get_socket(es_metrics_t *pCtx, int *fd);
+
+/**
+ * @brief es_metrics_deinit
+ * @param pCtx
+ * @return ES_OK on success
+ */
+es_status es_metrics_deinit(es_metrics_t *pCtx);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_METRICS_H_ */
@@ -0,0 +1,118 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_MPSC_H_
+#define _ESIP_MPSC_H_
+
+#include <stddef.h>
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define ES_MPSC_CACHE_LINE    64
+
+/**
+ * @brief Link of a node, embedded in the structure queued
+ */
+struct es_mpsc_node_s {
+   struct es_mpsc_node_s   *next;
+};
+
+/**
+ * @brief Intrusive queue, any thread pushes and one thread pops
+ * Pushing is one exchange and one store, never blocked by the consumer
+ * nor by other producers. A producer stopped between both hides the
+ * nodes after its own until it goes on: es_mpsc_pop() returns NULL
+ * meanwhile, and the producer is the one to wake the consumer again.
+ */
+struct es_mpsc_s {
+   /* Producers side */
+   struct es_mpsc_node_s   *tail;
+   char                    pad[ES_MPSC_CACHE_LINE - sizeof(struct es_mpsc_node_s *)];
+   /* Consumer side */
+   struct es_mpsc_node_s   *head;
+   struct es_mpsc_node_s   stub;
+};
+
+/**
+ * @brief Make an empty queue
+ */
+static inline void es_mpsc_init(struct es_mpsc_s *q)
+{
+   q->stub.next = NULL;
+   q->head = &q->stub;
+   q->tail = &q->stub;
+}
+
+/**
+ * @brief Queue a node, any thread
+ */
+static inline void es_mpsc_push(struct es_mpsc_s *q, struct es_mpsc_node_s *n)
+{
+   struct es_mpsc_node_s *prev = NULL;
+
+   __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+   prev = __atomic_exchange_n(&q->tail, n, __ATOMIC_ACQ_REL);
+   __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Dequeue the oldest node, consumer thread only
+ * @return the node, NULL if empty or a push is half done
+ */
+static inline struct es_mpsc_node_s *es_mpsc_pop(struct es_mpsc_s *q)
+{
+   struct es_mpsc_node_s *head = q->head;
+   struct es_mpsc_node_s *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+   if (head == &q->stub) {
+      if (next == NULL) {
+         return NULL;
+      }
+      q->head = next;
+      head = next;
+      next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+   }
+
+   if (next != NULL) {
+      q->head = next;
+      return head;
+   }
+
+   /* Last node: the stub goes behind it so that it can be taken */
+   if (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+      return NULL;
+   }
+   es_mpsc_push(q, &q->stub);
+
+   next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+   if (next != NULL) {
+      q->head = next;
+      return head;
+   }
+
+   return NULL;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_MPSC_H_ */
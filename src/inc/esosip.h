@@ -21,6 +21,22 @@
 /** @brief */
 typedef struct es_osip_s es_osip_t;
 
+/**
+ * @brief Call posted to the loop thread by es_osip_post()
+ * @param pCtx Stack, NULL if it goes away before the call
+ * @param arg Argument of es_osip_post()
+ */
+typedef void (*es_osip_post_cb)(es_osip_t *pCtx, void *arg);
+
+struct es_config_s;
+struct es_upgrade_buf_s;
+struct es_upgrade_journal_s;
+struct es_registrar_s;
+struct es_proxy_s;
+struct es_auth_s;
+struct es_work_s;
+struct es_parse_s;
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -33,6 +49,87 @@ extern "C" {
  */
 es_status es_osip_init(es_osip_t ** ctx, struct event_base * base);
 
+/**
+ * @brief es_osip_configure
+ * Apply the stack and transport settings, at start and on reload
+ * @param pCtx
+ * @param pCfg
+ * @return ES_OK on success
+ */
+es_status es_osip_configure(es_osip_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Handle REGISTER with a registrar, NULL to answer them without
+ * The registrar publishes its bindings in "show registrations".
+ */
+es_status es_osip_set_registrar(es_osip_t *pCtx, struct es_registrar_s *pRegistrar);
+
+/**
+ * @brief Check the credentials of INVITE and REGISTER, NULL to accept all
+ * Requests not authenticated are answered before the proxy and scenarios.
+ */
+es_status es_osip_set_auth(es_osip_t *pCtx, struct es_auth_s *pAuth);
+
+/**
+ * @brief Check credentials on a pool, NULL to check them on the loop
+ * The transaction waits for its check, the socket is read meanwhile.
+ */
+es_status es_osip_set_work(es_osip_t *pCtx, struct es_work_s *pWork);
+
+/**
+ * @brief Parse datagrams on parser threads, NULL to parse them on the loop
+ * The stack still handles them on the loop, in order for each source.
+ */
+es_status es_osip_set_parse(es_osip_t *pCtx, struct es_parse_s *pParse);
+
+/**
+ * @brief Give the messages received to a proxy first, NULL for none
+ * The ones it does not forward are handled by the stack.
+ */
+es_status es_osip_set_proxy(es_osip_t *pCtx, struct es_proxy_s *pProxy);
+
+/**
+ * @brief Use the SIP socket of the process we take over, before es_osip_start()
+ */
+es_status es_osip_adopt_socket(es_osip_t *pCtx, int fd);
+
+/**
+ * @brief SIP socket, to hand over
+ */
+es_status es_osip_get_socket(es_osip_t *pCtx, int *fd);
+
+/**
+ * @brief Stop (pause != 0) or start again reading SIP messages
+ * Transactions go on: timers run and responses are still sent.
+ */
+es_status es_osip_pause(es_osip_t *pCtx, int pause);
+
+/**
+ * @brief Number of transactions alive
+ */
+unsigned int es_osip_transactions(es_osip_t *pCtx);
+
+
+/**
+ * @brief Append the dialogs to a state handed over
+ */
+es_status es_osip_save(es_osip_t *pCtx, struct es_upgrade_buf_s *state);
+
+/**
+ * @brief Create the dialogs of a state handed over or saved
+ * Dialogs that can not be read are dropped, ended ones are removed.
+ * @param pCtx
+ * @param data State records
+ * @param len
+ * @param elapsed Seconds since the state was written
+ */
+es_status es_osip_restore(es_osip_t *pCtx, const uint8_t *data, size_t len, unsigned int elapsed);
+
+/**
+ * @brief Write the dialogs created and ended from now on, NULL to stop
+ */
+es_status es_osip_set_journal(es_osip_t *pCtx, const struct es_upgrade_journal_s *pJournal);
+
 /**
  * @brief es_osip_start
  * @param _ctx
@@ -63,6 +160,30 @@ es_status es_osip_deinit(es_osip_t *pCtx);
  */
 es_status es_osip_parse_msg(es_osip_t * ctx, const char * buf, unsigned int size);
 
+/**
+ * @brief Run a call on the loop thread of the stack, from any thread
+ * Only the loop thread touches the stack: other threads (CLI, workers,
+ * embedding code) go through this. Calls run in the order posted by
+ * one thread; the ones left at es_osip_deinit() get a NULL stack.
+ * @return ES_OK on success, the call is not made on error
+ */
+es_status es_osip_post(es_osip_t *pCtx, es_osip_post_cb cb, void *arg);
+
+/**
+ * @brief Hand a SIP message to the stack from any thread
+ * The buffer is copied, es_osip_parse_msg() runs on the loop thread.
+ */
+es_status es_osip_post_msg(es_osip_t *pCtx, const char *buf, unsigned int size);
+
+/**
+ * @brief es_osip_cli_register
+ * Register the stack commands (and its transport ones) on the CLI
+ * @param pCtx
+ * @param pCli
+ * @return
+ */
+es_status es_osip_cli_register(es_osip_t *pCtx, es_cli_t *pCli);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
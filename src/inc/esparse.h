@@ -0,0 +1,107 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_PARSE_H_
+#define _ESIP_PARSE_H_
+
+#include <netinet/in.h>
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Threads parsing the datagrams received, for the stack thread
+ * Each parser owns a ring fed by the loop and read back by it: the
+ * datagrams of one source always go to the same parser, so they reach
+ * the stack in the order received while parsing spreads over the cores.
+ * A datagram finding the ring of its parser full is dropped, as the
+ * socket would have: the sender retransmits.
+ */
+typedef struct es_parse_s es_parse_t;
+
+struct event_base;
+struct osip_event;
+
+/** Datagrams per parser, received and not handed to the stack yet */
+#define ES_PARSE_DEPTH           256
+
+/** Most parser threads */
+#define ES_PARSE_MAX_THREADS     16
+
+/** Largest datagram */
+#define ES_PARSE_MAX_SIZE        2048
+
+/**
+ * @brief A datagram and its parsing, handed to the stack
+ */
+struct es_parse_msg_s {
+   /* Parsed message, NULL if not SIP: taken by the callback */
+   struct osip_event         *evt;
+   struct sockaddr_in        from;
+   /* Received and parsed times, es_hist_now() */
+   uint64_t                  rxTs;
+   uint64_t                  parseTs;
+   unsigned int              size;
+   char                      buf[ES_PARSE_MAX_SIZE + 1];
+};
+
+/**
+ * @brief Datagram parsed, on the event loop, in the order received per source
+ */
+typedef void (*es_parse_cb)(void *arg, struct es_parse_msg_s *msg);
+
+/**
+ * @brief es_parse_init
+ * @param ppCtx
+ * @param base Event loop feeding the parsers and reading them back
+ * @param threads Parsers, 1 to ES_PARSE_MAX_THREADS
+ * @return ES_OK on success
+ */
+es_status es_parse_init(es_parse_t **ppCtx, struct event_base *base, unsigned int threads);
+
+/**
+ * @brief es_parse_deinit
+ * Messages not handed yet are freed.
+ */
+es_status es_parse_deinit(es_parse_t *pCtx);
+
+/**
+ * @brief Hand the messages parsed to cb, NULL to free them
+ */
+es_status es_parse_set_callback(es_parse_t *pCtx, es_parse_cb cb, void *arg);
+
+/**
+ * @brief Parse a datagram on the parser of its source
+ * From the event loop thread only, the buffer is copied.
+ * @return ES_OK, ES_ERROR_TRY_AGAIN if the ring of the parser is full
+ */
+es_status es_parse_submit(es_parse_t *pCtx, const char *buf, unsigned int size, const struct sockaddr_in *from);
+
+/**
+ * @brief es_parse_cli_register
+ * Register "show parse" command
+ */
+es_status es_parse_cli_register(es_parse_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_PARSE_H_ */
@@ -0,0 +1,116 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_PERSIST_H_
+#define _ESIP_PERSIST_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief State kept on disk across restarts
+ * A snapshot of the state is written every period to a file mapped in
+ * memory, the changes in between are appended to a log next to it
+ * (path.log), itself mapped and grown by chunks so an append is a copy.
+ * At start the snapshot is read in place and the log replayed over it,
+ * each record aged by the time passed since it was written. Both files
+ * hold upgrade records (esupgrade.h) and are replaced by rename(), so a
+ * process killed at any point leaves a consistent pair.
+ */
+typedef struct es_persist_s es_persist_t;
+
+struct event_base;
+struct es_upgrade_buf_s;
+struct es_upgrade_journal_s;
+
+/**
+ * @brief Takes records read from the files
+ * @param arg
+ * @param data Records
+ * @param len
+ * @param elapsed Seconds since they were written
+ */
+typedef es_status (*es_persist_restore_cb)(void *arg, const uint8_t *data, size_t len, unsigned int elapsed);
+
+/**
+ * @brief Writes the whole state, on the loop
+ * Called without the lock of the appends. What other threads append
+ * meanwhile is replayed over the snapshot: such records must set a whole
+ * value, as the ones of the registrar do.
+ */
+typedef es_status (*es_persist_save_cb)(void *arg, struct es_upgrade_buf_s *state);
+
+/**
+ * @brief Read the snapshot of path and replay its log
+ * @param path Snapshot file
+ * @param cb Called for the snapshot, then for each run of changes
+ * @param arg Given to cb
+ * @return ES_OK on success, ES_ERROR_NOT_FOUND without snapshot
+ */
+es_status es_persist_load(const char *path, es_persist_restore_cb cb, void *arg);
+
+/**
+ * @brief es_persist_init
+ * Nothing is written before es_persist_start().
+ * @param ppCtx
+ * @param pBase Loop taking the snapshots
+ * @param path Snapshot file
+ * @param period Seconds between snapshots
+ * @param cb Writes the state
+ * @param arg Given to cb
+ * @return ES_OK on success
+ */
+es_status es_persist_init(es_persist_t **ppCtx, struct event_base *pBase, const char *path, unsigned int period,
+                          es_persist_save_cb cb, void *arg);
+
+/**
+ * @brief Write a snapshot now, start a new log and take one every period
+ * Call it once the state is restored: the files of the previous run are
+ * replaced.
+ */
+es_status es_persist_start(es_persist_t *pCtx);
+
+/**
+ * @brief es_persist_deinit
+ * A last snapshot is written if started, unless paused.
+ */
+es_status es_persist_deinit(es_persist_t *pCtx);
+
+/**
+ * @brief Journal appending the changes to the log, for the modules
+ */
+es_status es_persist_journal(es_persist_t *pCtx, struct es_upgrade_journal_s *pJournal);
+
+/**
+ * @brief Stop writing, the files belong to another process
+ * Resuming writes a snapshot at once.
+ */
+es_status es_persist_pause(es_persist_t *pCtx, int pause);
+
+/**
+ * @brief es_persist_cli_register
+ */
+es_status es_persist_cli_register(es_persist_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_PERSIST_H_ */
@@ -0,0 +1,72 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_PROBE_H_
+#define _ESIP_PROBE_H_
+
+/**
+ * @brief USDT probes of the "esip" provider
+ * Built when <sys/sdt.h> is found (systemtap-sdt-dev), list them with:
+ *    bpftrace -l 'usdt:./src/esip:esip:*'
+ *
+ * recv       (buf, len, src addr, src port)
+ * parse      (call-id, branch, len, method, status code)
+ * tr_create  (call-id, branch, transaction id, fsm type)
+ * tr_kill    (call-id, branch, transaction id, fsm type)
+ * msg        (call-id, branch, callback type, transaction id)
+ * send       (call-id, branch, len, dst addr, dst port)
+ *
+ * A probe is a nop until a tracer is attached. Arguments that need some
+ * work (Call-ID, branch) are only computed under ES_PROBE_ENABLED().
+ */
+#define ES_PROBE_LIST(X)   \
+   X(recv)                 \
+   X(parse)                \
+   X(tr_create)            \
+   X(tr_kill)              \
+   X(msg)                  \
+   X(send)
+
+#if defined(HAVE_SYS_SDT_H)
+
+/* Semaphores are counted up by the tracer when a probe is attached */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define ES_PROBE_SEMAPHORE(name) \
+   __extension__ extern unsigned short esip_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+
+ES_PROBE_LIST(ES_PROBE_SEMAPHORE)
+
+#define ES_PROBE_ENABLED(name)                     __builtin_expect(esip_##name##_semaphore != 0, 0)
+
+#define ES_PROBE4(name, a1, a2, a3, a4)            STAP_PROBE4(esip, name, a1, a2, a3, a4)
+#define ES_PROBE5(name, a1, a2, a3, a4, a5)        STAP_PROBE5(esip, name, a1, a2, a3, a4, a5)
+
+#else /* HAVE_SYS_SDT_H */
+
+#define ES_PROBE_ENABLED(name)                     0
+
+/* Arguments are referenced but never evaluated */
+#define ES_PROBE4(name, a1, a2, a3, a4) \
+   do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while (0)
+#define ES_PROBE5(name, a1, a2, a3, a4, a5) \
+   do { if (0) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); } } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* _ESIP_PROBE_H_ */
@@ -0,0 +1,149 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_PROXY_H_
+#define _ESIP_PROXY_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Proxy of the requests received, instead of answering them
+ * Stateless: a request is sent on with our Via on top and Max-Forwards
+ * decremented, to the next Route, else to the first binding of the
+ * Request-URI in the registrar, else to the route of its user in the
+ * subscribers database, else to the route of the longest prefix of its
+ * user. A response goes to the Via under ours. Messages are edited
+ * in the receive buffer and sent in pieces (esraw), never printed again.
+ * REGISTER is left to the registrar. Runs on the SIP thread.
+ * Stateful, the stack forks requests to all the next hops located
+ * (esfork): the proxy only gives them, and forwards statelessly what no
+ * transaction matches.
+ */
+typedef struct es_proxy_s es_proxy_t;
+
+struct sockaddr_in;
+struct es_config_s;
+struct es_registrar_s;
+struct es_transport_s;
+struct es_db_s;
+
+/** Max length of a route prefix */
+#define ES_PROXY_PREFIX_LEN      32
+
+/** Max length of a Request-URI retargeted to */
+#define ES_PROXY_URI_LEN         256
+
+/**
+ * @brief A next hop of a request
+ */
+struct es_proxy_target_s {
+   struct sockaddr_in      to;                        //!< Sent to
+   char                    uri[ES_PROXY_URI_LEN];     //!< Request-URI, "" to keep it
+};
+
+/**
+ * @brief es_proxy_init
+ * Requests are answered until configured in a proxy mode.
+ */
+es_status es_proxy_init(es_proxy_t **ppCtx);
+
+/**
+ * @brief es_proxy_deinit
+ */
+es_status es_proxy_deinit(es_proxy_t *pCtx);
+
+/**
+ * @brief Apply the mode, Via address and routes file, read again each time
+ * The previous settings stay if the new ones are not valid.
+ */
+es_status es_proxy_configure(es_proxy_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Location service, NULL for routes only
+ */
+es_status es_proxy_set_registrar(es_proxy_t *pCtx, struct es_registrar_s *pRegistrar);
+
+/**
+ * @brief Routes of the subscribers, before the prefixes, NULL for none
+ */
+es_status es_proxy_set_db(es_proxy_t *pCtx, struct es_db_s *pDb);
+
+/**
+ * @brief Forward a message received, in stateless mode
+ * @param pCtx
+ * @param pTransport Sends it on
+ * @param buf Message, left as is
+ * @param len
+ * @param from Source
+ * @return ES_OK if forwarded, answered or dropped, ES_ERROR_NOTSUPPORTED
+ * for the stack to handle it
+ */
+es_status es_proxy_handle(es_proxy_t *pCtx, struct es_transport_s *pTransport, const char *buf, size_t len,
+                          const struct sockaddr_in *from);
+
+/**
+ * @brief Forward a message statelessly in any proxy mode
+ * For what the stateful proxy has no transaction for: responses after
+ * the first 2xx, ACK of a 2xx.
+ * @return as es_proxy_handle()
+ */
+es_status es_proxy_forward(es_proxy_t *pCtx, struct es_transport_s *pTransport, const char *buf, size_t len,
+                           const struct sockaddr_in *from);
+
+/**
+ * @brief Current mode, es_config_mode_t
+ */
+unsigned int es_proxy_mode(const es_proxy_t *pCtx);
+
+/**
+ * @brief Next hops of a Request-URI (Route aside)
+ * All the bindings of its AOR, else its address when not ours, else the
+ * route of its user.
+ * @param pCtx
+ * @param uri Request-URI
+ * @param len
+ * @param targets Next hops found
+ * @param max Size of targets
+ * @return the number of next hops, 0 if none
+ */
+unsigned int es_proxy_locate(es_proxy_t *pCtx, const char *uri, size_t len, struct es_proxy_target_s *targets,
+                             unsigned int max);
+
+/**
+ * @brief The address is ours
+ */
+int es_proxy_is_self(const es_proxy_t *pCtx, const struct sockaddr_in *to);
+
+/**
+ * @brief Our Via sent-by, host:port
+ */
+es_status es_proxy_sent_by(const es_proxy_t *pCtx, char *buf, size_t size);
+
+/**
+ * @brief es_proxy_cli_register
+ */
+es_status es_proxy_cli_register(es_proxy_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_PROXY_H_ */
@@ -0,0 +1,87 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_RATE_H_
+#define _ESIP_RATE_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Token buckets per source address, checked before parsing
+ * The sources are kept in a table of a fixed size: a new one takes the
+ * place of the least recently seen in its neighbourhood. Each source
+ * has a bucket per class of message, refilled at the rate configured
+ * and holding up to rate.burst seconds of it.
+ */
+typedef struct es_rate_s es_rate_t;
+
+struct es_config_s;
+struct sockaddr_in;
+
+/** Sources tracked at once, a power of 2 */
+#define ES_RATE_SOURCES          4096
+
+/** Slots looked at for a source, the oldest is evicted */
+#define ES_RATE_PROBE            8
+
+/** Highest rate of a class, datagrams per second */
+#define ES_RATE_MAX              100000
+
+/**
+ * @brief Classes of messages, told from the start of the datagram
+ */
+typedef enum es_rate_class_e {
+   ES_RATE_INVITE = 0,
+   ES_RATE_REGISTER,
+   ES_RATE_OTHER,          //!< Other requests and what is not SIP
+   ES_RATE_RESPONSE,
+
+   ES_RATE_CLASS_MAX
+} es_rate_class_t;
+
+es_status es_rate_init(es_rate_t **ppCtx);
+
+es_status es_rate_deinit(es_rate_t *pCtx);
+
+/**
+ * @brief Apply rate.* settings, at start and on reload
+ * The buckets keep their tokens, up to the new burst.
+ */
+es_status es_rate_configure(es_rate_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Take a token for a datagram received, loop thread only
+ * @param now es_hist_now()
+ * @return 1 if it goes on, 0 if it is dropped
+ */
+int es_rate_allow(es_rate_t *pCtx, const struct sockaddr_in *from, const char *buf, size_t len, uint64_t now);
+
+/**
+ * @brief es_rate_cli_register
+ * Register "show rate" command
+ */
+es_status es_rate_cli_register(es_rate_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_RATE_H_ */
@@ -0,0 +1,164 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_RAW_H_
+#define _ESIP_RAW_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief SIP message as received, read and edited in place
+ * Only the start line and the header bounds are read, a header is looked
+ * for when needed. Edits are kept aside and given as an iovec over the
+ * receive buffer: a message is forwarded without being copied nor
+ * printed again.
+ */
+
+struct iovec;
+struct sockaddr_in;
+
+/** Max edits of a message */
+#define ES_RAW_MAX_EDITS      8
+
+/** iovec entries needed for any edits */
+#define ES_RAW_MAX_IOV        (2 * ES_RAW_MAX_EDITS + 1)
+
+/**
+ * @brief Bounds of a message, offsets in buf
+ */
+struct es_raw_msg_s {
+   const char              *buf;
+   size_t                  len;
+   size_t                  lineEnd;    //!< Past the CRLF of the start line
+   size_t                  hdrEnd;     //!< Past the empty line
+   int                     request;
+   size_t                  methodLen;  //!< Request: method at 0
+   size_t                  uri;        //!< Request: Request-URI
+   size_t                  uriEnd;
+   int                     status;     //!< Response: status code
+};
+
+/**
+ * @brief A header line
+ */
+struct es_raw_hdr_s {
+   size_t                  start;      //!< Name
+   size_t                  value;      //!< Value, spaces skipped
+   size_t                  valueEnd;   //!< Past the value, spaces trimmed
+   size_t                  end;        //!< Past the CRLF, continuation lines included
+};
+
+/**
+ * @brief Changes to a message, by increasing offset
+ */
+struct es_raw_edits_s {
+   const char              *buf;
+   size_t                  len;
+   unsigned int            nb;
+   struct {
+      size_t               offset;
+      size_t               remove;
+      const char           *insert;
+      size_t               insertLen;
+   } edit[ES_RAW_MAX_EDITS];
+};
+
+/**
+ * @brief Read the start line and find the end of the headers
+ * @return ES_OK, ES_ERROR_BADPARAM if not a SIP message
+ */
+es_status es_raw_parse(struct es_raw_msg_s *msg, const char *buf, size_t len);
+
+/**
+ * @brief Next header of a name, from offset (0 for the first)
+ * @param msg
+ * @param name Full name, case insensitive
+ * @param compact Compact form, '\0' if none
+ * @param offset Where to look from, moved past the header found
+ * @param hdr Header found
+ * @return 1 if found, 0 if not
+ */
+int es_raw_header_next(const struct es_raw_msg_s *msg, const char *name, char compact, size_t *offset,
+                       struct es_raw_hdr_s *hdr);
+
+/**
+ * @brief End of the first value of a header with several, comma separated
+ */
+size_t es_raw_value_end(const struct es_raw_msg_s *msg, size_t value, size_t valueEnd);
+
+/**
+ * @brief Parameter of a value (;name or ;name=value), NULL if none
+ * @param p Value
+ * @param len
+ * @param name Parameter, case insensitive
+ * @param pLen Length of its value, 0 without
+ */
+const char *es_raw_param(const char *p, size_t len, const char *name, size_t *pLen);
+
+/**
+ * @brief User part of a SIP URI, in a name-addr or not
+ * @return ES_OK, ES_ERROR_NOT_FOUND if none
+ */
+es_status es_raw_uri_user(const char *p, size_t len, const char **pUser, size_t *pUserLen);
+
+/**
+ * @brief Host and port (0 length if none) of a SIP URI
+ */
+es_status es_raw_uri_host(const char *p, size_t len, const char **pHost, size_t *pHostLen,
+                          const char **pPort, size_t *pPortLen);
+
+/**
+ * @brief Address of the host of a SIP URI, 5060 by default
+ * Only IPv4 addresses are read, no name is resolved.
+ */
+es_status es_raw_uri_addr(const char *p, size_t len, struct sockaddr_in *addr);
+
+/**
+ * @brief Where to send a response of a Via value: received and rport
+ * over the sent-by, 5060 by default
+ */
+es_status es_raw_via_addr(const char *p, size_t len, struct sockaddr_in *addr);
+
+/**
+ * @brief es_raw_edits_init
+ */
+void es_raw_edits_init(struct es_raw_edits_s *edits, const char *buf, size_t len);
+
+/**
+ * @brief Replace remove bytes at offset by insert, edits must not overlap
+ * @return ES_OK, ES_ERROR_OUTOFRANGE past ES_RAW_MAX_EDITS or overlapping
+ */
+es_status es_raw_splice(struct es_raw_edits_s *edits, size_t offset, size_t remove, const char *insert, size_t insertLen);
+
+/**
+ * @brief The message edited, over the buffer and the inserts
+ * @param edits
+ * @param iov ES_RAW_MAX_IOV entries
+ * @param pLen Total length
+ * @return number of entries
+ */
+unsigned int es_raw_iov(const struct es_raw_edits_s *edits, struct iovec *iov, size_t *pLen);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_RAW_H_ */
@@ -0,0 +1,147 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_REGISTRAR_H_
+#define _ESIP_REGISTRAR_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Registrar and location service
+ * AOR -> Contact bindings in a hash table split in shards, each with its
+ * own lock, table and expiry wheel: lookups from other threads only wait
+ * for the shard they hit. Bindings expire on a one second tick of the
+ * SIP loop. Updates publish snapshot rows, so they come from the SIP
+ * thread.
+ */
+typedef struct es_registrar_s es_registrar_t;
+
+struct event_base;
+struct es_config_s;
+struct es_upgrade_journal_s;
+struct osip_message;
+struct osip_uri;
+
+/** Max length of an AOR key (user@host[:port]) */
+#define ES_REGISTRAR_AOR_LEN        128
+
+/** Max length of a Contact URI, longer ones are refused */
+#define ES_REGISTRAR_URI_LEN        256
+
+/** Max bindings of an AOR */
+#define ES_REGISTRAR_MAX_CONTACTS   16
+
+/**
+ * @brief A binding, as copied out by es_registrar_lookup()
+ */
+struct es_registrar_contact_s {
+   char                    uri[ES_REGISTRAR_URI_LEN];   //!< Contact URI
+   unsigned int            expires;                     //!< Seconds left
+};
+
+/**
+ * @brief es_registrar_init
+ * @param ppCtx
+ * @param pBase SIP loop, runs the expiry tick
+ * @return ES_OK on success
+ */
+es_status es_registrar_init(es_registrar_t **ppCtx, struct event_base *pBase);
+
+/**
+ * @brief es_registrar_deinit
+ * All bindings are dropped.
+ */
+es_status es_registrar_deinit(es_registrar_t *pCtx);
+
+/**
+ * @brief Apply the registrar.* settings, for the next REGISTER
+ */
+es_status es_registrar_configure(es_registrar_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Publish the bindings as ES_SNAP_REGISTRATIONS rows, NULL to stop
+ */
+es_status es_registrar_set_snap(es_registrar_t *pCtx, es_snap_t *pSnap);
+
+/**
+ * @brief Apply a REGISTER (RFC 3261 10.3), all its contacts or none
+ * @param pCtx
+ * @param request REGISTER received
+ * @return the final response code
+ */
+int es_registrar_update(es_registrar_t *pCtx, struct osip_message *request);
+
+/**
+ * @brief Complete the response of a REGISTER
+ * A 2xx gets the current bindings of the AOR, a 423 its Min-Expires.
+ */
+es_status es_registrar_answer(es_registrar_t *pCtx, struct osip_message *request, struct osip_message *response);
+
+/**
+ * @brief Key of the AOR of a URI: user@host[:port], host in lower case
+ */
+es_status es_registrar_aor(const struct osip_uri *uri, char *aor, size_t size);
+
+/**
+ * @brief Copy the bindings of an AOR, from any thread
+ * @param pCtx
+ * @param aor Key from es_registrar_aor()
+ * @param contacts Bindings copied
+ * @param max Size of contacts
+ * @return the number of bindings copied
+ */
+unsigned int es_registrar_lookup(es_registrar_t *pCtx, const char *aor, struct es_registrar_contact_s *contacts,
+                                 unsigned int max);
+
+/**
+ * @brief Write the bindings as ES_UPGRADE_REC_REGISTRATION records
+ */
+es_status es_registrar_save(es_registrar_t *pCtx, struct es_upgrade_buf_s *state);
+
+/**
+ * @brief Restore the bindings of a state, other records are skipped
+ * @param pCtx
+ * @param data State records
+ * @param len
+ * @param elapsed Seconds since the state was written
+ */
+es_status es_registrar_restore(es_registrar_t *pCtx, const uint8_t *data, size_t len, unsigned int elapsed);
+
+/**
+ * @brief Write the bindings added, refreshed and removed from now on,
+ * NULL to stop. Expiries are not written: a restore drops them.
+ */
+es_status es_registrar_set_journal(es_registrar_t *pCtx, const struct es_upgrade_journal_s *pJournal);
+
+/**
+ * @brief es_registrar_cli_register
+ * Register "show registrar" command
+ * @param pCtx
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_registrar_cli_register(es_registrar_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_REGISTRAR_H_ */
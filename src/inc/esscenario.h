@@ -0,0 +1,107 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_SCENARIO_H_
+#define _ESIP_SCENARIO_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Scripted responses of the UAS
+ * A scenario file gives, per method and Request-URI user prefix, the
+ * responses to send and when, one scenario per line:
+ *
+ *    # method  user prefix  steps
+ *    INVITE    *            100 180@200 486%10 200@2000
+ *    INVITE    33           100 603
+ *    *         *            200
+ *
+ * A step is code[@delay ms][%chance]: the delay runs from the previous
+ * response, a step whose chance is not drawn is skipped, a final
+ * response ends the scenario. The last step must be a final response
+ * without chance. The longest prefix of the method wins, then the ones
+ * of any method ("*"). Scenarios are compiled into one table of steps,
+ * the delays run on a timing wheel of 10 ms ticks. Runs on the SIP thread.
+ */
+typedef struct es_scenario_s es_scenario_t;
+
+struct event_base;
+struct osip_transaction;
+struct osip_message;
+struct es_config_s;
+
+/**
+ * @brief What the stack does for the scenarios
+ */
+struct es_scenario_stack_s {
+   /** Send a response to the request of a server transaction */
+   es_status (*respond)(void *arg, struct osip_transaction *tr, int code);
+   void *arg;
+};
+
+/**
+ * @brief es_scenario_init
+ * @param ppCtx
+ * @param pBase SIP loop, runs the delays
+ * @param pStack Responses of the stack
+ * @return ES_OK on success
+ */
+es_status es_scenario_init(es_scenario_t **ppCtx, struct event_base *pBase, const struct es_scenario_stack_s *pStack);
+
+/**
+ * @brief es_scenario_deinit
+ * Responses still scheduled are dropped.
+ */
+es_status es_scenario_deinit(es_scenario_t *pCtx);
+
+/**
+ * @brief Load response.scenarios, none if empty
+ * Running scenarios end with the table they started with.
+ * @return ES_OK on success, the table is left unchanged otherwise
+ */
+es_status es_scenario_configure(es_scenario_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Start the scenario of a new request, if any
+ * Responses due now are sent before it returns.
+ * @param pCtx
+ * @param tr Server transaction, its reserved3 holds the scenario
+ * @param request
+ * @return ES_OK if a scenario answers, ES_ERROR_NOT_FOUND if none matches
+ */
+es_status es_scenario_start(es_scenario_t *pCtx, struct osip_transaction *tr, struct osip_message *request);
+
+/**
+ * @brief A transaction ends, its responses still scheduled are dropped
+ */
+void es_scenario_release(es_scenario_t *pCtx, struct osip_transaction *tr);
+
+/**
+ * @brief es_scenario_cli_register
+ * Register "show scenarios" command
+ */
+es_status es_scenario_cli_register(es_scenario_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_SCENARIO_H_ */
@@ -0,0 +1,145 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_SNAP_H_
+#define _ESIP_SNAP_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Snapshots of the stack state, for the CLI
+ * The SIP thread keeps one row per live object and, while someone reads
+ * them, copies the rows into a new snapshot a slice at a time at low
+ * priority. Readers get the last complete snapshot without any lock.
+ */
+typedef struct es_snap_s es_snap_t;
+
+struct event_base;
+
+/** Text fields length, longer values are truncated */
+#define ES_SNAP_TEXT_LEN      48
+
+/**
+ * @brief Kinds of objects
+ */
+typedef enum es_snap_kind_e {
+   ES_SNAP_TRANSACTIONS = 0,
+   ES_SNAP_DIALOGS,
+   ES_SNAP_REGISTRATIONS,
+
+   ES_SNAP_KIND_MAX
+} es_snap_kind_t;
+
+/**
+ * @brief A row of a snapshot
+ */
+struct es_snap_row_s {
+   uint64_t                since;                        //!< Creation time (es_hist_now())
+   int                     id;                           //!< Transaction id, 0 if none
+   char                    type[8];                      //!< IST, NIST, UAS, ...
+   char                    state[16];                    //!< Current state
+   char                    callId[ES_SNAP_TEXT_LEN];     //!< Call-ID
+   char                    local[ES_SNAP_TEXT_LEN];      //!< Local URI (To of a request)
+   char                    remote[ES_SNAP_TEXT_LEN];     //!< Remote URI (From, Contact)
+};
+
+/**
+ * @brief A complete snapshot, never modified once published
+ */
+struct es_snap_view_s {
+   uint64_t                generation;    //!< Increased at each snapshot of the kind
+   uint64_t                ts;            //!< Time it was completed (es_hist_now())
+   unsigned int            count;         //!< Number of rows
+   unsigned int            size;          //!< Rows allocated
+   struct es_snap_view_s   *next;         //!< Retired list, private
+   struct es_snap_row_s    rows[];
+};
+
+/**
+ * @brief Update the changing fields of a row, called by the SIP thread
+ * @param obj Object given to es_snap_add()
+ * @param row Row to update
+ */
+typedef void (*es_snap_refresh_cb)(const void *obj, struct es_snap_row_s *row);
+
+/**
+ * @brief es_snap_init
+ * @param ppCtx
+ * @param pBase SIP loop, the snapshots are built by its thread
+ * @return ES_OK on success
+ */
+es_status es_snap_init(es_snap_t **ppCtx, struct event_base *pBase);
+
+/**
+ * @brief es_snap_deinit
+ * No reader must be left.
+ */
+es_status es_snap_deinit(es_snap_t *pCtx);
+
+/**
+ * @brief Set the refresh callback of a kind
+ */
+es_status es_snap_set_refresh(es_snap_t *pCtx, es_snap_kind_t kind, es_snap_refresh_cb cb);
+
+/**
+ * @brief Add a live object, SIP thread only
+ * @param pCtx
+ * @param kind
+ * @param obj Object, passed to the refresh callback until removed
+ * @param row Fixed fields of the row
+ * @param slot Row reference to give to es_snap_remove()
+ * @return ES_OK on success
+ */
+es_status es_snap_add(es_snap_t *pCtx, es_snap_kind_t kind, const void *obj, const struct es_snap_row_s *row, int *slot);
+
+/**
+ * @brief Remove a live object, SIP thread only
+ */
+void es_snap_remove(es_snap_t *pCtx, es_snap_kind_t kind, int slot);
+
+/**
+ * @brief Get the last snapshot of a kind, from any thread
+ * Asks the SIP thread to keep the snapshots fresh for a while.
+ * @param pCtx
+ * @param kind
+ * @param ref Reference to give to es_snap_release()
+ * @return the snapshot, NULL if none yet (or too many readers)
+ */
+const struct es_snap_view_s *es_snap_acquire(es_snap_t *pCtx, es_snap_kind_t kind, int *ref);
+
+/**
+ * @brief Release a snapshot from es_snap_acquire()
+ */
+void es_snap_release(es_snap_t *pCtx, int ref);
+
+/**
+ * @brief es_snap_cli_register
+ * Register "show transactions", "show dialogs" and "show registrations"
+ * @param pCtx
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_snap_cli_register(es_snap_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_SNAP_H_ */
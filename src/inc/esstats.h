@@ -0,0 +1,133 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_STATS_H_
+#define _ESIP_STATS_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/** First and last response code counted */
+#define ES_STATS_RESP_CODE_MIN   100
+#define ES_STATS_RESP_CODE_MAX   699
+
+/**
+ * @brief Counters identifiers
+ * Each thread owns a private copy of every counter, they are merged on read.
+ */
+typedef enum es_stats_id_e {
+   ES_STATS_RX_DATAGRAMS = 0,       //!< Datagrams received
+   ES_STATS_RX_BYTES,               //!< Bytes received
+   ES_STATS_TX_DATAGRAMS,           //!< Datagrams sent
+   ES_STATS_TX_BYTES,               //!< Bytes sent
+   ES_STATS_TX_ERRORS,              //!< Send failures
+   ES_STATS_PARSE_ERRORS,           //!< Datagrams not parsed as SIP
+   ES_STATS_TR_CREATED,             //!< Transactions created
+   ES_STATS_TR_KILLED,              //!< Transactions terminated
+   ES_STATS_DIALOGS,                //!< Dialogs active (gauge)
+
+   ES_STATS_REQ_INVITE,             //!< Requests by method
+   ES_STATS_REQ_ACK,
+   ES_STATS_REQ_BYE,
+   ES_STATS_REQ_CANCEL,
+   ES_STATS_REQ_REGISTER,
+   ES_STATS_REQ_OPTIONS,
+   ES_STATS_REQ_INFO,
+   ES_STATS_REQ_PRACK,
+   ES_STATS_REQ_UPDATE,
+   ES_STATS_REQ_SUBSCRIBE,
+   ES_STATS_REQ_NOTIFY,
+   ES_STATS_REQ_REFER,
+   ES_STATS_REQ_MESSAGE,
+   ES_STATS_REQ_PUBLISH,
+   ES_STATS_REQ_OTHER,
+
+   ES_STATS_RESP_FIRST,             //!< Responses by code, 100..699
+   ES_STATS_RESP_LAST = ES_STATS_RESP_FIRST + (ES_STATS_RESP_CODE_MAX - ES_STATS_RESP_CODE_MIN),
+
+   ES_STATS_MAX
+} es_stats_id_t;
+
+/** Current thread counters, allocated on first use */
+extern __thread int64_t *es_stats_local;
+
+/**
+ * @brief Allocate and register the counters of the current thread
+ * @return counters of the current thread
+ */
+int64_t *es_stats_local_init(void);
+
+/**
+ * @brief Add a value to a counter of the current thread, no lock involved
+ * @param id Counter
+ * @param value Value (negative for a gauge going down)
+ */
+static inline void es_stats_add(es_stats_id_t id, int64_t value)
+{
+   int64_t *c = es_stats_local;
+   if (c == NULL) {
+      c = es_stats_local_init();
+   }
+   /* Single writer: a plain add, published atomically for the readers */
+   __atomic_store_n(&c[id], c[id] + value, __ATOMIC_RELAXED);
+}
+
+#define ES_STATS_INC(_id)        es_stats_add((_id), 1)
+#define ES_STATS_DEC(_id)        es_stats_add((_id), -1)
+
+/**
+ * @brief Counter of a SIP method
+ * @param method Method name
+ * @return ES_STATS_REQ_xxx
+ */
+es_stats_id_t es_stats_method_id(const char *method);
+
+/**
+ * @brief Counter of a response code
+ * @param code Response code
+ * @return ES_STATS_RESP_FIRST + offset, ES_STATS_MAX if out of range
+ */
+es_stats_id_t es_stats_response_id(int code);
+
+/**
+ * @brief Name of a counter
+ * @param id Counter
+ * @return static string
+ */
+const char *es_stats_name(es_stats_id_t id);
+
+/**
+ * @brief Merge all the threads counters
+ * @param values Array of ES_STATS_MAX values
+ */
+void es_stats_snapshot(int64_t *values);
+
+/**
+ * @brief es_stats_cli_register
+ * Register "show stats" command
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_stats_cli_register(es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_STATS_H_ */
@@ -0,0 +1,93 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_SYS_H_
+#define _ESIP_SYS_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Placement of threads and memory
+ * Pinning, NUMA node of a CPU, locked and prefaulted memory: what keeps
+ * migrations and page faults out of the SIP path.
+ */
+
+/** Threads and sockets shown by "show system" */
+#define ES_SYS_MAX_ENTRIES    8
+
+/**
+ * @brief Pin the calling thread to a CPU
+ * @param name Thread name, shown by "show system"
+ * @param cpu CPU, -1 to leave the thread where it is
+ * @return ES_OK on success
+ */
+es_status es_sys_pin_thread(const char *name, int cpu);
+
+/**
+ * @brief NUMA node of a CPU
+ * @return the node, -1 if unknown (or not NUMA)
+ */
+int es_sys_cpu_node(int cpu);
+
+/**
+ * @brief Lock all current and future pages in memory
+ */
+es_status es_sys_lock_memory(void);
+
+/**
+ * @brief Map memory placed on a node and prefaulted
+ * Backed by hugepages when asked and available, else by normal pages
+ * with transparent hugepages advised.
+ * @param size Bytes wanted
+ * @param huge Try hugepages first
+ * @param node NUMA node, -1 for any
+ * @param pSize Bytes mapped (rounded up), for es_sys_unmap()
+ * @return the memory, NULL on failure
+ */
+void *es_sys_map(size_t size, int huge, int node, size_t *pSize);
+
+/**
+ * @brief Release memory from es_sys_map()
+ */
+void es_sys_unmap(void *ptr, size_t size);
+
+/**
+ * @brief Tell the kernel which CPU handles a socket (SO_INCOMING_CPU)
+ */
+es_status es_sys_set_incoming_cpu(int fd, int cpu);
+
+/**
+ * @brief Show a socket in "show system", with the CPU its packets come from
+ */
+es_status es_sys_watch_socket(const char *name, int fd);
+
+/**
+ * @brief es_sys_cli_register
+ * Register "show system" command
+ * @param pCli
+ * @return ES_OK on success
+ */
+es_status es_sys_cli_register(es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_SYS_H_ */
@@ -24,6 +24,13 @@ extern "C" {
 
 typedef struct es_transport_s es_transport_t;
 
+struct es_capture_s;
+struct es_rate_s;
+struct es_acl_s;
+struct es_config_s;
+struct sockaddr_in;
+struct iovec;
+
 typedef void (*es_transport_event_cb)(
       IN es_transport_t  * transp,
       IN int                  ev,
@@ -34,6 +41,7 @@ typedef void (*es_transport_msg_recv_cb)(
       IN es_transport_t   *   transp,
       IN const char const  * msg,
       IN const unsigned int   size,
+      IN const struct sockaddr_in * from,
       OUT void    *    ctx);
 
 
@@ -47,16 +55,51 @@ es_status es_transport_init(es_transport_t **ppCtx, struct event_base * pBase);
 
 es_status es_transport_set_callbacks(es_transport_t *pCtx, struct es_transport_callbacks_s * cs);
 
+/**
+ * @brief Apply the transport settings
+ * Buffer sizes and batch apply at once, the address and port only
+ * before es_transport_start().
+ */
+es_status es_transport_configure(es_transport_t *pCtx, const struct es_config_s *pCfg);
+
+/**
+ * @brief Use a socket handed over by another process instead of binding
+ * Before es_transport_start().
+ */
+es_status es_transport_adopt_socket(es_transport_t *pCtx, int fd);
+
 es_status es_transport_start(es_transport_t *pCtx);
 
+/**
+ * @brief Stop (pause != 0) or start again reading the socket
+ */
+es_status es_transport_pause(es_transport_t *pCtx, int pause);
+
 es_status es_transport_stop(es_transport_t *pCtx);
 
 es_status es_transport_destroy(es_transport_t *pCtx);
 
 es_status es_transport_get_udp_socket(es_transport_t *pCtx, int * fd);
 
+es_status es_transport_get_capture(es_transport_t *pCtx, struct es_capture_s **ppCapture);
+
+/**
+ * @brief Sources allowed to send, checked before the limits
+ */
+es_status es_transport_get_acl(es_transport_t *pCtx, struct es_acl_s **ppAcl);
+
+/**
+ * @brief Limits per source applied to the datagrams received
+ */
+es_status es_transport_get_rate(es_transport_t *pCtx, struct es_rate_s **ppRate);
+
 es_status es_transport_send(es_transport_t *pCtx, char * ip, int port, const char * msg, size_t size);
 
+/**
+ * @brief Send a datagram made of several pieces, without joining them
+ */
+es_status es_transport_sendv(es_transport_t *pCtx, const struct sockaddr_in *to, const struct iovec *iov, unsigned int nb);
+
 #if defined(__cplusplus)
 }
 #endif /* __cplusplus */
@@ -0,0 +1,201 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ESIP_UPGRADE_H_
+#define _ESIP_UPGRADE_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Restart without losing a packet
+ * The running process listens on a Unix socket. A new binary started to
+ * take over connects to it and gets the listening sockets (SCM_RIGHTS),
+ * tells when it is ready, then gets the state of the old one. The old
+ * process stops reading as soon as the new one is ready, the kernel keeps
+ * the datagrams meanwhile, and drains its transactions before exiting.
+ * The old loop waits for ready: the new process does its own init before
+ * it connects. Transactions running at the handoff can not complete: the
+ * messages to them are read by the new process, the old one only sends
+ * its retransmissions until they time out.
+ *
+ *    new                        old
+ *     |------- connect ---------->|
+ *     |<------ sockets -----------|
+ *     |------- ready ------------>|  old stops reading
+ *     |<------ state -------------|
+ *     |------- done ------------->|  old drains and exits
+ */
+typedef struct es_upgrade_s es_upgrade_t;
+
+struct event_base;
+
+/** Max sockets handed over */
+#define ES_UPGRADE_MAX_FDS    8
+
+/** Id of the upgrade socket itself */
+#define ES_UPGRADE_FD_SELF    0
+
+/**
+ * @brief Top level records of the state, each holds the fields of an
+ * object as records of its owner
+ */
+typedef enum es_upgrade_rec_e {
+   ES_UPGRADE_REC_DIALOG = 1,
+   ES_UPGRADE_REC_REGISTRATION,
+   ES_UPGRADE_REC_DIALOG_END,          //!< Change: a dialog ended, its ids
+   ES_UPGRADE_REC_UNREGISTRATION,      //!< Change: a binding removed, AOR and contact
+   ES_UPGRADE_REC_AUTH                 //!< Nonce key and sequence, on upgrade only
+} es_upgrade_rec_t;
+
+/**
+ * @brief A socket handed over, id tells the receiver what it is
+ */
+struct es_upgrade_fd_s {
+   uint32_t                id;
+   int                     fd;
+};
+
+/**
+ * @brief State buffer, a list of type / length / value records
+ * Numbers are in network order.
+ */
+struct es_upgrade_buf_s {
+   uint8_t                 *data;
+   size_t                  len;
+   size_t                  size;
+};
+
+/**
+ * @brief A record read from a state buffer
+ */
+struct es_upgrade_tlv_s {
+   uint16_t                type;
+   uint32_t                len;
+   const uint8_t           *value;
+};
+
+/**
+ * @brief Where a module writes its changes as they happen, one top level
+ * record each, to replay them over the last saved state
+ */
+struct es_upgrade_journal_s {
+   void (*append)(void *arg, uint16_t type, const uint8_t *value, size_t len);
+   void *arg;
+};
+
+/**
+ * @brief What the old process does during the handoff, on its loop
+ */
+struct es_upgrade_handler_s {
+   /** Sockets to hand over, at most ES_UPGRADE_MAX_FDS - 1 */
+   es_status (*give)(void *arg, struct es_upgrade_fd_s *fds, unsigned int *nb);
+   /** The new process reads now: stop reading */
+   void (*pause)(void *arg);
+   /** Write the state to hand over */
+   es_status (*save)(void *arg, struct es_upgrade_buf_s *state);
+   /** The handoff failed after pause: read again */
+   void (*resume)(void *arg);
+   /** The new process runs: drain and exit */
+   void (*done)(void *arg);
+   void *arg;
+};
+
+/**
+ * @brief Add a record, the buffer grows as needed
+ */
+es_status es_upgrade_buf_put(struct es_upgrade_buf_s *buf, uint16_t type, const void *value, size_t len);
+
+/**
+ * @brief Add a string record, with its '\0'. Nothing is added for NULL.
+ */
+es_status es_upgrade_buf_put_str(struct es_upgrade_buf_s *buf, uint16_t type, const char *value);
+
+/**
+ * @brief Add a number record
+ */
+es_status es_upgrade_buf_put_u32(struct es_upgrade_buf_s *buf, uint16_t type, uint32_t value);
+
+/**
+ * @brief Release the buffer data
+ */
+void es_upgrade_buf_free(struct es_upgrade_buf_s *buf);
+
+/**
+ * @brief Read the record at offset and move past it
+ * @return 1 if a record was read, 0 at the end, -1 if malformed
+ */
+int es_upgrade_tlv_next(const uint8_t *data, size_t len, size_t *offset, struct es_upgrade_tlv_s *tlv);
+
+/**
+ * @brief Value of a string record, NULL if it is not one
+ */
+const char *es_upgrade_tlv_str(const struct es_upgrade_tlv_s *tlv);
+
+/**
+ * @brief Value of a number record, 0 if it is not one
+ */
+uint32_t es_upgrade_tlv_u32(const struct es_upgrade_tlv_s *tlv);
+
+/**
+ * @brief Listen for a new process to hand over to
+ * @param ppCtx
+ * @param pBase Loop calling the handler
+ * @param path Unix socket path
+ * @param listenFd Socket already listening on path (handed over), -1 to bind
+ * @param pHandler Handoff steps of the process
+ * @return ES_OK on success
+ */
+es_status es_upgrade_init(es_upgrade_t **ppCtx, struct event_base *pBase, const char *path, int listenFd,
+                          const struct es_upgrade_handler_s *pHandler);
+
+/**
+ * @brief es_upgrade_deinit
+ * The path is left to the new process once handed over.
+ */
+es_status es_upgrade_deinit(es_upgrade_t *pCtx);
+
+/**
+ * @brief Connect to the running process and get its sockets
+ * The socket of path itself comes last with id ES_UPGRADE_FD_SELF, to
+ * give to es_upgrade_init().
+ * @param path Unix socket path
+ * @param pConn Connection for es_upgrade_receive()
+ * @param fds Sockets received, ES_UPGRADE_MAX_FDS
+ * @param pNb Number of sockets received
+ * @return ES_OK on success
+ */
+es_status es_upgrade_connect(const char *path, int *pConn, struct es_upgrade_fd_s *fds, unsigned int *pNb);
+
+/**
+ * @brief Tell the old process we are ready and get its state
+ * Call it once the sockets are in use, before reading them.
+ */
+es_status es_upgrade_receive(int conn, struct es_upgrade_buf_s *state);
+
+/**
+ * @brief Tell the old process we run, and close the connection
+ */
+es_status es_upgrade_finish(int conn);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_UPGRADE_H_ */
@@ -0,0 +1,107 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_WHEEL_H_
+#define _ESIP_WHEEL_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Hierarchical timing wheel
+ * Timers are kept in slots of 4 wheels of 256 ticks, each wheel 256 times
+ * slower than the previous one. Adding or removing a timer is O(1), a
+ * tick only looks at the timers due, plus the ones moved down a wheel
+ * every 256 ticks. The tick length is the caller's: it gives the time.
+ * Not thread safe.
+ */
+typedef struct es_wheel_s es_wheel_t;
+
+/** Bits of a wheel and number of wheels, 2^32 ticks covered */
+#define ES_WHEEL_BITS         8
+#define ES_WHEEL_LEVELS       4
+
+/**
+ * @brief A timer, embedded in the object it times
+ */
+struct es_wheel_entry_s {
+   struct es_wheel_entry_s *next;      //!< NULL when not pending
+   struct es_wheel_entry_s *prev;
+   uint64_t                expire;     //!< Tick it expires at
+};
+
+/**
+ * @brief Called for each timer expired, it is not pending anymore
+ * It can add or remove any timer.
+ */
+typedef void (*es_wheel_expire_cb)(struct es_wheel_entry_s *entry, void *arg);
+
+/**
+ * @brief es_wheel_init
+ * @param ppCtx
+ * @param now Current tick
+ * @param cb Expiry callback
+ * @param arg Given to cb
+ * @return ES_OK on success
+ */
+es_status es_wheel_init(es_wheel_t **ppCtx, uint64_t now, es_wheel_expire_cb cb, void *arg);
+
+/**
+ * @brief es_wheel_deinit
+ * Timers still pending are left as they are, their owner frees them.
+ */
+es_status es_wheel_deinit(es_wheel_t *pCtx);
+
+/**
+ * @brief Start a timer, or move it if pending
+ * A tick already past expires at the next es_wheel_advance(), one beyond
+ * the 2^32 ticks covered is clamped.
+ */
+void es_wheel_add(es_wheel_t *pCtx, struct es_wheel_entry_s *entry, uint64_t expire);
+
+/**
+ * @brief Stop a timer, nothing done if not pending
+ */
+void es_wheel_remove(es_wheel_t *pCtx, struct es_wheel_entry_s *entry);
+
+/**
+ * @brief Expire the timers due up to now, included
+ * @return the number of timers expired
+ */
+unsigned int es_wheel_advance(es_wheel_t *pCtx, uint64_t now);
+
+/**
+ * @brief Number of pending timers
+ */
+unsigned int es_wheel_count(const es_wheel_t *pCtx);
+
+/**
+ * @brief Timer pending
+ */
+static inline int es_wheel_pending(const struct es_wheel_entry_s *entry)
+{
+   return entry->next != NULL;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_WHEEL_H_ */
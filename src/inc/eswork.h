@@ -0,0 +1,86 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _ESIP_WORK_H_
+#define _ESIP_WORK_H_
+
+#include "estypes.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+ * @brief Pool of threads for the work too heavy for the event loop
+ * A job runs on a worker, then its completion on the event loop that
+ * submitted it, woken by an eventfd. The loop goes on reading sockets
+ * meanwhile. Jobs and completions are kept in two rings of a fixed size:
+ * a submission beyond it is refused, the caller does the work itself.
+ */
+typedef struct es_work_s es_work_t;
+
+struct event_base;
+
+/** Jobs in flight, submitted and not completed */
+#define ES_WORK_DEPTH            1024
+
+/** Most threads of a pool */
+#define ES_WORK_MAX_THREADS      64
+
+/**
+ * @brief Work of a job, on a worker: must not touch the state of the loop
+ */
+typedef void (*es_work_run_cb)(void *arg);
+
+/**
+ * @brief Completion of a job, on the event loop
+ */
+typedef void (*es_work_done_cb)(void *arg);
+
+/**
+ * @brief es_work_init
+ * @param ppCtx
+ * @param base Event loop of the completions
+ * @param threads Workers, 1 to ES_WORK_MAX_THREADS
+ * @return ES_OK on success
+ */
+es_status es_work_init(es_work_t **ppCtx, struct event_base *base, unsigned int threads);
+
+/**
+ * @brief es_work_deinit
+ * Jobs submitted are run, then their completions, before it returns.
+ */
+es_status es_work_deinit(es_work_t *pCtx);
+
+/**
+ * @brief Run a job on a worker, then its completion on the event loop
+ * From the event loop thread only.
+ * @return ES_OK, ES_ERROR_TRY_AGAIN if ES_WORK_DEPTH jobs are in flight
+ */
+es_status es_work_submit(es_work_t *pCtx, es_work_run_cb run, es_work_done_cb done, void *arg);
+
+/**
+ * @brief es_work_cli_register
+ * Register "show work" command
+ */
+es_status es_work_cli_register(es_work_t *pCtx, es_cli_t *pCli);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif /* _ESIP_WORK_H_ */
@@ -0,0 +1,482 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esconfig.h"
+#include "esacl.h"
+
+#define ES_ACL_MAGIC             0x20141217
+
+/** Bits per level of the trie, a node has an entry per value */
+#define ES_ACL_STRIDE            8
+#define ES_ACL_FANOUT            (1U << ES_ACL_STRIDE)
+
+/** Action of an entry, in its low bits, 0 to keep the shorter prefix one */
+#define ES_ACL_ALLOW             1
+#define ES_ACL_DENY              2
+#define ES_ACL_ACTION_MASK       3
+
+/** Child node of an entry, in its high bits, 0 for none (the root) */
+#define ES_ACL_CHILD_SHIFT       2
+
+/**
+ * @brief Trie of one address family
+ */
+struct _es_acl_trie_s {
+   /* nbNodes * ES_ACL_FANOUT entries, the root first */
+   uint32_t                  *nodes;
+   unsigned int              nbNodes;
+   unsigned int              size;
+   /* Bytes of an address */
+   unsigned int              levels;
+   /* Action of the /0 */
+   uint32_t                  def;
+   unsigned int              rules;
+};
+
+/**
+ * @brief Tries in use, switched as a whole on reload
+ */
+struct _es_acl_table_s {
+   struct _es_acl_trie_s     v4;
+   struct _es_acl_trie_s     v6;
+};
+
+/**
+ * @brief A line of the file, until the trie is built
+ */
+struct _es_acl_rule_s {
+   int                       family;
+   uint8_t                   addr[16];
+   unsigned int              len;
+   uint32_t                  action;
+   unsigned int              line;
+};
+
+struct es_acl_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct _es_acl_table_s    *table;
+   char                      path[ES_CONFIG_STR_LEN];
+   /* Counters, read by the CLI */
+   unsigned int              rulesV4;
+   unsigned int              rulesV6;
+   unsigned int              nodes;
+   uint64_t                  allowed;
+   uint64_t                  denied;
+   uint64_t                  reloads;
+};
+
+static inline uint32_t _es_acl_find(const struct _es_acl_trie_s *trie, const uint8_t *key)
+{
+   const uint32_t *node = trie->nodes;
+   uint32_t action = trie->def;
+   unsigned int i = 0;
+
+   if (node == NULL) {
+      return action;
+   }
+
+   /* The deepest entry with an action is the longest prefix */
+   for (i = 0; i < trie->levels; ++i) {
+      uint32_t e = node[key[i]];
+
+      if ((e & ES_ACL_ACTION_MASK) != 0) {
+         action = e & ES_ACL_ACTION_MASK;
+      }
+      if ((e >> ES_ACL_CHILD_SHIFT) == 0) {
+         break;
+      }
+      node = &trie->nodes[(e >> ES_ACL_CHILD_SHIFT) * ES_ACL_FANOUT];
+   }
+
+   return action;
+}
+
+static void _es_acl_table_free(struct _es_acl_table_s *table)
+{
+   if (table == NULL) {
+      return;
+   }
+
+   free(table->v4.nodes);
+   free(table->v6.nodes);
+   free(table);
+}
+
+static es_status _es_acl_node_new(struct _es_acl_trie_s *trie, unsigned int *index)
+{
+   if (trie->nbNodes == trie->size) {
+      unsigned int size = (trie->size == 0) ? 4 : trie->size * 2;
+      uint32_t *nodes = (uint32_t *) realloc(trie->nodes, (size_t)size * ES_ACL_FANOUT * sizeof(uint32_t));
+
+      if (nodes == NULL) {
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+      trie->nodes = nodes;
+      trie->size = size;
+   }
+
+   memset(&trie->nodes[trie->nbNodes * ES_ACL_FANOUT], 0, ES_ACL_FANOUT * sizeof(uint32_t));
+   *index = trie->nbNodes++;
+   return ES_OK;
+}
+
+/**
+ * @brief Put a rule in the trie, after the shorter ones
+ * A prefix ends in the level of its last bit and covers the entries of
+ * the values it leaves free there.
+ */
+static es_status _es_acl_trie_add(struct _es_acl_trie_s *trie, const struct _es_acl_rule_s *rule)
+{
+   unsigned int level = 0;
+   unsigned int node = 0;
+   unsigned int span = 0;
+   unsigned int first = 0;
+   unsigned int i = 0;
+
+   trie->rules++;
+
+   if (rule->len == 0) {
+      trie->def = rule->action;
+      return ES_OK;
+   }
+
+   if ((trie->nbNodes == 0) && (_es_acl_node_new(trie, &node) != ES_OK)) {
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   level = (rule->len - 1) / ES_ACL_STRIDE;
+   for (i = 0; i < level; ++i) {
+      uint32_t *e = &trie->nodes[node * ES_ACL_FANOUT + rule->addr[i]];
+      unsigned int child = *e >> ES_ACL_CHILD_SHIFT;
+
+      if (child == 0) {
+         if (_es_acl_node_new(trie, &child) != ES_OK) {
+            return ES_ERROR_OUTOFRESOURCES;
+         }
+         /* Nodes may have moved */
+         e = &trie->nodes[node * ES_ACL_FANOUT + rule->addr[i]];
+         *e |= child << ES_ACL_CHILD_SHIFT;
+      }
+      node = child;
+   }
+
+   span = 1U << (ES_ACL_STRIDE * (level + 1) - rule->len);
+   first = rule->addr[level] & ~(span - 1);
+   for (i = first; i < first + span; ++i) {
+      uint32_t *e = &trie->nodes[node * ES_ACL_FANOUT + i];
+      *e = (*e & ~ES_ACL_ACTION_MASK) | rule->action;
+   }
+
+   return ES_OK;
+}
+
+static int _es_acl_rule_cmp(const void *a, const void *b)
+{
+   const struct _es_acl_rule_s *ra = (const struct _es_acl_rule_s *)a;
+   const struct _es_acl_rule_s *rb = (const struct _es_acl_rule_s *)b;
+
+   /* Shorter first, then in file order: the last of a prefix wins */
+   if (ra->len != rb->len) {
+      return (ra->len < rb->len) ? -1 : 1;
+   }
+   return (ra->line < rb->line) ? -1 : (ra->line > rb->line);
+}
+
+/**
+ * @brief Parse "allow|deny address[/length]", host bits cleared
+ */
+static es_status _es_acl_rule_parse(const char *action, char *prefix, struct _es_acl_rule_s *rule)
+{
+   char *slash = strchr(prefix, '/');
+   unsigned int bits = 0;
+   unsigned int i = 0;
+   char *end = NULL;
+
+   if (strcmp(action, "allow") == 0) {
+      rule->action = ES_ACL_ALLOW;
+   } else if (strcmp(action, "deny") == 0) {
+      rule->action = ES_ACL_DENY;
+   } else {
+      return ES_ERROR_BADPARAM;
+   }
+
+   if (slash != NULL) {
+      *slash++ = '\0';
+   }
+
+   memset(rule->addr, 0, sizeof(rule->addr));
+   if (inet_pton(AF_INET, prefix, rule->addr) == 1) {
+      rule->family = AF_INET;
+      bits = 32;
+   } else if (inet_pton(AF_INET6, prefix, rule->addr) == 1) {
+      rule->family = AF_INET6;
+      bits = 128;
+   } else {
+      return ES_ERROR_BADPARAM;
+   }
+
+   rule->len = bits;
+   if (slash != NULL) {
+      unsigned long len = strtoul(slash, &end, 10);
+
+      if ((*slash == '\0') || (*end != '\0') || (len > bits)) {
+         return ES_ERROR_BADPARAM;
+      }
+      rule->len = (unsigned int)len;
+   }
+
+   for (i = rule->len; i < bits; ++i) {
+      rule->addr[i / 8] &= (uint8_t)~(0x80U >> (i % 8));
+   }
+
+   return ES_OK;
+}
+
+/**
+ * @brief Read an ACL file and build its tries
+ */
+static es_status _es_acl_load(const char *path, struct _es_acl_table_s **ppTable)
+{
+   struct _es_acl_table_s *table = NULL;
+   struct _es_acl_rule_s *rules = NULL;
+   char line[256];
+   unsigned int lines = 0;
+   unsigned int lineNb = 0;
+   unsigned int nb = 0;
+   unsigned int errors = 0;
+   unsigned int i = 0;
+   FILE *f = NULL;
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open ACL %s: %s", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   while (fgets(line, sizeof(line), f) != NULL) {
+      lines++;
+   }
+   rewind(f);
+
+   table = (struct _es_acl_table_s *) calloc(1, sizeof(struct _es_acl_table_s));
+   rules = (struct _es_acl_rule_s *) calloc((lines > 0) ? lines : 1, sizeof(struct _es_acl_rule_s));
+   if ((table == NULL) || (rules == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not load ACL: no more memory");
+      free(rules);
+      free(table);
+      fclose(f);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+   table->v4.levels = 4;
+   table->v4.def = ES_ACL_ALLOW;
+   table->v6.levels = 16;
+   table->v6.def = ES_ACL_ALLOW;
+
+   while ((fgets(line, sizeof(line), f) != NULL) && (lineNb < lines)) {
+      char action[8];
+      char prefix[INET6_ADDRSTRLEN + 8];
+      char extra[2];
+      char *p = NULL;
+      int n = 0;
+
+      lineNb++;
+
+      if ((p = strchr(line, '#')) != NULL) {
+         *p = '\0';
+      }
+
+      n = sscanf(line, "%7s %53s %1s", action, prefix, extra);
+      if (n <= 0) {
+         continue;
+      }
+
+      if ((n != 2) || (_es_acl_rule_parse(action, prefix, &rules[nb]) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: expected allow or deny and an address[/length]", path, lineNb);
+         errors++;
+         continue;
+      }
+      rules[nb++].line = lineNb;
+   }
+
+   fclose(f);
+
+   qsort(rules, nb, sizeof(struct _es_acl_rule_s), _es_acl_rule_cmp);
+   for (i = 0; (i < nb) && (errors == 0); ++i) {
+      if (_es_acl_trie_add((rules[i].family == AF_INET) ? &table->v4 : &table->v6, &rules[i]) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not build ACL: no more memory");
+         errors++;
+      }
+   }
+
+   free(rules);
+
+   if (errors != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "ACL %s not applied: %u error(s)", path, errors);
+      _es_acl_table_free(table);
+      return ES_ERROR_BADPARAM;
+   }
+
+   *ppTable = table;
+   return ES_OK;
+}
+
+es_status es_acl_init(es_acl_t **ppCtx)
+{
+   struct es_acl_s *_pCtx = NULL;
+
+   if (ppCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_acl_s *) calloc(1, sizeof(struct es_acl_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create ACL: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_ACL_MAGIC;
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_acl_deinit(es_acl_t *pCtx)
+{
+   struct es_acl_s *_pCtx = (struct es_acl_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_ACL_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _es_acl_table_free(_pCtx->table);
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_acl_configure(es_acl_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_acl_s *_pCtx = (struct es_acl_s *)pCtx;
+   struct _es_acl_table_s *table = NULL;
+   es_status ret = ES_OK;
+
+   if ((_pCtx == NULL) || (pCfg == NULL) || (_pCtx->magic != ES_ACL_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((pCfg->aclFile[0] != '\0') && ((ret = _es_acl_load(pCfg->aclFile, &table)) != ES_OK)) {
+      return ret;
+   }
+
+   /* Lookups run on this thread: the old tries are not in use */
+   table = __atomic_exchange_n(&_pCtx->table, table, __ATOMIC_ACQ_REL);
+   _es_acl_table_free(table);
+   table = _pCtx->table;
+
+   strcpy(_pCtx->path, pCfg->aclFile);
+   __atomic_store_n(&_pCtx->rulesV4, (table != NULL) ? table->v4.rules : 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&_pCtx->rulesV6, (table != NULL) ? table->v6.rules : 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&_pCtx->nodes, (table != NULL) ? table->v4.nbNodes + table->v6.nbNodes : 0, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&_pCtx->reloads, 1, __ATOMIC_RELAXED);
+
+   if (table != NULL) {
+      ESIP_TRACE(ESIP_LOG_INFO, "ACL %s: %u IPv4 and %u IPv6 rule(s)", _pCtx->path, table->v4.rules, table->v6.rules);
+   }
+
+   return ES_OK;
+}
+
+int es_acl_allow(es_acl_t *pCtx, const struct sockaddr *from)
+{
+   struct es_acl_s *_pCtx = (struct es_acl_s *)pCtx;
+   const struct _es_acl_table_s *table = __atomic_load_n(&_pCtx->table, __ATOMIC_ACQUIRE);
+   uint32_t action = ES_ACL_ALLOW;
+
+   if (table == NULL) {
+      return 1;
+   }
+
+   if (from->sa_family == AF_INET) {
+      action = _es_acl_find(&table->v4, (const uint8_t *)&((const struct sockaddr_in *)from)->sin_addr.s_addr);
+   } else if (from->sa_family == AF_INET6) {
+      action = _es_acl_find(&table->v6, ((const struct sockaddr_in6 *)from)->sin6_addr.s6_addr);
+   }
+
+   if (action == ES_ACL_DENY) {
+      __atomic_add_fetch(&_pCtx->denied, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   __atomic_add_fetch(&_pCtx->allowed, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+static int _es_acl_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_acl_s *_pCtx = (struct es_acl_s *)arg;
+   unsigned int nodes = __atomic_load_n(&_pCtx->nodes, __ATOMIC_RELAXED);
+
+   if (_pCtx->path[0] == '\0') {
+      es_cli_print(pCli, "ACL off: every source is allowed");
+   } else {
+      es_cli_print(pCli, "ACL %s: %u IPv4 and %u IPv6 rule(s), %u node(s) (%u KB)", _pCtx->path,
+                   __atomic_load_n(&_pCtx->rulesV4, __ATOMIC_RELAXED),
+                   __atomic_load_n(&_pCtx->rulesV6, __ATOMIC_RELAXED), nodes,
+                   (unsigned int)(nodes * ES_ACL_FANOUT * sizeof(uint32_t) / 1024));
+   }
+   es_cli_print(pCli, "%14s %14s %10s", "allowed", "denied", "loads");
+   es_cli_print(pCli, "%14llu %14llu %10llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->allowed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->denied, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->reloads, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_acl_cli_register(es_acl_t *pCtx, es_cli_t *pCli)
+{
+   struct es_acl_s *_pCtx = (struct es_acl_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_ACL_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show acl", "Show the source ACL and its counters", _es_acl_cli_show, _pCtx);
+}
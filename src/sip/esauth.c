@@ -0,0 +1,1105 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+
+#include <osip2/osip.h>
+#include <osipparser2/osip_md5.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshash.h"
+#include "eshist.h"
+#include "esmem.h"
+#include "esconfig.h"
+#include "esdb.h"
+#include "esupgrade.h"
+#include "esauth.h"
+
+#define ES_AUTH_MAGIC            0x20141125
+
+/** Max length of a user name */
+#define ES_AUTH_USER_LEN         64
+
+/** HA1 and responses, in hex */
+#define ES_AUTH_HEX_LEN          32
+
+/** Nonce: time and sequence in hex, then the HMAC */
+#define ES_AUTH_NONCE_LEN        (8 + 8 + ES_AUTH_HEX_LEN)
+
+/** Nonces followed for replay, 2^bits words of 4 bytes */
+#define ES_AUTH_RING_BITS        20
+#define ES_AUTH_RING_SIZE        (1U << ES_AUTH_RING_BITS)
+
+/** Nonce-counts accepted per nonce, one bit each */
+#define ES_AUTH_MAX_NC           32
+
+/** HMAC block and key */
+#define ES_AUTH_BLOCK            64
+#define ES_AUTH_KEY_LEN          16
+
+/** Method and credentials copied into a job */
+#define ES_AUTH_METHOD_LEN       16
+#define ES_AUTH_JOB_BUF_LEN      768
+
+/** auth.register / auth.invite */
+#define ES_AUTH_REGISTER         0x1
+#define ES_AUTH_INVITE           0x2
+
+/**
+ * @brief A user and its HA1, MD5(user:realm:password)
+ */
+struct _es_auth_user_s {
+   /* Length 0 for a free slot */
+   char                      name[ES_AUTH_USER_LEN];
+   unsigned int              len;
+   char                      ha1[ES_AUTH_HEX_LEN];
+};
+
+/**
+ * @brief Users of a file, open addressing at most half full
+ */
+struct _es_auth_users_s {
+   struct _es_auth_user_s    *slots;
+   unsigned int              mask;
+   unsigned int              nb;
+   /* The context and the jobs running, taken and left on the loop */
+   unsigned int              refs;
+};
+
+/**
+ * @brief Fields of the ES_UPGRADE_REC_AUTH record
+ */
+enum _es_auth_rec_e {
+   ES_AUTH_REC_KEY = 1,
+   ES_AUTH_REC_SEQ
+};
+
+/**
+ * @brief What a nonce is worth
+ */
+enum _es_auth_nonce_e {
+   _ES_AUTH_NONCE_BAD = 0,       /* Not ours */
+   _ES_AUTH_NONCE_STALE,         /* Ours, too old */
+   _ES_AUTH_NONCE_VALID
+};
+
+/* Verify results, set by es_auth_verify_run() */
+#define _ES_AUTH_JOB_NONCE       0x1
+#define _ES_AUTH_JOB_MATCH       0x2
+
+/**
+ * @brief Digest fields of a credentials, without their quotes
+ */
+struct _es_auth_cred_s {
+   const char                *user;
+   size_t                    userLen;
+   const char                *nonce;
+   size_t                    nonceLen;
+   const char                *uri;
+   size_t                    uriLen;
+   const char                *response;
+   size_t                    responseLen;
+   const char                *cnonce;
+   size_t                    cnonceLen;
+   const char                *qop;
+   size_t                    qopLen;
+   const char                *nc;
+   size_t                    ncLen;
+   const char                *algorithm;
+   size_t                    algorithmLen;
+};
+
+/**
+ * @brief A verification, its digests done away from the loop
+ * It holds copies of the credentials, the request may be gone when it
+ * runs, and a reference on the users table.
+ */
+struct es_auth_job_s {
+   struct _es_auth_cred_s    cred;
+   char                      method[ES_AUTH_METHOD_LEN];
+   char                      realm[ES_CONFIG_STR_LEN];
+   size_t                    realmLen;
+   unsigned int              nc;
+   struct _es_auth_users_s   *users;
+   es_db_t                   *db;
+   /* Results */
+   unsigned int              flags;
+   uint32_t                  ts;
+   uint32_t                  seq;
+   /* The credentials, cred points to them */
+   size_t                    used;
+   char                      buf[ES_AUTH_JOB_BUF_LEN];
+};
+
+struct es_auth_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* Empty when off */
+   char                      realm[ES_CONFIG_STR_LEN];
+   size_t                    realmLen;
+   unsigned int              methods;
+   unsigned int              ttl;
+   /* Users file and its table, NULL if none */
+   struct _es_auth_users_s   *users;
+   /* Subscribers database, NULL if none */
+   es_db_t                   *db;
+   /* HMAC-MD5 of the nonces: the key, handed over on upgrade, and the
+      states after the inner and outer pads */
+   unsigned char             key[ES_AUTH_KEY_LEN];
+   osip_MD5_CTX              inner;
+   osip_MD5_CTX              outer;
+   /* Nonce-counts used, by nonce sequence; the next sequence */
+   uint32_t                  *ncBits;
+   uint32_t                  seq;
+   /* First sequence of this process, the nonce-counts of the older ones
+      stayed in the previous process */
+   uint32_t                  seqFirst;
+   /* Counters, read by the CLI */
+   unsigned int              usersNb;
+   uint64_t                  challenged;
+   uint64_t                  accepted;
+   uint64_t                  stale;
+   uint64_t                  replayed;
+   uint64_t                  rejected;
+   uint64_t                  malformed;
+};
+
+/*******************************************************************************
+                              Digests
+ ******************************************************************************/
+
+static const char _es_auth_hex_digits[] = "0123456789abcdef";
+
+static void _es_auth_hex(const unsigned char *bin, size_t len, char *hex)
+{
+   size_t i = 0;
+
+   for (i = 0; i < len; ++i) {
+      hex[2 * i] = _es_auth_hex_digits[bin[i] >> 4];
+      hex[2 * i + 1] = _es_auth_hex_digits[bin[i] & 0xf];
+   }
+}
+
+static void _es_auth_md5_update(osip_MD5_CTX *md5, const char *p, size_t len)
+{
+   osip_MD5Update(md5, (unsigned char *)p, (unsigned int)len);
+}
+
+/* MD5 of the pieces joined by ':', in hex */
+static void _es_auth_md5_hex(char hex[ES_AUTH_HEX_LEN], unsigned int nb, const char **parts, const size_t *lens)
+{
+   osip_MD5_CTX md5;
+   unsigned char digest[16];
+   unsigned int i = 0;
+
+   osip_MD5Init(&md5);
+   for (i = 0; i < nb; ++i) {
+      if (i != 0) {
+         _es_auth_md5_update(&md5, ":", 1);
+      }
+      _es_auth_md5_update(&md5, parts[i], lens[i]);
+   }
+   osip_MD5Final(digest, &md5);
+
+   _es_auth_hex(digest, sizeof(digest), hex);
+}
+
+/* RFC 2104, the pads of the key absorbed once */
+static void _es_auth_hmac_key(struct es_auth_s *pCtx, const unsigned char *key, size_t len)
+{
+   unsigned char pad[ES_AUTH_BLOCK];
+   size_t i = 0;
+
+   memset(pad, 0x36, sizeof(pad));
+   for (i = 0; i < len; ++i) {
+      pad[i] ^= key[i];
+   }
+   osip_MD5Init(&pCtx->inner);
+   osip_MD5Update(&pCtx->inner, pad, sizeof(pad));
+
+   memset(pad, 0x5c, sizeof(pad));
+   for (i = 0; i < len; ++i) {
+      pad[i] ^= key[i];
+   }
+   osip_MD5Init(&pCtx->outer);
+   osip_MD5Update(&pCtx->outer, pad, sizeof(pad));
+}
+
+/* HMAC of the time, sequence and realm of a nonce, in hex; the key does
+   not change once drawn, any thread */
+static void _es_auth_nonce_sign(const struct es_auth_s *pCtx, const char *realm, size_t realmLen, const char *head,
+                                char hex[ES_AUTH_HEX_LEN])
+{
+   osip_MD5_CTX md5 = pCtx->inner;
+   unsigned char digest[16];
+
+   _es_auth_md5_update(&md5, head, 16);
+   _es_auth_md5_update(&md5, realm, realmLen);
+   osip_MD5Final(digest, &md5);
+
+   md5 = pCtx->outer;
+   osip_MD5Update(&md5, digest, sizeof(digest));
+   osip_MD5Final(digest, &md5);
+
+   _es_auth_hex(digest, sizeof(digest), hex);
+}
+
+static inline uint32_t _es_auth_now(void)
+{
+   return (uint32_t)(es_hist_now() / 1000000000ULL);
+}
+
+/* A new nonce, its nonce-counts all unused */
+static void _es_auth_nonce_new(struct es_auth_s *pCtx, char nonce[ES_AUTH_NONCE_LEN + 1])
+{
+   uint32_t seq = pCtx->seq++;
+
+   pCtx->ncBits[seq & (ES_AUTH_RING_SIZE - 1)] = 0;
+
+   snprintf(nonce, 17, "%08x%08x", _es_auth_now(), seq);
+   _es_auth_nonce_sign(pCtx, pCtx->realm, pCtx->realmLen, nonce, nonce + 16);
+   nonce[ES_AUTH_NONCE_LEN] = '\0';
+}
+
+/* A nonce of ours, its time and sequence; any thread */
+static int _es_auth_nonce_check(const struct es_auth_s *pCtx, const char *realm, size_t realmLen, const char *nonce,
+                                size_t len, uint32_t *pTs, uint32_t *pSeq)
+{
+   char head[17];
+   char hex[ES_AUTH_HEX_LEN];
+   unsigned int diff = 0;
+   char *end = NULL;
+   size_t i = 0;
+
+   if (len != ES_AUTH_NONCE_LEN) {
+      return 0;
+   }
+
+   memcpy(head, nonce, 16);
+   head[16] = '\0';
+   _es_auth_nonce_sign(pCtx, realm, realmLen, head, hex);
+
+   /* Same time whatever differs */
+   for (i = 0; i < ES_AUTH_HEX_LEN; ++i) {
+      diff |= (unsigned int)(hex[i] ^ nonce[16 + i]);
+   }
+   if (diff != 0) {
+      return 0;
+   }
+
+   *pSeq = (uint32_t)strtoul(head + 8, &end, 16);
+   head[8] = '\0';
+   *pTs = (uint32_t)strtoul(head, &end, 16);
+
+   return 1;
+}
+
+/* Too old, its bits given to a newer nonce, or given by the previous process */
+static enum _es_auth_nonce_e _es_auth_nonce_fresh(const struct es_auth_s *pCtx, uint32_t ts, uint32_t seq)
+{
+   if ((_es_auth_now() - ts > pCtx->ttl) || (pCtx->seq - 1 - seq >= ES_AUTH_RING_SIZE) ||
+       (seq - pCtx->seqFirst >= pCtx->seq - pCtx->seqFirst)) {
+      return _ES_AUTH_NONCE_STALE;
+   }
+
+   return _ES_AUTH_NONCE_VALID;
+}
+
+/*******************************************************************************
+                              Users
+ ******************************************************************************/
+
+static void _es_auth_users_free(struct _es_auth_users_s *users)
+{
+   if (users == NULL) {
+      return;
+   }
+
+   es_mem_free(users->slots);
+   es_mem_free(users);
+}
+
+/* Freed with its last reference */
+static void _es_auth_users_put(struct _es_auth_users_s *users)
+{
+   if ((users != NULL) && (--users->refs == 0)) {
+      _es_auth_users_free(users);
+   }
+}
+
+static struct _es_auth_user_s *_es_auth_users_slot(const struct _es_auth_users_s *users, const char *name, size_t len)
+{
+   uint32_t i = es_hash_fnv1a(name, len) & users->mask;
+
+   for (;; i = (i + 1) & users->mask) {
+      struct _es_auth_user_s *u = &users->slots[i];
+
+      if ((u->len == 0) || ((u->len == len) && (memcmp(u->name, name, len) == 0))) {
+         return u;
+      }
+   }
+}
+
+/**
+ * @brief Read a users file, "user password" or "user md5:HA1" per line
+ */
+static es_status _es_auth_users_load(const char *path, const char *realm, struct _es_auth_users_s **ppUsers)
+{
+   struct _es_auth_users_s *users = NULL;
+   char line[256];
+   unsigned int lines = 0;
+   unsigned int lineNb = 0;
+   unsigned int size = 16;
+   unsigned int errors = 0;
+   FILE *f = NULL;
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open users %s: %s", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   /* Sized for all the lines, at most half full */
+   while (fgets(line, sizeof(line), f) != NULL) {
+      lines++;
+   }
+   while (size < 2 * lines) {
+      size *= 2;
+   }
+   rewind(f);
+
+   users = (struct _es_auth_users_s *) es_mem_calloc(ES_MEM_AUTH, 1, sizeof(struct _es_auth_users_s));
+   if (users != NULL) {
+      users->slots = (struct _es_auth_user_s *) es_mem_calloc(ES_MEM_AUTH, size, sizeof(struct _es_auth_user_s));
+      users->mask = size - 1;
+      users->refs = 1;
+   }
+   if ((users == NULL) || (users->slots == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not load users: no more memory");
+      _es_auth_users_free(users);
+      fclose(f);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   while ((fgets(line, sizeof(line), f) != NULL) && (lineNb < lines)) {
+      char name[ES_AUTH_USER_LEN];
+      char secret[ES_AUTH_USER_LEN + 8];
+      char extra[2];
+      struct _es_auth_user_s *u = NULL;
+      size_t len = 0;
+      char *p = NULL;
+      int n = 0;
+
+      lineNb++;
+
+      if ((p = strchr(line, '#')) != NULL) {
+         *p = '\0';
+      }
+
+      n = sscanf(line, "%63s %71s %1s", name, secret, extra);
+      if (n <= 0) {
+         continue;
+      }
+
+      len = strlen(name);
+      u = (n == 2) ? _es_auth_users_slot(users, name, len) : NULL;
+      if ((u == NULL) || (u->len != 0)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: expected a new user and its password or md5:HA1", path, lineNb);
+         errors++;
+         continue;
+      }
+
+      if (strncmp(secret, "md5:", 4) == 0) {
+         if ((strlen(secret + 4) != ES_AUTH_HEX_LEN) || (strspn(secret + 4, "0123456789abcdefABCDEF") != ES_AUTH_HEX_LEN)) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: HA1 must be 32 hex digits", path, lineNb);
+            errors++;
+            continue;
+         }
+         for (n = 0; n < ES_AUTH_HEX_LEN; ++n) {
+            u->ha1[n] = (char)((secret[4 + n] >= 'A') && (secret[4 + n] <= 'F') ? secret[4 + n] - 'A' + 'a' : secret[4 + n]);
+         }
+      } else {
+         const char *parts[3] = { name, realm, secret };
+         size_t lens[3] = { len, strlen(realm), strlen(secret) };
+         _es_auth_md5_hex(u->ha1, 3, parts, lens);
+      }
+
+      memcpy(u->name, name, len);
+      u->len = (unsigned int)len;
+      users->nb++;
+   }
+
+   fclose(f);
+
+   if (errors != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Users %s not applied: %u error(s)", path, errors);
+      _es_auth_users_free(users);
+      return ES_ERROR_BADPARAM;
+   }
+
+   *ppUsers = users;
+   return ES_OK;
+}
+
+/*******************************************************************************
+                              Credentials
+ ******************************************************************************/
+
+/* A parameter without its quotes, NULL if none */
+static const char *_es_auth_unquote(const char *v, size_t *pLen)
+{
+   size_t len = 0;
+
+   if (v == NULL) {
+      *pLen = 0;
+      return NULL;
+   }
+
+   len = strlen(v);
+   if ((len >= 2) && (v[0] == '"') && (v[len - 1] == '"')) {
+      *pLen = len - 2;
+      return v + 1;
+   }
+
+   *pLen = len;
+   return v;
+}
+
+/* The Digest credentials of our realm, 0 if none */
+static int _es_auth_credentials(const struct es_auth_s *pCtx, osip_message_t *request, struct _es_auth_cred_s *cred)
+{
+   osip_authorization_t *auth = NULL;
+   int i = 0;
+
+   for (i = 0; osip_message_get_authorization(request, i, &auth) >= 0; ++i) {
+      const char *realm = NULL;
+      size_t realmLen = 0;
+
+      if ((auth == NULL) || (auth->auth_type == NULL) || (strcasecmp(auth->auth_type, "Digest") != 0)) {
+         continue;
+      }
+
+      realm = _es_auth_unquote(auth->realm, &realmLen);
+      if ((realm == NULL) || (realmLen != pCtx->realmLen) || (memcmp(realm, pCtx->realm, realmLen) != 0)) {
+         continue;
+      }
+
+      memset(cred, 0, sizeof(*cred));
+      cred->user = _es_auth_unquote(auth->username, &cred->userLen);
+      cred->nonce = _es_auth_unquote(auth->nonce, &cred->nonceLen);
+      cred->uri = _es_auth_unquote(auth->uri, &cred->uriLen);
+      cred->response = _es_auth_unquote(auth->response, &cred->responseLen);
+      cred->cnonce = _es_auth_unquote(auth->cnonce, &cred->cnonceLen);
+      cred->qop = _es_auth_unquote(auth->message_qop, &cred->qopLen);
+      cred->nc = _es_auth_unquote(auth->nonce_count, &cred->ncLen);
+      cred->algorithm = _es_auth_unquote(auth->algorithm, &cred->algorithmLen);
+      return 1;
+   }
+
+   return 0;
+}
+
+/* Nonce-count of qop=auth, 1 without qop; 0 if not valid, ES_AUTH_MAX_NC + 1
+   past the counts a nonce is good for */
+static unsigned int _es_auth_nc(const struct _es_auth_cred_s *cred)
+{
+   unsigned long nc = 0;
+   size_t i = 0;
+
+   if (cred->qop == NULL) {
+      return 1;
+   }
+
+   if (cred->ncLen != 8) {
+      return 0;
+   }
+
+   for (i = 0; i < cred->ncLen; ++i) {
+      const char *d = strchr(_es_auth_hex_digits, (cred->nc[i] >= 'A') && (cred->nc[i] <= 'F') ?
+                             cred->nc[i] - 'A' + 'a' : cred->nc[i]);
+      if ((d == NULL) || (*d == '\0')) {
+         return 0;
+      }
+      nc = (nc << 4) | (unsigned long)(d - _es_auth_hex_digits);
+   }
+
+   return (nc <= ES_AUTH_MAX_NC) ? (unsigned int)nc : ES_AUTH_MAX_NC + 1;
+}
+
+/* The response given against the expected one, the same time whatever
+   differs; hex digits of any case */
+static int _es_auth_response_equal(const struct _es_auth_cred_s *cred, const char expected[ES_AUTH_HEX_LEN])
+{
+   unsigned int diff = 0;
+   size_t i = 0;
+
+   if (cred->responseLen != ES_AUTH_HEX_LEN) {
+      return 0;
+   }
+
+   for (i = 0; i < ES_AUTH_HEX_LEN; ++i) {
+      diff |= (unsigned int)(tolower((unsigned char)cred->response[i]) ^ expected[i]);
+   }
+
+   return (diff == 0);
+}
+
+/* The response the user must have given */
+static void _es_auth_expected(const struct _es_auth_user_s *u, const char *method, const struct _es_auth_cred_s *cred,
+                              char hex[ES_AUTH_HEX_LEN])
+{
+   char ha2[ES_AUTH_HEX_LEN];
+   const char *parts[6];
+   size_t lens[6];
+
+   parts[0] = method;
+   lens[0] = strlen(method);
+   parts[1] = cred->uri;
+   lens[1] = cred->uriLen;
+   _es_auth_md5_hex(ha2, 2, parts, lens);
+
+   parts[0] = u->ha1;
+   lens[0] = ES_AUTH_HEX_LEN;
+   parts[1] = cred->nonce;
+   lens[1] = cred->nonceLen;
+
+   if (cred->qop == NULL) {
+      parts[2] = ha2;
+      lens[2] = ES_AUTH_HEX_LEN;
+      _es_auth_md5_hex(hex, 3, parts, lens);
+      return;
+   }
+
+   parts[2] = cred->nc;
+   lens[2] = cred->ncLen;
+   parts[3] = cred->cnonce;
+   lens[3] = cred->cnonceLen;
+   parts[4] = cred->qop;
+   lens[4] = cred->qopLen;
+   parts[5] = ha2;
+   lens[5] = ES_AUTH_HEX_LEN;
+   _es_auth_md5_hex(hex, 6, parts, lens);
+}
+
+static int _es_auth_challenged(const struct es_auth_s *pCtx, const osip_message_t *request)
+{
+   unsigned int methods = __atomic_load_n(&pCtx->methods, __ATOMIC_RELAXED);
+
+   if ((pCtx->realmLen == 0) || (request->sip_method == NULL)) {
+      return 0;
+   }
+
+   return ((methods & ES_AUTH_REGISTER) && (strcmp(request->sip_method, "REGISTER") == 0)) ||
+          ((methods & ES_AUTH_INVITE) && (strcmp(request->sip_method, "INVITE") == 0));
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_auth_init(es_auth_t **ppCtx)
+{
+   struct es_auth_s *_pCtx = NULL;
+   int fd = -1;
+
+   if (ppCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_auth_s *) es_mem_calloc(ES_MEM_AUTH, 1, sizeof(struct es_auth_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create auth: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_AUTH_MAGIC;
+
+   /* Nonces of another process are not ours, unless it hands its key over */
+   fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+   if ((fd < 0) || (read(fd, _pCtx->key, sizeof(_pCtx->key)) != (ssize_t)sizeof(_pCtx->key))) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not draw the nonce key: %s", strerror(errno));
+      if (fd >= 0) {
+         close(fd);
+      }
+      es_auth_deinit(_pCtx);
+      return ES_ERROR_UNKNOWN;
+   }
+   close(fd);
+
+   _es_auth_hmac_key(_pCtx, _pCtx->key, sizeof(_pCtx->key));
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_auth_deinit(es_auth_t *pCtx)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_AUTH_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _es_auth_users_put(_pCtx->users);
+   es_mem_free(_pCtx->ncBits);
+
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_auth_configure(es_auth_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct _es_auth_users_s *users = NULL;
+
+   if ((_pCtx == NULL) || (pCfg == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_AUTH_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (pCfg->authRealm[0] == '\0') {
+      _pCtx->realm[0] = '\0';
+      _pCtx->realmLen = 0;
+      return ES_OK;
+   }
+
+   if ((pCfg->authUsers[0] == '\0') && (_pCtx->db == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Digest realm %s needs auth.users or db.file", pCfg->authRealm);
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* Its HA1 are of one realm */
+   if ((_pCtx->db != NULL) && (es_db_realm(_pCtx->db)[0] != '\0') &&
+       (strcmp(es_db_realm(_pCtx->db), pCfg->authRealm) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Database built for realm %s, not %s", es_db_realm(_pCtx->db), pCfg->authRealm);
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* 4 MB, taken once */
+   if (_pCtx->ncBits == NULL) {
+      _pCtx->ncBits = (uint32_t *) es_mem_calloc(ES_MEM_AUTH, ES_AUTH_RING_SIZE, sizeof(uint32_t));
+      if (_pCtx->ncBits == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not follow nonces: no more memory");
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   if ((pCfg->authUsers[0] != '\0') && (_es_auth_users_load(pCfg->authUsers, pCfg->authRealm, &users) != ES_OK)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* Jobs running keep the previous one */
+   _es_auth_users_put(_pCtx->users);
+   _pCtx->users = users;
+   __atomic_store_n(&_pCtx->usersNb, (users != NULL) ? users->nb : 0, __ATOMIC_RELAXED);
+
+   strcpy(_pCtx->realm, pCfg->authRealm);
+   _pCtx->realmLen = strlen(_pCtx->realm);
+   _pCtx->ttl = pCfg->authNonceTtl;
+   __atomic_store_n(&_pCtx->methods, (pCfg->authRegister ? ES_AUTH_REGISTER : 0) | (pCfg->authInvite ? ES_AUTH_INVITE : 0),
+                    __ATOMIC_RELAXED);
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Digest realm %s, %u user(s)%s", _pCtx->realm, _pCtx->usersNb,
+              (_pCtx->db != NULL) ? " and the database" : "");
+
+   return ES_OK;
+}
+
+es_status es_auth_set_db(es_auth_t *pCtx, struct es_db_s *pDb)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_AUTH_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx->db = pDb;
+   return ES_OK;
+}
+
+/* A copy of a field into the job, NULL stays NULL */
+static int _es_auth_job_copy(struct es_auth_job_s *job, const char **p, size_t len)
+{
+   if (*p == NULL) {
+      return 1;
+   }
+
+   if (job->used + len + 1 > sizeof(job->buf)) {
+      return 0;
+   }
+
+   memcpy(job->buf + job->used, *p, len);
+   job->buf[job->used + len] = '\0';
+   *p = job->buf + job->used;
+   job->used += len + 1;
+
+   return 1;
+}
+
+/* The first step, on the loop: SIP_OK with the job filled, else the
+   response */
+static int _es_auth_begin(struct es_auth_s *pCtx, osip_message_t *request, struct es_auth_job_s *job)
+{
+   struct _es_auth_cred_s *cred = &job->cred;
+
+   if (!_es_auth_credentials(pCtx, request, cred)) {
+      __atomic_add_fetch(&pCtx->challenged, 1, __ATOMIC_RELAXED);
+      return SIP_UNAUTHORIZED;
+   }
+
+   if ((cred->user == NULL) || (cred->nonce == NULL) || (cred->uri == NULL) || (cred->response == NULL) ||
+       ((cred->algorithm != NULL) && ((cred->algorithmLen != 3) || (strncasecmp(cred->algorithm, "MD5", 3) != 0))) ||
+       ((cred->qop != NULL) && ((cred->qopLen != 4) || (memcmp(cred->qop, "auth", 4) != 0) || (cred->cnonce == NULL))) ||
+       ((job->nc = _es_auth_nc(cred)) == 0) || (strlen(request->sip_method) >= sizeof(job->method)) ||
+       !_es_auth_job_copy(job, &cred->user, cred->userLen) || !_es_auth_job_copy(job, &cred->nonce, cred->nonceLen) ||
+       !_es_auth_job_copy(job, &cred->uri, cred->uriLen) || !_es_auth_job_copy(job, &cred->response, cred->responseLen) ||
+       !_es_auth_job_copy(job, &cred->cnonce, cred->cnonceLen) || !_es_auth_job_copy(job, &cred->qop, cred->qopLen) ||
+       !_es_auth_job_copy(job, &cred->nc, cred->ncLen)) {
+      __atomic_add_fetch(&pCtx->malformed, 1, __ATOMIC_RELAXED);
+      return SIP_BAD_REQUEST;
+   }
+   cred->algorithm = NULL;
+
+   /* Its nonce used up: the client needs a new one, es_auth_answer gives it */
+   if (job->nc > ES_AUTH_MAX_NC) {
+      __atomic_add_fetch(&pCtx->stale, 1, __ATOMIC_RELAXED);
+      return SIP_UNAUTHORIZED;
+   }
+
+   strcpy(job->method, request->sip_method);
+   memcpy(job->realm, pCtx->realm, pCtx->realmLen + 1);
+   job->realmLen = pCtx->realmLen;
+   job->db = pCtx->db;
+   job->users = pCtx->users;
+   if (job->users != NULL) {
+      job->users->refs++;
+   }
+
+   return SIP_OK;
+}
+
+int es_auth_verify_begin(es_auth_t *pCtx, struct osip_message *request, struct es_auth_job_s **ppJob)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct es_auth_job_s *job = NULL;
+   int code = SIP_OK;
+
+   if (ppJob == NULL) {
+      return SIP_INTERNAL_SERVER_ERROR;
+   }
+   *ppJob = NULL;
+
+   if ((_pCtx == NULL) || (request == NULL) || !_es_auth_challenged(_pCtx, request)) {
+      return SIP_OK;
+   }
+
+   job = (struct es_auth_job_s *) es_mem_malloc(ES_MEM_AUTH, sizeof(struct es_auth_job_s));
+   if (job == NULL) {
+      return SIP_SERVICE_UNAVAILABLE;
+   }
+   memset(job, 0, offsetof(struct es_auth_job_s, buf));
+
+   code = _es_auth_begin(_pCtx, request, job);
+   if (code != SIP_OK) {
+      es_mem_free(job);
+      return code;
+   }
+
+   *ppJob = job;
+   return SIP_OK;
+}
+
+void es_auth_verify_run(es_auth_t *pCtx, struct es_auth_job_s *pJob)
+{
+   const struct es_auth_s *_pCtx = (const struct es_auth_s *)pCtx;
+   const struct _es_auth_cred_s *cred = &pJob->cred;
+   const struct _es_auth_user_s *u = NULL;
+   struct _es_auth_user_s dbUser;
+   char expected[ES_AUTH_HEX_LEN];
+
+   pJob->flags = 0;
+
+   if (!_es_auth_nonce_check(_pCtx, pJob->realm, pJob->realmLen, cred->nonce, cred->nonceLen, &pJob->ts, &pJob->seq)) {
+      return;
+   }
+   pJob->flags |= _ES_AUTH_JOB_NONCE;
+
+   u = (cred->userLen < ES_AUTH_USER_LEN) && (pJob->users != NULL) ?
+       _es_auth_users_slot(pJob->users, cred->user, cred->userLen) : NULL;
+   if (((u == NULL) || (u->len == 0)) && (pJob->db != NULL)) {
+      const struct es_db_record_s *rec = es_db_lookup(pJob->db, cred->user, cred->userLen);
+      if (rec != NULL) {
+         _es_auth_hex(rec->ha1, sizeof(rec->ha1), dbUser.ha1);
+         dbUser.len = rec->userLen;
+         u = &dbUser;
+      }
+   }
+   if ((u == NULL) || (u->len == 0)) {
+      return;
+   }
+
+   _es_auth_expected(u, pJob->method, cred, expected);
+   if (_es_auth_response_equal(cred, expected)) {
+      pJob->flags |= _ES_AUTH_JOB_MATCH;
+   }
+}
+
+void es_auth_job_free(es_auth_t *pCtx, struct es_auth_job_s *pJob)
+{
+   if (pJob == NULL) {
+      return;
+   }
+
+   _es_auth_users_put(pJob->users);
+   es_mem_free(pJob);
+}
+
+/* The last step, on the loop: nonce lifetime and nonce-count */
+static int _es_auth_end(struct es_auth_s *pCtx, const struct es_auth_job_s *job)
+{
+   uint32_t *bits = NULL;
+
+   if (!(job->flags & _ES_AUTH_JOB_NONCE)) {
+      __atomic_add_fetch(&pCtx->challenged, 1, __ATOMIC_RELAXED);
+      return SIP_UNAUTHORIZED;
+   }
+
+   if (_es_auth_nonce_fresh(pCtx, job->ts, job->seq) != _ES_AUTH_NONCE_VALID) {
+      __atomic_add_fetch(&pCtx->stale, 1, __ATOMIC_RELAXED);
+      return SIP_UNAUTHORIZED;
+   }
+
+   if (!(job->flags & _ES_AUTH_JOB_MATCH)) {
+      __atomic_add_fetch(&pCtx->rejected, 1, __ATOMIC_RELAXED);
+      return SIP_FORBIDDEN;
+   }
+
+   /* Once per nonce-count, checked last so a forged one does not use it */
+   bits = &pCtx->ncBits[job->seq & (ES_AUTH_RING_SIZE - 1)];
+   if (*bits & (1U << (job->nc - 1))) {
+      __atomic_add_fetch(&pCtx->replayed, 1, __ATOMIC_RELAXED);
+      return SIP_UNAUTHORIZED;
+   }
+   *bits |= 1U << (job->nc - 1);
+
+   __atomic_add_fetch(&pCtx->accepted, 1, __ATOMIC_RELAXED);
+   return SIP_OK;
+}
+
+int es_auth_verify_end(es_auth_t *pCtx, struct es_auth_job_s *pJob)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   int code = SIP_OK;
+
+   if ((_pCtx == NULL) || (pJob == NULL)) {
+      es_auth_job_free(pCtx, pJob);
+      return SIP_OK;
+   }
+
+   code = _es_auth_end(_pCtx, pJob);
+   es_auth_job_free(pCtx, pJob);
+
+   return code;
+}
+
+int es_auth_verify(es_auth_t *pCtx, struct osip_message *request)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct es_auth_job_s job;
+   int code = SIP_OK;
+
+   if ((_pCtx == NULL) || (request == NULL) || !_es_auth_challenged(_pCtx, request)) {
+      return SIP_OK;
+   }
+
+   /* All the steps here, the job on the stack */
+   memset(&job, 0, offsetof(struct es_auth_job_s, buf));
+   code = _es_auth_begin(_pCtx, request, &job);
+   if (code != SIP_OK) {
+      return code;
+   }
+
+   es_auth_verify_run(pCtx, &job);
+   code = _es_auth_end(_pCtx, &job);
+   _es_auth_users_put(job.users);
+
+   return code;
+}
+
+es_status es_auth_answer(es_auth_t *pCtx, struct osip_message *request, struct osip_message *response)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct _es_auth_cred_s cred;
+   char nonce[ES_AUTH_NONCE_LEN + 1];
+   char buf[ES_CONFIG_STR_LEN + ES_AUTH_NONCE_LEN + 96];
+   uint32_t ts = 0;
+   uint32_t seq = 0;
+   int stale = 0;
+
+   if ((_pCtx == NULL) || (request == NULL) || (response == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((response->status_code != SIP_UNAUTHORIZED) || (_pCtx->realmLen == 0) || (_pCtx->ncBits == NULL)) {
+      return ES_OK;
+   }
+
+   /* RFC 2617 3.2.1: the password was right, only the nonce is not */
+   if (_es_auth_credentials(_pCtx, request, &cred) && (cred.nonce != NULL) &&
+       _es_auth_nonce_check(_pCtx, _pCtx->realm, _pCtx->realmLen, cred.nonce, cred.nonceLen, &ts, &seq)) {
+      stale = (_es_auth_nonce_fresh(_pCtx, ts, seq) == _ES_AUTH_NONCE_STALE) ||
+              (_pCtx->ncBits[seq & (ES_AUTH_RING_SIZE - 1)] != 0) || (_es_auth_nc(&cred) > ES_AUTH_MAX_NC);
+   }
+
+   _es_auth_nonce_new(_pCtx, nonce);
+   snprintf(buf, sizeof(buf), "Digest realm=\"%s\", nonce=\"%s\", qop=\"auth\", algorithm=MD5%s",
+            _pCtx->realm, nonce, stale ? ", stale=TRUE" : "");
+
+   return (osip_message_set_www_authenticate(response, buf) == OSIP_SUCCESS) ? ES_OK : ES_ERROR_OUTOFRESOURCES;
+}
+
+es_status es_auth_save(es_auth_t *pCtx, struct es_upgrade_buf_s *state)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct es_upgrade_buf_s rec;
+   es_status ret = ES_OK;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_AUTH_MAGIC) || (state == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   memset(&rec, 0, sizeof(rec));
+
+   ret = es_upgrade_buf_put(&rec, ES_AUTH_REC_KEY, _pCtx->key, sizeof(_pCtx->key));
+   if (ret == ES_OK) {
+      ret = es_upgrade_buf_put_u32(&rec, ES_AUTH_REC_SEQ, _pCtx->seq);
+   }
+   if (ret == ES_OK) {
+      ret = es_upgrade_buf_put(state, ES_UPGRADE_REC_AUTH, rec.data, rec.len);
+   }
+
+   if (rec.data != NULL) {
+      memset(rec.data, 0, rec.len);
+   }
+   es_upgrade_buf_free(&rec);
+
+   return ret;
+}
+
+es_status es_auth_restore(es_auth_t *pCtx, const uint8_t *data, size_t len)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+   struct es_upgrade_tlv_s tlv;
+   size_t offset = 0;
+   int rc = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_AUTH_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   while ((rc = es_upgrade_tlv_next(data, len, &offset, &tlv)) > 0) {
+      struct es_upgrade_tlv_s field;
+      size_t fieldOffset = 0;
+      int hasKey = 0;
+      int hasSeq = 0;
+      uint32_t seq = 0;
+
+      if (tlv.type != ES_UPGRADE_REC_AUTH) {
+         continue;
+      }
+
+      while (es_upgrade_tlv_next(tlv.value, tlv.len, &fieldOffset, &field) > 0) {
+         if ((field.type == ES_AUTH_REC_KEY) && (field.len == sizeof(_pCtx->key))) {
+            memcpy(_pCtx->key, field.value, sizeof(_pCtx->key));
+            hasKey = 1;
+         } else if (field.type == ES_AUTH_REC_SEQ) {
+            seq = es_upgrade_tlv_u32(&field);
+            hasSeq = 1;
+         }
+      }
+
+      if (!hasKey || !hasSeq) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Nonce key not restored, the nonces given before are not ours");
+         return ES_ERROR_BADPARAM;
+      }
+
+      /* Before any request: the jobs read the key without lock */
+      _es_auth_hmac_key(_pCtx, _pCtx->key, sizeof(_pCtx->key));
+      _pCtx->seq = seq;
+      _pCtx->seqFirst = seq;
+
+      ESIP_TRACE(ESIP_LOG_INFO, "Nonce key restored, nonces from sequence %u", seq);
+   }
+
+   return (rc < 0) ? ES_ERROR_BADPARAM : ES_OK;
+}
+
+static int _es_auth_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)arg;
+   unsigned int methods = __atomic_load_n(&_pCtx->methods, __ATOMIC_RELAXED);
+
+   es_cli_print(pCli, "Users %u%s, challenging%s%s, nonces followed %u (%u bytes)",
+                __atomic_load_n(&_pCtx->usersNb, __ATOMIC_RELAXED), (_pCtx->db != NULL) ? " and database" : "",
+                (methods & ES_AUTH_REGISTER) ? " REGISTER" : "", (methods & ES_AUTH_INVITE) ? " INVITE" : "",
+                ES_AUTH_RING_SIZE, (unsigned int)(ES_AUTH_RING_SIZE * sizeof(uint32_t)));
+   es_cli_print(pCli, "%12s %12s %12s %12s %12s %12s",
+                "challenged", "accepted", "stale", "replayed", "rejected", "malformed");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu %12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->challenged, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->accepted, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->stale, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->replayed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->rejected, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->malformed, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_auth_cli_register(es_auth_t *pCtx, es_cli_t *pCli)
+{
+   struct es_auth_s *_pCtx = (struct es_auth_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_AUTH_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show auth", "Show the Digest authentication", _es_auth_cli_show, _pCtx);
+}
@@ -0,0 +1,634 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "eshash.h"
+#include "escli.h"
+
+#include "escapture.h"
+
+#define ES_CAPTURE_MAGIC            0x20141012
+
+/** Default directory of the pcap files */
+#define ES_CAPTURE_DEFAULT_DIR      "/tmp"
+
+/** Number of slots in the ring (power of 2) */
+#define ES_CAPTURE_RING_SLOTS       4096
+
+/** Max bytes copied per datagram, same as the transport read buffer */
+#define ES_CAPTURE_SNAPLEN          2048
+
+/** Size of one pcap file before switching to the next one */
+#define ES_CAPTURE_MAX_FILE_SIZE    (64 * 1024 * 1024)
+
+/** Number of pcap files kept, the oldest one is overwritten */
+#define ES_CAPTURE_MAX_FILES        8
+
+/** pcap magic for nanosecond timestamps */
+#define ES_CAPTURE_PCAP_MAGIC_NSEC  0xa1b23c4d
+
+/** LINKTYPE_RAW: packets begin with an IPv4 header */
+#define ES_CAPTURE_PCAP_LINKTYPE    101
+
+/** Synthesized IPv4 + UDP header length */
+#define ES_CAPTURE_IPUDP_HDR_LEN    28
+
+struct _es_capture_slot_s {
+   /* CLOCK_REALTIME in ns */
+   uint64_t                  ts;
+   /* Network order addresses */
+   uint32_t                  saddr;
+   uint32_t                  daddr;
+   /* Network order ports */
+   uint16_t                  sport;
+   uint16_t                  dport;
+   /* Copied length */
+   uint32_t                  caplen;
+   /* Datagram length */
+   uint32_t                  len;
+   /* Datagram */
+   char                      data[ES_CAPTURE_SNAPLEN];
+};
+
+struct _es_pcap_hdr_s {
+   uint32_t                  magic;
+   uint16_t                  major;
+   uint16_t                  minor;
+   int32_t                   thiszone;
+   uint32_t                  sigfigs;
+   uint32_t                  snaplen;
+   uint32_t                  linktype;
+};
+
+struct _es_pcap_rec_s {
+   uint32_t                  ts_sec;
+   uint32_t                  ts_nsec;
+   uint32_t                  incl_len;
+   uint32_t                  orig_len;
+};
+
+struct es_capture_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* Capture switch */
+   int                       enabled;
+   /* 1 Call-ID out of sampling */
+   unsigned int              sampling;
+   /* mmap'd ring, NULL until the first start */
+   struct _es_capture_slot_s *ring;
+   /* Ring mapping size */
+   size_t                    ringSize;
+   /* Next slot to fill (producer) */
+   uint64_t                  head;
+   /* Next slot to write (writer thread) */
+   uint64_t                  tail;
+   /* Datagrams copied into the ring */
+   uint64_t                  captured;
+   /* Datagrams lost because the ring was full */
+   uint64_t                  dropped;
+   /* Datagrams written to pcap files */
+   uint64_t                  written;
+   /* Directory of the pcap files */
+   char                      dir[256];
+   /* Current pcap file */
+   FILE                      *file;
+   /* Current pcap file index */
+   unsigned int              fileIdx;
+   /* Current pcap file size */
+   size_t                    fileSize;
+   /* IPv4 identification of synthesized headers */
+   uint16_t                  ipId;
+   /* Writer thread */
+   pthread_t                 thread;
+   /* Writer thread is running */
+   int                       running;
+   /* Writer thread blocks reading it while the ring is empty */
+   int                       efd;
+   /* Writer thread parked, the producer wakes it */
+   int                       sleeping;
+   /* Protect thread start/stop */
+   pthread_mutex_t           lock;
+};
+
+/**
+ * @brief Find the Call-ID value in a raw SIP buffer
+ * @return 1 if found
+ */
+static int _es_capture_callid(const char *buf, size_t len, const char **val, size_t *valLen)
+{
+   const char *p = buf;
+   const char *end = buf + len;
+
+   while (p < end) {
+      const char *eol = memchr(p, '\n', (size_t)(end - p));
+      const char *lineEnd = (eol == NULL) ? end : eol;
+      const char *v = NULL;
+      size_t lineLen = (size_t)(lineEnd - p);
+
+      /* Empty line: end of headers */
+      if ((lineLen == 0) || ((lineLen == 1) && (p[0] == '\r'))) {
+         break;
+      }
+
+      if ((lineLen > 8) && (strncasecmp(p, "Call-ID:", 8) == 0)) {
+         v = p + 8;
+      } else if ((lineLen > 2) && ((p[0] == 'i') || (p[0] == 'I')) && (p[1] == ':')) {
+         v = p + 2;
+      }
+
+      if (v != NULL) {
+         while ((v < lineEnd) && ((*v == ' ') || (*v == '\t'))) {
+            v++;
+         }
+         while ((lineEnd > v) && ((lineEnd[-1] == '\r') || (lineEnd[-1] == ' '))) {
+            lineEnd--;
+         }
+         *val = v;
+         *valLen = (size_t)(lineEnd - v);
+         return 1;
+      }
+
+      if (eol == NULL) {
+         break;
+      }
+      p = eol + 1;
+   }
+
+   return 0;
+}
+
+static uint16_t _es_capture_ip_csum(const uint8_t *hdr, size_t len)
+{
+   uint32_t sum = 0;
+   size_t i = 0;
+
+   for (i = 0; i + 1 < len; i += 2) {
+      sum += (uint32_t)((hdr[i] << 8) | hdr[i + 1]);
+   }
+   while (sum >> 16) {
+      sum = (sum & 0xffff) + (sum >> 16);
+   }
+
+   return htons((uint16_t)~sum);
+}
+
+static es_status _es_capture_rotate(struct es_capture_s *pCtx)
+{
+   char path[512];
+   struct _es_pcap_hdr_s hdr = {
+      ES_CAPTURE_PCAP_MAGIC_NSEC, 2, 4, 0, 0,
+      ES_CAPTURE_SNAPLEN + ES_CAPTURE_IPUDP_HDR_LEN,
+      ES_CAPTURE_PCAP_LINKTYPE
+   };
+
+   if (pCtx->file != NULL) {
+      fclose(pCtx->file);
+      pCtx->file = NULL;
+      pCtx->fileIdx = (pCtx->fileIdx + 1) % ES_CAPTURE_MAX_FILES;
+   }
+
+   snprintf(path, sizeof(path), "%s/" PACKAGE "-%u.pcap", pCtx->dir, pCtx->fileIdx);
+   pCtx->file = fopen(path, "w");
+   if (pCtx->file == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open capture file %s", path);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (fwrite(&hdr, sizeof(hdr), 1, pCtx->file) != 1) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not write capture file %s", path);
+      fclose(pCtx->file);
+      pCtx->file = NULL;
+      return ES_ERROR_UNKNOWN;
+   }
+   pCtx->fileSize = sizeof(hdr);
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Capturing into %s", path);
+   return ES_OK;
+}
+
+static void _es_capture_write_slot(struct es_capture_s *pCtx, const struct _es_capture_slot_s *slot)
+{
+   uint8_t ipudp[ES_CAPTURE_IPUDP_HDR_LEN];
+   struct _es_pcap_rec_s rec;
+   uint16_t ipLen = (uint16_t)(ES_CAPTURE_IPUDP_HDR_LEN + slot->len);
+   uint16_t udpLen = (uint16_t)(8 + slot->len);
+   uint16_t csum = 0;
+
+   if ((pCtx->file == NULL) || (pCtx->fileSize >= ES_CAPTURE_MAX_FILE_SIZE)) {
+      if (_es_capture_rotate(pCtx) != ES_OK) {
+         return;
+      }
+   }
+
+   /* IPv4 header */
+   memset(ipudp, 0, sizeof(ipudp));
+   ipudp[0] = 0x45;
+   ipudp[2] = (uint8_t)(ipLen >> 8);
+   ipudp[3] = (uint8_t)(ipLen & 0xff);
+   ipudp[4] = (uint8_t)(pCtx->ipId >> 8);
+   ipudp[5] = (uint8_t)(pCtx->ipId & 0xff);
+   ipudp[8] = 64;
+   ipudp[9] = IPPROTO_UDP;
+   memcpy(&ipudp[12], &slot->saddr, 4);
+   memcpy(&ipudp[16], &slot->daddr, 4);
+   csum = _es_capture_ip_csum(ipudp, 20);
+   memcpy(&ipudp[10], &csum, 2);
+   pCtx->ipId++;
+
+   /* UDP header, checksum is optional on IPv4 */
+   memcpy(&ipudp[20], &slot->sport, 2);
+   memcpy(&ipudp[22], &slot->dport, 2);
+   ipudp[24] = (uint8_t)(udpLen >> 8);
+   ipudp[25] = (uint8_t)(udpLen & 0xff);
+
+   rec.ts_sec = (uint32_t)(slot->ts / 1000000000ULL);
+   rec.ts_nsec = (uint32_t)(slot->ts % 1000000000ULL);
+   rec.incl_len = ES_CAPTURE_IPUDP_HDR_LEN + slot->caplen;
+   rec.orig_len = ES_CAPTURE_IPUDP_HDR_LEN + slot->len;
+
+   if ((fwrite(&rec, sizeof(rec), 1, pCtx->file) != 1) ||
+       (fwrite(ipudp, sizeof(ipudp), 1, pCtx->file) != 1) ||
+       (fwrite(slot->data, slot->caplen, 1, pCtx->file) != 1)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Writing capture file failed");
+      return;
+   }
+
+   pCtx->fileSize += sizeof(rec) + rec.incl_len;
+   __atomic_fetch_add(&pCtx->written, 1, __ATOMIC_RELAXED);
+}
+
+static unsigned int _es_capture_drain(struct es_capture_s *pCtx)
+{
+   unsigned int nb = 0;
+   uint64_t head = __atomic_load_n(&pCtx->head, __ATOMIC_ACQUIRE);
+   uint64_t tail = pCtx->tail;
+
+   while (tail != head) {
+      _es_capture_write_slot(pCtx, &pCtx->ring[tail & (ES_CAPTURE_RING_SLOTS - 1)]);
+      tail++;
+      nb++;
+      /* Give the slot back to the producer */
+      __atomic_store_n(&pCtx->tail, tail, __ATOMIC_RELEASE);
+   }
+
+   return nb;
+}
+
+static void _es_capture_wake(struct es_capture_s *pCtx)
+{
+   uint64_t one = 1;
+
+   if (write(pCtx->efd, &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not wake the capture writer up: %s", strerror(errno));
+   }
+}
+
+static void * _es_capture_writer_thread(void *arg)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *)arg;
+   uint64_t value = 0;
+
+   while (__atomic_load_n(&_pCtx->running, __ATOMIC_ACQUIRE)) {
+      if (_es_capture_drain(_pCtx) != 0) {
+         continue;
+      }
+
+      /* Ring empty: what is written reaches the file before parking */
+      if (_pCtx->file != NULL) {
+         fflush(_pCtx->file);
+      }
+
+      /* Flag first, then look again: the producer sees one or the other */
+      __atomic_store_n(&_pCtx->sleeping, 1, __ATOMIC_SEQ_CST);
+      if ((__atomic_load_n(&_pCtx->head, __ATOMIC_SEQ_CST) == _pCtx->tail) &&
+          __atomic_load_n(&_pCtx->running, __ATOMIC_SEQ_CST)) {
+         if ((read(_pCtx->efd, &value, sizeof(value)) < 0) && (errno != EINTR)) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "Capture writer can not wait: %s", strerror(errno));
+            break;
+         }
+      }
+      __atomic_store_n(&_pCtx->sleeping, 0, __ATOMIC_RELAXED);
+   }
+
+   /* Last records */
+   (void)_es_capture_drain(_pCtx);
+   if (_pCtx->file != NULL) {
+      fclose(_pCtx->file);
+      _pCtx->file = NULL;
+   }
+
+   return NULL;
+}
+
+es_status es_capture_init(es_capture_t **ppCtx, const char *dir)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *) malloc(sizeof(struct es_capture_s));
+   if (_pCtx == (struct es_capture_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize capture: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_capture_s));
+
+   _pCtx->magic = ES_CAPTURE_MAGIC;
+   _pCtx->sampling = 1;
+   snprintf(_pCtx->dir, sizeof(_pCtx->dir), "%s", (dir != NULL) ? dir : ES_CAPTURE_DEFAULT_DIR);
+
+   _pCtx->ringSize = ES_CAPTURE_RING_SLOTS * sizeof(struct _es_capture_slot_s);
+
+   /* Blocking: the writer thread waits on it */
+   _pCtx->efd = eventfd(0, EFD_CLOEXEC);
+   if (_pCtx->efd < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create capture eventfd: %s", strerror(errno));
+      free(_pCtx);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   if (pthread_mutex_init(&_pCtx->lock, NULL) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize capture lock");
+      close(_pCtx->efd);
+      free(_pCtx);
+      return ES_ERROR_UNKNOWN;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_capture_deinit(es_capture_t *pCtx)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *)pCtx;
+
+   if (_pCtx == (struct es_capture_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CAPTURE_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   __atomic_store_n(&_pCtx->enabled, 0, __ATOMIC_RELAXED);
+
+   pthread_mutex_lock(&_pCtx->lock);
+   if (_pCtx->running) {
+      __atomic_store_n(&_pCtx->running, 0, __ATOMIC_SEQ_CST);
+      _es_capture_wake(_pCtx);
+      pthread_join(_pCtx->thread, NULL);
+   }
+   pthread_mutex_unlock(&_pCtx->lock);
+
+   pthread_mutex_destroy(&_pCtx->lock);
+   close(_pCtx->efd);
+   if (_pCtx->ring != NULL) {
+      munmap(_pCtx->ring, _pCtx->ringSize);
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_capture_s));
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_capture_enable(es_capture_t *pCtx, int enable)
+{
+   es_status ret = ES_OK;
+   struct es_capture_s *_pCtx = (struct es_capture_s *)pCtx;
+
+   if (_pCtx == (struct es_capture_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CAPTURE_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   pthread_mutex_lock(&_pCtx->lock);
+
+   /* Mapped on the first start, prefaulted: capturing never allocates */
+   if (enable && (_pCtx->ring == NULL)) {
+      void *ring = mmap(NULL, _pCtx->ringSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (ring == MAP_FAILED) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not map capture ring");
+         pthread_mutex_unlock(&_pCtx->lock);
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+      _pCtx->ring = (struct _es_capture_slot_s *)ring;
+   }
+
+   if (enable && !_pCtx->running) {
+      _pCtx->running = 1;
+      if (pthread_create(&_pCtx->thread, NULL, &_es_capture_writer_thread, _pCtx) != 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start capture writer thread");
+         _pCtx->running = 0;
+         ret = ES_ERROR_UNKNOWN;
+      }
+   }
+   pthread_mutex_unlock(&_pCtx->lock);
+
+   if (ret == ES_OK) {
+      __atomic_store_n(&_pCtx->enabled, enable ? 1 : 0, __ATOMIC_RELEASE);
+      /* Stopped: what is left in the ring is written and flushed now */
+      if (!enable && _pCtx->running) {
+         _es_capture_wake(_pCtx);
+      }
+   }
+
+   return ret;
+}
+
+es_status es_capture_set_sampling(es_capture_t *pCtx, unsigned int rate)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *)pCtx;
+
+   if (_pCtx == (struct es_capture_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_CAPTURE_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   __atomic_store_n(&_pCtx->sampling, (rate == 0) ? 1 : rate, __ATOMIC_RELAXED);
+   return ES_OK;
+}
+
+int es_capture_enabled(const es_capture_t *pCtx)
+{
+   const struct es_capture_s *_pCtx = (const struct es_capture_s *)pCtx;
+
+   return (_pCtx != (struct es_capture_s *)0) && __atomic_load_n(&_pCtx->enabled, __ATOMIC_RELAXED);
+}
+
+void es_capture_packet(es_capture_t *pCtx, const struct sockaddr_in *src, const struct sockaddr_in *dst, const char *buf, size_t len)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *)pCtx;
+   struct _es_capture_slot_s *slot = NULL;
+   struct timespec now;
+   unsigned int sampling = 1;
+   uint64_t head = 0;
+
+   if ((_pCtx == (struct es_capture_s *)0) || !__atomic_load_n(&_pCtx->enabled, __ATOMIC_ACQUIRE)) {
+      return;
+   }
+
+   /* Keep all the datagrams of a sampled call */
+   sampling = __atomic_load_n(&_pCtx->sampling, __ATOMIC_RELAXED);
+   if (sampling > 1) {
+      const char *callId = NULL;
+      size_t callIdLen = 0;
+      if (!_es_capture_callid(buf, len, &callId, &callIdLen)) {
+         return;
+      }
+      if ((es_hash_fnv1a(callId, callIdLen) % sampling) != 0) {
+         return;
+      }
+   }
+
+   /* Single producer: every caller runs on the SIP loop, head is not locked */
+   head = _pCtx->head;
+   if ((head - __atomic_load_n(&_pCtx->tail, __ATOMIC_ACQUIRE)) >= ES_CAPTURE_RING_SLOTS) {
+      __atomic_fetch_add(&_pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   clock_gettime(CLOCK_REALTIME, &now);
+
+   slot = &_pCtx->ring[head & (ES_CAPTURE_RING_SLOTS - 1)];
+   slot->ts = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+   slot->saddr = src->sin_addr.s_addr;
+   slot->sport = src->sin_port;
+   slot->daddr = dst->sin_addr.s_addr;
+   slot->dport = dst->sin_port;
+   slot->len = (uint32_t)len;
+   slot->caplen = (uint32_t)ES_MIN(len, ES_CAPTURE_SNAPLEN);
+   memcpy(slot->data, buf, slot->caplen);
+
+   /* Published before the flag is read: a writer going to sleep sees it */
+   __atomic_store_n(&_pCtx->head, head + 1, __ATOMIC_SEQ_CST);
+   __atomic_fetch_add(&_pCtx->captured, 1, __ATOMIC_RELAXED);
+   if (__atomic_exchange_n(&_pCtx->sleeping, 0, __ATOMIC_SEQ_CST) != 0) {
+      _es_capture_wake(_pCtx);
+   }
+}
+
+static int _es_capture_cli_start(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   if (es_capture_enable((es_capture_t *)arg, 1) != ES_OK) {
+      es_cli_print(pCli, "Can not start capture");
+      return CLI_ERROR;
+   }
+   es_cli_print(pCli, "Capture started");
+   return CLI_OK;
+}
+
+static int _es_capture_cli_stop(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   if (es_capture_enable((es_capture_t *)arg, 0) != ES_OK) {
+      es_cli_print(pCli, "Can not stop capture");
+      return CLI_ERROR;
+   }
+   es_cli_print(pCli, "Capture stopped");
+   return CLI_OK;
+}
+
+static int _es_capture_cli_sample(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   unsigned int rate = 0;
+
+   if ((argc < 1) || (sscanf(argv[0], "%u", &rate) != 1)) {
+      es_cli_print(pCli, "Usage: capture sample <N> (1 Call-ID out of N, 1 for all)");
+      return CLI_ERROR_ARG;
+   }
+
+   if (es_capture_set_sampling((es_capture_t *)arg, rate) != ES_OK) {
+      return CLI_ERROR;
+   }
+   es_cli_print(pCli, "Capturing 1 Call-ID out of %u", (rate == 0) ? 1 : rate);
+   return CLI_OK;
+}
+
+static int _es_capture_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_capture_s *_pCtx = (struct es_capture_s *)arg;
+
+   es_cli_print(pCli, "Capture:  %s", __atomic_load_n(&_pCtx->enabled, __ATOMIC_RELAXED) ? "on" : "off");
+   es_cli_print(pCli, "Ring:     %s", (_pCtx->ring != NULL) ? "mapped" : "not mapped");
+   es_cli_print(pCli, "Sampling: 1/%u", __atomic_load_n(&_pCtx->sampling, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "Files:    %s/" PACKAGE "-[0-%u].pcap", _pCtx->dir, ES_CAPTURE_MAX_FILES - 1);
+   es_cli_print(pCli, "Captured: %llu", (unsigned long long)__atomic_load_n(&_pCtx->captured, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "Written:  %llu", (unsigned long long)__atomic_load_n(&_pCtx->written, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "Dropped:  %llu", (unsigned long long)__atomic_load_n(&_pCtx->dropped, __ATOMIC_RELAXED));
+   return CLI_OK;
+}
+
+es_status es_capture_cli_register(es_capture_t *pCtx, es_cli_t *pCli)
+{
+   es_status ret = ES_OK;
+
+   if (pCtx == (es_capture_t *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Capture Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   ret = es_cli_register_cmd(pCli, "capture start", "Start capturing SIP traffic to pcap files", _es_capture_cli_start, pCtx);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   ret = es_cli_register_cmd(pCli, "capture stop", "Stop capturing SIP traffic", _es_capture_cli_stop, pCtx);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   ret = es_cli_register_cmd(pCli, "capture sample", "Capture 1 Call-ID out of N", _es_capture_cli_sample, pCtx);
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return es_cli_register_cmd(pCli, "show capture", "Show capture state", _es_capture_cli_show, pCtx);
+}
+
+// vim: ts=2:sw=2
@@ -0,0 +1,1104 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+
+#include <osip2/osip.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshash.h"
+#include "eshist.h"
+#include "esmem.h"
+#include "eswheel.h"
+#include "esconfig.h"
+#include "esomsg.h"
+#include "esraw.h"
+#include "esproxy.h"
+#include "esfork.h"
+
+#define ES_FORK_MAGIC            0x20141120
+
+/** Our branches, RFC 3261 magic cookie first */
+#define ES_FORK_BRANCH           "z9hG4bK-esf-"
+
+/** Max branches of a fork, as many as bindings of an AOR */
+#define ES_FORK_MAX_BRANCHES     16
+
+/** Max-Forwards added when missing */
+#define ES_FORK_MAX_FORWARDS     70
+
+/** Records of a pool chunk, 2^bits */
+#define ES_FORK_CHUNK_BITS       10
+
+/** No record: end of a chain */
+#define ES_FORK_NONE             0xffffffffU
+
+/** Buckets of the forks by server branch, a power of 2 */
+#define ES_FORK_BUCKETS          16384
+
+/** Timer C (s), above the 3 minutes of RFC 3261 16.6 */
+#define ES_FORK_TIMER_C          181
+
+/** Wait (s) for the final response of a branch Timer C cancelled, 64*T1 (RFC 3261 9.1) */
+#define ES_FORK_TIMER_CANCEL     32
+
+/** Timer C tick (ms), the wheel counts seconds */
+#define ES_FORK_TICK_MS          1000
+
+/**
+ * @brief Records of one size, in chunks that never move
+ * A free record starts with the index of the next free one.
+ */
+struct _es_fork_pool_s {
+   uint8_t                   **chunks;
+   unsigned int              nbChunks;
+   size_t                    size;
+   uint32_t                  freeList;
+   /* Records in use, read by the CLI */
+   uint32_t                  used;
+};
+
+/**
+ * @brief CANCEL of a branch
+ */
+enum _es_fork_cancel_e {
+   _ES_FORK_CANCEL_NONE = 0,
+   _ES_FORK_CANCEL_WANTED,       /* Sent once a provisional response comes */
+   _ES_FORK_CANCEL_SENT
+};
+
+/**
+ * @brief A branch: a client transaction of a fork
+ */
+struct _es_fork_branch_s {
+   /* Next branch of the fork, or next free */
+   uint32_t                  next;
+   uint32_t                  fork;
+   /* NULL once ended */
+   osip_transaction_t        *tr;
+   struct sockaddr_in        to;
+   /* Final response, 0 while pending */
+   uint16_t                  code;
+   /* A provisional response came: it can be cancelled */
+   uint8_t                   provisional;
+   uint8_t                   cancel;
+};
+
+/**
+ * @brief A request forked: its server transaction and branches
+ */
+struct _es_fork_s {
+   /* First: the wheel gives Timer C back */
+   struct es_wheel_entry_s   timer;
+   /* Next of the bucket, or next free */
+   uint32_t                  next;
+   uint32_t                  index;
+   uint32_t                  hash;
+   uint32_t                  branches;
+   /* Branches without a final response */
+   uint16_t                  pending;
+   /* Transactions not ended: server and branches */
+   uint16_t                  alive;
+   /* Best final response so far, 0 if none */
+   uint16_t                  best;
+   uint8_t                   invite;
+   /* A final response went back */
+   uint8_t                   answered;
+   /* Timer C fired: the timer now waits for the 487 of the branches */
+   uint8_t                   expired;
+   /* NULL once ended */
+   osip_transaction_t        *server;
+   /* Best final response, our Via removed, NULL if we make it */
+   osip_message_t            *bestResp;
+};
+
+struct es_fork_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct es_fork_stack_s    stack;
+   /* Next hops and Via, NULL if none */
+   es_proxy_t                *proxyCtx;
+   /* Timer C */
+   struct event              *tick;
+   es_wheel_t                *wheel;
+   struct _es_fork_pool_s    forks;
+   struct _es_fork_pool_s    branches;
+   /* Forks by hash of their server branch and Call-ID */
+   uint32_t                  *buckets;
+   /* Our branches: random of the process, then a sequence */
+   uint32_t                  tag;
+   uint32_t                  seq;
+   /* Counters, read by the CLI */
+   uint64_t                  forked;
+   uint64_t                  started;
+   uint64_t                  answered;
+   uint64_t                  failed;
+   uint64_t                  cancelled;
+   uint64_t                  cancels;
+   uint64_t                  timerC;
+};
+
+/*******************************************************************************
+                              Pools
+ ******************************************************************************/
+
+static void *_es_fork_pool_at(const struct _es_fork_pool_s *pool, uint32_t index)
+{
+   return pool->chunks[index >> ES_FORK_CHUNK_BITS] +
+          (size_t)(index & ((1U << ES_FORK_CHUNK_BITS) - 1)) * pool->size;
+}
+
+static void *_es_fork_pool_alloc(struct _es_fork_pool_s *pool, uint32_t *pIndex)
+{
+   void *rec = NULL;
+
+   /* A chunk more, its records chained as free */
+   if (pool->freeList == ES_FORK_NONE) {
+      uint32_t first = (uint32_t)pool->nbChunks << ES_FORK_CHUNK_BITS;
+      uint8_t **chunks = NULL;
+      uint8_t *chunk = NULL;
+      uint32_t i = 0;
+
+      if (pool->nbChunks >= (ES_FORK_NONE >> ES_FORK_CHUNK_BITS)) {
+         return NULL;
+      }
+
+      chunks = (uint8_t **) es_mem_malloc(ES_MEM_PROXY, (pool->nbChunks + 1) * sizeof(uint8_t *));
+      chunk = (uint8_t *) es_mem_calloc(ES_MEM_PROXY, 1U << ES_FORK_CHUNK_BITS, pool->size);
+      if ((chunks == NULL) || (chunk == NULL)) {
+         es_mem_free(chunks);
+         es_mem_free(chunk);
+         return NULL;
+      }
+
+      if (pool->chunks != NULL) {
+         memcpy(chunks, pool->chunks, pool->nbChunks * sizeof(uint8_t *));
+         es_mem_free(pool->chunks);
+      }
+      chunks[pool->nbChunks] = chunk;
+      pool->chunks = chunks;
+      __atomic_store_n(&pool->nbChunks, pool->nbChunks + 1, __ATOMIC_RELAXED);
+
+      for (i = 0; i < (1U << ES_FORK_CHUNK_BITS); ++i) {
+         uint32_t next = (i + 1 < (1U << ES_FORK_CHUNK_BITS)) ? first + i + 1 : ES_FORK_NONE;
+         memcpy(chunk + (size_t)i * pool->size, &next, sizeof(next));
+      }
+      pool->freeList = first;
+   }
+
+   *pIndex = pool->freeList;
+   rec = _es_fork_pool_at(pool, pool->freeList);
+   memcpy(&pool->freeList, rec, sizeof(pool->freeList));
+   memset(rec, 0, pool->size);
+   __atomic_add_fetch(&pool->used, 1, __ATOMIC_RELAXED);
+
+   return rec;
+}
+
+static void _es_fork_pool_free(struct _es_fork_pool_s *pool, uint32_t index)
+{
+   memcpy(_es_fork_pool_at(pool, index), &pool->freeList, sizeof(pool->freeList));
+   pool->freeList = index;
+   __atomic_sub_fetch(&pool->used, 1, __ATOMIC_RELAXED);
+}
+
+static void _es_fork_pool_deinit(struct _es_fork_pool_s *pool)
+{
+   unsigned int i = 0;
+
+   for (i = 0; i < pool->nbChunks; ++i) {
+      es_mem_free(pool->chunks[i]);
+   }
+
+   es_mem_free(pool->chunks);
+   memset(pool, 0, sizeof(*pool));
+}
+
+/*******************************************************************************
+                              Forks
+ ******************************************************************************/
+
+static inline uint64_t _es_fork_now(void)
+{
+   return es_hist_now() / 1000000000ULL;
+}
+
+/* Hash of a top Via branch and Call-ID, 0 without branch */
+static uint32_t _es_fork_key(osip_via_t *via, osip_call_id_t *callId, const char **pBranch)
+{
+   osip_generic_param_t *branch = NULL;
+   uint32_t h = ES_HASH_FNV1A_INIT;
+
+   if ((via == NULL) || (osip_via_param_get_byname(via, "branch", &branch) != OSIP_SUCCESS) ||
+       (branch == NULL) || (branch->gvalue == NULL) || (callId == NULL) || (callId->number == NULL)) {
+      return 0;
+   }
+
+   *pBranch = branch->gvalue;
+   h = es_hash_fnv1a_update(h, branch->gvalue, strlen(branch->gvalue));
+   return es_hash_fnv1a_update(h, callId->number, strlen(callId->number));
+}
+
+/* The fork of the INVITE a CANCEL is for (RFC 3261 9.2) */
+static struct _es_fork_s *_es_fork_find(struct es_fork_s *pCtx, osip_message_t *cancel)
+{
+   const char *branch = NULL;
+   uint32_t hash = _es_fork_key((osip_via_t *)osip_list_get(&cancel->vias, 0), cancel->call_id, &branch);
+   uint32_t i = 0;
+
+   if (hash == 0) {
+      return NULL;
+   }
+
+   for (i = pCtx->buckets[hash & (ES_FORK_BUCKETS - 1)]; i != ES_FORK_NONE; ) {
+      struct _es_fork_s *fork = (struct _es_fork_s *)_es_fork_pool_at(&pCtx->forks, i);
+      const char *forkBranch = NULL;
+
+      if ((fork->hash == hash) && (fork->server != NULL) && fork->invite &&
+          (_es_fork_key(fork->server->topvia, fork->server->callid, &forkBranch) == hash) &&
+          (strcmp(forkBranch, branch) == 0) && (strcmp(fork->server->callid->number, cancel->call_id->number) == 0)) {
+         return fork;
+      }
+
+      i = fork->next;
+   }
+
+   return NULL;
+}
+
+static void _es_fork_free(struct es_fork_s *pCtx, struct _es_fork_s *fork)
+{
+   uint32_t *link = &pCtx->buckets[fork->hash & (ES_FORK_BUCKETS - 1)];
+
+   while (*link != ES_FORK_NONE) {
+      struct _es_fork_s *f = (struct _es_fork_s *)_es_fork_pool_at(&pCtx->forks, *link);
+
+      if (f == fork) {
+         *link = fork->next;
+         break;
+      }
+      link = &f->next;
+   }
+
+   while (fork->branches != ES_FORK_NONE) {
+      struct _es_fork_branch_s *branch = (struct _es_fork_branch_s *)_es_fork_pool_at(&pCtx->branches, fork->branches);
+      uint32_t index = fork->branches;
+
+      fork->branches = branch->next;
+      _es_fork_pool_free(&pCtx->branches, index);
+   }
+
+   es_wheel_remove(pCtx->wheel, &fork->timer);
+
+   if (fork->bestResp != NULL) {
+      osip_message_free(fork->bestResp);
+   }
+
+   fork->alive = 0;
+   _es_fork_pool_free(&pCtx->forks, fork->index);
+}
+
+/* Copy of a response with our Via removed */
+static osip_message_t *_es_fork_pop_via(osip_message_t *resp)
+{
+   osip_message_t *copy = NULL;
+   osip_via_t *via = NULL;
+   int memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+
+   if (osip_message_clone(resp, &copy) != OSIP_SUCCESS) {
+      es_mem_scope_leave(memScope);
+      return NULL;
+   }
+
+   via = (osip_via_t *)osip_list_get(&copy->vias, 0);
+   if (via != NULL) {
+      osip_list_remove(&copy->vias, 0);
+      osip_via_free(via);
+   }
+   osip_message_force_update(copy);
+   es_mem_scope_leave(memScope);
+
+   return copy;
+}
+
+/* Answer on a server transaction with a response of ours */
+static void _es_fork_reply(struct es_fork_s *pCtx, osip_transaction_t *tr, osip_message_t *request, int code)
+{
+   osip_message_t *resp = NULL;
+   int memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   es_status ret = es_msg_initResponse(&resp, code, request);
+
+   es_mem_scope_leave(memScope);
+
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not answer %d: no more memory", code);
+      return;
+   }
+
+   (void)pCtx->stack.post(pCtx->stack.arg, tr, resp);
+}
+
+/* A response of a branch goes back: on the server transaction until the
+   first final one, statelessly after (more 2xx) */
+static void _es_fork_upstream(struct es_fork_s *pCtx, struct _es_fork_s *fork, osip_message_t *resp)
+{
+   osip_message_t *copy = _es_fork_pop_via(resp);
+
+   if (copy == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Response not forwarded: no more memory");
+      return;
+   }
+
+   (void)pCtx->stack.post(pCtx->stack.arg, fork->answered ? NULL : fork->server, copy);
+}
+
+/* CANCEL of an INVITE sent (RFC 3261 9.1): same Request-URI, Call-ID,
+   To, From, CSeq number, top Via and Route */
+static osip_message_t *_es_fork_cancel_new(const osip_message_t *invite)
+{
+   osip_message_t *cancel = NULL;
+   osip_via_t *via = NULL;
+   int bad = 0;
+   int i = 0;
+
+   if ((invite == NULL) || (osip_message_init(&cancel) != OSIP_SUCCESS)) {
+      return NULL;
+   }
+
+   osip_message_set_version(cancel, osip_strdup("SIP/2.0"));
+   osip_message_set_method(cancel, osip_strdup("CANCEL"));
+
+   bad |= (osip_uri_clone(invite->req_uri, &cancel->req_uri) != OSIP_SUCCESS);
+   bad |= (osip_call_id_clone(invite->call_id, &cancel->call_id) != OSIP_SUCCESS);
+   bad |= (osip_from_clone(invite->from, &cancel->from) != OSIP_SUCCESS);
+   bad |= (osip_to_clone(invite->to, &cancel->to) != OSIP_SUCCESS);
+   bad |= (osip_cseq_clone(invite->cseq, &cancel->cseq) != OSIP_SUCCESS);
+   bad |= (osip_via_clone((osip_via_t *)osip_list_get(&invite->vias, 0), &via) != OSIP_SUCCESS);
+   if (bad) {
+      osip_message_free(cancel);
+      return NULL;
+   }
+
+   osip_list_add(&cancel->vias, via, -1);
+   osip_free(cancel->cseq->method);
+   cancel->cseq->method = osip_strdup("CANCEL");
+
+   for (i = 0; !osip_list_eol(&invite->routes, i); ++i) {
+      osip_route_t *route = NULL;
+
+      if (osip_from_clone((osip_route_t *)osip_list_get(&invite->routes, i), &route) != OSIP_SUCCESS) {
+         osip_message_free(cancel);
+         return NULL;
+      }
+      osip_list_add(&cancel->routes, route, -1);
+   }
+
+   osip_message_set_max_forwards(cancel, "70");
+
+   return cancel;
+}
+
+static void _es_fork_cancel_branch(struct es_fork_s *pCtx, struct _es_fork_branch_s *branch)
+{
+   osip_message_t *cancel = NULL;
+   int memScope = 0;
+
+   if ((branch->tr == NULL) || (branch->code != 0) || (branch->cancel == _ES_FORK_CANCEL_SENT)) {
+      return;
+   }
+
+   /* Not before a provisional response (RFC 3261 9.1) */
+   if (!branch->provisional) {
+      branch->cancel = _ES_FORK_CANCEL_WANTED;
+      return;
+   }
+
+   branch->cancel = _ES_FORK_CANCEL_SENT;
+
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   cancel = _es_fork_cancel_new(branch->tr->orig_request);
+   es_mem_scope_leave(memScope);
+
+   /* Its own transaction, not part of the fork */
+   if ((cancel == NULL) || (pCtx->stack.send(pCtx->stack.arg, cancel, &branch->to, NULL) == NULL)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "CANCEL of a branch not sent");
+      return;
+   }
+
+   __atomic_add_fetch(&pCtx->cancels, 1, __ATOMIC_RELAXED);
+}
+
+static void _es_fork_cancel_all(struct es_fork_s *pCtx, struct _es_fork_s *fork)
+{
+   uint32_t i = 0;
+
+   if (!fork->invite) {
+      return;
+   }
+
+   for (i = fork->branches; i != ES_FORK_NONE; ) {
+      struct _es_fork_branch_s *branch = (struct _es_fork_branch_s *)_es_fork_pool_at(&pCtx->branches, i);
+
+      _es_fork_cancel_branch(pCtx, branch);
+      i = branch->next;
+   }
+}
+
+/* RFC 3261 16.7.6: a 6xx, else the lowest class, the first of a class */
+static int _es_fork_better(unsigned int code, unsigned int best)
+{
+   if (best == 0) {
+      return 1;
+   }
+
+   if ((best >= 600) || (code >= 600)) {
+      return best < 600;
+   }
+
+   return (code / 100) < (best / 100);
+}
+
+/* All the branches failed: the best response goes back */
+static void _es_fork_answer(struct es_fork_s *pCtx, struct _es_fork_s *fork)
+{
+   osip_message_t *resp = fork->bestResp;
+
+   fork->answered = 1;
+   fork->bestResp = NULL;
+   es_wheel_remove(pCtx->wheel, &fork->timer);
+   __atomic_add_fetch(&pCtx->failed, 1, __ATOMIC_RELAXED);
+
+   if (fork->server == NULL) {
+      if (resp != NULL) {
+         osip_message_free(resp);
+      }
+      return;
+   }
+
+   if (resp == NULL) {
+      _es_fork_reply(pCtx, fork->server, fork->server->orig_request, fork->best);
+      return;
+   }
+
+   /* Our trouble, not the caller's */
+   if (resp->status_code == SIP_SERVICE_UNAVAILABLE) {
+      osip_message_set_status_code(resp, SIP_INTERNAL_SERVER_ERROR);
+      osip_free(resp->reason_phrase);
+      osip_message_set_reason_phrase(resp, osip_strdup(osip_message_get_reason(SIP_INTERNAL_SERVER_ERROR)));
+      osip_message_force_update(resp);
+   }
+
+   (void)pCtx->stack.post(pCtx->stack.arg, fork->server, resp);
+}
+
+/* A branch ended with a final response, NULL if ours */
+static void _es_fork_final(struct es_fork_s *pCtx, struct _es_fork_s *fork, struct _es_fork_branch_s *branch,
+                           int code, osip_message_t *resp)
+{
+   branch->code = (uint16_t)code;
+   fork->pending--;
+
+   /* Every 2xx goes back, the first one cancels the other branches */
+   if ((code >= 200) && (code < 300)) {
+      _es_fork_upstream(pCtx, fork, resp);
+      if (!fork->answered) {
+         fork->answered = 1;
+         es_wheel_remove(pCtx->wheel, &fork->timer);
+         __atomic_add_fetch(&pCtx->answered, 1, __ATOMIC_RELAXED);
+         _es_fork_cancel_all(pCtx, fork);
+      }
+      return;
+   }
+
+   if (!fork->answered && _es_fork_better((unsigned int)code, fork->best)) {
+      if (fork->bestResp != NULL) {
+         osip_message_free(fork->bestResp);
+      }
+      fork->bestResp = (resp != NULL) ? _es_fork_pop_via(resp) : NULL;
+      fork->best = (uint16_t)code;
+   }
+
+   if ((fork->pending == 0) && !fork->answered) {
+      _es_fork_answer(pCtx, fork);
+   }
+}
+
+/* A response of a branch, NULL when it timed out */
+static void _es_fork_response(struct es_fork_s *pCtx, osip_transaction_t *tr, osip_message_t *resp)
+{
+   struct _es_fork_branch_s *branch = (struct _es_fork_branch_s *)osip_transaction_get_reserved2(tr);
+   struct _es_fork_s *fork = NULL;
+   int code = (resp != NULL) ? resp->status_code : SIP_REQUEST_TIME_OUT;
+
+   /* A CANCEL of ours, or a branch already ended */
+   if ((branch == NULL) || (branch->code != 0)) {
+      return;
+   }
+
+   fork = (struct _es_fork_s *)_es_fork_pool_at(&pCtx->forks, branch->fork);
+
+   if (code >= 200) {
+      _es_fork_final(pCtx, fork, branch, code, resp);
+      return;
+   }
+
+   if (!branch->provisional) {
+      branch->provisional = 1;
+      if (branch->cancel == _ES_FORK_CANCEL_WANTED) {
+         _es_fork_cancel_branch(pCtx, branch);
+      }
+   }
+
+   /* Still ringing: Timer C starts again, unless cancelled by it */
+   if (es_wheel_pending(&fork->timer) && !fork->expired) {
+      es_wheel_add(pCtx->wheel, &fork->timer, _es_fork_now() + ES_FORK_TIMER_C);
+   }
+
+   /* Ours went back already */
+   if ((code != SIP_TRYING) && !fork->answered) {
+      _es_fork_upstream(pCtx, fork, resp);
+   }
+}
+
+static int _es_fork_route_addr(osip_route_t *route, struct sockaddr_in *to)
+{
+   char *uri = NULL;
+   int ret = 0;
+
+   if ((route == NULL) || (route->url == NULL) || (osip_uri_to_str(route->url, &uri) != OSIP_SUCCESS)) {
+      return 0;
+   }
+
+   ret = (es_raw_uri_addr(uri, strlen(uri), to) == ES_OK);
+   osip_free(uri);
+
+   return ret;
+}
+
+/* A copy of the request on its own client transaction */
+static es_status _es_fork_branch_start(struct es_fork_s *pCtx, struct _es_fork_s *fork, osip_message_t *request,
+                                       const struct es_proxy_target_s *target, int popRoute,
+                                       unsigned long maxForwards, unsigned int n)
+{
+   struct _es_fork_branch_s *branch = NULL;
+   osip_message_t *req = NULL;
+   osip_header_t *mf = NULL;
+   osip_via_t *via = NULL;
+   osip_uri_t *uri = NULL;
+   osip_transaction_t *tr = NULL;
+   char sentBy[ES_CONFIG_STR_LEN + 8];
+   char value[ES_CONFIG_STR_LEN + 64];
+   uint32_t index = 0;
+   int memScope = 0;
+   int bad = 0;
+
+   if (es_proxy_sent_by(pCtx->proxyCtx, sentBy, sizeof(sentBy)) != ES_OK) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+
+   if (osip_message_clone(request, &req) != OSIP_SUCCESS) {
+      es_mem_scope_leave(memScope);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Retargeted to a binding */
+   if (target->uri[0] != '\0') {
+      bad |= (osip_uri_init(&uri) != OSIP_SUCCESS) || (osip_uri_parse(uri, target->uri) != OSIP_SUCCESS);
+      if (!bad) {
+         osip_uri_free(req->req_uri);
+         osip_message_set_uri(req, uri);
+      } else if (uri != NULL) {
+         osip_uri_free(uri);
+      }
+   }
+
+   if (popRoute && !osip_list_eol(&req->routes, 0)) {
+      osip_route_t *route = (osip_route_t *)osip_list_get(&req->routes, 0);
+      osip_list_remove(&req->routes, 0);
+      osip_route_free(route);
+   }
+
+   snprintf(value, sizeof(value), "%lu", maxForwards);
+   if ((osip_message_get_max_forwards(req, 0, &mf) >= 0) && (mf != NULL)) {
+      osip_free(mf->hvalue);
+      mf->hvalue = osip_strdup(value);
+   } else {
+      bad |= (osip_message_set_max_forwards(req, value) != OSIP_SUCCESS);
+   }
+
+   /* Our Via on top, a branch of its own */
+   snprintf(value, sizeof(value), "SIP/2.0/UDP %s;branch=" ES_FORK_BRANCH "%08x%08x%02x",
+            sentBy, pCtx->tag, pCtx->seq, n);
+   bad |= (osip_via_init(&via) != OSIP_SUCCESS);
+   if (!bad && (osip_via_parse(via, value) == OSIP_SUCCESS)) {
+      osip_list_add(&req->vias, via, 0);
+   } else {
+      if (via != NULL) {
+         osip_via_free(via);
+      }
+      bad = 1;
+   }
+
+   osip_message_force_update(req);
+   es_mem_scope_leave(memScope);
+
+   if (bad) {
+      osip_message_free(req);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   branch = (struct _es_fork_branch_s *)_es_fork_pool_alloc(&pCtx->branches, &index);
+   if (branch == NULL) {
+      osip_message_free(req);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   branch->fork = fork->index;
+   branch->to = target->to;
+   branch->next = fork->branches;
+   fork->branches = index;
+
+   tr = pCtx->stack.send(pCtx->stack.arg, req, &target->to, branch);
+   if (tr == NULL) {
+      fork->branches = branch->next;
+      _es_fork_pool_free(&pCtx->branches, index);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   branch->tr = tr;
+   fork->pending++;
+   fork->alive++;
+   __atomic_add_fetch(&pCtx->started, 1, __ATOMIC_RELAXED);
+
+   return ES_OK;
+}
+
+/* A new request: to each next hop, or answered if none */
+static es_status _es_fork_request(struct es_fork_s *pCtx, osip_transaction_t *tr, osip_message_t *request)
+{
+   struct es_proxy_target_s targets[ES_FORK_MAX_BRANCHES];
+   struct _es_fork_s *fork = NULL;
+   osip_header_t *mf = NULL;
+   osip_route_t *route = NULL;
+   const char *branch = NULL;
+   unsigned long maxForwards = ES_FORK_MAX_FORWARDS;
+   unsigned int nb = 0;
+   unsigned int i = 0;
+   unsigned int self = 0;
+   uint32_t index = 0;
+   int popRoute = 0;
+
+   /* Loops end after Max-Forwards hops */
+   if ((osip_message_get_max_forwards(request, 0, &mf) >= 0) && (mf != NULL) && (mf->hvalue != NULL)) {
+      char *end = NULL;
+
+      maxForwards = strtoul(mf->hvalue, &end, 10);
+      if ((end == mf->hvalue) || (maxForwards == 0)) {
+         _es_fork_reply(pCtx, tr, request, (end == mf->hvalue) ? SIP_BAD_REQUEST : SIP_TOO_MANY_HOPS);
+         return ES_OK;
+      }
+   }
+
+   /* Loose routing: the first Route not ours, else the next hops located */
+   route = (osip_route_t *)osip_list_get(&request->routes, 0);
+   if ((route != NULL) && _es_fork_route_addr(route, &targets[0].to) && es_proxy_is_self(pCtx->proxyCtx, &targets[0].to)) {
+      popRoute = 1;
+      route = (osip_route_t *)osip_list_get(&request->routes, 1);
+   }
+
+   if (route != NULL) {
+      nb = _es_fork_route_addr(route, &targets[0].to) ? 1 : 0;
+      targets[0].uri[0] = '\0';
+   } else {
+      char *uri = NULL;
+
+      if ((request->req_uri != NULL) && (osip_uri_to_str(request->req_uri, &uri) == OSIP_SUCCESS)) {
+         nb = es_proxy_locate(pCtx->proxyCtx, uri, strlen(uri), targets, ES_FORK_MAX_BRANCHES);
+         osip_free(uri);
+      }
+   }
+
+   if (nb == 0) {
+      _es_fork_reply(pCtx, tr, request, SIP_NOT_FOUND);
+      return ES_OK;
+   }
+
+   for (i = 0; i < nb; ++i) {
+      self += (unsigned int)es_proxy_is_self(pCtx->proxyCtx, &targets[i].to);
+   }
+
+   if (self == nb) {
+      _es_fork_reply(pCtx, tr, request, SIP_LOOP_DETECTED);
+      return ES_OK;
+   }
+
+   fork = (struct _es_fork_s *)_es_fork_pool_alloc(&pCtx->forks, &index);
+   if (fork == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not fork: no more memory");
+      _es_fork_reply(pCtx, tr, request, SIP_INTERNAL_SERVER_ERROR);
+      return ES_OK;
+   }
+
+   fork->index = index;
+   fork->branches = ES_FORK_NONE;
+   fork->server = tr;
+   fork->alive = 1;
+   fork->invite = MSG_IS_INVITE(request) ? 1 : 0;
+   fork->hash = _es_fork_key(tr->topvia, tr->callid, &branch);
+   pCtx->seq++;
+
+   /* Found again by a CANCEL */
+   fork->next = pCtx->buckets[fork->hash & (ES_FORK_BUCKETS - 1)];
+   pCtx->buckets[fork->hash & (ES_FORK_BUCKETS - 1)] = index;
+
+   /* Do not retransmit, we are on it (RFC 3261 16.2) */
+   if (fork->invite) {
+      _es_fork_reply(pCtx, tr, request, SIP_TRYING);
+   }
+
+   for (i = 0; i < nb; ++i) {
+      if (!es_proxy_is_self(pCtx->proxyCtx, &targets[i].to) &&
+          (_es_fork_branch_start(pCtx, fork, request, &targets[i], popRoute, maxForwards - 1, i) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Branch %u of %u not started", i + 1, nb);
+      }
+   }
+
+   if (fork->pending == 0) {
+      _es_fork_free(pCtx, fork);
+      _es_fork_reply(pCtx, tr, request, SIP_INTERNAL_SERVER_ERROR);
+      return ES_OK;
+   }
+
+   osip_transaction_set_reserved2(tr, fork);
+
+   if (fork->invite) {
+      es_wheel_add(pCtx->wheel, &fork->timer, _es_fork_now() + ES_FORK_TIMER_C);
+   }
+
+   __atomic_add_fetch(&pCtx->forked, 1, __ATOMIC_RELAXED);
+   return ES_OK;
+}
+
+/* A CANCEL received: answered at once, its INVITE branches cancelled */
+static es_status _es_fork_cancel(struct es_fork_s *pCtx, osip_transaction_t *tr, osip_message_t *cancel)
+{
+   struct _es_fork_s *fork = _es_fork_find(pCtx, cancel);
+
+   _es_fork_reply(pCtx, tr, cancel, (fork != NULL) ? SIP_OK : SIP_CALL_TRANSACTION_DOES_NOT_EXIST);
+
+   /* The 487 of the branches goes back as the best response */
+   if ((fork != NULL) && !fork->answered) {
+      __atomic_add_fetch(&pCtx->cancelled, 1, __ATOMIC_RELAXED);
+      _es_fork_cancel_all(pCtx, fork);
+   }
+
+   return ES_OK;
+}
+
+/* RFC 3261 16.8: cancel what rings, a branch silent so far timed out.
+   Fired again when a cancelled branch never ends: it times out too, the
+   client gets the best response so far or 408 */
+static void _es_fork_timer_c_cb(struct es_wheel_entry_s *entry, void *arg)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)arg;
+   struct _es_fork_s *fork = (struct _es_fork_s *)entry;
+   uint32_t i = 0;
+
+   if (!fork->expired) {
+      __atomic_add_fetch(&_pCtx->timerC, 1, __ATOMIC_RELAXED);
+   }
+
+   for (i = fork->branches; (i != ES_FORK_NONE) && !fork->answered; ) {
+      struct _es_fork_branch_s *branch = (struct _es_fork_branch_s *)_es_fork_pool_at(&_pCtx->branches, i);
+
+      i = branch->next;
+      if (branch->code != 0) {
+         continue;
+      }
+
+      if (branch->provisional && !fork->expired) {
+         _es_fork_cancel_branch(_pCtx, branch);
+      } else {
+         _es_fork_final(_pCtx, fork, branch, SIP_REQUEST_TIME_OUT, NULL);
+      }
+   }
+
+   /* Cancelled branches left: their 487, else the second pass */
+   if (!fork->answered && !fork->expired && (fork->pending != 0)) {
+      fork->expired = 1;
+      es_wheel_add(_pCtx->wheel, &fork->timer, _es_fork_now() + ES_FORK_TIMER_CANCEL);
+   }
+}
+
+static void _es_fork_tick_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)arg;
+
+   (void)es_wheel_advance(_pCtx->wheel, _es_fork_now());
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_fork_init(es_fork_t **ppCtx, struct event_base *pBase, const struct es_fork_stack_s *pStack)
+{
+   struct es_fork_s *_pCtx = NULL;
+   struct timeval tv = { ES_FORK_TICK_MS / 1000, (ES_FORK_TICK_MS % 1000) * 1000 };
+   unsigned int i = 0;
+
+   if ((ppCtx == NULL) || (pBase == NULL) || (pStack == NULL) || (pStack->send == NULL) || (pStack->post == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_fork_s *) es_mem_calloc(ES_MEM_PROXY, 1, sizeof(struct es_fork_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create forks: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_FORK_MAGIC;
+   _pCtx->stack = *pStack;
+   _pCtx->tag = osip_build_random_number();
+   _pCtx->forks.size = sizeof(struct _es_fork_s);
+   _pCtx->forks.freeList = ES_FORK_NONE;
+   _pCtx->branches.size = sizeof(struct _es_fork_branch_s);
+   _pCtx->branches.freeList = ES_FORK_NONE;
+
+   _pCtx->buckets = (uint32_t *) es_mem_malloc(ES_MEM_PROXY, ES_FORK_BUCKETS * sizeof(uint32_t));
+   if ((_pCtx->buckets == NULL) || (es_wheel_init(&_pCtx->wheel, _es_fork_now(), _es_fork_timer_c_cb, _pCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create forks: no more memory");
+      es_fork_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   for (i = 0; i < ES_FORK_BUCKETS; ++i) {
+      _pCtx->buckets[i] = ES_FORK_NONE;
+   }
+
+   /* Low priority: SIP messages first */
+   _pCtx->tick = event_new(pBase, -1, EV_PERSIST, _es_fork_tick_cb, _pCtx);
+   if ((_pCtx->tick == NULL) || (event_priority_set(_pCtx->tick, 1) != 0) || (event_add(_pCtx->tick, &tv) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start Timer C tick");
+      es_fork_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_fork_deinit(es_fork_t *pCtx)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)pCtx;
+   uint32_t i = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_FORK_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->tick != NULL) {
+      event_free(_pCtx->tick);
+   }
+
+   /* Responses kept, the transactions are the stack's */
+   for (i = 0; i < (_pCtx->forks.nbChunks << ES_FORK_CHUNK_BITS); ++i) {
+      struct _es_fork_s *fork = (struct _es_fork_s *)_es_fork_pool_at(&_pCtx->forks, i);
+
+      if ((fork->alive != 0) && (fork->index == i) && (fork->bestResp != NULL)) {
+         osip_message_free(fork->bestResp);
+      }
+   }
+
+   if (_pCtx->wheel != NULL) {
+      es_wheel_deinit(_pCtx->wheel);
+   }
+
+   _es_fork_pool_deinit(&_pCtx->forks);
+   _es_fork_pool_deinit(&_pCtx->branches);
+   es_mem_free(_pCtx->buckets);
+
+   _pCtx->magic = 0;
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_fork_set_proxy(es_fork_t *pCtx, struct es_proxy_s *pProxy)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_FORK_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx->proxyCtx = pProxy;
+   return ES_OK;
+}
+
+es_status es_fork_handle(es_fork_t *pCtx, int type, struct osip_transaction *tr, struct osip_message *msg)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->proxyCtx == NULL)) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   /* Branches go on whatever the mode now */
+   switch (type) {
+   case OSIP_ICT_STATUS_1XX_RECEIVED:
+   case OSIP_ICT_STATUS_2XX_RECEIVED:
+   case OSIP_ICT_STATUS_3XX_RECEIVED:
+   case OSIP_ICT_STATUS_4XX_RECEIVED:
+   case OSIP_ICT_STATUS_5XX_RECEIVED:
+   case OSIP_ICT_STATUS_6XX_RECEIVED:
+   case OSIP_NICT_STATUS_1XX_RECEIVED:
+   case OSIP_NICT_STATUS_2XX_RECEIVED:
+   case OSIP_NICT_STATUS_3XX_RECEIVED:
+   case OSIP_NICT_STATUS_4XX_RECEIVED:
+   case OSIP_NICT_STATUS_5XX_RECEIVED:
+   case OSIP_NICT_STATUS_6XX_RECEIVED:
+      _es_fork_response(_pCtx, tr, msg);
+      return ES_OK;
+   case OSIP_ICT_STATUS_TIMEOUT:
+   case OSIP_NICT_STATUS_TIMEOUT:
+      _es_fork_response(_pCtx, tr, NULL);
+      return ES_OK;
+   default:
+      break;
+   }
+
+   if (es_proxy_mode(_pCtx->proxyCtx) != ES_CONFIG_MODE_STATEFUL) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   /* REGISTER is the registrar's */
+   switch (type) {
+   case OSIP_IST_INVITE_RECEIVED:
+   case OSIP_NIST_BYE_RECEIVED:
+   case OSIP_NIST_OPTIONS_RECEIVED:
+   case OSIP_NIST_INFO_RECEIVED:
+   case OSIP_NIST_NOTIFY_RECEIVED:
+   case OSIP_NIST_SUBSCRIBE_RECEIVED:
+   case OSIP_NIST_UNKNOWN_REQUEST_RECEIVED:
+      return _es_fork_request(_pCtx, tr, msg);
+   case OSIP_NIST_CANCEL_RECEIVED:
+      return _es_fork_cancel(_pCtx, tr, msg);
+   default:
+      return ES_ERROR_NOTSUPPORTED;
+   }
+}
+
+void es_fork_release(es_fork_t *pCtx, struct osip_transaction *tr)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)pCtx;
+   struct _es_fork_s *fork = NULL;
+   void *owner = NULL;
+
+   if ((_pCtx == NULL) || (tr == NULL) || ((owner = osip_transaction_get_reserved2(tr)) == NULL)) {
+      return;
+   }
+
+   osip_transaction_set_reserved2(tr, NULL);
+
+   if ((tr->ctx_type == IST) || (tr->ctx_type == NIST)) {
+      fork = (struct _es_fork_s *)owner;
+      fork->server = NULL;
+
+      /* Nobody waits for them anymore */
+      if (!fork->answered) {
+         fork->answered = 1;
+         es_wheel_remove(_pCtx->wheel, &fork->timer);
+         _es_fork_cancel_all(_pCtx, fork);
+      }
+   } else {
+      struct _es_fork_branch_s *branch = (struct _es_fork_branch_s *)owner;
+
+      fork = (struct _es_fork_s *)_es_fork_pool_at(&_pCtx->forks, branch->fork);
+      branch->tr = NULL;
+
+      /* Ended without a final response: a transport error */
+      if (branch->code == 0) {
+         _es_fork_final(_pCtx, fork, branch, SIP_REQUEST_TIME_OUT, NULL);
+      }
+   }
+
+   if (--fork->alive == 0) {
+      _es_fork_free(_pCtx, fork);
+   }
+}
+
+int es_fork_proxied(const es_fork_t *pCtx, const struct osip_transaction *tr)
+{
+   return (pCtx != NULL) && (tr != NULL) && ((tr->ctx_type == IST) || (tr->ctx_type == NIST)) &&
+          (tr->reserved2 != NULL);
+}
+
+static int _es_fork_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)arg;
+   unsigned int forkChunks = __atomic_load_n(&_pCtx->forks.nbChunks, __ATOMIC_RELAXED);
+   unsigned int branchChunks = __atomic_load_n(&_pCtx->branches.nbChunks, __ATOMIC_RELAXED);
+
+   es_cli_print(pCli, "Forks %u of %u pooled (%u bytes each), branches %u of %u pooled (%u bytes each)",
+                __atomic_load_n(&_pCtx->forks.used, __ATOMIC_RELAXED), forkChunks << ES_FORK_CHUNK_BITS,
+                (unsigned int)sizeof(struct _es_fork_s),
+                __atomic_load_n(&_pCtx->branches.used, __ATOMIC_RELAXED), branchChunks << ES_FORK_CHUNK_BITS,
+                (unsigned int)sizeof(struct _es_fork_branch_s));
+   es_cli_print(pCli, "%12s %12s %12s %12s %12s %12s %12s",
+                "forked", "branches", "answered", "failed", "cancelled", "cancels", "timer C");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu %12llu %12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->forked, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->started, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->answered, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->failed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->cancelled, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->cancels, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->timerC, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_fork_cli_register(es_fork_t *pCtx, es_cli_t *pCli)
+{
+   struct es_fork_s *_pCtx = (struct es_fork_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_FORK_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show forks", "Show the forks of the stateful proxy", _es_fork_cli_show, _pCtx);
+}
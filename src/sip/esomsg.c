@@ -33,6 +33,8 @@
 
 #include "eserror.h"
 #include "log.h"
+#include "escli.h"
+#include "eshist.h"
 #include "esomsg.h"
 
 #define ES_OMSG_MAGIC      0x20140917
@@ -137,6 +139,7 @@ es_status es_msg_init(es_msg_t **ppCtx)
 es_status es_msg_initResponse(osip_message_t **ppRes, int respCode, osip_message_t *req)
 {
    osip_message_t *_pMsg = NULL;
+   uint64_t buildTs = es_hist_now();
 
    if (req == (osip_message_t *)0) {
            return ES_ERROR_OUTOFRESOURCES;
@@ -227,6 +230,8 @@ es_status es_msg_initResponse(osip_message_t **ppRes, int respCode, osip_message
    osip_message_set_subject(_pMsg, "Testing with " PACKAGE_STRING);
    osip_message_set_server(_pMsg, PACKAGE_STRING " Server");
 
+   es_hist_record_since(ES_HIST_RESP_BUILD, buildTs);
+
    *ppRes = _pMsg;
    return ES_OK;
 }
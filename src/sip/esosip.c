@@ -22,25 +22,64 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include <event2/event.h>
 
+#include <libcli.h>
+
 #include <osip2/osip.h>
 #include <osip2/osip_dialog.h>
 
 #include "eserror.h"
 #include "log.h"
+#include "escli.h"
+#include "esstats.h"
+#include "eshist.h"
+#include "esloop.h"
+#include "esprobe.h"
+#include "esflow.h"
+#include "esmem.h"
+#include "esmpsc.h"
+#include "essnap.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "esregistrar.h"
+#include "esproxy.h"
+#include "esfork.h"
+#include "esscenario.h"
+#include "esauth.h"
+#include "eswork.h"
+#include "esparse.h"
+#include "esrate.h"
+#include "esacl.h"
 
 #include "estransport.h"
+#include "escapture.h"
 #include "esomsg.h"
 #include "esosip.h"
 
 #define ES_OSIP_MAGIC       0x20140607
 
+/** Posted calls run per wake up, the sockets are read between batches */
+#define ES_OSIP_POST_BATCH  64
+
+/** Largest message injected from the CLI */
+#define ES_OSIP_INJECT_MAX  65535
+
+/** Period of the transaction timers (A to K), under T1/5 */
+#define ES_OSIP_TIMERS_MS   50
+
 struct es_osip_s {
    /* Magic */
    uint32_t                  magic;
@@ -54,6 +93,122 @@ struct es_osip_s {
    osip_list_t               pendingEv;
    /* Dialog list */
    osip_list_t               osipDialog;
+   /* Transactions terminated, freed after the state machines pass */
+   osip_list_t               killedTr;
+   /* Time of the oldest wake up not handled yet (0: none) */
+   uint64_t                  pendingTs;
+   /* Transactions and dialogs published to the CLI */
+   es_snap_t                 *snapCtx;
+   /* Changes of the dialogs, append NULL if none */
+   struct es_upgrade_journal_s journal;
+   /* Bindings of REGISTER, NULL if none */
+   es_registrar_t            *registrarCtx;
+   /* Proxy, messages go to it first, NULL if none */
+   es_proxy_t                *proxyCtx;
+   /* Requests forked on client transactions (stateful proxy) */
+   es_fork_t                 *forkCtx;
+   /* Scripted responses, replace the ones below when one matches */
+   es_scenario_t             *scenarioCtx;
+   /* Digest credentials of INVITE and REGISTER, NULL if none */
+   es_auth_t                 *authCtx;
+   /* Pool of the digests, NULL to do them here */
+   es_work_t                 *workCtx;
+   /* Parser threads, NULL to parse here */
+   es_parse_t                *parseCtx;
+   /* Final responses sent to INVITE, REGISTER and BYE */
+   int                       inviteCode;
+   int                       registerCode;
+   int                       byeCode;
+   /* Calls posted by other threads, eventfd written once until read */
+   struct es_mpsc_s          posted;
+   int                       postSignaled;
+   int                       postFd;
+   struct event              *evPost;
+   /* Runs the transaction timers while no message comes */
+   struct event              *evTimers;
+   /* Counters of the posts, read by the CLI */
+   uint64_t                  postCount;
+   uint64_t                  postRun;
+   uint64_t                  postWakeups;
+   /* Only files of this directory are injected, none if empty; set on the
+      loop, read by the CLI thread */
+   pthread_mutex_t           injectLock;
+   char                      injectDir[ES_CONFIG_STR_LEN];
+};
+
+/**
+ * @brief A call posted to the loop thread, a message copied after it
+ */
+struct _es_osip_post_s {
+   struct es_mpsc_node_s     link;
+   es_osip_post_cb           cb;
+   void                      *arg;
+   /* Post time, es_hist_now() */
+   uint64_t                  ts;
+   unsigned int              size;
+   char                      buf[];
+};
+
+/**
+ * @brief Data attached to each transaction (reserved1)
+ */
+struct es_osip_tr_s {
+   /* Time the request was received */
+   uint64_t                  rxTs;
+   /* A response was already sent */
+   int                       responded;
+   /* Call flow traced, and its Call-ID hash */
+   int                       traced;
+   uint32_t                  flowHash;
+   /* Snapshot row, -1 if none */
+   int                       snapSlot;
+   /* Credentials checked on the pool, NULL if none */
+   struct _es_osip_work_s    *work;
+};
+
+/**
+ * @brief A request waiting for the check of its credentials on the pool
+ * Released by its completion, tr set to NULL if the transaction goes
+ * first.
+ */
+struct _es_osip_work_s {
+   struct es_osip_s          *ctx;
+   es_auth_t                 *auth;
+   struct es_auth_job_s      *job;
+   osip_transaction_t        *tr;
+   osip_message_t            *msg;
+   int                       type;
+};
+
+/**
+ * @brief Data attached to each dialog (instance)
+ */
+struct es_osip_dlg_s {
+   /* Stack owning the dialog */
+   struct es_osip_s          *ctx;
+   /* Snapshot row, -1 if none */
+   int                       snapSlot;
+   /* Creation time (es_hist_now()) */
+   uint64_t                  since;
+};
+
+/**
+ * @brief Fields of an ES_UPGRADE_REC_DIALOG record
+ */
+enum _es_osip_dlg_field_e {
+   ES_OSIP_DLG_CALL_ID = 1,
+   ES_OSIP_DLG_LOCAL_TAG,
+   ES_OSIP_DLG_REMOTE_TAG,
+   ES_OSIP_DLG_LINE_PARAM,
+   ES_OSIP_DLG_LOCAL_URI,
+   ES_OSIP_DLG_REMOTE_URI,
+   ES_OSIP_DLG_CONTACT,
+   ES_OSIP_DLG_ROUTE,            /* One per route, in order */
+   ES_OSIP_DLG_LOCAL_CSEQ,
+   ES_OSIP_DLG_REMOTE_CSEQ,
+   ES_OSIP_DLG_STATE,
+   ES_OSIP_DLG_SECURE,
+   ES_OSIP_DLG_AGE_MS
 };
 
 /*******************************************************************************
@@ -80,7 +235,8 @@ static void _es_transport_event_cb(es_transport_t *transp, int event, int error,
  * @param size
  * @param data
  */
-static void _es_transport_msg_cb(es_transport_t *transp, const char const *msg, const unsigned int size, void *data);
+static void _es_transport_msg_cb(es_transport_t *transp, const char const *msg, const unsigned int size,
+                                 const struct sockaddr_in *from, void *data);
 
 /**
  * @brief Set OSip stack callbacks to internal ones
@@ -97,6 +253,169 @@ static es_status _es_osip_set_internal_callbacks(struct es_osip_s *_ctx);
  */
 static es_status _es_osip_wakeup(struct es_osip_s *_ctx);
 
+/**
+ * @brief Release the data attached to a transaction
+ */
+static void _es_osip_tr_data_free(osip_transaction_t *tr);
+
+/**
+ * @brief Build a response, counted as message memory
+ */
+static es_status _es_osip_new_response(osip_message_t **ppResp, int code, osip_message_t *request);
+
+/**
+ * @brief Free the transactions terminated during the last pass
+ */
+static void _es_osip_free_killed(struct es_osip_s *pCtx);
+
+/**
+ * @brief Free all the transactions of a list
+ */
+static void _es_osip_free_transactions(struct es_osip_s *pCtx, osip_list_t *list);
+
+/**
+ * @brief Record a step of the call flow of a traced transaction
+ */
+static void _es_osip_flow(osip_transaction_t *tr, es_flow_kind_t kind, uint64_t ts, uint64_t dur, int arg);
+
+/**
+ * @brief Call-ID and branch of a message or transaction, for the probes
+ * @param callId Call-ID header (may be NULL)
+ * @param via Top Via header (may be NULL)
+ * @param pCallId Call-ID number or ""
+ * @param pBranch Branch or ""
+ */
+static void _es_osip_probe_ids(osip_call_id_t *callId, osip_via_t *via, const char **pCallId, const char **pBranch);
+
+/**
+ * @brief A message received for the first time, neither sent nor retransmitted
+ * @param type oSIP message callback type
+ * @return 1 if the method and response counters count it
+ */
+static int _es_osip_is_received(int type);
+
+/**
+ * @brief A message of a transaction, its credentials checked
+ */
+static void _es_osip_message(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg);
+
+/**
+ * @brief Check the credentials of a request, on the pool if any
+ */
+static void _es_osip_authenticate(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg);
+
+/**
+ * @brief Go on with a request checked, or answer it
+ */
+static void _es_osip_authenticated(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg,
+                                   int code);
+
+static void _es_osip_work_run(void *arg);
+static void _es_osip_work_done(void *arg);
+
+/**
+ * @brief Publish a new transaction to the snapshots
+ */
+static void _es_osip_snap_tr(struct es_osip_s *pCtx, osip_transaction_t *tr, struct es_osip_tr_s *trData);
+
+/**
+ * @brief Current state of a transaction or dialog row
+ */
+static void _es_osip_snap_tr_refresh(const void *obj, struct es_snap_row_s *row);
+static void _es_osip_snap_dialog_refresh(const void *obj, struct es_snap_row_s *row);
+
+/**
+ * @brief Create a dialog as UAS, published to the snapshots
+ */
+static es_status _es_osip_dialog_new(struct es_osip_s *pCtx, osip_transaction_t *tr, osip_message_t *resp);
+
+/**
+ * @brief Add a dialog to the list, published to the snapshots
+ */
+static es_status _es_osip_dialog_track(struct es_osip_s *pCtx, osip_dialog_t *dialog, uint64_t since);
+
+/**
+ * @brief Write a dialog fields, for an upgrade
+ */
+static es_status _es_osip_dialog_save(osip_dialog_t *dialog, struct es_upgrade_buf_s *rec, uint64_t now);
+
+/**
+ * @brief Create a dialog from its fields, after an upgrade
+ */
+static es_status _es_osip_dialog_restore(struct es_osip_s *pCtx, const uint8_t *data, size_t len, uint64_t now);
+
+/**
+ * @brief Remove the dialog of an ES_UPGRADE_REC_DIALOG_END record
+ */
+static es_status _es_osip_dialog_end(struct es_osip_s *pCtx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Write a dialog change to the journal
+ */
+static void _es_osip_dialog_journal(struct es_osip_s *pCtx, osip_dialog_t *dialog, int ended);
+
+/**
+ * @brief Free a dialog removed from the list
+ */
+static void _es_osip_dialog_free(struct es_osip_s *pCtx, osip_dialog_t *dialog);
+
+/**
+ * @brief Attach esip data to a transaction, and the socket responses go on
+ */
+static es_status _es_osip_tr_attach(struct es_osip_s *pCtx, osip_transaction_t *tr, uint64_t rxTs, int traced,
+                                    uint32_t flowHash, int created);
+
+/**
+ * @brief Stack operations of the forks
+ * A request sent on a new client transaction, a response on a server
+ * transaction or statelessly.
+ */
+static osip_transaction_t *_es_osip_fork_send(void *arg, osip_message_t *request, const struct sockaddr_in *to,
+                                              void *owner);
+static es_status _es_osip_fork_post(void *arg, osip_transaction_t *tr, osip_message_t *response);
+
+/**
+ * @brief Send a response to its top Via, out of any transaction
+ */
+static es_status _es_osip_send_stateless(struct es_osip_s *pCtx, osip_message_t *response);
+
+/**
+ * @brief Send a response of ours on a server transaction
+ * A 2xx to REGISTER goes through the registrar first, a 401 gets a challenge.
+ */
+static es_status _es_osip_respond(struct es_osip_s *pCtx, osip_transaction_t *tr, osip_message_t *request, int code);
+static es_status _es_osip_scenario_respond(void *arg, osip_transaction_t *tr, int code);
+
+/**
+ * @brief Transactions and dialogs of a message parsed, evt taken
+ * @return ES_ERROR_NOT_FOUND if out of any transaction
+ */
+static es_status _es_osip_handle(struct es_osip_s *pCtx, osip_event_t *evt, unsigned int size,
+                                 uint64_t rxTs, uint64_t parseTs);
+
+/**
+ * @brief What is left of a datagram once handled: the proxy may route it
+ */
+static void _es_osip_handled(struct es_osip_s *pCtx, es_status ret, const char *buf, unsigned int size,
+                             const struct sockaddr_in *from);
+
+/**
+ * @brief Datagram parsed by a parser thread, in order for its source
+ */
+static void _es_osip_parsed(void *arg, struct es_parse_msg_s *msg);
+
+/**
+ * @brief Queue a post and wake the loop thread if it is not already
+ */
+static void _es_osip_post_push(struct es_osip_s *pCtx, struct _es_osip_post_s *post);
+static void _es_osip_post_cb(evutil_socket_t fd, short what, void *arg);
+static void _es_osip_post_parse(es_osip_t *pCtx, void *arg);
+
+/**
+ * @brief Periodic tick: a state machines pass while transactions are running
+ */
+static void _es_osip_timers_cb(evutil_socket_t fd, short what, void *arg);
+
 /*******************************************************************************
                         Public functions implementation
  ******************************************************************************/
@@ -150,7 +469,7 @@ es_status es_osip_init(es_osip_t **pCtx, struct event_base *base)
    /* list of pending event */
    if (osip_list_init(&_pCtx->pendingEv) != OSIP_SUCCESS) {
       ESIP_TRACE(ESIP_LOG_ERROR, "List for pending event initialization failed");
-      free(_pCtx->osip);
+      osip_release(_pCtx->osip);
       free(_pCtx);
       return ES_ERROR_OUTOFRESOURCES;
    }
@@ -158,224 +477,698 @@ es_status es_osip_init(es_osip_t **pCtx, struct event_base *base)
    /* list of dialog */
    if (osip_list_init(&_pCtx->osipDialog) != OSIP_SUCCESS) {
       ESIP_TRACE(ESIP_LOG_ERROR, "Dialog list failed");
-      free(_pCtx->osip);
+      osip_release(_pCtx->osip);
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* list of terminated transactions */
+   if (osip_list_init(&_pCtx->killedTr) != OSIP_SUCCESS) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Terminated transactions list failed");
+      osip_release(_pCtx->osip);
       free(_pCtx);
       return ES_ERROR_OUTOFRESOURCES;
    }
 
    /* Set internal OSip Callback */
    if ((ret = _es_osip_set_internal_callbacks(_pCtx)) != ES_OK) {
-      free(_pCtx->osip);
+      osip_release(_pCtx->osip);
+      free(_pCtx);
+      return ret;
+   }
+
+   /* State shown by the CLI, built by this thread */
+   if ((ret = es_snap_init(&_pCtx->snapCtx, base)) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Snapshots initialization failed");
+      osip_release(_pCtx->osip);
       free(_pCtx);
       return ret;
    }
+   es_snap_set_refresh(_pCtx->snapCtx, ES_SNAP_TRANSACTIONS, _es_osip_snap_tr_refresh);
+   es_snap_set_refresh(_pCtx->snapCtx, ES_SNAP_DIALOGS, _es_osip_snap_dialog_refresh);
+
+   /* Forks of the stateful proxy, idle until a proxy is set */
+   {
+      struct es_fork_stack_s stack = {
+         _es_osip_fork_send,
+         _es_osip_fork_post,
+         _pCtx
+      };
+
+      if ((ret = es_fork_init(&_pCtx->forkCtx, base, &stack)) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Forks initialization failed");
+         es_snap_deinit(_pCtx->snapCtx);
+         osip_release(_pCtx->osip);
+         free(_pCtx);
+         return ret;
+      }
+   }
+
+   /* Scripted responses, none until configured */
+   {
+      struct es_scenario_stack_s stack = {
+         _es_osip_scenario_respond,
+         _pCtx
+      };
+
+      if ((ret = es_scenario_init(&_pCtx->scenarioCtx, base, &stack)) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Scenarios initialization failed");
+         es_fork_deinit(_pCtx->forkCtx);
+         es_snap_deinit(_pCtx->snapCtx);
+         osip_release(_pCtx->osip);
+         free(_pCtx);
+         return ret;
+      }
+   }
+
+   /* Calls posted by the other threads */
+   es_mpsc_init(&_pCtx->posted);
+   _pCtx->postFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_pCtx->postFd >= 0) {
+      _pCtx->evPost = event_new(base, _pCtx->postFd, EV_READ | EV_PERSIST, _es_osip_post_cb, _pCtx);
+   }
+   if ((_pCtx->evPost == NULL) || (event_priority_set(_pCtx->evPost, 0) != 0) ||
+       (event_add(_pCtx->evPost, NULL) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not watch calls posted to the stack");
+      if (_pCtx->evPost != NULL) {
+         event_free(_pCtx->evPost);
+      }
+      if (_pCtx->postFd >= 0) {
+         close(_pCtx->postFd);
+      }
+      es_scenario_deinit(_pCtx->scenarioCtx);
+      es_fork_deinit(_pCtx->forkCtx);
+      es_snap_deinit(_pCtx->snapCtx);
+      osip_release(_pCtx->osip);
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Retransmissions and timeouts of the transactions, low priority */
+   {
+      struct timeval tv = { ES_OSIP_TIMERS_MS / 1000, (ES_OSIP_TIMERS_MS % 1000) * 1000 };
+
+      _pCtx->evTimers = event_new(base, -1, EV_PERSIST, _es_osip_timers_cb, _pCtx);
+      if ((_pCtx->evTimers == NULL) || (event_priority_set(_pCtx->evTimers, 1) != 0) ||
+          (event_add(_pCtx->evTimers, &tv) != 0)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start the transaction timers");
+         if (_pCtx->evTimers != NULL) {
+            event_free(_pCtx->evTimers);
+         }
+         event_free(_pCtx->evPost);
+         close(_pCtx->postFd);
+         es_scenario_deinit(_pCtx->scenarioCtx);
+         es_fork_deinit(_pCtx->forkCtx);
+         es_snap_deinit(_pCtx->snapCtx);
+         osip_release(_pCtx->osip);
+         free(_pCtx);
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   /* Nothing left to fail */
+   pthread_mutex_init(&_pCtx->injectLock, NULL);
 
    /* Set base event thread to use */
    _pCtx->base = base;
 
+   _pCtx->inviteCode = SIP_OK;
+   _pCtx->registerCode = SIP_OK;
+   _pCtx->byeCode = SIP_OK;
+
    /* Ok */
    *pCtx = _pCtx;
    return ES_OK;
 }
 
-es_status es_osip_start(es_osip_t *pCtx)
+es_status es_osip_configure(es_osip_t *pCtx, const struct es_config_s *pCfg)
 {
-   es_status ret = ES_OK;
-
    struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
-   if (_pCtx == NULL) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize OSip stack: no more memory");
-      return ES_ERROR_OUTOFRESOURCES;
+
+   if ((_pCtx == NULL) || (pCfg == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
    }
 
-   ret = es_transport_start(_pCtx->transportCtx);
-   if (ret != ES_OK) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Start Transport Layer failed");
-      return ret;
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
    }
 
-   return ret;
+   /* Used for the next requests, running transactions keep their response */
+   _pCtx->inviteCode = (int)pCfg->inviteCode;
+   _pCtx->registerCode = (int)pCfg->registerCode;
+   _pCtx->byeCode = (int)pCfg->byeCode;
+
+   pthread_mutex_lock(&_pCtx->injectLock);
+   strcpy(_pCtx->injectDir, pCfg->cliInjectDir);
+   pthread_mutex_unlock(&_pCtx->injectLock);
+
+   if (es_scenario_configure(_pCtx->scenarioCtx, pCfg) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Scenarios not applied, the previous ones kept");
+   }
+
+   return es_transport_configure(_pCtx->transportCtx, pCfg);
 }
 
-es_status es_osip_stop(es_osip_t *pCtx)
+es_status es_osip_set_journal(es_osip_t *pCtx, const struct es_upgrade_journal_s *pJournal)
 {
-   es_status ret = ES_OK;
-
    struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize OSip stack: no more memory");
-      return ES_ERROR_NULLPTR;
-   }
 
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic %d - ptr(%p)(%d)", ES_OSIP_MAGIC, _pCtx, _pCtx->magic);
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
       return ES_ERROR_NULLPTR;
    }
 
-   ret = es_transport_stop(_pCtx->transportCtx);
-   if (ret != ES_OK) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Start Transport Layer failed");
-      return ret;
+   if (pJournal != NULL) {
+      _pCtx->journal = *pJournal;
+   } else {
+      memset(&_pCtx->journal, 0, sizeof(_pCtx->journal));
    }
 
-   return ret;
+   return ES_OK;
 }
 
-static void _es_osip_list_freeEl(void *pEl)
+es_status es_osip_set_registrar(es_osip_t *pCtx, struct es_registrar_s *pRegistrar)
 {
-   struct event *_pEvSip = (struct event *)pEl;
-   if (_pEvSip == (struct event *)0) {
-      return;
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
    }
 
-   event_free(_pEvSip);
+   if (_pCtx->registrarCtx != NULL) {
+      (void)es_registrar_set_snap(_pCtx->registrarCtx, NULL);
+   }
+
+   _pCtx->registrarCtx = pRegistrar;
+
+   return (pRegistrar != NULL) ? es_registrar_set_snap(pRegistrar, _pCtx->snapCtx) : ES_OK;
 }
 
-es_status es_osip_deinit(es_osip_t *pCtx)
+es_status es_osip_set_auth(es_osip_t *pCtx, struct es_auth_s *pAuth)
 {
    struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Context pointer ptr(%p)", _pCtx);
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
       return ES_ERROR_NULLPTR;
    }
 
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic %d - ptr(%p)(%d)", ES_OSIP_MAGIC, _pCtx, _pCtx->magic);
+   _pCtx->authCtx = pAuth;
+
+   return ES_OK;
+}
+
+es_status es_osip_set_work(es_osip_t *pCtx, struct es_work_s *pWork)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
       return ES_ERROR_NULLPTR;
    }
 
-   osip_list_special_free(&_pCtx->pendingEv, _es_osip_list_freeEl);
-
-   es_transport_destroy(_pCtx->transportCtx);
-   
-   osip_release(_pCtx->osip);
-   
-   free(_pCtx);
+   _pCtx->workCtx = pWork;
 
    return ES_OK;
 }
 
-es_status es_osip_parse_msg(es_osip_t *pCtx, const char *buf, unsigned int size)
+es_status es_osip_set_parse(es_osip_t *pCtx, struct es_parse_s *pParse)
 {
-   osip_event_t * evt = (osip_event_t *)0;
    struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
-   osip_transaction_t *tr = (osip_transaction_t *)0;
 
-   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
-
-   /* Check Context */
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
       return ES_ERROR_NULLPTR;
    }
 
-   /* Check Context magic */
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is not valid");
-      return ES_ERROR_INVALID_HANDLE;
+   /* Datagrams still with the previous parsers are dropped */
+   if (_pCtx->parseCtx != NULL) {
+      (void)es_parse_set_callback(_pCtx->parseCtx, NULL, NULL);
    }
 
-   /* Parse buffer and check if it's really a SIP Message */
-   evt = osip_parse(buf, size);
-   if (evt == (osip_event_t *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Error creating OSip event");
-      return ES_ERROR_NETWORK_PROBLEM;
+   _pCtx->parseCtx = pParse;
+
+   if (pParse != NULL) {
+      return es_parse_set_callback(pParse, _es_osip_parsed, _pCtx);
    }
 
-   ESIP_TRACE(ESIP_LOG_INFO,"received SIP type %s: %s",
-              (MSG_IS_REQUEST(evt->sip))? "REQUEST" : "RESPONSE",
-              (MSG_IS_REQUEST(evt->sip) ? ((evt->sip->sip_method)    ? evt->sip->sip_method    : "NULL") :
-                                          ((evt->sip->reason_phrase) ? evt->sip->reason_phrase : "NULL")));
+   return ES_OK;
+}
 
-   if (EVT_IS_RCV_STATUS_1XX(evt)) {
-      tr = osip_transaction_find(&_pCtx->osip->osip_ist_transactions, evt);
-      if (tr == (osip_transaction_t *)0) {
-         ESIP_TRACE(ESIP_LOG_INFO, "No transaction for MESSAGE event");
-         free(evt);
-         return ES_ERROR_ILLEGAL_ACTION;
-      }
-   }
+es_status es_osip_set_proxy(es_osip_t *pCtx, struct es_proxy_s *pProxy)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
 
-   if( EVT_IS_RCV_STATUS_2XX(evt) || EVT_IS_RCV_STATUS_3456XX(evt)) {
-      tr = osip_transaction_find(&_pCtx->osip->osip_ist_transactions, evt);
-      if (tr == (osip_transaction_t *)0) {
-         ESIP_TRACE(ESIP_LOG_INFO, "No transaction for MESSAGE event");
-         free(evt);
-         return ES_ERROR_ILLEGAL_ACTION;
-      }
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
    }
 
-   if (EVT_IS_RCV_ACK(evt)) {
-      int _i = 0;
-      osip_dialog_t *dialog = (osip_dialog_t *)0;
-      for (_i=0; !osip_list_eol(&_pCtx->osipDialog, _i); ++_i, dialog=(osip_dialog_t *)0) {
-         dialog = (osip_dialog_t *)osip_list_get(&_pCtx->osipDialog, _i);
+   _pCtx->proxyCtx = pProxy;
+   return es_fork_set_proxy(_pCtx->forkCtx, pProxy);
+}
+
+es_status es_osip_adopt_socket(es_osip_t *pCtx, int fd)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_transport_adopt_socket(_pCtx->transportCtx, fd);
+}
+
+es_status es_osip_get_socket(es_osip_t *pCtx, int *fd)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_transport_get_udp_socket(_pCtx->transportCtx, fd);
+}
+
+es_status es_osip_pause(es_osip_t *pCtx, int pause)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_transport_pause(_pCtx->transportCtx, pause);
+}
+
+unsigned int es_osip_transactions(es_osip_t *pCtx)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      return 0;
+   }
+
+   return (unsigned int)(osip_list_size(&_pCtx->osip->osip_ict_transactions) +
+                         osip_list_size(&_pCtx->osip->osip_ist_transactions) +
+                         osip_list_size(&_pCtx->osip->osip_nict_transactions) +
+                         osip_list_size(&_pCtx->osip->osip_nist_transactions));
+}
+
+es_status es_osip_save(es_osip_t *pCtx, struct es_upgrade_buf_s *state)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   struct es_upgrade_buf_s rec;
+   uint64_t now = es_hist_now();
+   es_status ret = ES_OK;
+   int i = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC) || (state == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   memset(&rec, 0, sizeof(rec));
+
+   for (i = 0; (ret == ES_OK) && !osip_list_eol(&_pCtx->osipDialog, i); ++i) {
+      osip_dialog_t *dialog = (osip_dialog_t *)osip_list_get(&_pCtx->osipDialog, i);
+
+      rec.len = 0;
+      ret = _es_osip_dialog_save(dialog, &rec, now);
+      if (ret == ES_OK) {
+         ret = es_upgrade_buf_put(state, ES_UPGRADE_REC_DIALOG, rec.data, rec.len);
+      }
+   }
+
+   es_upgrade_buf_free(&rec);
+
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Dialogs not saved: no more memory");
+      return ret;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "%d dialog(s) saved", i);
+   return ES_OK;
+}
+
+es_status es_osip_restore(es_osip_t *pCtx, const uint8_t *data, size_t len, unsigned int elapsed)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   struct es_upgrade_tlv_s tlv;
+   uint64_t now = es_hist_now();
+   unsigned int restored = 0;
+   unsigned int ended = 0;
+   unsigned int failed = 0;
+   size_t offset = 0;
+   int rc = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_OSIP_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "OSip Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   /* Dialogs are as old as when written, plus the time since */
+   now -= (uint64_t)elapsed * 1000000000ULL;
+
+   while ((rc = es_upgrade_tlv_next(data, len, &offset, &tlv)) > 0) {
+      /* Records of other modules are theirs */
+      if (tlv.type == ES_UPGRADE_REC_DIALOG_END) {
+         if (_es_osip_dialog_end(_pCtx, tlv.value, tlv.len) == ES_OK) {
+            ended++;
+         }
+         continue;
+      }
+
+      if (tlv.type != ES_UPGRADE_REC_DIALOG) {
+         continue;
+      }
+
+      if (_es_osip_dialog_restore(_pCtx, tlv.value, tlv.len, now) == ES_OK) {
+         restored++;
+      } else {
+         failed++;
+      }
+   }
+
+   ESIP_TRACE((failed != 0) ? ESIP_LOG_WARNING : ESIP_LOG_INFO,
+              "%u dialog(s) restored, %u ended, %u dropped", restored, ended, failed);
+
+   return (rc < 0) ? ES_ERROR_BADPARAM : ES_OK;
+}
+
+es_status es_osip_start(es_osip_t *pCtx)
+{
+   es_status ret = ES_OK;
+
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize OSip stack: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   ret = es_transport_start(_pCtx->transportCtx);
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Start Transport Layer failed");
+      return ret;
+   }
+
+   return ret;
+}
+
+es_status es_osip_stop(es_osip_t *pCtx)
+{
+   es_status ret = ES_OK;
+
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize OSip stack: no more memory");
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic %d - ptr(%p)(%d)", ES_OSIP_MAGIC, _pCtx, _pCtx->magic);
+      return ES_ERROR_NULLPTR;
+   }
+
+   ret = es_transport_stop(_pCtx->transportCtx);
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Start Transport Layer failed");
+      return ret;
+   }
+
+   return ret;
+}
+
+static void _es_osip_list_freeEl(void *pEl)
+{
+   struct event *_pEvSip = (struct event *)pEl;
+   if (_pEvSip == (struct event *)0) {
+      return;
+   }
+
+   event_free(_pEvSip);
+}
+
+es_status es_osip_deinit(es_osip_t *pCtx)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Context pointer ptr(%p)", _pCtx);
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic %d - ptr(%p)(%d)", ES_OSIP_MAGIC, _pCtx, _pCtx->magic);
+      return ES_ERROR_NULLPTR;
+   }
+
+   event_free(_pCtx->evTimers);
+   osip_list_special_free(&_pCtx->pendingEv, _es_osip_list_freeEl);
+
+   /* Posts not run: their owners release what they hold */
+   event_free(_pCtx->evPost);
+   {
+      struct _es_osip_post_s *post = NULL;
+
+      while ((post = (struct _es_osip_post_s *)es_mpsc_pop(&_pCtx->posted)) != NULL) {
+         post->cb(NULL, post->arg);
+         es_mem_free(post);
+      }
+   }
+   close(_pCtx->postFd);
+
+   es_transport_destroy(_pCtx->transportCtx);
+
+   /* Dialogs and transactions still alive */
+   while (!osip_list_eol(&_pCtx->osipDialog, 0)) {
+      osip_dialog_t *dialog = (osip_dialog_t *)osip_list_get(&_pCtx->osipDialog, 0);
+      osip_list_remove(&_pCtx->osipDialog, 0);
+      _es_osip_dialog_free(_pCtx, dialog);
+   }
+
+   /* Before the transactions they point to */
+   es_scenario_deinit(_pCtx->scenarioCtx);
+
+   _es_osip_free_transactions(_pCtx, &_pCtx->osip->osip_ict_transactions);
+   _es_osip_free_transactions(_pCtx, &_pCtx->osip->osip_ist_transactions);
+   _es_osip_free_transactions(_pCtx, &_pCtx->osip->osip_nict_transactions);
+   _es_osip_free_transactions(_pCtx, &_pCtx->osip->osip_nist_transactions);
+   _es_osip_free_killed(_pCtx);
+
+   es_fork_deinit(_pCtx->forkCtx);
+   es_snap_deinit(_pCtx->snapCtx);
+
+   osip_release(_pCtx->osip);
+
+   pthread_mutex_destroy(&_pCtx->injectLock);
+   free(_pCtx);
+
+   /* Whatever the stack still holds now is lost */
+   es_mem_report_leaks((1U << ES_MEM_OSIP) | (1U << ES_MEM_MESSAGE) | (1U << ES_MEM_TRANSACTION) |
+                       (1U << ES_MEM_DIALOG) | (1U << ES_MEM_EVENT) | (1U << ES_MEM_SCENARIO));
+
+   return ES_OK;
+}
+
+es_status es_osip_parse_msg(es_osip_t *pCtx, const char *buf, unsigned int size)
+{
+   osip_event_t * evt = (osip_event_t *)0;
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   uint64_t rxTs = es_hist_now();
+   uint64_t parseTs = 0;
+   int memScope = 0;
+
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
+
+   /* Check Context */
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
+      return ES_ERROR_NULLPTR;
+   }
+
+   /* Check Context magic */
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is not valid");
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   /* Parse buffer and check if it's really a SIP Message */
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   evt = osip_parse(buf, size);
+   es_mem_scope_leave(memScope);
+   parseTs = es_hist_now();
+   es_hist_record(ES_HIST_PARSE, parseTs - rxTs);
+   if (evt == (osip_event_t *)0) {
+      ES_STATS_INC(ES_STATS_PARSE_ERRORS);
+      ESIP_TRACE(ESIP_LOG_ERROR, "Error creating OSip event");
+      return ES_ERROR_NETWORK_PROBLEM;
+   }
+
+   return _es_osip_handle(_pCtx, evt, size, rxTs, parseTs);
+}
+
+static es_status _es_osip_handle(struct es_osip_s *_pCtx, osip_event_t *evt, unsigned int size,
+                                 uint64_t rxTs, uint64_t parseTs)
+{
+   osip_transaction_t *tr = (osip_transaction_t *)0;
+   int created = 0;
+   int traced = 0;
+   uint32_t flowHash = 0;
+   int memScope = 0;
+   int ret = OSIP_SUCCESS;
+
+   /* Call flow sampling, decided once per Call-ID */
+   if ((__atomic_load_n(&es_flow_sampling, __ATOMIC_RELAXED) != 0) && (evt->sip->call_id != NULL)) {
+      flowHash = es_flow_call_hash(evt->sip->call_id->number, evt->sip->call_id->host);
+      traced = es_flow_sampled(flowHash);
+      if (traced) {
+         es_flow_record(flowHash, evt->sip->call_id->number, ES_FLOW_RECV, rxTs, 0, (int)size);
+         es_flow_record(flowHash, evt->sip->call_id->number, ES_FLOW_PARSE, rxTs, parseTs - rxTs, (int)size);
+      }
+   }
+
+   if (ES_PROBE_ENABLED(parse)) {
+      const char *callId = NULL;
+      const char *branch = NULL;
+      _es_osip_probe_ids(evt->sip->call_id, (osip_via_t *)osip_list_get(&evt->sip->vias, 0), &callId, &branch);
+      ES_PROBE5(parse, callId, branch, size, evt->sip->sip_method, evt->sip->status_code);
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO,"received SIP type %s: %s",
+              (MSG_IS_REQUEST(evt->sip))? "REQUEST" : "RESPONSE",
+              (MSG_IS_REQUEST(evt->sip) ? ((evt->sip->sip_method)    ? evt->sip->sip_method    : "NULL") :
+                                          ((evt->sip->reason_phrase) ? evt->sip->reason_phrase : "NULL")));
+
+   /* Responses belong to the client transactions we started */
+   if (EVT_IS_RCV_STATUS_1XX(evt) || EVT_IS_RCV_STATUS_2XX(evt) || EVT_IS_RCV_STATUS_3456XX(evt)) {
+      int invite = (evt->sip->cseq != NULL) && (evt->sip->cseq->method != NULL) &&
+                   (strcmp(evt->sip->cseq->method, "INVITE") == 0);
+
+      tr = osip_transaction_find(invite ? &_pCtx->osip->osip_ict_transactions :
+                                          &_pCtx->osip->osip_nict_transactions, evt);
+      if (tr == (osip_transaction_t *)0) {
+         ESIP_TRACE(ESIP_LOG_INFO, "No transaction for response");
+         osip_event_free(evt);
+         return ES_ERROR_NOT_FOUND;
+      }
+   }
+
+   if (EVT_IS_RCV_ACK(evt)) {
+      int _i = 0;
+      osip_dialog_t *dialog = (osip_dialog_t *)0;
+
+      /* ACK of a non 2xx final response: its INVITE server transaction */
+      tr = osip_transaction_find(&_pCtx->osip->osip_ist_transactions, evt);
+      if (tr != (osip_transaction_t *)0) {
+         if (osip_transaction_add_event(tr, evt) != OSIP_SUCCESS) {
+            osip_event_free(evt);
+            return ES_ERROR_OUTOFRESOURCES;
+         }
+         return _es_osip_wakeup(_pCtx);
+      }
+
+      for (_i=0; !osip_list_eol(&_pCtx->osipDialog, _i); ++_i, dialog=(osip_dialog_t *)0) {
+         dialog = (osip_dialog_t *)osip_list_get(&_pCtx->osipDialog, _i);
          if (osip_dialog_match_as_uas(dialog, evt->sip) == OSIP_SUCCESS) {
             ESIP_TRACE(ESIP_LOG_DEBUG, "Dialog for ACK found [STATE:%d]", dialog->state);
             break;
          }
       }
 
-      if (dialog != (osip_dialog_t *)0); {
-         osip_stop_retransmissions_from_dialog(_pCtx->osip, dialog);
+      osip_event_free(evt);
+      if (dialog == (osip_dialog_t *)0) {
+         /* End to end, a proxy may route it */
+         return ES_ERROR_NOT_FOUND;
       }
 
-      free(evt);
+      osip_stop_retransmissions_from_dialog(_pCtx->osip, dialog);
       return ES_OK;
    }
 
+   /* A retransmitted request: its server transaction answers it again (RFC 3261 17.2) */
+   if (EVT_IS_RCV_INVITE(evt) || EVT_IS_RCV_REQUEST(evt)) {
+      tr = osip_transaction_find(EVT_IS_RCV_INVITE(evt) ? &_pCtx->osip->osip_ist_transactions :
+                                                           &_pCtx->osip->osip_nist_transactions, evt);
+      if (tr != (osip_transaction_t *)0) {
+         ESIP_TRACE(ESIP_LOG_INFO, "Request retransmitted");
+         if (osip_transaction_add_event(tr, evt) != OSIP_SUCCESS) {
+            osip_event_free(evt);
+            return ES_ERROR_OUTOFRESOURCES;
+         }
+         return _es_osip_wakeup(_pCtx);
+      }
+   }
+
    if (EVT_IS_RCV_INVITE(evt)) {
       ESIP_TRACE(ESIP_LOG_INFO, "New INVITE transaction");
       /* Init a new INVITE Server Transaction */
-      if (osip_transaction_init(&tr, IST, _pCtx->osip, evt->sip) != OSIP_SUCCESS) {
+      memScope = es_mem_scope_enter(ES_MEM_TRANSACTION);
+      ret = osip_transaction_init(&tr, IST, _pCtx->osip, evt->sip);
+      es_mem_scope_leave(memScope);
+      if (ret != OSIP_SUCCESS) {
          ESIP_TRACE(ESIP_LOG_ERROR, "Erro init new transation");
-         free(evt);
+         osip_event_free(evt);
          return ES_ERROR_OUTOFRESOURCES;
       }
+      ES_STATS_INC(ES_STATS_TR_CREATED);
+      created = 1;
    }
 
    if (EVT_IS_RCV_REQUEST(evt)) {
       ESIP_TRACE(ESIP_LOG_INFO, "New NON INVITE transaction");
       /* Init a new NON INVITE Server Transaction */
-      if (osip_transaction_init(&tr, NIST, _pCtx->osip, evt->sip) != OSIP_SUCCESS) {
+      memScope = es_mem_scope_enter(ES_MEM_TRANSACTION);
+      ret = osip_transaction_init(&tr, NIST, _pCtx->osip, evt->sip);
+      es_mem_scope_leave(memScope);
+      if (ret != OSIP_SUCCESS) {
          ESIP_TRACE(ESIP_LOG_ERROR, "Erro init new transation");
-         free(evt);
+         osip_event_free(evt);
          return ES_ERROR_OUTOFRESOURCES;
       }
+      ES_STATS_INC(ES_STATS_TR_CREATED);
+      created = 1;
+   }
+
+   if (created && ES_PROBE_ENABLED(tr_create)) {
+      const char *callId = NULL;
+      const char *branch = NULL;
+      _es_osip_probe_ids(tr->callid, tr->topvia, &callId, &branch);
+      ES_PROBE4(tr_create, callId, branch, tr->transactionid, tr->ctx_type);
    }
 
    if (tr != (osip_transaction_t *)0) {
-      /* Set Out Socket for the new Transaction, used to send response */
-      {
-         int fd = -1;
-         es_transport_get_udp_socket(_pCtx->transportCtx, &fd);
-         if (osip_transaction_set_out_socket(tr, fd) != OSIP_SUCCESS) {
-            ESIP_TRACE(ESIP_LOG_ERROR, "Setting socket descriptor failed");
+      es_status attached = _es_osip_tr_attach(_pCtx, tr, rxTs, traced, flowHash, created);
+
+      if (attached != ES_OK) {
+         if (created) {
             osip_transaction_free(tr);
-            free(evt);
-            return ES_ERROR_UNKNOWN;
          }
+         osip_event_free(evt);
+         return attached;
       }
 
-      /* Set context reference into Transaction struct */
-      osip_transaction_set_your_instance(tr, (void *)_pCtx);
-
       /* add a new OSip event into FiFo list */
       if (osip_transaction_add_event(tr, evt)) {
          ESIP_TRACE(ESIP_LOG_ERROR, "adding event failed");
+         _es_osip_tr_data_free(tr);
          osip_transaction_free(tr);
-         free(evt);
+         osip_event_free(evt);
          return ES_ERROR_OUTOFRESOURCES;
       }
 
-      /* Send notification using event for the transaction */
+      /* Send notification using event for the transaction, evt belongs to it now */
       if (_es_osip_wakeup(_pCtx) != ES_OK) {
          ESIP_TRACE(ESIP_LOG_ERROR, "sending event failed");
-         free(evt);
          return ES_ERROR_UNKNOWN;
       }
    } else {
-      free(evt);
+      osip_event_free(evt);
    }
 
    /* Look for existant Dialog */
@@ -383,43 +1176,292 @@ es_status es_osip_parse_msg(es_osip_t *pCtx, const char *buf, unsigned int size)
    return ES_OK;
 }
 
-/*******************************************************************************
-                  Internal static functions implementation
- ******************************************************************************/
-
-static void _es_transport_event_cb(es_transport_t *transp, int event, int error, void *data)
+es_status es_osip_post(es_osip_t *pCtx, es_osip_post_cb cb, void *arg)
 {
-   ESIP_TRACE(ESIP_LOG_DEBUG, "Event: %d", event);
-}
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   struct _es_osip_post_s *post = NULL;
 
-static void _es_transport_msg_cb(es_transport_t *transp, const char const *msg, const unsigned int size, void *data)
-{
-   struct es_osip_s * ctx = (struct es_osip_s *)data;
+   if ((_pCtx == NULL) || (cb == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
 
-   if (ctx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Context reference is invalid");
-      return;
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
    }
 
-   if (size < 3) {
-      ESIP_TRACE(ESIP_LOG_WARNING, "Message length [%d] can not be right !", size);
+   post = (struct _es_osip_post_s *)es_mem_malloc(ES_MEM_EVENT, sizeof(struct _es_osip_post_s));
+   if (post == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not post to the stack: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
    }
 
-   ESIP_TRACE(ESIP_LOG_DEBUG, "Received:\n<=====\n%s\n<=====", msg);
+   post->cb = cb;
+   post->arg = arg;
+   post->size = 0;
+   _es_osip_post_push(_pCtx, post);
 
-   if (es_osip_parse_msg(ctx, msg, size) != ES_OK) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Error parsing Message!");
-      return;
-   }
+   return ES_OK;
 }
 
-static void _es_osip_loop(evutil_socket_t fd, short event, void *arg)
+es_status es_osip_post_msg(es_osip_t *pCtx, const char *buf, unsigned int size)
 {
-   struct es_osip_s * _pCtx = (struct es_osip_s *)arg;
-   /* Check Context */
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
-      return;
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+   struct _es_osip_post_s *post = NULL;
+
+   if ((_pCtx == NULL) || (buf == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (size == 0) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   post = (struct _es_osip_post_s *)es_mem_malloc(ES_MEM_MESSAGE, sizeof(struct _es_osip_post_s) + size);
+   if (post == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not post a message to the stack: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   post->cb = _es_osip_post_parse;
+   post->arg = post;
+   post->size = size;
+   memcpy(post->buf, buf, size);
+   _es_osip_post_push(_pCtx, post);
+
+   return ES_OK;
+}
+
+static int _es_osip_cli_inject(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   char path[ES_CONFIG_STR_LEN + NAME_MAX + 2];
+   struct stat st;
+   char *buf = NULL;
+   ssize_t len = 0;
+   int fd = -1;
+
+   if (argc < 1) {
+      es_cli_print(pCli, "Usage: sip inject <file>");
+      return CLI_ERROR;
+   }
+
+   /* The session is not authenticated: a name in the inject directory, nothing else */
+   if ((argv[0][0] == '\0') || (argv[0][0] == '.') || (strchr(argv[0], '/') != NULL) ||
+       (strlen(argv[0]) > NAME_MAX)) {
+      es_cli_print(pCli, "%s is not a file name of the inject directory", argv[0]);
+      return CLI_ERROR;
+   }
+
+   pthread_mutex_lock(&_pCtx->injectLock);
+   if (_pCtx->injectDir[0] != '\0') {
+      snprintf(path, sizeof(path), "%s/%s", _pCtx->injectDir, argv[0]);
+   } else {
+      path[0] = '\0';
+   }
+   pthread_mutex_unlock(&_pCtx->injectLock);
+
+   if (path[0] == '\0') {
+      es_cli_print(pCli, "No inject directory, see cli.inject_dir");
+      return CLI_ERROR;
+   }
+
+   /* Neither a link out of the directory nor a FIFO holding the session */
+   fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0) {
+      es_cli_print(pCli, "Can not open %s: %s", argv[0], strerror(errno));
+      return CLI_ERROR;
+   }
+
+   if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+      es_cli_print(pCli, "%s is not a regular file", argv[0]);
+      close(fd);
+      return CLI_ERROR;
+   }
+
+   buf = (char *)malloc(ES_OSIP_INJECT_MAX);
+   if (buf == NULL) {
+      close(fd);
+      return CLI_ERROR;
+   }
+
+   len = read(fd, buf, ES_OSIP_INJECT_MAX);
+   close(fd);
+   if (len <= 0) {
+      es_cli_print(pCli, "Nothing read from %s", argv[0]);
+      free(buf);
+      return CLI_ERROR;
+   }
+
+   if (es_osip_post_msg(_pCtx, buf, (unsigned int)len) != ES_OK) {
+      es_cli_print(pCli, "Can not hand the message to the stack");
+      free(buf);
+      return CLI_ERROR;
+   }
+
+   free(buf);
+   es_cli_print(pCli, "%zd bytes handed to the stack", len);
+   return CLI_OK;
+}
+
+static int _es_osip_cli_show_posts(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   uint64_t posted = __atomic_load_n(&_pCtx->postCount, __ATOMIC_RELAXED);
+   uint64_t run = __atomic_load_n(&_pCtx->postRun, __ATOMIC_RELAXED);
+
+   es_cli_print(pCli, "%12s %12s %12s %12s", "posted", "run", "waiting", "wakeups");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu", (unsigned long long)posted, (unsigned long long)run,
+                (unsigned long long)(posted - run),
+                (unsigned long long)__atomic_load_n(&_pCtx->postWakeups, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_osip_cli_register(es_osip_t *pCtx, es_cli_t *pCli)
+{
+   es_capture_t *capture = (es_capture_t *)0;
+   es_rate_t *rate = (es_rate_t *)0;
+   es_acl_t *acl = (es_acl_t *)0;
+   struct es_osip_s *_pCtx = (struct es_osip_s *)pCtx;
+
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Context pointer ptr(%p)", _pCtx);
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Bad Magic %d - ptr(%p)(%d)", ES_OSIP_MAGIC, _pCtx, _pCtx->magic);
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (es_transport_get_capture(_pCtx->transportCtx, &capture) == ES_OK) {
+      if (es_capture_cli_register(capture, pCli) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Capture commands not registered");
+      }
+   }
+
+   if (es_transport_get_rate(_pCtx->transportCtx, &rate) == ES_OK) {
+      if (es_rate_cli_register(rate, pCli) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Rate commands not registered");
+      }
+   }
+
+   if (es_transport_get_acl(_pCtx->transportCtx, &acl) == ES_OK) {
+      if (es_acl_cli_register(acl, pCli) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "ACL commands not registered");
+      }
+   }
+
+   if (es_snap_cli_register(_pCtx->snapCtx, pCli) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Snapshot commands not registered");
+   }
+
+   if (es_fork_cli_register(_pCtx->forkCtx, pCli) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Fork commands not registered");
+   }
+
+   if (es_scenario_cli_register(_pCtx->scenarioCtx, pCli) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Scenario commands not registered");
+   }
+
+   if ((es_cli_register_cmd(pCli, "sip inject", "Hand the SIP message of a file of cli.inject_dir to the stack <file>",
+                            _es_osip_cli_inject, _pCtx) != ES_OK) ||
+       (es_cli_register_cmd(pCli, "show posts", "Show the calls posted to the stack by other threads",
+                            _es_osip_cli_show_posts, _pCtx) != ES_OK)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Post commands not registered");
+   }
+
+   return ES_OK;
+}
+
+/*******************************************************************************
+                  Internal static functions implementation
+ ******************************************************************************/
+
+static void _es_transport_event_cb(es_transport_t *transp, int event, int error, void *data)
+{
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Event: %d", event);
+}
+
+static void _es_transport_msg_cb(es_transport_t *transp, const char const *msg, const unsigned int size,
+                                 const struct sockaddr_in *from, void *data)
+{
+   struct es_osip_s * ctx = (struct es_osip_s *)data;
+
+   if (ctx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Context reference is invalid");
+      return;
+   }
+
+   if (size < 3) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Message length [%d] can not be right !", size);
+   }
+
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Received:\n<=====\n%s\n<=====", msg);
+
+   /* Forwarded as received, without going through the stack */
+   if ((ctx->proxyCtx != NULL) && (es_proxy_handle(ctx->proxyCtx, transp, msg, size, from) == ES_OK)) {
+      return;
+   }
+
+   /* Parsed on the thread of its source, handled when it comes back */
+   if (ctx->parseCtx != NULL) {
+      if (es_parse_submit(ctx->parseCtx, msg, size, from) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Parsers busy, message dropped");
+      }
+      return;
+   }
+
+   _es_osip_handled(ctx, es_osip_parse_msg(ctx, msg, size), msg, size, from);
+}
+
+static void _es_osip_handled(struct es_osip_s *pCtx, es_status ret, const char *buf, unsigned int size,
+                             const struct sockaddr_in *from)
+{
+   switch (ret) {
+   case ES_OK:
+      break;
+   case ES_ERROR_NOT_FOUND:
+      /* Out of any transaction: 2xx retransmitted, ACK of a 2xx */
+      if ((pCtx->proxyCtx != NULL) &&
+          (es_proxy_forward(pCtx->proxyCtx, pCtx->transportCtx, buf, size, from) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_INFO, "Message out of any transaction dropped");
+      }
+      break;
+   default:
+      ESIP_TRACE(ESIP_LOG_ERROR, "Error parsing Message!");
+      break;
+   }
+}
+
+static void _es_osip_parsed(void *arg, struct es_parse_msg_s *msg)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   es_status ret = ES_ERROR_NETWORK_PROBLEM;
+
+   if (msg->evt == NULL) {
+      ES_STATS_INC(ES_STATS_PARSE_ERRORS);
+      ESIP_TRACE(ESIP_LOG_ERROR, "Error creating OSip event");
+   } else {
+      ret = _es_osip_handle(_pCtx, msg->evt, msg->size, msg->rxTs, msg->parseTs);
+      msg->evt = NULL;
+   }
+
+   _es_osip_handled(_pCtx, ret, msg->buf, msg->size, &msg->from);
+}
+
+static void _es_osip_loop(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_osip_s * _pCtx = (struct es_osip_s *)arg;
+   uint64_t cbTs = es_hist_now();
+   /* Check Context */
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
+      return;
    }
 
    /* Loop until we have no pending event,
@@ -430,267 +1472,1218 @@ static void _es_osip_loop(evutil_socket_t fd, short event, void *arg)
       /* Get the first event from the list */
       struct event * ev = (struct event *)osip_list_get(&_pCtx->pendingEv, 0);
 
-      ESIP_TRACE(ESIP_LOG_DEBUG, "pending event %p", ev);
+      uint64_t fsmTs = 0;
+
+      ESIP_TRACE(ESIP_LOG_DEBUG, "pending event %p", ev);
+
+      /* Remove this event since it handled now */
+      osip_list_remove(&_pCtx->pendingEv, 0);
+
+      fsmTs = es_hist_now();
+      if (_pCtx->pendingTs != 0) {
+         es_hist_record(ES_HIST_QUEUE, fsmTs - _pCtx->pendingTs);
+         _pCtx->pendingTs = 0;
+      }
+
+      /* INVITE Client Transaction Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending ICT event...");
+      if (osip_ict_execute(_pCtx->osip) != OSIP_SUCCESS) {
+         ESIP_TRACE(ESIP_LOG_ERROR,"== ICT failed");
+      }
+
+      /* INVITE Server Transaction Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending IST event...");
+      if (osip_ist_execute(_pCtx->osip) != OSIP_SUCCESS) {
+         ESIP_TRACE(ESIP_LOG_ERROR,"== IST failed");
+      }
+
+      /* Non-INVITE Client Transaction Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending NICT event...");
+      if (osip_nict_execute(_pCtx->osip) != OSIP_SUCCESS) {
+         ESIP_TRACE(ESIP_LOG_ERROR,"== NICT failed");
+      }
+
+      /* Non-INVITE Server Transaction Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending NIST event...");
+      if (osip_nist_execute(_pCtx->osip) != OSIP_SUCCESS) {
+         ESIP_TRACE(ESIP_LOG_ERROR,"== NIST failed");
+      }
+
+      /* Timers fired since the last pass, _es_osip_timers_cb runs one at least every ES_OSIP_TIMERS_MS */
+
+      /* INVITE Client Transation Timer Event Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-ICT event...");
+      osip_timers_ict_execute(_pCtx->osip);
+
+      /* INVITE Server Transaction Timer Event Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-IST event...");
+      osip_timers_ist_execute(_pCtx->osip);
+
+      /* Non-INVITE Client Transaction Timer Event Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-NICT event...");
+      osip_timers_nict_execute(_pCtx->osip);
+
+      /* Non-INVITE Server Transaction Timer Event Fifo list */
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-NIST event...");
+      osip_timers_nist_execute(_pCtx->osip);
+
+      es_hist_record_since(ES_HIST_FSM, fsmTs);
+
+      /* Out of the state machines now, terminated transactions can go */
+      _es_osip_free_killed(_pCtx);
+
+      event_free(ev);
+   }
+
+   es_loop_cb_done(ES_HIST_CB_OSIP, "osip", cbTs);
+}
+
+static es_status _es_osip_wakeup(struct es_osip_s *pCtx)
+{
+   struct event * _pEvSip = (struct event *)0;
+   int memScope = 0;
+
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
+
+   /* Check Context */
+   if (pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
+      return ES_ERROR_NULLPTR;
+   }
+
+   /* Dispatch a new event to unblock the base loop thread */
+   memScope = es_mem_scope_enter(ES_MEM_EVENT);
+   _pEvSip = event_new(pCtx->base, -1, (EV_READ), _es_osip_loop, (void *)pCtx);
+   es_mem_scope_leave(memScope);
+   if (_pEvSip == (struct event *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create event for OSip stack");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* set priority */
+   if (event_priority_set(_pEvSip, 0) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set priority event for OSip stack");
+   }
+
+   /* Add the new event to base loop thread handler */
+   if (event_add(_pEvSip, NULL) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not make OSip event pending");
+      event_del(_pEvSip);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* This is a pending event now, add it to Fifo list */
+   memScope = es_mem_scope_enter(ES_MEM_EVENT);
+   osip_list_add(&pCtx->pendingEv, _pEvSip, 0);
+   es_mem_scope_leave(memScope);
+   if (pCtx->pendingTs == 0) {
+      pCtx->pendingTs = es_hist_now();
+   }
+
+   /* activate the event (callabck will be executed) */
+   event_active(_pEvSip, EV_READ, 0);
+
+   return ES_OK;
+}
+
+static void _es_osip_post_push(struct es_osip_s *pCtx, struct _es_osip_post_s *post)
+{
+   uint64_t one = 1;
+
+   post->ts = es_hist_now();
+   __atomic_add_fetch(&pCtx->postCount, 1, __ATOMIC_RELAXED);
+   es_mpsc_push(&pCtx->posted, &post->link);
+
+   /* Queued before the flag is read: a loop clearing it sees the post */
+   if (__atomic_exchange_n(&pCtx->postSignaled, 1, __ATOMIC_SEQ_CST) != 0) {
+      return;
+   }
+
+   __atomic_add_fetch(&pCtx->postWakeups, 1, __ATOMIC_RELAXED);
+   if (write(pCtx->postFd, &one, sizeof(one)) < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not wake the stack: %s", strerror(errno));
+   }
+}
+
+static void _es_osip_post_cb(evutil_socket_t fd, short what, void *arg)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   struct _es_osip_post_s *post = NULL;
+   uint64_t cbTs = es_hist_now();
+   uint64_t value = 0;
+   unsigned int n = 0;
+
+   /* Cleared first: a post queued from now on writes the eventfd again */
+   (void)__atomic_exchange_n(&_pCtx->postSignaled, 0, __ATOMIC_SEQ_CST);
+   if ((read(fd, &value, sizeof(value)) < 0) && (errno != EAGAIN)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not read the post eventfd: %s", strerror(errno));
+   }
+
+   while ((n < ES_OSIP_POST_BATCH) &&
+          ((post = (struct _es_osip_post_s *)es_mpsc_pop(&_pCtx->posted)) != NULL)) {
+      es_hist_record_since(ES_HIST_POST, post->ts);
+      post->cb(_pCtx, post->arg);
+      es_mem_free(post);
+      n++;
+   }
+   __atomic_add_fetch(&_pCtx->postRun, n, __ATOMIC_RELAXED);
+
+   /* More waiting: next loop turn, after the sockets */
+   if ((n == ES_OSIP_POST_BATCH) && (__atomic_exchange_n(&_pCtx->postSignaled, 1, __ATOMIC_SEQ_CST) == 0)) {
+      value = 1;
+      if (write(fd, &value, sizeof(value)) < 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not wake the stack: %s", strerror(errno));
+      }
+   }
+
+   es_loop_cb_done(ES_HIST_CB_OSIP, "post", cbTs);
+}
+
+static void _es_osip_timers_cb(evutil_socket_t fd, short what, void *arg)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+
+   /* Idle stack: nothing to retransmit nor to time out */
+   if ((es_osip_transactions(_pCtx) == 0) || (osip_list_size(&_pCtx->pendingEv) > 0)) {
+      return;
+   }
+
+   (void)_es_osip_wakeup(_pCtx);
+}
+
+static void _es_osip_post_parse(es_osip_t *pCtx, void *arg)
+{
+   struct _es_osip_post_s *post = (struct _es_osip_post_s *)arg;
+
+   if (pCtx == NULL) {
+      return;
+   }
+
+   (void)es_osip_parse_msg(pCtx, post->buf, post->size);
+}
+
+static int _es_internal_send_msg_cb(osip_transaction_t *tr, osip_message_t *msg, char *addr, int port, int socket)
+{
+   char * buf = NULL;
+   size_t buf_len = 0;
+   struct es_osip_s * _pCtx = (struct es_osip_s *)0;
+   struct es_osip_tr_s * trData = (struct es_osip_tr_s *)0;
+   uint64_t sendTs = es_hist_now();
+   int memScope = 0;
+
+   _pCtx = osip_transaction_get_your_instance(tr);
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
+      return -1;
+   }
+
+   /* Check magic */
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
+      return -1;
+   }
+
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   osip_message_to_str(msg, &buf, &buf_len);
+   es_mem_scope_leave(memScope);
+
+   if (ES_PROBE_ENABLED(send)) {
+      const char *callId = NULL;
+      const char *branch = NULL;
+      _es_osip_probe_ids(msg->call_id, (osip_via_t *)osip_list_get(&msg->vias, 0), &callId, &branch);
+      ES_PROBE5(send, callId, branch, buf_len, addr, port);
+   }
+   
+   ESIP_TRACE(ESIP_LOG_DEBUG,"Sending \n=====>\n%s\n=====>", buf);
+   
+   es_transport_send(_pCtx->transportCtx, addr, port, buf, buf_len);
+
+   osip_free(buf);
+
+   es_hist_record_since(ES_HIST_SEND, sendTs);
+   _es_osip_flow(tr, ES_FLOW_SEND, sendTs, es_hist_now() - sendTs, (int)buf_len);
+
+   /* Receive to send, first response only */
+   trData = (struct es_osip_tr_s *)osip_transaction_get_reserved1(tr);
+   if ((trData != (struct es_osip_tr_s *)0) && !trData->responded && MSG_IS_RESPONSE(msg)) {
+      trData->responded = 1;
+      es_hist_record_since(ES_HIST_E2E, trData->rxTs);
+   }
+
+   return OSIP_SUCCESS;
+}
+
+static void _es_internal_transport_error_cb(int type, osip_transaction_t *tr, int error)
+{
+   ESIP_TRACE(ESIP_LOG_INFO,"Error Transport for Transaction %p type %d, error %d", tr, type, error);
+}
+
+static void _es_internal_kill_transaction_cb(int type, osip_transaction_t *tr)
+{
+   struct es_osip_s *_pCtx = NULL;
+   ESIP_TRACE(ESIP_LOG_INFO,"Removing Transaction %p", tr);
+
+   ES_STATS_INC(ES_STATS_TR_KILLED);
+
+   if (ES_PROBE_ENABLED(tr_kill)) {
+      const char *callId = NULL;
+      const char *branch = NULL;
+      _es_osip_probe_ids(tr->callid, tr->topvia, &callId, &branch);
+      ES_PROBE4(tr_kill, callId, branch, tr->transactionid, type);
+   }
+
+   _es_osip_flow(tr, ES_FLOW_TR_KILL, es_hist_now(), 0, tr->transactionid);
+   _es_osip_tr_data_free(tr);
+
+   _pCtx = osip_transaction_get_your_instance(tr);
+   if (_pCtx == (struct es_osip_s *)0) {
+      return;
+   }
+
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
+      return;
+   }
+
+   /* Its fork goes on without it, its scripted responses are dropped */
+   es_fork_release(_pCtx->forkCtx, tr);
+   es_scenario_release(_pCtx->scenarioCtx, tr);
+
+   /* The state machine still uses it: freed at the end of the pass */
+   osip_remove_transaction(_pCtx->osip, tr);
+   osip_list_add(&_pCtx->killedTr, tr, -1);
+}
+
+static void _es_internal_message_cb(int type, osip_transaction_t *tr, osip_message_t *msg)
+{
+   struct es_osip_s * _pCtx = (struct es_osip_s *)0;
+
+   ESIP_TRACE(ESIP_LOG_DEBUG,"Enter: type %d", type);
+
+   _pCtx = osip_transaction_get_your_instance(tr);
+   if (_pCtx == (struct es_osip_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
+      return;
+   }
+
+   /* Check magic */
+   if (_pCtx->magic != ES_OSIP_MAGIC) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
+      return;
+   }
+
+   _es_osip_flow(tr, ES_FLOW_CALLBACK, es_hist_now(), 0, type);
+
+   /* Timer B or F of a client transaction: no message, the fork ends its branch */
+   if (msg == (osip_message_t *)0) {
+      _es_osip_message(_pCtx, type, tr, msg);
+      return;
+   }
+
+   if (ES_PROBE_ENABLED(msg)) {
+      const char *callId = NULL;
+      const char *branch = NULL;
+      _es_osip_probe_ids(msg->call_id, (osip_via_t *)osip_list_get(&msg->vias, 0), &callId, &branch);
+      ES_PROBE4(msg, callId, branch, type, tr->transactionid);
+   }
+
+   /* Received traffic only: not ours sent, nor the retransmissions */
+   if (_es_osip_is_received(type)) {
+      if (MSG_IS_REQUEST(msg)) {
+         ES_STATS_INC(es_stats_method_id(msg->sip_method));
+      } else if (es_stats_response_id(msg->status_code) != ES_STATS_MAX) {
+         ES_STATS_INC(es_stats_response_id(msg->status_code));
+      }
+   }
+
+   /* Credentials first, a request challenged is neither forked nor scripted */
+   if (((type == OSIP_IST_INVITE_RECEIVED) || (type == OSIP_NIST_REGISTER_RECEIVED)) && (_pCtx->authCtx != NULL)) {
+      _es_osip_authenticate(_pCtx, type, tr, msg);
+      return;
+   }
+
+   _es_osip_message(_pCtx, type, tr, msg);
+}
+
+static void _es_osip_message(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg)
+{
+   int sendResp = 0;
+   int scripted = 0;
+   int code = 0;
+
+   /* Stateful proxy: requests forked, responses of the branches */
+   if (es_fork_handle(pCtx->forkCtx, type, tr, msg) == ES_OK) {
+      return;
+   }
+
+   switch (type) {
+
+   case OSIP_IST_INVITE_RECEIVED: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_INVITE_RECEIVED");
+      code = pCtx->inviteCode;
+      sendResp = 1;
+      scripted = 1;
+   }
+      break;
+
+   case OSIP_IST_INVITE_RECEIVED_AGAIN: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_INVITE_RECEIVED_AGAIN");
+   }
+      break;
+
+   case OSIP_IST_STATUS_2XX_SENT: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_STATUS_2XX_SENT");
+      /* A proxy is not part of the dialog */
+      if (MSG_IS_RESPONSE_FOR(msg, "INVITE") && !MSG_TEST_CODE(msg, 100) && !es_fork_proxied(pCtx->forkCtx, tr)) {
+         if (_es_osip_dialog_new(pCtx, tr, msg) != ES_OK) {
+            ESIP_TRACE(ESIP_LOG_ERROR, "Creating new dialog failed");
+            return;
+         }
+      }
+   }
+      break;
+
+   case OSIP_NIST_STATUS_2XX_SENT: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_STATUS_2XX_SENT");
+   }
+      break;
+
+   case OSIP_IST_ACK_RECEIVED: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_ACK_RECEIVED");
+   }
+      break;
+
+   case OSIP_IST_ACK_RECEIVED_AGAIN: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_ACK_RECEIVED_AGAIN");
+   }
+      break;
+
+   case OSIP_NIST_REGISTER_RECEIVED: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_REGISTER_RECEIVED");
+      code = pCtx->registerCode;
+      sendResp = 1;
+      scripted = 1;
+   }
+      break;
+
+   case OSIP_NIST_BYE_RECEIVED: {
+      int _i = 0;
+      osip_dialog_t *dialog = NULL;
+      for (_i=0; !osip_list_eol(&pCtx->osipDialog, _i); ++_i, dialog=NULL) {
+         dialog = (osip_dialog_t *)osip_list_get(&pCtx->osipDialog, _i);
+         if (osip_dialog_match_as_uas(dialog, msg) == OSIP_SUCCESS) {
+            ESIP_TRACE(ESIP_LOG_DEBUG, "Dialog for FOUND found [STATE:%d]", dialog->state);
+            break;
+         }
+      }
+
+      /* The dialog ends with the BYE */
+      if (dialog != NULL) {
+         _es_osip_dialog_journal(pCtx, dialog, 1);
+         osip_list_remove(&pCtx->osipDialog, _i);
+         _es_osip_dialog_free(pCtx, dialog);
+      }
+
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_BYE_RECEIVED");
+      code = pCtx->byeCode;
+      sendResp = 1;
+      scripted = 1;
+   }
+      break;
+
+   case OSIP_NIST_OPTIONS_RECEIVED:
+   case OSIP_NIST_INFO_RECEIVED:
+   case OSIP_NIST_NOTIFY_RECEIVED:
+   case OSIP_NIST_SUBSCRIBE_RECEIVED: {
+      ESIP_TRACE(ESIP_LOG_INFO,"NIST request %s received", msg->sip_method);
+      scripted = 1;
+   }
+      break;
+
+   case OSIP_NIST_UNKNOWN_REQUEST_RECEIVED: {
+      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_UNKNOWN_REQUEST_RECEIVED");
+      scripted = 1;
+   }
+      break;
+
+   default: {
+      ESIP_TRACE(ESIP_LOG_INFO,"NOT SUPPORTED METHODE");
+   }
+      break;
+   }
+
+   /* A scenario of the request replaces the configured response */
+   if (scripted && (es_scenario_start(pCtx->scenarioCtx, tr, msg) == ES_OK)) {
+      return;
+   }
+
+   if (sendResp) {
+      (void)_es_osip_respond(pCtx, tr, msg, code);
+   }
+}
+
+static void _es_osip_authenticate(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg)
+{
+   struct es_osip_tr_s *trData = (struct es_osip_tr_s *)osip_transaction_get_reserved1(tr);
+   struct es_auth_job_s *job = NULL;
+   struct _es_osip_work_s *work = NULL;
+   int code = SIP_OK;
+
+   if ((pCtx->workCtx == NULL) || (trData == (struct es_osip_tr_s *)0)) {
+      _es_osip_authenticated(pCtx, type, tr, msg, es_auth_verify(pCtx->authCtx, msg));
+      return;
+   }
+
+   code = es_auth_verify_begin(pCtx->authCtx, msg, &job);
+   if (job == NULL) {
+      _es_osip_authenticated(pCtx, type, tr, msg, code);
+      return;
+   }
+
+   /* The digests on the pool, the transaction waits for them */
+   work = (struct _es_osip_work_s *) es_mem_calloc(ES_MEM_WORK, 1, sizeof(struct _es_osip_work_s));
+   if (work != NULL) {
+      work->ctx = pCtx;
+      work->auth = pCtx->authCtx;
+      work->job = job;
+      work->tr = tr;
+      work->msg = msg;
+      work->type = type;
+      if (es_work_submit(pCtx->workCtx, _es_osip_work_run, _es_osip_work_done, work) == ES_OK) {
+         trData->work = work;
+         return;
+      }
+      es_mem_free(work);
+   }
+
+   /* Pool full: done here */
+   es_auth_verify_run(pCtx->authCtx, job);
+   _es_osip_authenticated(pCtx, type, tr, msg, es_auth_verify_end(pCtx->authCtx, job));
+}
+
+static void _es_osip_authenticated(struct es_osip_s *pCtx, int type, osip_transaction_t *tr, osip_message_t *msg,
+                                   int code)
+{
+   if (code != SIP_OK) {
+      (void)_es_osip_respond(pCtx, tr, msg, code);
+      return;
+   }
+
+   _es_osip_message(pCtx, type, tr, msg);
+}
+
+static void _es_osip_work_run(void *arg)
+{
+   struct _es_osip_work_s *work = (struct _es_osip_work_s *)arg;
+
+   es_auth_verify_run(work->auth, work->job);
+}
+
+static void _es_osip_work_done(void *arg)
+{
+   struct _es_osip_work_s *work = (struct _es_osip_work_s *)arg;
+   struct es_osip_tr_s *trData = NULL;
+
+   /* Transaction gone meanwhile */
+   if (work->tr == NULL) {
+      es_auth_job_free(work->auth, work->job);
+      es_mem_free(work);
+      return;
+   }
+
+   trData = (struct es_osip_tr_s *)osip_transaction_get_reserved1(work->tr);
+   if (trData != (struct es_osip_tr_s *)0) {
+      trData->work = NULL;
+   }
+
+   _es_osip_authenticated(work->ctx, work->type, work->tr, work->msg, es_auth_verify_end(work->auth, work->job));
+   es_mem_free(work);
+}
+
+static int _es_osip_is_received(int type)
+{
+   switch (type) {
+   case OSIP_ICT_STATUS_1XX_RECEIVED:
+   case OSIP_ICT_STATUS_2XX_RECEIVED:
+   case OSIP_ICT_STATUS_3XX_RECEIVED:
+   case OSIP_ICT_STATUS_4XX_RECEIVED:
+   case OSIP_ICT_STATUS_5XX_RECEIVED:
+   case OSIP_ICT_STATUS_6XX_RECEIVED:
+   case OSIP_IST_INVITE_RECEIVED:
+   case OSIP_IST_ACK_RECEIVED:
+   case OSIP_NICT_STATUS_1XX_RECEIVED:
+   case OSIP_NICT_STATUS_2XX_RECEIVED:
+   case OSIP_NICT_STATUS_3XX_RECEIVED:
+   case OSIP_NICT_STATUS_4XX_RECEIVED:
+   case OSIP_NICT_STATUS_5XX_RECEIVED:
+   case OSIP_NICT_STATUS_6XX_RECEIVED:
+   case OSIP_NIST_REGISTER_RECEIVED:
+   case OSIP_NIST_BYE_RECEIVED:
+   case OSIP_NIST_OPTIONS_RECEIVED:
+   case OSIP_NIST_INFO_RECEIVED:
+   case OSIP_NIST_CANCEL_RECEIVED:
+   case OSIP_NIST_NOTIFY_RECEIVED:
+   case OSIP_NIST_SUBSCRIBE_RECEIVED:
+   case OSIP_NIST_UNKNOWN_REQUEST_RECEIVED:
+      return 1;
+   default:
+      return 0;
+   }
+}
+
+static void _es_osip_probe_ids(osip_call_id_t *callId, osip_via_t *via, const char **pCallId, const char **pBranch)
+{
+   osip_generic_param_t *branch = (osip_generic_param_t *)0;
+
+   *pCallId = ((callId != NULL) && (callId->number != NULL)) ? callId->number : "";
+   *pBranch = "";
+
+   if ((via != NULL) && (osip_via_param_get_byname(via, "branch", &branch) == OSIP_SUCCESS) &&
+       (branch != NULL) && (branch->gvalue != NULL)) {
+      *pBranch = branch->gvalue;
+   }
+}
+
+static es_status _es_osip_new_response(osip_message_t **ppResp, int code, osip_message_t *request)
+{
+   int memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   es_status ret = es_msg_initResponse(ppResp, code, request);
+   es_mem_scope_leave(memScope);
+   return ret;
+}
+
+static es_status _es_osip_respond(struct es_osip_s *pCtx, osip_transaction_t *tr, osip_message_t *request, int code)
+{
+   osip_message_t *_pResp = (osip_message_t *)0;
+   osip_event_t * _pEvt = (osip_event_t *)0;
+   int registered = (pCtx->registrarCtx != NULL) && MSG_IS_REGISTER(request) && (code >= 200);
+   int memScope = 0;
+
+   /* A failure set by configuration skips the registrar */
+   if (registered && (code >= 200) && (code < 300)) {
+      code = es_registrar_update(pCtx->registrarCtx, request);
+   }
+
+   if (_es_osip_new_response(&_pResp, code, request) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Creating Response failed");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   if (registered) {
+      memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+      if (es_registrar_answer(pCtx->registrarCtx, request, _pResp) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Bindings missing in the response");
+      }
+      es_mem_scope_leave(memScope);
+   }
+
+   if ((code == SIP_UNAUTHORIZED) && (pCtx->authCtx != NULL)) {
+      memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+      if (es_auth_answer(pCtx->authCtx, request, _pResp) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_WARNING, "Challenge missing in the response");
+      }
+      es_mem_scope_leave(memScope);
+   }
+
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   _pEvt = osip_new_outgoing_sipmessage(_pResp);
+   es_mem_scope_leave(memScope);
+   osip_transaction_add_event(tr, _pEvt);
+
+   /* Send notification using event for the transaction, it owns _pEvt */
+   if (_es_osip_wakeup(pCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "sending event failed");
+      return ES_ERROR_UNKNOWN;
+   }
+
+   return ES_OK;
+}
+
+static es_status _es_osip_scenario_respond(void *arg, osip_transaction_t *tr, int code)
+{
+   return _es_osip_respond((struct es_osip_s *)arg, tr, tr->orig_request, code);
+}
+
+static void _es_osip_free_killed(struct es_osip_s *pCtx)
+{
+   while (!osip_list_eol(&pCtx->killedTr, 0)) {
+      osip_transaction_t *tr = (osip_transaction_t *)osip_list_get(&pCtx->killedTr, 0);
+      osip_list_remove(&pCtx->killedTr, 0);
+      osip_transaction_free(tr);
+   }
+}
+
+static void _es_osip_free_transactions(struct es_osip_s *pCtx, osip_list_t *list)
+{
+   while (!osip_list_eol(list, 0)) {
+      osip_transaction_t *tr = (osip_transaction_t *)osip_list_get(list, 0);
+      if (osip_remove_transaction(pCtx->osip, tr) != OSIP_SUCCESS) {
+         osip_list_remove(list, 0);
+      }
+      _es_osip_tr_data_free(tr);
+      osip_transaction_free(tr);
+   }
+}
+
+static void _es_osip_flow(osip_transaction_t *tr, es_flow_kind_t kind, uint64_t ts, uint64_t dur, int arg)
+{
+   struct es_osip_tr_s *trData = (struct es_osip_tr_s *)osip_transaction_get_reserved1(tr);
+
+   if ((trData == (struct es_osip_tr_s *)0) || !trData->traced) {
+      return;
+   }
+
+   es_flow_record(trData->flowHash, (tr->callid != NULL) ? tr->callid->number : NULL, kind, ts, dur, arg);
+}
 
-      /* Remove this event since it handled now */
-      osip_list_remove(&_pCtx->pendingEv, 0);
+static void _es_osip_tr_data_free(osip_transaction_t *tr)
+{
+   struct es_osip_tr_s *trData = (struct es_osip_tr_s *)osip_transaction_get_reserved1(tr);
+   if (trData == (struct es_osip_tr_s *)0) {
+      return;
+   }
 
-      /* INVITE Client Transaction Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending ICT event...");
-      if (osip_ict_execute(_pCtx->osip) != OSIP_SUCCESS) {
-         ESIP_TRACE(ESIP_LOG_ERROR,"== ICT failed");
+   if (trData->snapSlot >= 0) {
+      struct es_osip_s *_pCtx = (struct es_osip_s *)osip_transaction_get_your_instance(tr);
+      if (_pCtx != (struct es_osip_s *)0) {
+         es_snap_remove(_pCtx->snapCtx, ES_SNAP_TRANSACTIONS, trData->snapSlot);
       }
+   }
 
-      /* INVITE Server Transaction Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending IST event...");
-      if (osip_ist_execute(_pCtx->osip) != OSIP_SUCCESS) {
-         ESIP_TRACE(ESIP_LOG_ERROR,"== IST failed");
-      }
+   /* Its check completes for nothing */
+   if (trData->work != NULL) {
+      trData->work->tr = NULL;
+   }
 
-      /* Non-INVITE Client Transaction Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending NICT event...");
-      if (osip_nict_execute(_pCtx->osip) != OSIP_SUCCESS) {
-         ESIP_TRACE(ESIP_LOG_ERROR,"== NICT failed");
+   osip_transaction_set_reserved1(tr, NULL);
+   es_mem_free(trData);
+}
+
+static es_status _es_osip_tr_attach(struct es_osip_s *pCtx, osip_transaction_t *tr, uint64_t rxTs, int traced,
+                                    uint32_t flowHash, int created)
+{
+   /* Set Out Socket for the new Transaction, used to send response */
+   {
+      int fd = -1;
+      es_transport_get_udp_socket(pCtx->transportCtx, &fd);
+      if (osip_transaction_set_out_socket(tr, fd) != OSIP_SUCCESS) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Setting socket descriptor failed");
+         return ES_ERROR_UNKNOWN;
       }
+   }
 
-      /* Non-INVITE Server Transaction Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending NIST event...");
-      if (osip_nist_execute(_pCtx->osip) != OSIP_SUCCESS) {
-         ESIP_TRACE(ESIP_LOG_ERROR,"== NIST failed");
+   /* Set context reference into Transaction struct */
+   osip_transaction_set_your_instance(tr, (void *)pCtx);
+
+   /* Attach esip data to a new transaction */
+   if (osip_transaction_get_reserved1(tr) == NULL) {
+      struct es_osip_tr_s *trData = (struct es_osip_tr_s *) es_mem_calloc(ES_MEM_TRANSACTION, 1, sizeof(struct es_osip_tr_s));
+      if (trData == (struct es_osip_tr_s *)0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not allocate transaction data");
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+      trData->rxTs = rxTs;
+      trData->traced = traced;
+      trData->flowHash = flowHash;
+      trData->snapSlot = -1;
+      osip_transaction_set_reserved1(tr, trData);
+      if (created) {
+         _es_osip_flow(tr, ES_FLOW_TR_CREATE, es_hist_now(), 0, tr->transactionid);
+         _es_osip_snap_tr(pCtx, tr, trData);
       }
+   }
 
-      /* TODO: For timer OSIP event we must find an other method to wake up libEvent */
+   return ES_OK;
+}
 
-      /* INVITE Client Transation Timer Event Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-ICT event...");
-      osip_timers_ict_execute(_pCtx->osip);
+static osip_transaction_t *_es_osip_fork_send(void *arg, osip_message_t *request, const struct sockaddr_in *to,
+                                              void *owner)
+{
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   osip_transaction_t *tr = (osip_transaction_t *)0;
+   osip_event_t *evt = (osip_event_t *)0;
+   int invite = MSG_IS_INVITE(request);
+   char ip[INET_ADDRSTRLEN];
+   int memScope = 0;
+   int ret = OSIP_SUCCESS;
+
+   if (inet_ntop(AF_INET, &to->sin_addr, ip, sizeof(ip)) == NULL) {
+      osip_message_free(request);
+      return NULL;
+   }
 
-      /* INVITE Server Transaction Timer Event Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-IST event...");
-      osip_timers_ist_execute(_pCtx->osip);
+   memScope = es_mem_scope_enter(ES_MEM_TRANSACTION);
+   ret = osip_transaction_init(&tr, invite ? ICT : NICT, _pCtx->osip, request);
+   es_mem_scope_leave(memScope);
+   if (ret != OSIP_SUCCESS) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create client transaction");
+      osip_message_free(request);
+      return NULL;
+   }
 
-      /* Non-INVITE Client Transaction Timer Event Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-NICT event...");
-      osip_timers_nict_execute(_pCtx->osip);
+   /* The next hop, not the Request-URI */
+   if (invite) {
+      osip_ict_set_destination((osip_ict_t *)tr->ict_context, osip_strdup(ip), ntohs(to->sin_port));
+   } else {
+      osip_nict_set_destination((osip_nict_t *)tr->nict_context, osip_strdup(ip), ntohs(to->sin_port));
+   }
 
-      /* Non-INVITE Server Transaction Timer Event Fifo list */
-      ESIP_TRACE(ESIP_LOG_DEBUG, "Check pending TIMER-NIST event...");
-      osip_timers_nist_execute(_pCtx->osip);
+   if (_es_osip_tr_attach(_pCtx, tr, es_hist_now(), 0, 0, 1) != ES_OK) {
+      _es_osip_tr_data_free(tr);
+      osip_transaction_free(tr);
+      osip_message_free(request);
+      return NULL;
+   }
+   osip_transaction_set_reserved2(tr, owner);
+
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   evt = osip_new_outgoing_sipmessage(request);
+   es_mem_scope_leave(memScope);
+   if ((evt == (osip_event_t *)0) || (osip_transaction_add_event(tr, evt) != OSIP_SUCCESS)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not send on client transaction");
+      if (evt != (osip_event_t *)0) {
+         osip_event_free(evt);
+      } else {
+         osip_message_free(request);
+      }
+      _es_osip_tr_data_free(tr);
+      osip_transaction_free(tr);
+      return NULL;
+   }
 
-      event_free(ev);
+   ES_STATS_INC(ES_STATS_TR_CREATED);
+
+   if (_es_osip_wakeup(_pCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "sending event failed");
    }
+
+   return tr;
 }
 
-static es_status _es_osip_wakeup(struct es_osip_s *pCtx)
+static es_status _es_osip_fork_post(void *arg, osip_transaction_t *tr, osip_message_t *response)
 {
-   struct event * _pEvSip = (struct event *)0;
+   struct es_osip_s *_pCtx = (struct es_osip_s *)arg;
+   osip_event_t *evt = (osip_event_t *)0;
+   int memScope = 0;
 
-   ESIP_TRACE(ESIP_LOG_DEBUG, "Enter");
+   if (tr == (osip_transaction_t *)0) {
+      return _es_osip_send_stateless(_pCtx, response);
+   }
 
-   /* Check Context */
-   if (pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "SIP ctx is null");
-      return ES_ERROR_NULLPTR;
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   evt = osip_new_outgoing_sipmessage(response);
+   es_mem_scope_leave(memScope);
+   if (evt == (osip_event_t *)0) {
+      osip_message_free(response);
+      return ES_ERROR_OUTOFRESOURCES;
    }
 
-   /* Dispatch a new event to unblock the base loop thread */
-   _pEvSip = event_new(pCtx->base, -1, (EV_READ), _es_osip_loop, (void *)pCtx);
-   if (_pEvSip == (struct event *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create event for OSip stack");
+   if (osip_transaction_add_event(tr, evt) != OSIP_SUCCESS) {
+      osip_event_free(evt);
       return ES_ERROR_OUTOFRESOURCES;
    }
 
-   /* set priority */
-   if (event_priority_set(_pEvSip, 0) != 0) {
-      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set priority event for OSip stack");
+   return _es_osip_wakeup(_pCtx);
+}
+
+static es_status _es_osip_send_stateless(struct es_osip_s *pCtx, osip_message_t *response)
+{
+   osip_via_t *via = (osip_via_t *)osip_list_get(&response->vias, 0);
+   osip_generic_param_t *received = (osip_generic_param_t *)0;
+   osip_generic_param_t *rport = (osip_generic_param_t *)0;
+   char *host = NULL;
+   char *buf = NULL;
+   size_t len = 0;
+   int port = 5060;
+   int memScope = 0;
+   es_status ret = ES_OK;
+
+   if ((via == NULL) || (via->host == NULL)) {
+      osip_message_free(response);
+      return ES_ERROR_BADPARAM;
    }
 
-   /* Add the new event to base loop thread handler */
-   if (event_add(_pEvSip, NULL) != 0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Can not make OSip event pending");
-      event_del(_pEvSip);
-      return ES_ERROR_OUTOFRESOURCES;
+   /* RFC 3261 18.2.2 and RFC 3581: where the request came from */
+   host = via->host;
+   if ((osip_via_param_get_byname(via, "received", &received) == OSIP_SUCCESS) &&
+       (received != NULL) && (received->gvalue != NULL)) {
+      host = received->gvalue;
+   }
+   if (via->port != NULL) {
+      port = atoi(via->port);
+   }
+   if ((osip_via_param_get_byname(via, "rport", &rport) == OSIP_SUCCESS) &&
+       (rport != NULL) && (rport->gvalue != NULL)) {
+      port = atoi(rport->gvalue);
    }
 
-   /* This is a pending event now, add it to Fifo list */
-   osip_list_add(&pCtx->pendingEv, _pEvSip, 0);
+   memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+   if (osip_message_to_str(response, &buf, &len) != OSIP_SUCCESS) {
+      buf = NULL;
+   }
+   es_mem_scope_leave(memScope);
 
-   /* activate the event (callabck will be executed) */
-   event_active(_pEvSip, EV_READ, 0);
+   if (buf != NULL) {
+      ret = es_transport_send(pCtx->transportCtx, host, port, buf, len);
+      osip_free(buf);
+   } else {
+      ret = ES_ERROR_OUTOFRESOURCES;
+   }
 
-   return ES_OK;
+   osip_message_free(response);
+   return ret;
 }
 
-static int _es_internal_send_msg_cb(osip_transaction_t *tr, osip_message_t *msg, char *addr, int port, int socket)
+static const char *_es_osip_state_name(state_t state)
 {
-   char * buf = NULL;
-   size_t buf_len = 0;
-   struct es_osip_s * _pCtx = (struct es_osip_s *)0;
-
-   _pCtx = osip_transaction_get_your_instance(tr);
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
-      return -1;
+   switch (state) {
+   case ICT_PRE_CALLING:      return "PRE_CALLING";
+   case ICT_CALLING:          return "CALLING";
+   case ICT_PROCEEDING:       return "PROCEEDING";
+   case ICT_COMPLETED:        return "COMPLETED";
+   case ICT_TERMINATED:       return "TERMINATED";
+   case IST_PRE_PROCEEDING:   return "PRE_PROCEEDING";
+   case IST_PROCEEDING:       return "PROCEEDING";
+   case IST_COMPLETED:        return "COMPLETED";
+   case IST_CONFIRMED:        return "CONFIRMED";
+   case IST_TERMINATED:       return "TERMINATED";
+   case NICT_PRE_TRYING:      return "PRE_TRYING";
+   case NICT_TRYING:          return "TRYING";
+   case NICT_PROCEEDING:      return "PROCEEDING";
+   case NICT_COMPLETED:       return "COMPLETED";
+   case NICT_TERMINATED:      return "TERMINATED";
+   case NIST_PRE_TRYING:      return "PRE_TRYING";
+   case NIST_TRYING:          return "TRYING";
+   case NIST_PROCEEDING:      return "PROCEEDING";
+   case NIST_COMPLETED:       return "COMPLETED";
+   case NIST_TERMINATED:      return "TERMINATED";
+   case DIALOG_EARLY:         return "EARLY";
+   case DIALOG_CONFIRMED:     return "CONFIRMED";
+   case DIALOG_CLOSE:         return "CLOSE";
+   default:                   return "?";
    }
+}
 
-   /* Check magic */
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
-      return -1;
+static void _es_osip_snap_uri(const osip_from_t *from, char *buf, size_t size)
+{
+   if ((from == NULL) || (from->url == NULL) || (from->url->host == NULL)) {
+      buf[0] = '\0';
+      return;
    }
 
-   osip_message_to_str(msg, &buf, &buf_len);
-   
-   ESIP_TRACE(ESIP_LOG_DEBUG,"Sending \n=====>\n%s\n=====>", buf);
-   
-   es_transport_send(_pCtx->transportCtx, addr, port, buf, buf_len);
-   
-   free(buf);
-   return OSIP_SUCCESS;
+   snprintf(buf, size, "%s%s%s",
+            (from->url->username != NULL) ? from->url->username : "",
+            (from->url->username != NULL) ? "@" : "",
+            from->url->host);
 }
 
-static void _es_internal_transport_error_cb(int type, osip_transaction_t *tr, int error)
+static void _es_osip_snap_tr_refresh(const void *obj, struct es_snap_row_s *row)
 {
-   ESIP_TRACE(ESIP_LOG_INFO,"Error Transport for Transaction %p type %d, error %d", tr, type, error);
+   const osip_transaction_t *tr = (const osip_transaction_t *)obj;
+   snprintf(row->state, sizeof(row->state), "%s", _es_osip_state_name(tr->state));
 }
 
-static void _es_internal_kill_transaction_cb(int type, osip_transaction_t *tr)
+static void _es_osip_snap_dialog_refresh(const void *obj, struct es_snap_row_s *row)
 {
-   struct es_osip_s *_pCtx = NULL;
-   ESIP_TRACE(ESIP_LOG_INFO,"Removing Transaction %p", tr);
+   const osip_dialog_t *dialog = (const osip_dialog_t *)obj;
+   snprintf(row->state, sizeof(row->state), "%s", _es_osip_state_name(dialog->state));
+}
 
-   _pCtx = osip_transaction_get_your_instance(tr);
-   if (_pCtx == (struct es_osip_s *)0) {
-      return;
+static void _es_osip_snap_tr(struct es_osip_s *pCtx, osip_transaction_t *tr, struct es_osip_tr_s *trData)
+{
+   static const char const *types[] = { "ICT", "IST", "NICT", "NIST" };
+   struct es_snap_row_s row;
+
+   memset(&row, 0, sizeof(row));
+   row.since = trData->rxTs;
+   row.id = tr->transactionid;
+   snprintf(row.type, sizeof(row.type), "%s", ((unsigned int)tr->ctx_type <= NIST) ? types[tr->ctx_type] : "?");
+   snprintf(row.callId, sizeof(row.callId), "%s",
+            ((tr->callid != NULL) && (tr->callid->number != NULL)) ? tr->callid->number : "");
+   _es_osip_snap_uri(tr->to, row.local, sizeof(row.local));
+   _es_osip_snap_uri(tr->from, row.remote, sizeof(row.remote));
+
+   if (es_snap_add(pCtx->snapCtx, ES_SNAP_TRANSACTIONS, tr, &row, &trData->snapSlot) != ES_OK) {
+      trData->snapSlot = -1;
+   }
+}
+
+static es_status _es_osip_dialog_new(struct es_osip_s *pCtx, osip_transaction_t *tr, osip_message_t *resp)
+{
+   osip_dialog_t *dialog = NULL;
+   int memScope = es_mem_scope_enter(ES_MEM_DIALOG);
+
+   if (osip_dialog_init_as_uas(&dialog, tr->orig_request, resp) != OSIP_SUCCESS) {
+      es_mem_scope_leave(memScope);
+      return ES_ERROR_UNKNOWN;
    }
 
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
-      return;
+   osip_dialog_update_route_set_as_uas(dialog, tr->orig_request);
+   es_mem_scope_leave(memScope);
+
+   if (_es_osip_dialog_track(pCtx, dialog, es_hist_now()) != ES_OK) {
+      return ES_ERROR_OUTOFRESOURCES;
    }
+
+   _es_osip_dialog_journal(pCtx, dialog, 0);
+   return ES_OK;
 }
 
-static void _es_internal_message_cb(int type, osip_transaction_t *tr, osip_message_t *msg)
+static es_status _es_osip_dialog_track(struct es_osip_s *pCtx, osip_dialog_t *dialog, uint64_t since)
 {
-   struct es_osip_s * _pCtx = (struct es_osip_s *)0;
-   osip_message_t *_pResp = (osip_message_t *)0;
-   osip_event_t * _pEvt = (osip_event_t *)0;
-   int sendResp = 0;
+   struct es_osip_dlg_s *dlgData = NULL;
+   struct es_snap_row_s row;
 
-   ESIP_TRACE(ESIP_LOG_DEBUG,"Enter: type %d", type);
+   dlgData = (struct es_osip_dlg_s *) es_mem_calloc(ES_MEM_DIALOG, 1, sizeof(struct es_osip_dlg_s));
+   if (dlgData == (struct es_osip_dlg_s *)0) {
+      osip_dialog_free(dialog);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
 
-   _pCtx = osip_transaction_get_your_instance(tr);
-   if (_pCtx == (struct es_osip_s *)0) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
-      return;
+   dlgData->ctx = pCtx;
+   dlgData->snapSlot = -1;
+   dlgData->since = since;
+   osip_dialog_set_instance(dialog, dlgData);
+   osip_list_add(&pCtx->osipDialog, (void *)dialog, 0);
+   ES_STATS_INC(ES_STATS_DIALOGS);
+
+   memset(&row, 0, sizeof(row));
+   row.since = since;
+   snprintf(row.type, sizeof(row.type), "UAS");
+   snprintf(row.callId, sizeof(row.callId), "%s", (dialog->call_id != NULL) ? dialog->call_id : "");
+   _es_osip_snap_uri(dialog->local_uri, row.local, sizeof(row.local));
+   _es_osip_snap_uri(dialog->remote_uri, row.remote, sizeof(row.remote));
+
+   if (es_snap_add(pCtx->snapCtx, ES_SNAP_DIALOGS, dialog, &row, &dlgData->snapSlot) != ES_OK) {
+      dlgData->snapSlot = -1;
    }
 
-   /* Check magic */
-   if (_pCtx->magic != ES_OSIP_MAGIC) {
-      ESIP_TRACE(ESIP_LOG_ERROR, "Reference is invalid");
-      return;
+   return ES_OK;
+}
+
+static es_status _es_osip_dialog_save(osip_dialog_t *dialog, struct es_upgrade_buf_s *rec, uint64_t now)
+{
+   struct es_osip_dlg_s *dlgData = (struct es_osip_dlg_s *)dialog->your_instance;
+   char *str = NULL;
+   es_status ret = ES_OK;
+   int i = 0;
+
+   ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_CALL_ID, dialog->call_id);
+   ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_LOCAL_TAG, dialog->local_tag);
+   ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_REMOTE_TAG, dialog->remote_tag);
+   ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_LINE_PARAM, dialog->line_param);
+
+   if ((dialog->local_uri != NULL) && (osip_from_to_str(dialog->local_uri, &str) == OSIP_SUCCESS)) {
+      ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_LOCAL_URI, str);
+      osip_free(str);
    }
 
-   switch (type) {
+   if ((dialog->remote_uri != NULL) && (osip_to_to_str(dialog->remote_uri, &str) == OSIP_SUCCESS)) {
+      ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_REMOTE_URI, str);
+      osip_free(str);
+   }
 
-   case OSIP_IST_INVITE_RECEIVED: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_INVITE_RECEIVED");
-      if (es_msg_initResponse(&_pResp, SIP_OK, msg) != ES_OK) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Creating Response failed");
-         return;
+   if ((dialog->remote_contact_uri != NULL) && (osip_contact_to_str(dialog->remote_contact_uri, &str) == OSIP_SUCCESS)) {
+      ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_CONTACT, str);
+      osip_free(str);
+   }
+
+   for (i = 0; !osip_list_eol(&dialog->route_set, i); ++i) {
+      osip_route_t *route = (osip_route_t *)osip_list_get(&dialog->route_set, i);
+      if (osip_route_to_str(route, &str) == OSIP_SUCCESS) {
+         ret |= es_upgrade_buf_put_str(rec, ES_OSIP_DLG_ROUTE, str);
+         osip_free(str);
       }
-      sendResp = 1;
    }
-      break;
 
-   case OSIP_IST_INVITE_RECEIVED_AGAIN: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_INVITE_RECEIVED_AGAIN");
+   ret |= es_upgrade_buf_put_u32(rec, ES_OSIP_DLG_LOCAL_CSEQ, (uint32_t)dialog->local_cseq);
+   ret |= es_upgrade_buf_put_u32(rec, ES_OSIP_DLG_REMOTE_CSEQ, (uint32_t)dialog->remote_cseq);
+   ret |= es_upgrade_buf_put_u32(rec, ES_OSIP_DLG_STATE, (uint32_t)dialog->state);
+   ret |= es_upgrade_buf_put_u32(rec, ES_OSIP_DLG_SECURE, (uint32_t)dialog->secure);
+
+   if ((dlgData != (struct es_osip_dlg_s *)0) && (now > dlgData->since)) {
+      ret |= es_upgrade_buf_put_u32(rec, ES_OSIP_DLG_AGE_MS, (uint32_t)((now - dlgData->since) / 1000000ULL));
    }
-      break;
 
-   case OSIP_IST_STATUS_2XX_SENT: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_STATUS_2XX_SENT");
-      if (MSG_IS_RESPONSE_FOR(msg, "INVITE") && !MSG_TEST_CODE(msg, 100)) {
-         osip_dialog_t *dialog = NULL;
-         if (osip_dialog_init_as_uas(&dialog, tr->orig_request, msg) != OSIP_SUCCESS) {
-            ESIP_TRACE(ESIP_LOG_ERROR, "Creating new dialog failed");
-            return;
+   return (ret == ES_OK) ? ES_OK : ES_ERROR_OUTOFRESOURCES;
+}
+
+static es_status _es_osip_dialog_restore(struct es_osip_s *pCtx, const uint8_t *data, size_t len, uint64_t now)
+{
+   struct es_upgrade_tlv_s tlv;
+   osip_dialog_t *dialog = NULL;
+   osip_route_t *route = NULL;
+   uint64_t age = 0;
+   size_t offset = 0;
+   int memScope = 0;
+   int bad = 0;
+   int rc = 0;
+
+   memScope = es_mem_scope_enter(ES_MEM_DIALOG);
+
+   dialog = (osip_dialog_t *) osip_malloc(sizeof(osip_dialog_t));
+   if (dialog == NULL) {
+      es_mem_scope_leave(memScope);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(dialog, 0, sizeof(osip_dialog_t));
+   osip_list_init(&dialog->route_set);
+   dialog->type = CALLEE;
+   dialog->state = DIALOG_CONFIRMED;
+
+   while (!bad && ((rc = es_upgrade_tlv_next(data, len, &offset, &tlv)) > 0)) {
+      const char *str = es_upgrade_tlv_str(&tlv);
+
+      switch (tlv.type) {
+      case ES_OSIP_DLG_CALL_ID:
+         bad = (str == NULL) || ((dialog->call_id = osip_strdup(str)) == NULL);
+         break;
+      case ES_OSIP_DLG_LOCAL_TAG:
+         bad = (str == NULL) || ((dialog->local_tag = osip_strdup(str)) == NULL);
+         break;
+      case ES_OSIP_DLG_REMOTE_TAG:
+         bad = (str == NULL) || ((dialog->remote_tag = osip_strdup(str)) == NULL);
+         break;
+      case ES_OSIP_DLG_LINE_PARAM:
+         bad = (str == NULL) || ((dialog->line_param = osip_strdup(str)) == NULL);
+         break;
+      case ES_OSIP_DLG_LOCAL_URI:
+         bad = (str == NULL) || (osip_from_init(&dialog->local_uri) != OSIP_SUCCESS) ||
+               (osip_from_parse(dialog->local_uri, str) != OSIP_SUCCESS);
+         break;
+      case ES_OSIP_DLG_REMOTE_URI:
+         bad = (str == NULL) || (osip_to_init(&dialog->remote_uri) != OSIP_SUCCESS) ||
+               (osip_to_parse(dialog->remote_uri, str) != OSIP_SUCCESS);
+         break;
+      case ES_OSIP_DLG_CONTACT:
+         bad = (str == NULL) || (osip_contact_init(&dialog->remote_contact_uri) != OSIP_SUCCESS) ||
+               (osip_contact_parse(dialog->remote_contact_uri, str) != OSIP_SUCCESS);
+         break;
+      case ES_OSIP_DLG_ROUTE:
+         bad = (str == NULL) || (osip_route_init(&route) != OSIP_SUCCESS);
+         if (!bad) {
+            if (osip_route_parse(route, str) == OSIP_SUCCESS) {
+               osip_list_add(&dialog->route_set, route, -1);
+            } else {
+               osip_route_free(route);
+               bad = 1;
+            }
+            route = NULL;
          }
-         osip_dialog_set_instance(dialog, _pCtx);
-         osip_dialog_update_route_set_as_uas(dialog, tr->orig_request);
-         osip_list_add(&_pCtx->osipDialog, (void *)dialog, 0);
+         break;
+      case ES_OSIP_DLG_LOCAL_CSEQ:
+         dialog->local_cseq = (int)es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_OSIP_DLG_REMOTE_CSEQ:
+         dialog->remote_cseq = (int)es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_OSIP_DLG_STATE:
+         dialog->state = (state_t)es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_OSIP_DLG_SECURE:
+         dialog->secure = (int)es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_OSIP_DLG_AGE_MS:
+         age = (uint64_t)es_upgrade_tlv_u32(&tlv) * 1000000ULL;
+         break;
+      default:
+         /* Field of a later version */
+         break;
       }
    }
-      break;
 
-   case OSIP_NIST_STATUS_2XX_SENT: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_STATUS_2XX_SENT");
-   }
-      break;
+   es_mem_scope_leave(memScope);
 
-   case OSIP_IST_ACK_RECEIVED: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_ACK_RECEIVED");
+   /* What osip_dialog_match_as_uas() needs */
+   if (bad || (rc < 0) || (dialog->call_id == NULL) || (dialog->local_tag == NULL) ||
+       (dialog->remote_uri == NULL) || (dialog->local_uri == NULL)) {
+      osip_dialog_free(dialog);
+      return ES_ERROR_BADPARAM;
    }
-      break;
 
-   case OSIP_IST_ACK_RECEIVED_AGAIN: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_IST_ACK_RECEIVED_AGAIN");
-   }
-      break;
+   return _es_osip_dialog_track(pCtx, dialog, (now > age) ? (now - age) : 0);
+}
 
-   case OSIP_NIST_REGISTER_RECEIVED: {
-      /* TODO: Send it to REGISTRAR module */
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_REGISTER_RECEIVED");
-      if (es_msg_initResponse(&_pResp, SIP_OK, msg) != ES_OK) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Creating Response failed");
-         return;
+static es_status _es_osip_dialog_end(struct es_osip_s *pCtx, const uint8_t *data, size_t len)
+{
+   struct es_upgrade_tlv_s tlv;
+   const char *callId = NULL;
+   const char *localTag = NULL;
+   const char *remoteTag = NULL;
+   size_t offset = 0;
+   int i = 0;
+
+   while (es_upgrade_tlv_next(data, len, &offset, &tlv) > 0) {
+      if (tlv.type == ES_OSIP_DLG_CALL_ID) {
+         callId = es_upgrade_tlv_str(&tlv);
+      } else if (tlv.type == ES_OSIP_DLG_LOCAL_TAG) {
+         localTag = es_upgrade_tlv_str(&tlv);
+      } else if (tlv.type == ES_OSIP_DLG_REMOTE_TAG) {
+         remoteTag = es_upgrade_tlv_str(&tlv);
       }
-      sendResp = 1;
    }
-      break;
 
-   case OSIP_NIST_BYE_RECEIVED: {
-      int _i = 0;
-      osip_dialog_t *dialog = NULL;
-      for (_i=0; !osip_list_eol(&_pCtx->osipDialog, _i); ++_i, dialog=NULL) {
-         dialog = (osip_dialog_t *)osip_list_get(&_pCtx->osipDialog, _i);
-         if (osip_dialog_match_as_uas(dialog, msg) == OSIP_SUCCESS) {
-            ESIP_TRACE(ESIP_LOG_DEBUG, "Dialog for FOUND found [STATE:%d]", dialog->state);
-            break;
-         }
-      }
+   if ((callId == NULL) || (localTag == NULL)) {
+      return ES_ERROR_BADPARAM;
+   }
 
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_BYE_RECEIVED");
-      if (es_msg_initResponse(&_pResp, SIP_OK, msg) != ES_OK) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "Creating Response failed");
-         return;
+   for (i = 0; !osip_list_eol(&pCtx->osipDialog, i); ++i) {
+      osip_dialog_t *dialog = (osip_dialog_t *)osip_list_get(&pCtx->osipDialog, i);
+
+      if ((dialog->call_id != NULL) && (strcmp(dialog->call_id, callId) == 0) &&
+          (dialog->local_tag != NULL) && (strcmp(dialog->local_tag, localTag) == 0) &&
+          ((remoteTag == NULL) || ((dialog->remote_tag != NULL) && (strcmp(dialog->remote_tag, remoteTag) == 0)))) {
+         osip_list_remove(&pCtx->osipDialog, i);
+         _es_osip_dialog_free(pCtx, dialog);
+         return ES_OK;
       }
-      sendResp = 1;
    }
-      break;
 
-   case OSIP_NIST_UNKNOWN_REQUEST_RECEIVED: {
-      ESIP_TRACE(ESIP_LOG_INFO,"OSIP_NIST_UNKNOWN_REQUEST_RECEIVED");
+   return ES_ERROR_NOT_FOUND;
+}
+
+static void _es_osip_dialog_journal(struct es_osip_s *pCtx, osip_dialog_t *dialog, int ended)
+{
+   struct es_upgrade_buf_s rec;
+   es_status ret = ES_OK;
+
+   if (pCtx->journal.append == NULL) {
+      return;
    }
-      break;
 
-   default: {
-      ESIP_TRACE(ESIP_LOG_INFO,"NOT SUPPORTED METHODE");
+   memset(&rec, 0, sizeof(rec));
+
+   /* An end only needs what osip_dialog_match_as_uas() compares */
+   if (ended) {
+      ret |= es_upgrade_buf_put_str(&rec, ES_OSIP_DLG_CALL_ID, dialog->call_id);
+      ret |= es_upgrade_buf_put_str(&rec, ES_OSIP_DLG_LOCAL_TAG, dialog->local_tag);
+      ret |= es_upgrade_buf_put_str(&rec, ES_OSIP_DLG_REMOTE_TAG, dialog->remote_tag);
+   } else {
+      ret = _es_osip_dialog_save(dialog, &rec, es_hist_now());
    }
-      break;
+
+   if (ret == ES_OK) {
+      pCtx->journal.append(pCtx->journal.arg, ended ? ES_UPGRADE_REC_DIALOG_END : ES_UPGRADE_REC_DIALOG,
+                           rec.data, rec.len);
+   } else {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Dialog change not written: no more memory");
    }
 
-   if (sendResp) {
-      _pEvt = osip_new_outgoing_sipmessage(_pResp);
-      osip_transaction_add_event(tr, _pEvt);
+   es_upgrade_buf_free(&rec);
+}
 
-      /* Send notification using event for the transaction */
-      if (_es_osip_wakeup(_pCtx) != ES_OK) {
-         ESIP_TRACE(ESIP_LOG_ERROR, "sending event failed");
-         free(_pEvt);
-         return;
-      }
+static void _es_osip_dialog_free(struct es_osip_s *pCtx, osip_dialog_t *dialog)
+{
+   struct es_osip_dlg_s *dlgData = (struct es_osip_dlg_s *)dialog->your_instance;
+
+   if (dlgData != (struct es_osip_dlg_s *)0) {
+      es_snap_remove(pCtx->snapCtx, ES_SNAP_DIALOGS, dlgData->snapSlot);
+      es_mem_free(dlgData);
    }
+
+   osip_dialog_free(dialog);
+   ES_STATS_DEC(ES_STATS_DIALOGS);
 }
 
 static es_status _es_osip_set_internal_callbacks(struct es_osip_s *ctx)
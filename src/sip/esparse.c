@@ -0,0 +1,424 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+#include <event2/event.h>
+
+#include <libcli.h>
+
+#include <osip2/osip.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esloop.h"
+#include "esmem.h"
+#include "eshash.h"
+#include "esparse.h"
+
+#define ES_PARSE_MAGIC           0x20141203
+
+#define ES_PARSE_CACHE_LINE      64
+
+/**
+ * @brief Ring of one parser, indexes are free running
+ * Slots go from the loop (tail) to the parser (parsed) and back to the
+ * loop (head): each index has a single writer.
+ * The loop and parser fields are on separate cache lines. The ring comes
+ * from posix_memalign(): es_mem_calloc() puts its header before the block,
+ * which is then only 16 bytes aligned and the two lines could overlap.
+ */
+struct _es_parse_ring_s {
+   struct es_parse_s         *ctx;
+   struct es_parse_msg_s     *msgs;
+   pthread_t                 thread;
+   int                       started;
+   /* Parser wake up, it blocks reading it */
+   int                       efd;
+   /* Loop: next slot to fill, next slot to hand */
+   uint32_t                  tail __attribute__((aligned(ES_PARSE_CACHE_LINE)));
+   uint32_t                  head;
+   uint64_t                  dropped;
+   /* Parser: next slot to parse, waiting for tail to move */
+   uint32_t                  parsed __attribute__((aligned(ES_PARSE_CACHE_LINE)));
+   int                       sleeping;
+   uint64_t                  errors;
+};
+
+struct es_parse_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct event_base         *base;
+   struct _es_parse_ring_s   *rings[ES_PARSE_MAX_THREADS];
+   unsigned int              nbThreads;
+   int                       stopping;
+   /* Parsed: parsers to loop, eventfd written once until read */
+   int                       signaled;
+   int                       efd;
+   struct event              *evParsed;
+   es_parse_cb               cb;
+   void                      *cbArg;
+   /* Counters, read by the CLI */
+   uint64_t                  wakeups;
+};
+
+static inline struct es_parse_msg_s *_es_parse_slot(struct _es_parse_ring_s *ring, uint32_t i)
+{
+   return &ring->msgs[i & (ES_PARSE_DEPTH - 1)];
+}
+
+static void _es_parse_wake(int fd)
+{
+   uint64_t one = 1;
+
+   if (write(fd, &one, sizeof(one)) != (ssize_t)sizeof(one)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not wake a thread up: %s", strerror(errno));
+   }
+}
+
+static void * _es_parse_thread(void *arg)
+{
+   struct _es_parse_ring_s *ring = (struct _es_parse_ring_s *)arg;
+   struct es_parse_s *ctx = ring->ctx;
+   uint32_t parsed = ring->parsed;
+   uint32_t tail = 0;
+   uint64_t value = 0;
+
+   for (;;) {
+      tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      if (parsed == tail) {
+         /* Stopped once the datagrams received are parsed */
+         if (__atomic_load_n(&ctx->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+         }
+
+         /* Flag first, then look again: the loop sees one or the other */
+         __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+         if ((__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == parsed) &&
+             !__atomic_load_n(&ctx->stopping, __ATOMIC_SEQ_CST)) {
+            if ((read(ring->efd, &value, sizeof(value)) < 0) && (errno != EINTR)) {
+               ESIP_TRACE(ESIP_LOG_ERROR, "Parser can not wait: %s", strerror(errno));
+               break;
+            }
+         }
+         __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      for (; parsed != tail; ++parsed) {
+         struct es_parse_msg_s *msg = _es_parse_slot(ring, parsed);
+         uint64_t startTs = es_hist_now();
+         int memScope = es_mem_scope_enter(ES_MEM_MESSAGE);
+
+         msg->evt = osip_parse(msg->buf, msg->size);
+         es_mem_scope_leave(memScope);
+         msg->parseTs = es_hist_now();
+         es_hist_record(ES_HIST_PARSE, msg->parseTs - startTs);
+         if (msg->evt == NULL) {
+            __atomic_add_fetch(&ring->errors, 1, __ATOMIC_RELAXED);
+         }
+      }
+      __atomic_store_n(&ring->parsed, parsed, __ATOMIC_RELEASE);
+
+      if (__atomic_exchange_n(&ctx->signaled, 1, __ATOMIC_SEQ_CST) == 0) {
+         _es_parse_wake(ctx->efd);
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * @brief Hand the datagrams parsed by a parser to the stack, in order
+ */
+static void _es_parse_hand(struct es_parse_s *pCtx, struct _es_parse_ring_s *ring)
+{
+   uint32_t parsed = __atomic_load_n(&ring->parsed, __ATOMIC_ACQUIRE);
+   uint32_t head = ring->head;
+
+   for (; head != parsed; ++head) {
+      struct es_parse_msg_s *msg = _es_parse_slot(ring, head);
+
+      if (pCtx->cb != NULL) {
+         pCtx->cb(pCtx->cbArg, msg);
+      } else if (msg->evt != NULL) {
+         osip_event_free(msg->evt);
+      }
+      msg->evt = NULL;
+   }
+
+   /* Slots given back to the loop only */
+   __atomic_store_n(&ring->head, head, __ATOMIC_RELAXED);
+}
+
+static void _es_parse_done_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)arg;
+   uint64_t cbTs = es_hist_now();
+   uint64_t value = 0;
+   unsigned int i = 0;
+
+   /* Cleared first: a parser done from now on writes the eventfd again */
+   (void)__atomic_exchange_n(&_pCtx->signaled, 0, __ATOMIC_SEQ_CST);
+   if ((read(fd, &value, sizeof(value)) < 0) && (errno != EAGAIN)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not read the parsers eventfd: %s", strerror(errno));
+   }
+   __atomic_add_fetch(&_pCtx->wakeups, 1, __ATOMIC_RELAXED);
+
+   for (i = 0; i < _pCtx->nbThreads; ++i) {
+      _es_parse_hand(_pCtx, _pCtx->rings[i]);
+   }
+
+   es_loop_cb_done(ES_HIST_CB_OSIP, "parse", cbTs);
+}
+
+static void _es_parse_ring_free(struct _es_parse_ring_s *ring)
+{
+   uint32_t head = 0;
+
+   if (ring == NULL) {
+      return;
+   }
+
+   /* Parser stopped: whatever it parsed was not handed */
+   for (head = ring->head; head != ring->parsed; ++head) {
+      struct es_parse_msg_s *msg = _es_parse_slot(ring, head);
+      if (msg->evt != NULL) {
+         osip_event_free(msg->evt);
+      }
+   }
+
+   if (ring->efd >= 0) {
+      close(ring->efd);
+   }
+   es_mem_free(ring->msgs);
+   free(ring);
+}
+
+es_status es_parse_init(es_parse_t **ppCtx, struct event_base *base, unsigned int threads)
+{
+   struct es_parse_s *_pCtx = NULL;
+   unsigned int i = 0;
+
+   if ((ppCtx == NULL) || (base == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((threads == 0) || (threads > ES_PARSE_MAX_THREADS)) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   _pCtx = (struct es_parse_s *) es_mem_calloc(ES_MEM_WORK, 1, sizeof(struct es_parse_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create parsers: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_PARSE_MAGIC;
+   _pCtx->base = base;
+
+   _pCtx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (_pCtx->efd < 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create parsers eventfd: %s", strerror(errno));
+      goto ERROR;
+   }
+
+   _pCtx->evParsed = event_new(base, _pCtx->efd, EV_READ | EV_PERSIST, _es_parse_done_cb, _pCtx);
+   if ((_pCtx->evParsed == NULL) || (event_add(_pCtx->evParsed, NULL) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not watch the parsers");
+      goto ERROR;
+   }
+
+   for (i = 0; i < threads; ++i) {
+      struct _es_parse_ring_s *ring = NULL;
+
+      /* Aligned as its members, the loop and parser indexes on their own lines */
+      if (posix_memalign((void **)&ring, ES_PARSE_CACHE_LINE, sizeof(struct _es_parse_ring_s)) != 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not create parser %u: no more memory", i);
+         goto ERROR;
+      }
+      memset(ring, 0, sizeof(struct _es_parse_ring_s));
+      ring->ctx = _pCtx;
+      ring->efd = -1;
+      _pCtx->rings[i] = ring;
+      _pCtx->nbThreads++;
+
+      ring->msgs = (struct es_parse_msg_s *) es_mem_calloc(ES_MEM_WORK, ES_PARSE_DEPTH, sizeof(struct es_parse_msg_s));
+      ring->efd = eventfd(0, EFD_CLOEXEC);
+      if ((ring->msgs == NULL) || (ring->efd < 0)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not create parser %u ring", i);
+         goto ERROR;
+      }
+
+      if (pthread_create(&ring->thread, NULL, _es_parse_thread, ring) != 0) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not start parser %u", i);
+         goto ERROR;
+      }
+      ring->started = 1;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "%u parser thread(s), %u datagrams each", threads, ES_PARSE_DEPTH);
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+
+ERROR:
+   es_parse_deinit(_pCtx);
+   return ES_ERROR_OUTOFRESOURCES;
+}
+
+es_status es_parse_deinit(es_parse_t *pCtx)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)pCtx;
+   unsigned int i = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PARSE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   __atomic_store_n(&_pCtx->stopping, 1, __ATOMIC_SEQ_CST);
+   for (i = 0; i < _pCtx->nbThreads; ++i) {
+      if (_pCtx->rings[i]->started) {
+         _es_parse_wake(_pCtx->rings[i]->efd);
+         pthread_join(_pCtx->rings[i]->thread, NULL);
+      }
+   }
+
+   for (i = 0; i < _pCtx->nbThreads; ++i) {
+      _es_parse_ring_free(_pCtx->rings[i]);
+   }
+
+   if (_pCtx->evParsed != NULL) {
+      event_free(_pCtx->evParsed);
+   }
+   if (_pCtx->efd >= 0) {
+      close(_pCtx->efd);
+   }
+
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_parse_set_callback(es_parse_t *pCtx, es_parse_cb cb, void *arg)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PARSE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx->cb = cb;
+   _pCtx->cbArg = arg;
+
+   return ES_OK;
+}
+
+es_status es_parse_submit(es_parse_t *pCtx, const char *buf, unsigned int size, const struct sockaddr_in *from)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)pCtx;
+   struct _es_parse_ring_s *ring = NULL;
+   struct es_parse_msg_s *msg = NULL;
+   uint32_t h = ES_HASH_FNV1A_INIT;
+
+   if ((_pCtx == NULL) || (buf == NULL) || (from == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (size > ES_PARSE_MAX_SIZE) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   /* One source, one parser: its datagrams stay in order */
+   h = es_hash_fnv1a_update(h, &from->sin_addr.s_addr, sizeof(from->sin_addr.s_addr));
+   h = es_hash_fnv1a_update(h, &from->sin_port, sizeof(from->sin_port));
+   ring = _pCtx->rings[h % _pCtx->nbThreads];
+
+   if (ring->tail - ring->head == ES_PARSE_DEPTH) {
+      __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return ES_ERROR_TRY_AGAIN;
+   }
+
+   msg = _es_parse_slot(ring, ring->tail);
+   memcpy(msg->buf, buf, size);
+   msg->buf[size] = '\0';
+   msg->size = size;
+   msg->from = *from;
+   msg->rxTs = es_hist_now();
+   msg->evt = NULL;
+
+   /* Published before the flag is read: a parser going to sleep sees it */
+   __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+   /* Read before written: the parser line moves only when it sleeps */
+   if (__atomic_load_n(&ring->sleeping, __ATOMIC_SEQ_CST) &&
+       (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST) != 0)) {
+      _es_parse_wake(ring->efd);
+   }
+
+   return ES_OK;
+}
+
+static int _es_parse_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)arg;
+   unsigned int i = 0;
+
+   es_cli_print(pCli, "Parsers %u, %u datagrams each, %llu wakeups of the stack", _pCtx->nbThreads, ES_PARSE_DEPTH,
+                (unsigned long long)__atomic_load_n(&_pCtx->wakeups, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "%6s %12s %12s %12s %8s %12s", "parser", "received", "parsed", "not SIP", "waiting", "dropped");
+
+   for (i = 0; i < _pCtx->nbThreads; ++i) {
+      struct _es_parse_ring_s *ring = _pCtx->rings[i];
+      uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+      uint32_t parsed = __atomic_load_n(&ring->parsed, __ATOMIC_RELAXED);
+      uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+      es_cli_print(pCli, "%6u %12u %12u %12llu %8u %12llu", i, tail, parsed,
+                   (unsigned long long)__atomic_load_n(&ring->errors, __ATOMIC_RELAXED), tail - head,
+                   (unsigned long long)__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED));
+   }
+
+   return CLI_OK;
+}
+
+es_status es_parse_cli_register(es_parse_t *pCtx, es_cli_t *pCli)
+{
+   struct es_parse_s *_pCtx = (struct es_parse_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PARSE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show parse", "Show the parser threads", _es_parse_cli_show, _pCtx);
+}
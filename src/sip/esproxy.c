@@ -0,0 +1,1002 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <osip2/osip.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshash.h"
+#include "esmem.h"
+#include "essnap.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "esregistrar.h"
+#include "esdb.h"
+#include "estransport.h"
+#include "esraw.h"
+#include "esproxy.h"
+
+#define ES_PROXY_MAGIC           0x20141106
+
+/** Our branches, RFC 3261 magic cookie first */
+#define ES_PROXY_BRANCH          "z9hG4bK-esp-"
+
+/** Max-Forwards added when missing */
+#define ES_PROXY_MAX_FORWARDS    70
+
+/** Longest Via line we add */
+#define ES_PROXY_VIA_LEN         (ES_CONFIG_STR_LEN + 64)
+
+/** Longest answer of the proxy itself */
+#define ES_PROXY_REPLY_LEN       4096
+
+/**
+ * @brief A route of the table, by prefix of the Request-URI user
+ */
+struct _es_proxy_route_s {
+   /* Prefix, length 0 for a free slot */
+   char                      prefix[ES_PROXY_PREFIX_LEN];
+   unsigned int              len;
+   struct sockaddr_in        to;
+};
+
+/**
+ * @brief Routes of a file, looked up from the longest prefix length
+ */
+struct _es_proxy_routes_s {
+   /* Open addressing, at most half full */
+   struct _es_proxy_route_s  *slots;
+   unsigned int              mask;
+   unsigned int              nb;
+   /* Prefix lengths in use, longest first */
+   unsigned int              lengths[ES_PROXY_PREFIX_LEN];
+   unsigned int              nbLengths;
+   /* "*", for users that match no prefix */
+   int                       hasDefault;
+   struct sockaddr_in        def;
+};
+
+struct es_proxy_s {
+   /* Magic */
+   uint32_t                  magic;
+   /* es_config_mode_t */
+   unsigned int              mode;
+   /* Our address, in Via and to recognize our Route */
+   struct sockaddr_in        self;
+   char                      host[INET_ADDRSTRLEN];
+   unsigned int              port;
+   /* Routes file and its table, NULL if none */
+   char                      routesPath[ES_CONFIG_STR_LEN];
+   struct _es_proxy_routes_s *routes;
+   /* Location service, NULL if none */
+   es_registrar_t            *registrarCtx;
+   /* Routes of the subscribers, NULL if none */
+   es_db_t                   *db;
+   /* Counters, read by the CLI */
+   unsigned int              routesNb;
+   uint64_t                  requests;
+   uint64_t                  responses;
+   uint64_t                  located;
+   uint64_t                  routed;
+   uint64_t                  replied;
+   uint64_t                  dropped;
+};
+
+/*******************************************************************************
+                              Routes
+ ******************************************************************************/
+
+static void _es_proxy_routes_free(struct _es_proxy_routes_s *routes)
+{
+   if (routes == NULL) {
+      return;
+   }
+
+   es_mem_free(routes->slots);
+   es_mem_free(routes);
+}
+
+static struct _es_proxy_route_s *_es_proxy_routes_slot(const struct _es_proxy_routes_s *routes,
+                                                       const char *prefix, unsigned int len)
+{
+   uint32_t i = es_hash_fnv1a(prefix, len) & routes->mask;
+
+   for (;; i = (i + 1) & routes->mask) {
+      struct _es_proxy_route_s *r = &routes->slots[i];
+
+      if ((r->len == 0) || ((r->len == len) && (memcmp(r->prefix, prefix, len) == 0))) {
+         return r;
+      }
+   }
+}
+
+static const struct sockaddr_in *_es_proxy_routes_find(const struct _es_proxy_routes_s *routes,
+                                                       const char *user, size_t userLen)
+{
+   unsigned int i = 0;
+
+   for (i = 0; i < routes->nbLengths; ++i) {
+      const struct _es_proxy_route_s *r = NULL;
+
+      if (routes->lengths[i] > userLen) {
+         continue;
+      }
+
+      r = _es_proxy_routes_slot(routes, user, routes->lengths[i]);
+      if (r->len != 0) {
+         return &r->to;
+      }
+   }
+
+   return routes->hasDefault ? &routes->def : NULL;
+}
+
+static es_status _es_proxy_routes_add(struct _es_proxy_routes_s *routes, const char *prefix,
+                                      const struct sockaddr_in *to)
+{
+   size_t len = strlen(prefix);
+   struct _es_proxy_route_s *r = NULL;
+   unsigned int i = 0;
+
+   if (strcmp(prefix, "*") == 0) {
+      routes->hasDefault = 1;
+      routes->def = *to;
+      return ES_OK;
+   }
+
+   if (len >= ES_PROXY_PREFIX_LEN) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   /* The table was sized for all the lines */
+   r = _es_proxy_routes_slot(routes, prefix, (unsigned int)len);
+   if (r->len == 0) {
+      memcpy(r->prefix, prefix, len);
+      r->len = (unsigned int)len;
+      routes->nb++;
+   }
+   r->to = *to;
+
+   /* Longest first */
+   for (i = 0; (i < routes->nbLengths) && (routes->lengths[i] > len); ++i) {
+   }
+   if ((i == routes->nbLengths) || (routes->lengths[i] != len)) {
+      memmove(&routes->lengths[i + 1], &routes->lengths[i], (routes->nbLengths - i) * sizeof(routes->lengths[0]));
+      routes->lengths[i] = (unsigned int)len;
+      routes->nbLengths++;
+   }
+
+   return ES_OK;
+}
+
+/**
+ * @brief Read a routes file, "prefix host[:port]" per line
+ */
+static es_status _es_proxy_routes_load(const char *path, struct _es_proxy_routes_s **ppRoutes)
+{
+   struct _es_proxy_routes_s *routes = NULL;
+   char line[256];
+   unsigned int lines = 0;
+   unsigned int lineNb = 0;
+   unsigned int size = 16;
+   unsigned int errors = 0;
+   FILE *f = NULL;
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open routes %s: %s", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   /* Sized for all the lines, at most half full */
+   while (fgets(line, sizeof(line), f) != NULL) {
+      lines++;
+   }
+   while (size < 2 * lines) {
+      size *= 2;
+   }
+   rewind(f);
+
+   routes = (struct _es_proxy_routes_s *) es_mem_calloc(ES_MEM_PROXY, 1, sizeof(struct _es_proxy_routes_s));
+   if (routes != NULL) {
+      routes->slots = (struct _es_proxy_route_s *) es_mem_calloc(ES_MEM_PROXY, size, sizeof(struct _es_proxy_route_s));
+      routes->mask = size - 1;
+   }
+   if ((routes == NULL) || (routes->slots == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not load routes: no more memory");
+      _es_proxy_routes_free(routes);
+      fclose(f);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   while ((fgets(line, sizeof(line), f) != NULL) && (lineNb < lines)) {
+      char uri[ES_CONFIG_STR_LEN + 8];
+      char prefix[ES_PROXY_PREFIX_LEN + 1];
+      char hop[ES_CONFIG_STR_LEN];
+      char extra[2];
+      struct sockaddr_in to;
+      char *p = NULL;
+      int n = 0;
+
+      lineNb++;
+
+      if ((p = strchr(line, '#')) != NULL) {
+         *p = '\0';
+      }
+
+      n = sscanf(line, "%32s %63s %1s", prefix, hop, extra);
+      if (n <= 0) {
+         continue;
+      }
+
+      snprintf(uri, sizeof(uri), "sip:%s", hop);
+      if ((n != 2) || (es_raw_uri_addr(uri, strlen(uri), &to) != ES_OK) ||
+          (_es_proxy_routes_add(routes, prefix, &to) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: expected prefix and IPv4 address[:port]", path, lineNb);
+         errors++;
+      }
+   }
+
+   fclose(f);
+
+   if (errors != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Routes %s not applied: %u error(s)", path, errors);
+      _es_proxy_routes_free(routes);
+      return ES_ERROR_BADPARAM;
+   }
+
+   *ppRoutes = routes;
+   return ES_OK;
+}
+
+/*******************************************************************************
+                              Messages
+ ******************************************************************************/
+
+static int _es_proxy_is_request(const struct es_raw_msg_s *msg, const char *method)
+{
+   return (msg->methodLen == strlen(method)) && (memcmp(msg->buf, method, msg->methodLen) == 0);
+}
+
+/* A host and port that are ours, the port 5060 if none */
+static int _es_proxy_is_us(const struct es_proxy_s *pCtx, const char *host, size_t hostLen,
+                           const char *port, size_t portLen)
+{
+   char p[8];
+
+   if ((hostLen != strlen(pCtx->host)) || (strncasecmp(host, pCtx->host, hostLen) != 0)) {
+      return 0;
+   }
+
+   if (portLen == 0) {
+      return pCtx->port == 5060;
+   }
+
+   return (portLen == (size_t)snprintf(p, sizeof(p), "%u", pCtx->port)) && (memcmp(port, p, portLen) == 0);
+}
+
+/* The sent-by of a Via value is ours */
+static int _es_proxy_via_is_us(const struct es_proxy_s *pCtx, const char *p, size_t len)
+{
+   const char *end = p + len;
+   const char *host = NULL;
+   const char *he = NULL;
+   const char *port = NULL;
+   const char *pe = NULL;
+
+   /* SIP/2.0/UDP sent-by */
+   for (host = p; (host < end) && (*host != ' ') && (*host != '\t'); ++host) {
+   }
+   while ((host < end) && ((*host == ' ') || (*host == '\t'))) {
+      host++;
+   }
+
+   for (he = host; (he < end) && (*he != ':') && (*he != ';') && (*he != ' ') && (*he != '\t'); ++he) {
+   }
+
+   if ((he < end) && (*he == ':')) {
+      for (port = he + 1, pe = port; (pe < end) && (*pe >= '0') && (*pe <= '9'); ++pe) {
+      }
+   }
+
+   return _es_proxy_is_us(pCtx, host, (size_t)(he - host), port, (port != NULL) ? (size_t)(pe - port) : 0);
+}
+
+static int _es_proxy_uri_is_us(const struct es_proxy_s *pCtx, const char *p, size_t len)
+{
+   const char *host = NULL;
+   const char *port = NULL;
+   size_t hostLen = 0;
+   size_t portLen = 0;
+
+   return (es_raw_uri_host(p, len, &host, &hostLen, &port, &portLen) == ES_OK) &&
+          _es_proxy_is_us(pCtx, host, hostLen, port, portLen);
+}
+
+/**
+ * @brief Answer a request ourselves, to the source of the request
+ * Only the headers a response needs are copied.
+ */
+static void _es_proxy_reply(struct es_proxy_s *pCtx, struct es_transport_s *pTransport,
+                            const struct es_raw_msg_s *msg, const struct sockaddr_in *from, int code)
+{
+   static const struct {
+      const char *name;
+      char compact;
+   } copied[] = { { "Via", 'v' }, { "From", 'f' }, { "To", 't' }, { "Call-ID", 'i' }, { "CSeq", '\0' } };
+   char out[ES_PROXY_REPLY_LEN];
+   struct es_raw_hdr_s hdr;
+   struct sockaddr_in to;
+   struct iovec iov;
+   size_t len = 0;
+   unsigned int i = 0;
+   int first = 1;
+
+   /* No answer to ACK */
+   if (_es_proxy_is_request(msg, "ACK")) {
+      return;
+   }
+
+   len = (size_t)snprintf(out, sizeof(out), "SIP/2.0 %d %s\r\n", code, osip_message_get_reason(code));
+
+   for (i = 0; i < sizeof(copied) / sizeof(copied[0]); ++i) {
+      size_t offset = 0;
+
+      while (es_raw_header_next(msg, copied[i].name, copied[i].compact, &offset, &hdr)) {
+         size_t hdrLen = hdr.end - hdr.start;
+         size_t tagLen = 0;
+
+         if (len + hdrLen + 32 > sizeof(out)) {
+            return;
+         }
+
+         /* Back to the sender of the request (RFC 3261 18.2.2) */
+         if (first && (copied[i].compact == 'v')) {
+            first = 0;
+            if (es_raw_via_addr(msg->buf + hdr.value, hdr.valueEnd - hdr.value, &to) != ES_OK) {
+               to = *from;
+            }
+            to.sin_addr = from->sin_addr;
+            if (es_raw_param(msg->buf + hdr.value, hdr.valueEnd - hdr.value, "rport", &tagLen) != NULL) {
+               to.sin_port = from->sin_port;
+            }
+         }
+
+         /* A To tag of ours, the same for each retransmission */
+         if ((copied[i].compact == 't') &&
+             (es_raw_param(msg->buf + hdr.value, hdr.valueEnd - hdr.value, "tag", &tagLen) == NULL)) {
+            memcpy(out + len, msg->buf + hdr.start, hdr.valueEnd - hdr.start);
+            len += hdr.valueEnd - hdr.start;
+            len += (size_t)snprintf(out + len, sizeof(out) - len, ";tag=esp%08x\r\n",
+                                    es_hash_fnv1a(msg->buf, msg->lineEnd));
+            continue;
+         }
+
+         memcpy(out + len, msg->buf + hdr.start, hdrLen);
+         len += hdrLen;
+      }
+   }
+
+   if (first || (len + 32 > sizeof(out))) {
+      return;
+   }
+
+   len += (size_t)snprintf(out + len, sizeof(out) - len, "Content-Length: 0\r\n\r\n");
+
+   iov.iov_base = out;
+   iov.iov_len = len;
+   if (es_transport_sendv(pTransport, &to, &iov, 1) == ES_OK) {
+      __atomic_add_fetch(&pCtx->replied, 1, __ATOMIC_RELAXED);
+   }
+}
+
+/**
+ * @brief Next hops of a Request-URI: its bindings in the registrar, else
+ * its address when not ours, else the route of its user in the database,
+ * else the route of the longest prefix of its user. A binding also gives
+ * the Request-URI to send to.
+ */
+static unsigned int _es_proxy_locate(struct es_proxy_s *pCtx, const char *uri, size_t len,
+                                     struct es_proxy_target_s *targets, unsigned int max)
+{
+   const char *user = NULL;
+   size_t userLen = 0;
+
+   if (max == 0) {
+      return 0;
+   }
+
+   /* Location service: the bindings of the AOR */
+   if (pCtx->registrarCtx != NULL) {
+      struct es_registrar_contact_s bindings[ES_REGISTRAR_MAX_CONTACTS];
+      char aor[ES_REGISTRAR_AOR_LEN];
+      const char *host = NULL;
+      const char *port = NULL;
+      size_t hostLen = 0;
+      size_t portLen = 0;
+      unsigned int nb = 0;
+      unsigned int n = 0;
+      size_t i = 0;
+
+      if ((es_raw_uri_user(uri, len, &user, &userLen) == ES_OK) &&
+          (es_raw_uri_host(uri, len, &host, &hostLen, &port, &portLen) == ES_OK) &&
+          (userLen + hostLen + portLen + 3 <= sizeof(aor))) {
+         /* As es_registrar_aor() */
+         memcpy(aor, user, userLen);
+         aor[userLen] = '@';
+         for (i = 0; i < hostLen; ++i) {
+            aor[userLen + 1 + i] = (char)tolower((unsigned char)host[i]);
+         }
+         i += userLen + 1;
+         if (portLen != 0) {
+            aor[i++] = ':';
+            memcpy(aor + i, port, portLen);
+            i += portLen;
+         }
+         aor[i] = '\0';
+
+         n = es_registrar_lookup(pCtx->registrarCtx, aor, bindings,
+                                 (max < ES_REGISTRAR_MAX_CONTACTS) ? max : ES_REGISTRAR_MAX_CONTACTS);
+         for (i = 0; i < n; ++i) {
+            if ((strlen(bindings[i].uri) < sizeof(targets[nb].uri)) &&
+                (es_raw_uri_addr(bindings[i].uri, strlen(bindings[i].uri), &targets[nb].to) == ES_OK)) {
+               strcpy(targets[nb].uri, bindings[i].uri);
+               nb++;
+            }
+         }
+
+         if (nb != 0) {
+            __atomic_add_fetch(&pCtx->located, 1, __ATOMIC_RELAXED);
+            return nb;
+         }
+      }
+   }
+
+   /* Not for our domain: where the Request-URI is, no name resolved */
+   if (!_es_proxy_uri_is_us(pCtx, uri, len) && (es_raw_uri_addr(uri, len, &targets[0].to) == ES_OK)) {
+      targets[0].uri[0] = '\0';
+      return 1;
+   }
+
+   if (es_raw_uri_user(uri, len, &user, &userLen) != ES_OK) {
+      userLen = 0;
+   }
+
+   /* Route of the subscriber */
+   if ((pCtx->db != NULL) && (userLen != 0)) {
+      const struct es_db_record_s *rec = es_db_lookup(pCtx->db, user, userLen);
+
+      if ((rec != NULL) && (rec->routeAddr != 0)) {
+         memset(&targets[0].to, 0, sizeof(targets[0].to));
+         targets[0].to.sin_family = AF_INET;
+         targets[0].to.sin_addr.s_addr = rec->routeAddr;
+         targets[0].to.sin_port = rec->routePort;
+         targets[0].uri[0] = '\0';
+         __atomic_add_fetch(&pCtx->routed, 1, __ATOMIC_RELAXED);
+         return 1;
+      }
+   }
+
+   /* Static routes, by the longest prefix of the user */
+   if (pCtx->routes != NULL) {
+      const struct sockaddr_in *route = NULL;
+
+      route = _es_proxy_routes_find(pCtx->routes, user, userLen);
+      if (route != NULL) {
+         targets[0].to = *route;
+         targets[0].uri[0] = '\0';
+         __atomic_add_fetch(&pCtx->routed, 1, __ATOMIC_RELAXED);
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/**
+ * @brief Next hop of a request: next Route, else the first one located.
+ * Our Route on top is removed, the Request-URI is retargeted to a binding
+ * (target->uri, kept until sent).
+ * @return 1 found, 0 not found, -1 message not edited
+ */
+static int _es_proxy_next_hop(struct es_proxy_s *pCtx, const struct es_raw_msg_s *msg, struct es_raw_edits_s *edits,
+                              struct es_proxy_target_s *target)
+{
+   const char *buf = msg->buf;
+   struct es_raw_hdr_s hdr;
+   size_t offset = 0;
+
+   /* Loose routing, the first Route not ours */
+   if (es_raw_header_next(msg, "Route", '\0', &offset, &hdr)) {
+      size_t value = hdr.value;
+      size_t valueEnd = es_raw_value_end(msg, hdr.value, hdr.valueEnd);
+
+      if (_es_proxy_uri_is_us(pCtx, buf + value, valueEnd - value)) {
+         if (valueEnd == hdr.valueEnd) {
+            if (es_raw_splice(edits, hdr.start, hdr.end - hdr.start, NULL, 0) != ES_OK) {
+               return -1;
+            }
+            value = 0;
+            if (es_raw_header_next(msg, "Route", '\0', &offset, &hdr)) {
+               value = hdr.value;
+               valueEnd = es_raw_value_end(msg, hdr.value, hdr.valueEnd);
+            }
+         } else {
+            size_t next = valueEnd + 1;
+
+            while ((next < hdr.valueEnd) && ((buf[next] == ' ') || (buf[next] == '\t'))) {
+               next++;
+            }
+            if (es_raw_splice(edits, hdr.value, next - hdr.value, NULL, 0) != ES_OK) {
+               return -1;
+            }
+            value = next;
+            valueEnd = es_raw_value_end(msg, next, hdr.valueEnd);
+         }
+      }
+
+      if (value != 0) {
+         return (es_raw_uri_addr(buf + value, valueEnd - value, &target->to) == ES_OK) ? 1 : 0;
+      }
+   }
+
+   if (_es_proxy_locate(pCtx, buf + msg->uri, msg->uriEnd - msg->uri, target, 1) == 0) {
+      return 0;
+   }
+
+   if ((target->uri[0] != '\0') &&
+       (es_raw_splice(edits, msg->uri, msg->uriEnd - msg->uri, target->uri, strlen(target->uri)) != ES_OK)) {
+      return -1;
+   }
+
+   return 1;
+}
+
+static es_status _es_proxy_request(struct es_proxy_s *pCtx, struct es_transport_s *pTransport,
+                                   const struct es_raw_msg_s *msg, const struct sockaddr_in *from)
+{
+   const char *buf = msg->buf;
+   struct es_raw_edits_s edits;
+   struct es_raw_hdr_s via;
+   struct es_raw_hdr_s hdr;
+   struct iovec iov[ES_RAW_MAX_IOV];
+   struct es_proxy_target_s target;
+   struct sockaddr_in sentBy;
+   char viaLine[ES_PROXY_VIA_LEN];
+   char maxForwards[32];
+   char received[INET_ADDRSTRLEN + 16];
+   char rport[16];
+   const char *param = NULL;
+   size_t paramLen = 0;
+   size_t viaEnd = 0;
+   size_t offset = 0;
+   size_t len = 0;
+   unsigned int nb = 0;
+   int edited = 1;
+   int found = 0;
+
+   /* We are the location service of the proxied requests */
+   if (_es_proxy_is_request(msg, "REGISTER")) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   es_raw_edits_init(&edits, buf, msg->len);
+
+   if (!es_raw_header_next(msg, "Via", 'v', &offset, &via)) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+   viaEnd = es_raw_value_end(msg, via.value, via.valueEnd);
+
+   /* Our Via, its branch the same for a retransmission, a CANCEL or the
+      ACK of a failure: a hash of the Via and Request-URI received */
+   len = (size_t)snprintf(viaLine, sizeof(viaLine), "Via: SIP/2.0/UDP %s:%u;branch=" ES_PROXY_BRANCH "%08x\r\n",
+                          pCtx->host, pCtx->port,
+                          es_hash_fnv1a_update(es_hash_fnv1a(buf + via.value, viaEnd - via.value),
+                                               buf + msg->uri, msg->uriEnd - msg->uri));
+   edited &= (es_raw_splice(&edits, msg->lineEnd, 0, viaLine, len) == ES_OK);
+
+   /* Loops end after Max-Forwards hops */
+   offset = 0;
+   if (es_raw_header_next(msg, "Max-Forwards", '\0', &offset, &hdr)) {
+      unsigned long mf = 0;
+      size_t i = 0;
+
+      for (i = hdr.value; (i < hdr.valueEnd) && (buf[i] >= '0') && (buf[i] <= '9') && (mf < 256); ++i) {
+         mf = mf * 10 + (unsigned long)(buf[i] - '0');
+      }
+
+      if ((i == hdr.value) || (mf == 0)) {
+         _es_proxy_reply(pCtx, pTransport, msg, from, (i == hdr.value) ? SIP_BAD_REQUEST : SIP_TOO_MANY_HOPS);
+         return ES_OK;
+      }
+
+      len = (size_t)snprintf(maxForwards, sizeof(maxForwards), "%lu", mf - 1);
+      edited &= (es_raw_splice(&edits, hdr.value, hdr.valueEnd - hdr.value, maxForwards, len) == ES_OK);
+   } else {
+      len = (size_t)snprintf(maxForwards, sizeof(maxForwards), "Max-Forwards: %u\r\n", ES_PROXY_MAX_FORWARDS - 1);
+      edited &= (es_raw_splice(&edits, msg->lineEnd, 0, maxForwards, len) == ES_OK);
+   }
+
+   /* Where the request came from, for its responses (RFC 3261 18.2.1, RFC 3581) */
+   param = es_raw_param(buf + via.value, viaEnd - via.value, "rport", &paramLen);
+   if ((param != NULL) && (paramLen == 0)) {
+      len = (size_t)snprintf(rport, sizeof(rport), "=%u", ntohs(from->sin_port));
+      edited &= (es_raw_splice(&edits, (size_t)(param - buf), 0, rport, len) == ES_OK);
+   }
+
+   if ((es_raw_via_addr(buf + via.value, viaEnd - via.value, &sentBy) != ES_OK) ||
+       (sentBy.sin_addr.s_addr != from->sin_addr.s_addr)) {
+      if (es_raw_param(buf + via.value, viaEnd - via.value, "received", &paramLen) == NULL) {
+         len = (size_t)snprintf(received, sizeof(received), ";received=%s", inet_ntoa(from->sin_addr));
+         edited &= (es_raw_splice(&edits, viaEnd, 0, received, len) == ES_OK);
+      }
+   }
+
+   if (edited) {
+      found = _es_proxy_next_hop(pCtx, msg, &edits, &target);
+   }
+
+   /* Never forwarded half rewritten: without our Via or a hop less */
+   if (!edited || (found < 0)) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Request not rewritten, not forwarded");
+      _es_proxy_reply(pCtx, pTransport, msg, from, SIP_INTERNAL_SERVER_ERROR);
+      return ES_OK;
+   }
+
+   if (found == 0) {
+      _es_proxy_reply(pCtx, pTransport, msg, from, SIP_NOT_FOUND);
+      return ES_OK;
+   }
+
+   if (es_proxy_is_self(pCtx, &target.to)) {
+      _es_proxy_reply(pCtx, pTransport, msg, from, SIP_LOOP_DETECTED);
+      return ES_OK;
+   }
+
+   nb = es_raw_iov(&edits, iov, &len);
+   if (es_transport_sendv(pTransport, &target.to, iov, nb) != ES_OK) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   __atomic_add_fetch(&pCtx->requests, 1, __ATOMIC_RELAXED);
+   return ES_OK;
+}
+
+static es_status _es_proxy_response(struct es_proxy_s *pCtx, struct es_transport_s *pTransport,
+                                    const struct es_raw_msg_s *msg)
+{
+   const char *buf = msg->buf;
+   struct es_raw_edits_s edits;
+   struct es_raw_hdr_s via;
+   struct iovec iov[ES_RAW_MAX_IOV];
+   struct sockaddr_in to;
+   size_t viaEnd = 0;
+   size_t next = 0;
+   size_t nextEnd = 0;
+   size_t offset = 0;
+   size_t len = 0;
+   unsigned int nb = 0;
+   es_status ret = ES_OK;
+
+   es_raw_edits_init(&edits, buf, msg->len);
+
+   /* Ours on top, else not for us */
+   if (!es_raw_header_next(msg, "Via", 'v', &offset, &via)) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   viaEnd = es_raw_value_end(msg, via.value, via.valueEnd);
+   if (!_es_proxy_via_is_us(pCtx, buf + via.value, viaEnd - via.value)) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   /* Pop it, the header or its first value */
+   if (viaEnd == via.valueEnd) {
+      ret = es_raw_splice(&edits, via.start, via.end - via.start, NULL, 0);
+      if (es_raw_header_next(msg, "Via", 'v', &offset, &via)) {
+         next = via.value;
+         nextEnd = es_raw_value_end(msg, via.value, via.valueEnd);
+      }
+   } else {
+      next = viaEnd + 1;
+      while ((next < via.valueEnd) && ((buf[next] == ' ') || (buf[next] == '\t'))) {
+         next++;
+      }
+      ret = es_raw_splice(&edits, via.value, next - via.value, NULL, 0);
+      nextEnd = es_raw_value_end(msg, next, via.valueEnd);
+   }
+
+   /* Sent back with our Via, it would loop to us */
+   if ((ret != ES_OK) || (next == 0) || (es_raw_via_addr(buf + next, nextEnd - next, &to) != ES_OK)) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   nb = es_raw_iov(&edits, iov, &len);
+   if (es_transport_sendv(pTransport, &to, iov, nb) != ES_OK) {
+      __atomic_add_fetch(&pCtx->dropped, 1, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   __atomic_add_fetch(&pCtx->responses, 1, __ATOMIC_RELAXED);
+   return ES_OK;
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_proxy_init(es_proxy_t **ppCtx)
+{
+   struct es_proxy_s *_pCtx = NULL;
+
+   if (ppCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_proxy_s *) es_mem_calloc(ES_MEM_PROXY, 1, sizeof(struct es_proxy_s));
+   if (_pCtx == (struct es_proxy_s *)0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not initialize proxy: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_PROXY_MAGIC;
+   _pCtx->mode = ES_CONFIG_MODE_UAS;
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_proxy_deinit(es_proxy_t *pCtx)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PROXY_MAGIC)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Proxy Ctx not valid");
+      return ES_ERROR_NULLPTR;
+   }
+
+   _es_proxy_routes_free(_pCtx->routes);
+
+   _pCtx->magic = 0;
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_proxy_configure(es_proxy_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+   struct _es_proxy_routes_s *routes = NULL;
+   const char *host = NULL;
+   struct sockaddr_in self;
+
+   if ((_pCtx == NULL) || (pCfg == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PROXY_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (pCfg->proxyMode == ES_CONFIG_MODE_UAS) {
+      __atomic_store_n(&_pCtx->mode, ES_CONFIG_MODE_UAS, __ATOMIC_RELAXED);
+      return ES_OK;
+   }
+
+   /* Our Via must reach us: an address, not any */
+   host = (pCfg->proxyHost[0] != '\0') ? pCfg->proxyHost : pCfg->sipAddress;
+   memset(&self, 0, sizeof(self));
+   self.sin_family = AF_INET;
+   self.sin_port = htons((uint16_t)pCfg->sipPort);
+   if ((inet_pton(AF_INET, host, &self.sin_addr) != 1) || (self.sin_addr.s_addr == htonl(INADDR_ANY))) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Proxy needs proxy.host or sip.address, an IPv4 address: %s", host);
+      return ES_ERROR_BADPARAM;
+   }
+
+   if ((pCfg->proxyRoutes[0] != '\0') && (_es_proxy_routes_load(pCfg->proxyRoutes, &routes) != ES_OK)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   _es_proxy_routes_free(_pCtx->routes);
+   _pCtx->routes = routes;
+   strcpy(_pCtx->routesPath, pCfg->proxyRoutes);
+   __atomic_store_n(&_pCtx->routesNb, (routes != NULL) ? routes->nb + (unsigned int)routes->hasDefault : 0,
+                    __ATOMIC_RELAXED);
+
+   _pCtx->self = self;
+   strcpy(_pCtx->host, host);
+   _pCtx->port = pCfg->sipPort;
+   __atomic_store_n(&_pCtx->mode, pCfg->proxyMode, __ATOMIC_RELAXED);
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Proxy as %s:%u, %u route(s)", _pCtx->host, _pCtx->port, _pCtx->routesNb);
+
+   return ES_OK;
+}
+
+es_status es_proxy_set_registrar(es_proxy_t *pCtx, struct es_registrar_s *pRegistrar)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PROXY_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   _pCtx->registrarCtx = pRegistrar;
+   return ES_OK;
+}
+
+es_status es_proxy_set_db(es_proxy_t *pCtx, struct es_db_s *pDb)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_PROXY_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   _pCtx->db = pDb;
+   return ES_OK;
+}
+
+es_status es_proxy_handle(es_proxy_t *pCtx, struct es_transport_s *pTransport, const char *buf, size_t len,
+                          const struct sockaddr_in *from)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   /* A stateful proxy goes through the stack */
+   if ((_pCtx == NULL) || (_pCtx->mode != ES_CONFIG_MODE_STATELESS)) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   return es_proxy_forward(pCtx, pTransport, buf, len, from);
+}
+
+es_status es_proxy_forward(es_proxy_t *pCtx, struct es_transport_s *pTransport, const char *buf, size_t len,
+                           const struct sockaddr_in *from)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+   struct es_raw_msg_s msg;
+
+   if ((_pCtx == NULL) || (_pCtx->mode == ES_CONFIG_MODE_UAS)) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   /* Not SIP: the stack counts it */
+   if (es_raw_parse(&msg, buf, len) != ES_OK) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   if (msg.request) {
+      return _es_proxy_request(_pCtx, pTransport, &msg, from);
+   }
+
+   return _es_proxy_response(_pCtx, pTransport, &msg);
+}
+
+unsigned int es_proxy_mode(const es_proxy_t *pCtx)
+{
+   const struct es_proxy_s *_pCtx = (const struct es_proxy_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PROXY_MAGIC)) {
+      return ES_CONFIG_MODE_UAS;
+   }
+
+   return __atomic_load_n(&_pCtx->mode, __ATOMIC_RELAXED);
+}
+
+unsigned int es_proxy_locate(es_proxy_t *pCtx, const char *uri, size_t len, struct es_proxy_target_s *targets,
+                             unsigned int max)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PROXY_MAGIC) || (uri == NULL) || (targets == NULL)) {
+      return 0;
+   }
+
+   return _es_proxy_locate(_pCtx, uri, len, targets, max);
+}
+
+int es_proxy_is_self(const es_proxy_t *pCtx, const struct sockaddr_in *to)
+{
+   const struct es_proxy_s *_pCtx = (const struct es_proxy_s *)pCtx;
+
+   return (_pCtx != NULL) && (to->sin_addr.s_addr == _pCtx->self.sin_addr.s_addr) &&
+          (to->sin_port == _pCtx->self.sin_port);
+}
+
+es_status es_proxy_sent_by(const es_proxy_t *pCtx, char *buf, size_t size)
+{
+   const struct es_proxy_s *_pCtx = (const struct es_proxy_s *)pCtx;
+
+   if ((_pCtx == NULL) || (buf == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if ((size_t)snprintf(buf, size, "%s:%u", _pCtx->host, _pCtx->port) >= size) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   return ES_OK;
+}
+
+static int _es_proxy_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)arg;
+   unsigned int mode = __atomic_load_n(&_pCtx->mode, __ATOMIC_RELAXED);
+
+   if (mode == ES_CONFIG_MODE_UAS) {
+      es_cli_print(pCli, "Proxy off: requests are answered");
+      return CLI_OK;
+   }
+
+   es_cli_print(pCli, "%s proxy as %s:%u, %u route(s)%s, location service %s",
+                (mode == ES_CONFIG_MODE_STATEFUL) ? "Stateful" : "Stateless", _pCtx->host, _pCtx->port,
+                __atomic_load_n(&_pCtx->routesNb, __ATOMIC_RELAXED), (_pCtx->db != NULL) ? " and database" : "",
+                (_pCtx->registrarCtx != NULL) ? "on" : "off");
+   es_cli_print(pCli, "%12s %12s %12s %12s %12s %12s", "requests", "responses", "located", "routed", "replied", "dropped");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu %12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->requests, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->responses, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->located, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->routed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->replied, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->dropped, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_proxy_cli_register(es_proxy_t *pCtx, es_cli_t *pCli)
+{
+   struct es_proxy_s *_pCtx = (struct es_proxy_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_PROXY_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show proxy", "Show the proxy mode and counters", _es_proxy_cli_show, _pCtx);
+}
@@ -0,0 +1,280 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <netinet/in.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "esconfig.h"
+#include "eshash.h"
+#include "esrate.h"
+
+#define ES_RATE_MAGIC            0x20141210
+
+/** A token is worth 1s in ns: a refill is rate * elapsed ns, nothing lost */
+#define ES_RATE_UNIT             1000000000ULL
+
+/**
+ * @brief Buckets of a source, addr 0 if the slot is free
+ */
+struct _es_rate_source_s {
+   uint32_t                  addr;
+   uint64_t                  tokens[ES_RATE_CLASS_MAX];
+   /* Last refill, es_hist_now(): also the age for the eviction */
+   uint64_t                  lastTs;
+};
+
+struct es_rate_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct _es_rate_source_s  *sources;
+   /* Datagrams per second by class, 0 for no limit */
+   unsigned int              rates[ES_RATE_CLASS_MAX];
+   unsigned int              burst;
+   int                       enabled;
+   /* Counters, read by the CLI */
+   uint64_t                  passed[ES_RATE_CLASS_MAX];
+   uint64_t                  dropped[ES_RATE_CLASS_MAX];
+   uint64_t                  evicted;
+   unsigned int              used;
+};
+
+static const char const *_es_rate_names[ES_RATE_CLASS_MAX] = {
+   "INVITE",
+   "REGISTER",
+   "other",
+   "response"
+};
+
+static es_rate_class_t _es_rate_class(const char *buf, size_t len)
+{
+   if ((len >= 7) && (memcmp(buf, "INVITE ", 7) == 0)) {
+      return ES_RATE_INVITE;
+   }
+   if ((len >= 9) && (memcmp(buf, "REGISTER ", 9) == 0)) {
+      return ES_RATE_REGISTER;
+   }
+   if ((len >= 8) && (memcmp(buf, "SIP/2.0 ", 8) == 0)) {
+      return ES_RATE_RESPONSE;
+   }
+   return ES_RATE_OTHER;
+}
+
+/**
+ * @brief Buckets of a source, taken from the oldest one if new
+ */
+static struct _es_rate_source_s *_es_rate_source(struct es_rate_s *pCtx, uint32_t addr, uint64_t now)
+{
+   struct _es_rate_source_s *oldest = NULL;
+   uint32_t i = es_hash_fnv1a(&addr, sizeof(addr));
+   unsigned int n = 0;
+   unsigned int c = 0;
+
+   for (n = 0; n < ES_RATE_PROBE; ++n, ++i) {
+      struct _es_rate_source_s *s = &pCtx->sources[i & (ES_RATE_SOURCES - 1)];
+
+      if (s->addr == addr) {
+         return s;
+      }
+      /* A free slot, else the source seen the longest ago */
+      if ((oldest == NULL) || ((oldest->addr != 0) && ((s->addr == 0) || (s->lastTs < oldest->lastTs)))) {
+         oldest = s;
+      }
+   }
+
+   if (oldest->addr == 0) {
+      __atomic_store_n(&pCtx->used, pCtx->used + 1, __ATOMIC_RELAXED);
+   } else {
+      __atomic_add_fetch(&pCtx->evicted, 1, __ATOMIC_RELAXED);
+   }
+
+   /* A new source starts with full buckets */
+   oldest->addr = addr;
+   oldest->lastTs = now;
+   for (c = 0; c < ES_RATE_CLASS_MAX; ++c) {
+      oldest->tokens[c] = (uint64_t)pCtx->rates[c] * pCtx->burst * ES_RATE_UNIT;
+   }
+
+   return oldest;
+}
+
+es_status es_rate_init(es_rate_t **ppCtx)
+{
+   struct es_rate_s *_pCtx = NULL;
+
+   if (ppCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_rate_s *) calloc(1, sizeof(struct es_rate_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create rate limiter: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->sources = (struct _es_rate_source_s *) calloc(ES_RATE_SOURCES, sizeof(struct _es_rate_source_s));
+   if (_pCtx->sources == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create rate limiter sources: no more memory");
+      free(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_RATE_MAGIC;
+   _pCtx->burst = 1;
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_rate_deinit(es_rate_t *pCtx)
+{
+   struct es_rate_s *_pCtx = (struct es_rate_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_RATE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   free(_pCtx->sources);
+   memset(_pCtx, 0, sizeof(*_pCtx));
+   free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_rate_configure(es_rate_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_rate_s *_pCtx = (struct es_rate_s *)pCtx;
+   unsigned int c = 0;
+
+   if ((_pCtx == NULL) || (pCfg == NULL) || (_pCtx->magic != ES_RATE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx->rates[ES_RATE_INVITE] = pCfg->rateInvite;
+   _pCtx->rates[ES_RATE_REGISTER] = pCfg->rateRegister;
+   _pCtx->rates[ES_RATE_OTHER] = pCfg->rateOther;
+   _pCtx->rates[ES_RATE_RESPONSE] = pCfg->rateResponse;
+   _pCtx->burst = (pCfg->rateBurst > 0) ? pCfg->rateBurst : 1;
+
+   _pCtx->enabled = 0;
+   for (c = 0; c < ES_RATE_CLASS_MAX; ++c) {
+      if (_pCtx->rates[c] != 0) {
+         _pCtx->enabled = 1;
+      }
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "Rate per source: INVITE %u/s, REGISTER %u/s, other %u/s, responses %u/s, burst %us",
+              _pCtx->rates[ES_RATE_INVITE], _pCtx->rates[ES_RATE_REGISTER], _pCtx->rates[ES_RATE_OTHER],
+              _pCtx->rates[ES_RATE_RESPONSE], _pCtx->burst);
+
+   return ES_OK;
+}
+
+int es_rate_allow(es_rate_t *pCtx, const struct sockaddr_in *from, const char *buf, size_t len, uint64_t now)
+{
+   struct es_rate_s *_pCtx = (struct es_rate_s *)pCtx;
+   struct _es_rate_source_s *s = NULL;
+   es_rate_class_t cls = ES_RATE_OTHER;
+   uint64_t elapsed = 0;
+   uint64_t depth = 0;
+   unsigned int c = 0;
+
+   if (!_pCtx->enabled) {
+      return 1;
+   }
+
+   cls = _es_rate_class(buf, len);
+   if (_pCtx->rates[cls] == 0) {
+      __atomic_add_fetch(&_pCtx->passed[cls], 1, __ATOMIC_RELAXED);
+      return 1;
+   }
+
+   s = _es_rate_source(_pCtx, from->sin_addr.s_addr, now);
+
+   /* Refill every class for the time elapsed, a full bucket at most */
+   elapsed = now - s->lastTs;
+   if (elapsed > _pCtx->burst * ES_RATE_UNIT) {
+      elapsed = _pCtx->burst * ES_RATE_UNIT;
+   }
+   for (c = 0; c < ES_RATE_CLASS_MAX; ++c) {
+      depth = (uint64_t)_pCtx->rates[c] * _pCtx->burst * ES_RATE_UNIT;
+      s->tokens[c] += elapsed * _pCtx->rates[c];
+      if (s->tokens[c] > depth) {
+         s->tokens[c] = depth;
+      }
+   }
+   s->lastTs = now;
+
+   if (s->tokens[cls] >= ES_RATE_UNIT) {
+      s->tokens[cls] -= ES_RATE_UNIT;
+      __atomic_add_fetch(&_pCtx->passed[cls], 1, __ATOMIC_RELAXED);
+      return 1;
+   }
+
+   __atomic_add_fetch(&_pCtx->dropped[cls], 1, __ATOMIC_RELAXED);
+   return 0;
+}
+
+static int _es_rate_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_rate_s *_pCtx = (struct es_rate_s *)arg;
+   unsigned int c = 0;
+
+   es_cli_print(pCli, "Sources %u of %u, %llu evicted, burst of %us", __atomic_load_n(&_pCtx->used, __ATOMIC_RELAXED),
+                ES_RATE_SOURCES, (unsigned long long)__atomic_load_n(&_pCtx->evicted, __ATOMIC_RELAXED), _pCtx->burst);
+   es_cli_print(pCli, "%-10s %10s %14s %14s", "class", "rate/s", "passed", "dropped");
+
+   for (c = 0; c < ES_RATE_CLASS_MAX; ++c) {
+      char rate[16];
+
+      if (_pCtx->rates[c] == 0) {
+         snprintf(rate, sizeof(rate), "-");
+      } else {
+         snprintf(rate, sizeof(rate), "%u", _pCtx->rates[c]);
+      }
+      es_cli_print(pCli, "%-10s %10s %14llu %14llu", _es_rate_names[c], rate,
+                   (unsigned long long)__atomic_load_n(&_pCtx->passed[c], __ATOMIC_RELAXED),
+                   (unsigned long long)__atomic_load_n(&_pCtx->dropped[c], __ATOMIC_RELAXED));
+   }
+
+   return CLI_OK;
+}
+
+es_status es_rate_cli_register(es_rate_t *pCtx, es_cli_t *pCli)
+{
+   struct es_rate_s *_pCtx = (struct es_rate_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_RATE_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show rate", "Show the rate limits per source and the drops", _es_rate_cli_show, _pCtx);
+}
@@ -0,0 +1,505 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "eserror.h"
+#include "esraw.h"
+
+#define ES_RAW_VERSION        "SIP/2.0"
+#define ES_RAW_VERSION_LEN    (sizeof(ES_RAW_VERSION) - 1)
+#define ES_RAW_DEFAULT_PORT   5060
+
+static int _es_raw_space(char c)
+{
+   return (c == ' ') || (c == '\t');
+}
+
+/* End of the token starting at p, stopping at one of stops or a space */
+static const char *_es_raw_token_end(const char *p, const char *end, const char *stops)
+{
+   while ((p < end) && !_es_raw_space(*p) && (strchr(stops, *p) == NULL)) {
+      p++;
+   }
+   return p;
+}
+
+es_status es_raw_parse(struct es_raw_msg_s *msg, const char *buf, size_t len)
+{
+   const char *nl = NULL;
+   const char *end = NULL;
+   const char *sp = NULL;
+
+   memset(msg, 0, sizeof(struct es_raw_msg_s));
+   msg->buf = buf;
+   msg->len = len;
+
+   nl = (const char *) memchr(buf, '\n', len);
+   if ((nl == NULL) || (nl == buf)) {
+      return ES_ERROR_BADPARAM;
+   }
+   msg->lineEnd = (size_t)(nl - buf) + 1;
+   end = (nl[-1] == '\r') ? nl - 1 : nl;
+
+   if ((len > ES_RAW_VERSION_LEN) && (strncmp(buf, ES_RAW_VERSION " ", ES_RAW_VERSION_LEN + 1) == 0)) {
+      const char *code = buf + ES_RAW_VERSION_LEN + 1;
+
+      if ((end - code < 3) || (code[0] < '1') || (code[0] > '6') ||
+          (code[1] < '0') || (code[1] > '9') || (code[2] < '0') || (code[2] > '9')) {
+         return ES_ERROR_BADPARAM;
+      }
+      msg->status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+   } else {
+      /* Method SP Request-URI SP SIP-Version */
+      sp = (const char *) memchr(buf, ' ', (size_t)(end - buf));
+      if ((sp == NULL) || (sp == buf)) {
+         return ES_ERROR_BADPARAM;
+      }
+      msg->request = 1;
+      msg->methodLen = (size_t)(sp - buf);
+      msg->uri = msg->methodLen + 1;
+
+      sp = (const char *) memchr(buf + msg->uri, ' ', (size_t)(end - buf) - msg->uri);
+      if ((sp == NULL) || ((size_t)(sp - buf) == msg->uri) ||
+          ((size_t)(end - sp - 1) != ES_RAW_VERSION_LEN) || (strncmp(sp + 1, ES_RAW_VERSION, ES_RAW_VERSION_LEN) != 0)) {
+         return ES_ERROR_BADPARAM;
+      }
+      msg->uriEnd = (size_t)(sp - buf);
+   }
+
+   /* Empty line, right after the start line without header */
+   if ((len - msg->lineEnd >= 2) && (buf[msg->lineEnd] == '\r') && (buf[msg->lineEnd + 1] == '\n')) {
+      msg->hdrEnd = msg->lineEnd + 2;
+      return ES_OK;
+   }
+
+   end = (const char *) memmem(buf + msg->lineEnd, len - msg->lineEnd, "\r\n\r\n", 4);
+   if (end == NULL) {
+      return ES_ERROR_BADPARAM;
+   }
+   msg->hdrEnd = (size_t)(end - buf) + 4;
+
+   return ES_OK;
+}
+
+int es_raw_header_next(const struct es_raw_msg_s *msg, const char *name, char compact, size_t *offset,
+                       struct es_raw_hdr_s *hdr)
+{
+   const char *buf = msg->buf;
+   size_t nameLen = strlen(name);
+   size_t pos = (*offset > msg->lineEnd) ? *offset : msg->lineEnd;
+
+   while (pos < msg->hdrEnd) {
+      const char *line = buf + pos;
+      const char *colon = NULL;
+      const char *n = line;
+      const char *nl = NULL;
+      size_t end = pos;
+
+      /* The line and its continuations */
+      do {
+         nl = (const char *) memchr(buf + end, '\n', msg->hdrEnd - end);
+         end = (nl != NULL) ? (size_t)(nl - buf) + 1 : msg->hdrEnd;
+      } while ((end < msg->hdrEnd) && _es_raw_space(buf[end]));
+
+      colon = (const char *) memchr(line, ':', end - pos);
+      if (colon != NULL) {
+         const char *ne = colon;
+         size_t len = 0;
+
+         while ((ne > n) && _es_raw_space(ne[-1])) {
+            ne--;
+         }
+         len = (size_t)(ne - n);
+
+         if (((len == nameLen) && (strncasecmp(n, name, len) == 0)) ||
+             ((len == 1) && (compact != '\0') && ((*n | 0x20) == (compact | 0x20)))) {
+            const char *v = colon + 1;
+            const char *ve = buf + end;
+
+            while ((ve > v) && ((ve[-1] == '\r') || (ve[-1] == '\n') || _es_raw_space(ve[-1]))) {
+               ve--;
+            }
+            while ((v < ve) && _es_raw_space(*v)) {
+               v++;
+            }
+
+            hdr->start = pos;
+            hdr->value = (size_t)(v - buf);
+            hdr->valueEnd = (size_t)(ve - buf);
+            hdr->end = end;
+            *offset = end;
+            return 1;
+         }
+      }
+
+      pos = end;
+   }
+
+   *offset = msg->hdrEnd;
+   return 0;
+}
+
+size_t es_raw_value_end(const struct es_raw_msg_s *msg, size_t value, size_t valueEnd)
+{
+   const char *buf = msg->buf;
+   int quoted = 0;
+   int angle = 0;
+   size_t i = value;
+
+   for (; i < valueEnd; ++i) {
+      char c = buf[i];
+
+      if (quoted) {
+         if (c == '\\') {
+            i++;
+         } else if (c == '"') {
+            quoted = 0;
+         }
+      } else if (c == '"') {
+         quoted = 1;
+      } else if (c == '<') {
+         angle = 1;
+      } else if (c == '>') {
+         angle = 0;
+      } else if ((c == ',') && !angle) {
+         break;
+      }
+   }
+
+   while ((i > value) && _es_raw_space(buf[i - 1])) {
+      i--;
+   }
+
+   return i;
+}
+
+const char *es_raw_param(const char *p, size_t len, const char *name, size_t *pLen)
+{
+   const char *end = p + len;
+   size_t nameLen = strlen(name);
+   int angle = 0;
+
+   for (; p < end; ++p) {
+      const char *n = NULL;
+      const char *v = NULL;
+
+      if (*p == '<') {
+         angle = 1;
+      } else if (*p == '>') {
+         angle = 0;
+      }
+
+      if ((*p != ';') || angle) {
+         continue;
+      }
+
+      n = p + 1;
+      while ((n < end) && _es_raw_space(*n)) {
+         n++;
+      }
+
+      v = _es_raw_token_end(n, end, "=;,");
+      if (((size_t)(v - n) != nameLen) || (strncasecmp(n, name, nameLen) != 0)) {
+         continue;
+      }
+
+      while ((v < end) && _es_raw_space(*v)) {
+         v++;
+      }
+
+      if ((v < end) && (*v == '=')) {
+         const char *ve = NULL;
+
+         v++;
+         while ((v < end) && _es_raw_space(*v)) {
+            v++;
+         }
+         ve = _es_raw_token_end(v, end, ";,>");
+         *pLen = (size_t)(ve - v);
+         return v;
+      }
+
+      *pLen = 0;
+      return v;
+   }
+
+   return NULL;
+}
+
+/* After the scheme of a URI, the one of a name-addr if any */
+static const char *_es_raw_uri_start(const char *p, size_t len, const char **pEnd)
+{
+   const char *end = p + len;
+   const char *lt = (const char *) memchr(p, '<', len);
+
+   if (lt != NULL) {
+      const char *gt = (const char *) memchr(lt, '>', (size_t)(end - lt));
+      p = lt + 1;
+      end = (gt != NULL) ? gt : end;
+   }
+
+   while ((p < end) && _es_raw_space(*p)) {
+      p++;
+   }
+
+   if ((end - p > 4) && (strncasecmp(p, "sip:", 4) == 0)) {
+      p += 4;
+   } else if ((end - p > 5) && (strncasecmp(p, "sips:", 5) == 0)) {
+      p += 5;
+   } else {
+      return NULL;
+   }
+
+   *pEnd = end;
+   return p;
+}
+
+es_status es_raw_uri_user(const char *p, size_t len, const char **pUser, size_t *pUserLen)
+{
+   const char *end = NULL;
+   const char *at = NULL;
+   const char *u = _es_raw_uri_start(p, len, &end);
+
+   if (u == NULL) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* The user ends at '@', before any parameter */
+   for (at = u; (at < end) && (*at != '@') && (*at != ';') && (*at != '?') && !_es_raw_space(*at); ++at) {
+   }
+
+   if ((at == end) || (*at != '@') || (at == u)) {
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   /* Without the password */
+   *pUser = u;
+   *pUserLen = (size_t)(at - u);
+   for (p = u; p < at; ++p) {
+      if (*p == ':') {
+         *pUserLen = (size_t)(p - u);
+         break;
+      }
+   }
+
+   return ES_OK;
+}
+
+static es_status _es_raw_addr(const char *host, size_t hostLen, const char *port, size_t portLen,
+                              struct sockaddr_in *addr)
+{
+   char ip[INET_ADDRSTRLEN];
+   unsigned long p = ES_RAW_DEFAULT_PORT;
+
+   if ((hostLen == 0) || (hostLen >= sizeof(ip))) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   memcpy(ip, host, hostLen);
+   ip[hostLen] = '\0';
+
+   memset(addr, 0, sizeof(struct sockaddr_in));
+   addr->sin_family = AF_INET;
+   if (inet_pton(AF_INET, ip, &addr->sin_addr) != 1) {
+      return ES_ERROR_NOTSUPPORTED;
+   }
+
+   if (portLen != 0) {
+      size_t i = 0;
+
+      p = 0;
+      for (i = 0; i < portLen; ++i) {
+         if ((port[i] < '0') || (port[i] > '9') || (p > 65535)) {
+            return ES_ERROR_BADPARAM;
+         }
+         p = p * 10 + (unsigned long)(port[i] - '0');
+      }
+      if ((p == 0) || (p > 65535)) {
+         return ES_ERROR_BADPARAM;
+      }
+   }
+
+   addr->sin_port = htons((uint16_t)p);
+   return ES_OK;
+}
+
+es_status es_raw_uri_host(const char *p, size_t len, const char **pHost, size_t *pHostLen,
+                          const char **pPort, size_t *pPortLen)
+{
+   const char *end = NULL;
+   const char *host = _es_raw_uri_start(p, len, &end);
+   const char *he = NULL;
+   const char *port = NULL;
+   const char *pe = NULL;
+
+   if (host == NULL) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* Past the user, if any */
+   for (he = host; (he < end) && (*he != ';') && (*he != '?') && !_es_raw_space(*he); ++he) {
+      if (*he == '@') {
+         host = he + 1;
+      }
+   }
+
+   he = _es_raw_token_end(host, end, ":;?>");
+   if ((he < end) && (*he == ':')) {
+      port = he + 1;
+      pe = _es_raw_token_end(port, end, ";?>");
+   }
+
+   *pHost = host;
+   *pHostLen = (size_t)(he - host);
+   *pPort = port;
+   *pPortLen = (port != NULL) ? (size_t)(pe - port) : 0;
+
+   return (he > host) ? ES_OK : ES_ERROR_BADPARAM;
+}
+
+es_status es_raw_uri_addr(const char *p, size_t len, struct sockaddr_in *addr)
+{
+   const char *host = NULL;
+   const char *port = NULL;
+   size_t hostLen = 0;
+   size_t portLen = 0;
+   es_status ret = es_raw_uri_host(p, len, &host, &hostLen, &port, &portLen);
+
+   if (ret != ES_OK) {
+      return ret;
+   }
+
+   return _es_raw_addr(host, hostLen, port, portLen, addr);
+}
+
+es_status es_raw_via_addr(const char *p, size_t len, struct sockaddr_in *addr)
+{
+   const char *end = p + len;
+   const char *host = NULL;
+   const char *he = NULL;
+   const char *port = NULL;
+   const char *pe = NULL;
+   const char *received = NULL;
+   const char *rport = NULL;
+   size_t receivedLen = 0;
+   size_t rportLen = 0;
+
+   /* SIP/2.0/UDP sent-by */
+   host = _es_raw_token_end(p, end, "");
+   while ((host < end) && _es_raw_space(*host)) {
+      host++;
+   }
+
+   he = _es_raw_token_end(host, end, ":;,");
+   if ((he < end) && (*he == ':')) {
+      port = he + 1;
+      pe = _es_raw_token_end(port, end, ";,");
+   }
+
+   received = es_raw_param(he, (size_t)(end - he), "received", &receivedLen);
+   rport = es_raw_param(he, (size_t)(end - he), "rport", &rportLen);
+
+   if ((received != NULL) && (receivedLen != 0)) {
+      host = received;
+      he = received + receivedLen;
+   }
+
+   if ((rport != NULL) && (rportLen != 0)) {
+      port = rport;
+      pe = rport + rportLen;
+   }
+
+   return _es_raw_addr(host, (size_t)(he - host), port, (port != NULL) ? (size_t)(pe - port) : 0, addr);
+}
+
+void es_raw_edits_init(struct es_raw_edits_s *edits, const char *buf, size_t len)
+{
+   edits->buf = buf;
+   edits->len = len;
+   edits->nb = 0;
+}
+
+es_status es_raw_splice(struct es_raw_edits_s *edits, size_t offset, size_t remove, const char *insert, size_t insertLen)
+{
+   unsigned int i = 0;
+
+   if ((edits->nb >= ES_RAW_MAX_EDITS) || (offset + remove > edits->len)) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   /* After the edits before it, inserts at the same offset in order */
+   while ((i < edits->nb) && (edits->edit[i].offset <= offset)) {
+      i++;
+   }
+
+   if (((i > 0) && (edits->edit[i - 1].offset + edits->edit[i - 1].remove > offset)) ||
+       ((i < edits->nb) && (offset + remove > edits->edit[i].offset))) {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   memmove(&edits->edit[i + 1], &edits->edit[i], (edits->nb - i) * sizeof(edits->edit[0]));
+   edits->edit[i].offset = offset;
+   edits->edit[i].remove = remove;
+   edits->edit[i].insert = insert;
+   edits->edit[i].insertLen = insertLen;
+   edits->nb++;
+
+   return ES_OK;
+}
+
+unsigned int es_raw_iov(const struct es_raw_edits_s *edits, struct iovec *iov, size_t *pLen)
+{
+   unsigned int nb = 0;
+   unsigned int i = 0;
+   size_t pos = 0;
+   size_t len = 0;
+
+   for (i = 0; i < edits->nb; ++i) {
+      if (edits->edit[i].offset > pos) {
+         iov[nb].iov_base = (void *)(edits->buf + pos);
+         iov[nb].iov_len = edits->edit[i].offset - pos;
+         len += iov[nb++].iov_len;
+      }
+      if (edits->edit[i].insertLen != 0) {
+         iov[nb].iov_base = (void *)edits->edit[i].insert;
+         iov[nb].iov_len = edits->edit[i].insertLen;
+         len += iov[nb++].iov_len;
+      }
+      pos = edits->edit[i].offset + edits->edit[i].remove;
+   }
+
+   if (pos < edits->len) {
+      iov[nb].iov_base = (void *)(edits->buf + pos);
+      iov[nb].iov_len = edits->len - pos;
+      len += iov[nb++].iov_len;
+   }
+
+   *pLen = len;
+   return nb;
+}
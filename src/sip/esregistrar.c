@@ -0,0 +1,1180 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include <event2/event.h>
+
+#include <osip2/osip.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esmem.h"
+#include "essnap.h"
+#include "eswheel.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "esregistrar.h"
+
+#define ES_REGISTRAR_MAGIC          0x20141104
+
+/** Shards, a power of 2 */
+#define ES_REGISTRAR_SHARDS         64
+
+/** Initial buckets of a shard, a power of 2 */
+#define ES_REGISTRAR_BUCKETS        256
+
+/** Expiry tick (ms), the wheel counts seconds */
+#define ES_REGISTRAR_TICK_MS        1000
+
+/** Max length of a Call-ID kept */
+#define ES_REGISTRAR_CALLID_LEN     128
+
+/** Shards and counters on their own cache lines, written by several threads */
+#define ES_REGISTRAR_CACHE_LINE     64
+
+/**
+ * @brief A Contact bound to an AOR
+ */
+struct _es_registrar_binding_s {
+   /* First: the wheel gives it back */
+   struct es_wheel_entry_s          timer;
+   struct _es_registrar_aor_s       *aor;
+   /* Next binding of the AOR */
+   struct _es_registrar_binding_s   *next;
+   /* Creation time (es_hist_now()) */
+   uint64_t                         since;
+   uint32_t                         cseq;
+   /* Snapshot row, -1 if none */
+   int                              snapSlot;
+   /* In data, after the contact */
+   const char                       *callId;
+   char                             contact[];
+};
+
+/**
+ * @brief An AOR and its bindings
+ */
+struct _es_registrar_aor_s {
+   /* Next of the bucket */
+   struct _es_registrar_aor_s       *next;
+   uint32_t                         hash;
+   unsigned int                     count;
+   struct _es_registrar_binding_s   *bindings;
+   char                             name[];
+};
+
+struct _es_registrar_shard_s {
+   pthread_mutex_t                  lock;
+   struct _es_registrar_aor_s       **buckets;
+   unsigned int                     mask;
+   unsigned int                     aors;
+   unsigned int                     bindings;
+   /* Expiry of the bindings of the shard */
+   es_wheel_t                       *wheel;
+} __attribute__((aligned(ES_REGISTRAR_CACHE_LINE)));
+
+struct es_registrar_s {
+   uint32_t                         magic;
+   /* SIP loop */
+   struct event_base                *base;
+   struct event                     *tick;
+   /* Rows of "show registrations", NULL if none */
+   es_snap_t                        *snapCtx;
+   /* Changes, append NULL if none */
+   struct es_upgrade_journal_s      journal;
+   /* Settings, read by any thread */
+   unsigned int                     minExpires;
+   unsigned int                     maxExpires;
+   unsigned int                     defaultExpires;
+   /* Counters, read by the CLI, off the line of the settings each REGISTER reads */
+   uint64_t                         added __attribute__((aligned(ES_REGISTRAR_CACHE_LINE)));
+   uint64_t                         refreshed;
+   uint64_t                         removed;
+   uint64_t                         expired;
+   uint64_t                         rejected;
+   struct _es_registrar_shard_s     shards[ES_REGISTRAR_SHARDS];
+};
+
+/**
+ * @brief A Contact of a REGISTER
+ */
+struct _es_registrar_req_s {
+   char                             *uri;
+   unsigned int                     expires;
+};
+
+/**
+ * @brief Fields of an ES_UPGRADE_REC_REGISTRATION record
+ */
+enum _es_registrar_field_e {
+   ES_REGISTRAR_REC_AOR = 1,
+   ES_REGISTRAR_REC_CONTACT,
+   ES_REGISTRAR_REC_CALL_ID,
+   ES_REGISTRAR_REC_CSEQ,
+   ES_REGISTRAR_REC_EXPIRES,     /* Seconds left */
+   ES_REGISTRAR_REC_AGE_S
+};
+
+static inline uint64_t _es_registrar_now(void)
+{
+   return es_hist_now() / 1000000000ULL;
+}
+
+/* FNV-1a */
+static uint32_t _es_registrar_hash(const char *s)
+{
+   uint32_t h = 2166136261U;
+
+   while (*s != '\0') {
+      h ^= (uint8_t)*s++;
+      h *= 16777619U;
+   }
+
+   return h;
+}
+
+static inline struct _es_registrar_shard_s *_es_registrar_shard(struct es_registrar_s *pCtx, uint32_t hash)
+{
+   return &pCtx->shards[hash & (ES_REGISTRAR_SHARDS - 1)];
+}
+
+/* Low bits pick the shard, the next ones the bucket */
+static inline unsigned int _es_registrar_bucket(const struct _es_registrar_shard_s *shard, uint32_t hash)
+{
+   return (hash >> 6) & shard->mask;
+}
+
+static struct _es_registrar_aor_s *_es_registrar_find(struct _es_registrar_shard_s *shard, uint32_t hash, const char *name)
+{
+   struct _es_registrar_aor_s *aor = shard->buckets[_es_registrar_bucket(shard, hash)];
+
+   while ((aor != NULL) && ((aor->hash != hash) || (strcmp(aor->name, name) != 0))) {
+      aor = aor->next;
+   }
+
+   return aor;
+}
+
+static void _es_registrar_grow(struct _es_registrar_shard_s *shard)
+{
+   unsigned int size = (shard->mask + 1) * 2;
+   struct _es_registrar_aor_s **buckets = NULL;
+   unsigned int i = 0;
+
+   buckets = (struct _es_registrar_aor_s **) es_mem_calloc(ES_MEM_REGISTRAR, size, sizeof(*buckets));
+   if (buckets == NULL) {
+      /* Longer chains, still working */
+      return;
+   }
+
+   for (i = 0; i <= shard->mask; ++i) {
+      while (shard->buckets[i] != NULL) {
+         struct _es_registrar_aor_s *aor = shard->buckets[i];
+         unsigned int idx = (aor->hash >> 6) & (size - 1);
+
+         shard->buckets[i] = aor->next;
+         aor->next = buckets[idx];
+         buckets[idx] = aor;
+      }
+   }
+
+   es_mem_free(shard->buckets);
+   shard->buckets = buckets;
+   shard->mask = size - 1;
+}
+
+static struct _es_registrar_aor_s *_es_registrar_aor_new(struct _es_registrar_shard_s *shard, uint32_t hash, const char *name)
+{
+   size_t len = strlen(name) + 1;
+   struct _es_registrar_aor_s *aor = NULL;
+   unsigned int idx = 0;
+
+   aor = (struct _es_registrar_aor_s *) es_mem_malloc(ES_MEM_REGISTRAR, sizeof(struct _es_registrar_aor_s) + len);
+   if (aor == NULL) {
+      return NULL;
+   }
+
+   aor->hash = hash;
+   aor->count = 0;
+   aor->bindings = NULL;
+   memcpy(aor->name, name, len);
+
+   if (shard->aors > shard->mask) {
+      _es_registrar_grow(shard);
+   }
+
+   idx = _es_registrar_bucket(shard, hash);
+   aor->next = shard->buckets[idx];
+   shard->buckets[idx] = aor;
+   shard->aors++;
+
+   return aor;
+}
+
+/* Drop the AOR once it has no binding left */
+static void _es_registrar_aor_release(struct _es_registrar_shard_s *shard, struct _es_registrar_aor_s *aor)
+{
+   struct _es_registrar_aor_s **link = NULL;
+
+   if (aor->count != 0) {
+      return;
+   }
+
+   link = &shard->buckets[_es_registrar_bucket(shard, aor->hash)];
+   while ((*link != NULL) && (*link != aor)) {
+      link = &(*link)->next;
+   }
+
+   if (*link == aor) {
+      *link = aor->next;
+      shard->aors--;
+   }
+
+   es_mem_free(aor);
+}
+
+static struct _es_registrar_binding_s *_es_registrar_binding_find(struct _es_registrar_aor_s *aor, const char *contact)
+{
+   struct _es_registrar_binding_s *b = (aor != NULL) ? aor->bindings : NULL;
+
+   while ((b != NULL) && (strcmp(b->contact, contact) != 0)) {
+      b = b->next;
+   }
+
+   return b;
+}
+
+static void _es_registrar_snap_refresh(const void *obj, struct es_snap_row_s *row)
+{
+   const struct _es_registrar_binding_s *b = (const struct _es_registrar_binding_s *)obj;
+   uint64_t now = _es_registrar_now();
+
+   snprintf(row->state, sizeof(row->state), "%lus left",
+            (unsigned long)((b->timer.expire > now) ? (b->timer.expire - now) : 0));
+}
+
+static es_status _es_registrar_binding_rec(const struct _es_registrar_binding_s *b, struct es_upgrade_buf_s *rec,
+                                           uint64_t now, uint64_t nowNs)
+{
+   es_status ret = ES_OK;
+
+   rec->len = 0;
+   ret |= es_upgrade_buf_put_str(rec, ES_REGISTRAR_REC_AOR, b->aor->name);
+   ret |= es_upgrade_buf_put_str(rec, ES_REGISTRAR_REC_CONTACT, b->contact);
+   ret |= es_upgrade_buf_put_str(rec, ES_REGISTRAR_REC_CALL_ID, b->callId);
+   ret |= es_upgrade_buf_put_u32(rec, ES_REGISTRAR_REC_CSEQ, b->cseq);
+   ret |= es_upgrade_buf_put_u32(rec, ES_REGISTRAR_REC_EXPIRES,
+                                 (b->timer.expire > now) ? (uint32_t)(b->timer.expire - now) : 0);
+   ret |= es_upgrade_buf_put_u32(rec, ES_REGISTRAR_REC_AGE_S,
+                                 (nowNs > b->since) ? (uint32_t)((nowNs - b->since) / 1000000000ULL) : 0);
+
+   return (ret == ES_OK) ? ES_OK : ES_ERROR_OUTOFRESOURCES;
+}
+
+/* A binding added or refreshed, or removed */
+static void _es_registrar_journal(struct es_registrar_s *pCtx, const struct _es_registrar_binding_s *b, int removed)
+{
+   struct es_upgrade_buf_s rec;
+   es_status ret = ES_OK;
+
+   if (pCtx->journal.append == NULL) {
+      return;
+   }
+
+   memset(&rec, 0, sizeof(rec));
+
+   if (removed) {
+      ret |= es_upgrade_buf_put_str(&rec, ES_REGISTRAR_REC_AOR, b->aor->name);
+      ret |= es_upgrade_buf_put_str(&rec, ES_REGISTRAR_REC_CONTACT, b->contact);
+   } else {
+      ret = _es_registrar_binding_rec(b, &rec, _es_registrar_now(), es_hist_now());
+   }
+
+   if (ret == ES_OK) {
+      pCtx->journal.append(pCtx->journal.arg, removed ? ES_UPGRADE_REC_UNREGISTRATION : ES_UPGRADE_REC_REGISTRATION,
+                           rec.data, rec.len);
+   }
+
+   es_upgrade_buf_free(&rec);
+}
+
+/* A binding not linked yet: allocated before anything changes */
+static struct _es_registrar_binding_s *_es_registrar_binding_new(const char *contact, const char *callId, uint32_t cseq,
+                                                                 uint64_t since)
+{
+   size_t contactLen = strlen(contact) + 1;
+   size_t callIdLen = strlen(callId) + 1;
+   struct _es_registrar_binding_s *b = NULL;
+
+   b = (struct _es_registrar_binding_s *) es_mem_malloc(ES_MEM_REGISTRAR,
+                                                        sizeof(struct _es_registrar_binding_s) + contactLen + callIdLen);
+   if (b == NULL) {
+      return NULL;
+   }
+
+   memset(b, 0, sizeof(struct _es_registrar_binding_s));
+   memcpy(b->contact, contact, contactLen);
+   memcpy(b->contact + contactLen, callId, callIdLen);
+   b->callId = b->contact + contactLen;
+   b->cseq = cseq;
+   b->since = since;
+   b->snapSlot = -1;
+
+   return b;
+}
+
+static void _es_registrar_bind(struct es_registrar_s *pCtx, struct _es_registrar_shard_s *shard,
+                               struct _es_registrar_aor_s *aor, struct _es_registrar_binding_s *b, uint64_t expire)
+{
+   b->aor = aor;
+   b->next = aor->bindings;
+   aor->bindings = b;
+   aor->count++;
+   shard->bindings++;
+
+   es_wheel_add(shard->wheel, &b->timer, expire);
+
+   if (pCtx->snapCtx != NULL) {
+      struct es_snap_row_s row;
+
+      memset(&row, 0, sizeof(row));
+      row.since = b->since;
+      snprintf(row.type, sizeof(row.type), "REG");
+      snprintf(row.callId, sizeof(row.callId), "%s", b->callId);
+      snprintf(row.local, sizeof(row.local), "%s", aor->name);
+      snprintf(row.remote, sizeof(row.remote), "%s", b->contact);
+      _es_registrar_snap_refresh(b, &row);
+
+      if (es_snap_add(pCtx->snapCtx, ES_SNAP_REGISTRATIONS, b, &row, &b->snapSlot) != ES_OK) {
+         b->snapSlot = -1;
+      }
+   }
+}
+
+/* The AOR is left, even empty */
+static void _es_registrar_unbind(struct es_registrar_s *pCtx, struct _es_registrar_shard_s *shard,
+                                 struct _es_registrar_binding_s *b)
+{
+   struct _es_registrar_binding_s **link = &b->aor->bindings;
+
+   while ((*link != NULL) && (*link != b)) {
+      link = &(*link)->next;
+   }
+
+   if (*link == b) {
+      *link = b->next;
+      b->aor->count--;
+      shard->bindings--;
+   }
+
+   es_wheel_remove(shard->wheel, &b->timer);
+
+   if ((pCtx->snapCtx != NULL) && (b->snapSlot >= 0)) {
+      es_snap_remove(pCtx->snapCtx, ES_SNAP_REGISTRATIONS, b->snapSlot);
+   }
+
+   es_mem_free(b);
+}
+
+static void _es_registrar_expire_cb(struct es_wheel_entry_s *entry, void *arg)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)arg;
+   struct _es_registrar_binding_s *b = (struct _es_registrar_binding_s *)entry;
+   struct _es_registrar_aor_s *aor = b->aor;
+   struct _es_registrar_shard_s *shard = _es_registrar_shard(_pCtx, aor->hash);
+
+   ESIP_TRACE(ESIP_LOG_DEBUG, "Binding %s of %s expired", b->contact, aor->name);
+
+   _es_registrar_unbind(_pCtx, shard, b);
+   _es_registrar_aor_release(shard, aor);
+   __atomic_add_fetch(&_pCtx->expired, 1, __ATOMIC_RELAXED);
+}
+
+static void _es_registrar_tick_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)arg;
+   uint64_t now = _es_registrar_now();
+   unsigned int i = 0;
+
+   for (i = 0; i < ES_REGISTRAR_SHARDS; ++i) {
+      pthread_mutex_lock(&_pCtx->shards[i].lock);
+      (void)es_wheel_advance(_pCtx->shards[i].wheel, now);
+      pthread_mutex_unlock(&_pCtx->shards[i].lock);
+   }
+}
+
+es_status es_registrar_init(es_registrar_t **ppCtx, struct event_base *pBase)
+{
+   struct es_registrar_s *_pCtx = NULL;
+   struct timeval tv = { ES_REGISTRAR_TICK_MS / 1000, (ES_REGISTRAR_TICK_MS % 1000) * 1000 };
+   uint64_t now = _es_registrar_now();
+   unsigned int i = 0;
+
+   if ((ppCtx == NULL) || (pBase == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   /* Aligned as its shards */
+   if (posix_memalign((void **)&_pCtx, ES_REGISTRAR_CACHE_LINE, sizeof(struct es_registrar_s)) != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create registrar: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   memset(_pCtx, 0, sizeof(struct es_registrar_s));
+
+   _pCtx->magic = ES_REGISTRAR_MAGIC;
+   _pCtx->base = pBase;
+   _pCtx->minExpires = 60;
+   _pCtx->maxExpires = 3600;
+   _pCtx->defaultExpires = 3600;
+
+   for (i = 0; i < ES_REGISTRAR_SHARDS; ++i) {
+      struct _es_registrar_shard_s *shard = &_pCtx->shards[i];
+
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->mask = ES_REGISTRAR_BUCKETS - 1;
+      shard->buckets = (struct _es_registrar_aor_s **) es_mem_calloc(ES_MEM_REGISTRAR, ES_REGISTRAR_BUCKETS,
+                                                                    sizeof(struct _es_registrar_aor_s *));
+      if ((shard->buckets == NULL) || (es_wheel_init(&shard->wheel, now, _es_registrar_expire_cb, _pCtx) != ES_OK)) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not create registrar tables: no more memory");
+         es_registrar_deinit(_pCtx);
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   /* Low priority: SIP messages first */
+   _pCtx->tick = event_new(pBase, -1, EV_PERSIST, _es_registrar_tick_cb, _pCtx);
+   if ((_pCtx->tick == NULL) || (event_priority_set(_pCtx->tick, 1) != 0) || (event_add(_pCtx->tick, &tv) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start registrar expiry tick");
+      es_registrar_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_registrar_deinit(es_registrar_t *pCtx)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   unsigned int i = 0;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_REGISTRAR_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (_pCtx->tick != NULL) {
+      event_free(_pCtx->tick);
+   }
+
+   for (i = 0; i < ES_REGISTRAR_SHARDS; ++i) {
+      struct _es_registrar_shard_s *shard = &_pCtx->shards[i];
+      unsigned int j = 0;
+
+      for (j = 0; (shard->buckets != NULL) && (j <= shard->mask); ++j) {
+         while (shard->buckets[j] != NULL) {
+            struct _es_registrar_aor_s *aor = shard->buckets[j];
+
+            while (aor->bindings != NULL) {
+               _es_registrar_unbind(_pCtx, shard, aor->bindings);
+            }
+            _es_registrar_aor_release(shard, aor);
+         }
+      }
+
+      if (shard->wheel != NULL) {
+         es_wheel_deinit(shard->wheel);
+      }
+      es_mem_free(shard->buckets);
+      pthread_mutex_destroy(&shard->lock);
+   }
+
+   _pCtx->magic = 0;
+   free(_pCtx);
+
+   es_mem_report_leaks(1U << ES_MEM_REGISTRAR);
+
+   return ES_OK;
+}
+
+es_status es_registrar_configure(es_registrar_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   unsigned int max = 0;
+
+   if ((_pCtx == NULL) || (pCfg == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_REGISTRAR_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   max = pCfg->registrarMaxExpires;
+   __atomic_store_n(&_pCtx->maxExpires, max, __ATOMIC_RELAXED);
+   __atomic_store_n(&_pCtx->minExpires, (pCfg->registrarMinExpires < max) ? pCfg->registrarMinExpires : max, __ATOMIC_RELAXED);
+   __atomic_store_n(&_pCtx->defaultExpires, (pCfg->registrarDefaultExpires < max) ? pCfg->registrarDefaultExpires : max,
+                    __ATOMIC_RELAXED);
+
+   return ES_OK;
+}
+
+es_status es_registrar_set_snap(es_registrar_t *pCtx, es_snap_t *pSnap)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_REGISTRAR_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   /* Bindings already there are not published */
+   _pCtx->snapCtx = pSnap;
+   if (pSnap != NULL) {
+      es_snap_set_refresh(pSnap, ES_SNAP_REGISTRATIONS, _es_registrar_snap_refresh);
+   }
+
+   return ES_OK;
+}
+
+es_status es_registrar_set_journal(es_registrar_t *pCtx, const struct es_upgrade_journal_s *pJournal)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+
+   if (_pCtx == NULL) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_REGISTRAR_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (pJournal != NULL) {
+      _pCtx->journal = *pJournal;
+   } else {
+      memset(&_pCtx->journal, 0, sizeof(_pCtx->journal));
+   }
+
+   return ES_OK;
+}
+
+es_status es_registrar_aor(const struct osip_uri *uri, char *aor, size_t size)
+{
+   size_t len = 0;
+   const char *p = NULL;
+
+   if ((uri == NULL) || (uri->host == NULL) || (aor == NULL) || (size == 0)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   if ((uri->username != NULL) && (uri->username[0] != '\0')) {
+      len = (size_t)snprintf(aor, size, "%s@", uri->username);
+      if (len >= size) {
+         return ES_ERROR_OUTOFRANGE;
+      }
+   }
+
+   /* Host names are not case sensitive, users are */
+   for (p = uri->host; (*p != '\0') && (len < size - 1); ++p) {
+      aor[len++] = (char)tolower((unsigned char)*p);
+   }
+   aor[len] = '\0';
+
+   if (*p != '\0') {
+      return ES_ERROR_OUTOFRANGE;
+   }
+
+   if ((uri->port != NULL) && (uri->port[0] != '\0')) {
+      if ((size_t)snprintf(aor + len, size - len, ":%s", uri->port) >= size - len) {
+         return ES_ERROR_OUTOFRANGE;
+      }
+   }
+
+   return ES_OK;
+}
+
+/* Under the shard lock: all the contacts or none */
+static int _es_registrar_apply(struct es_registrar_s *pCtx, struct _es_registrar_shard_s *shard, uint32_t hash,
+                               const char *name, const char *callId, uint32_t cseq,
+                               const struct _es_registrar_req_s *req, unsigned int nb, int wildcard)
+{
+   struct _es_registrar_binding_s *fresh[ES_REGISTRAR_MAX_CONTACTS];
+   struct _es_registrar_aor_s *aor = _es_registrar_find(shard, hash, name);
+   uint64_t now = _es_registrar_now();
+   uint64_t since = es_hist_now();
+   unsigned int count = (aor != NULL) ? aor->count : 0;
+   unsigned int i = 0;
+   unsigned int j = 0;
+   int again = 0;
+
+   /* Out of order: an older request of the same Call-ID. The same CSeq is
+    * a retransmission, already applied: answered with the bindings as they are */
+   if (wildcard) {
+      struct _es_registrar_binding_s *b = NULL;
+
+      for (b = (aor != NULL) ? aor->bindings : NULL; b != NULL; b = b->next) {
+         if ((strcmp(b->callId, callId) == 0) && (cseq < b->cseq)) {
+            return SIP_INTERNAL_SERVER_ERROR;
+         }
+         again |= (strcmp(b->callId, callId) == 0) && (cseq == b->cseq);
+      }
+
+      if (again) {
+         return SIP_OK;
+      }
+
+      while ((aor != NULL) && (aor->bindings != NULL)) {
+         _es_registrar_journal(pCtx, aor->bindings, 1);
+         _es_registrar_unbind(pCtx, shard, aor->bindings);
+         __atomic_add_fetch(&pCtx->removed, 1, __ATOMIC_RELAXED);
+      }
+
+      if (aor != NULL) {
+         _es_registrar_aor_release(shard, aor);
+      }
+      return SIP_OK;
+   }
+
+   for (i = 0; i < nb; ++i) {
+      struct _es_registrar_binding_s *b = _es_registrar_binding_find(aor, req[i].uri);
+
+      if ((b != NULL) && (strcmp(b->callId, callId) == 0) && (cseq < b->cseq)) {
+         return SIP_INTERNAL_SERVER_ERROR;
+      }
+      again |= (b != NULL) && (strcmp(b->callId, callId) == 0) && (cseq == b->cseq);
+
+      if ((b == NULL) && (req[i].expires != 0)) {
+         count++;
+      } else if ((b != NULL) && (req[i].expires == 0)) {
+         count--;
+      }
+   }
+
+   if (again) {
+      return SIP_OK;
+   }
+
+   if (count > ES_REGISTRAR_MAX_CONTACTS) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Too many bindings for %s", name);
+      return SIP_FORBIDDEN;
+   }
+
+   if ((aor == NULL) && (count != 0)) {
+      aor = _es_registrar_aor_new(shard, hash, name);
+      if (aor == NULL) {
+         return SIP_INTERNAL_SERVER_ERROR;
+      }
+   }
+
+   /* The new bindings allocated first: past this point nothing fails. A
+      contact given twice may need one after its first removed it */
+   for (i = 0; i < nb; ++i) {
+      struct _es_registrar_binding_s *b = _es_registrar_binding_find(aor, req[i].uri);
+
+      for (j = 0; (j < i) && (strcmp(req[j].uri, req[i].uri) != 0); ++j) {
+      }
+
+      fresh[i] = NULL;
+      if ((aor == NULL) || (req[i].expires == 0) || ((b != NULL) && (strcmp(b->callId, callId) == 0) && (j == i))) {
+         continue;
+      }
+
+      fresh[i] = _es_registrar_binding_new(req[i].uri, callId, cseq, since);
+      if (fresh[i] == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Bindings of %s not updated: no more memory", name);
+         while (i-- > 0) {
+            es_mem_free(fresh[i]);
+         }
+         _es_registrar_aor_release(shard, aor);
+         return SIP_INTERNAL_SERVER_ERROR;
+      }
+   }
+
+   for (i = 0; (aor != NULL) && (i < nb); ++i) {
+      struct _es_registrar_binding_s *b = _es_registrar_binding_find(aor, req[i].uri);
+
+      if (req[i].expires == 0) {
+         if (b != NULL) {
+            _es_registrar_journal(pCtx, b, 1);
+            _es_registrar_unbind(pCtx, shard, b);
+            __atomic_add_fetch(&pCtx->removed, 1, __ATOMIC_RELAXED);
+         }
+         continue;
+      }
+
+      /* Refresh: the binding stays where it is, only its timer moves */
+      if ((b != NULL) && (strcmp(b->callId, callId) == 0)) {
+         es_mem_free(fresh[i]);
+         b->cseq = cseq;
+         es_wheel_add(shard->wheel, &b->timer, now + req[i].expires);
+         _es_registrar_journal(pCtx, b, 0);
+         __atomic_add_fetch(&pCtx->refreshed, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      /* Another Call-ID: the UA restarted, the binding is new */
+      if (b != NULL) {
+         _es_registrar_journal(pCtx, b, 1);
+         _es_registrar_unbind(pCtx, shard, b);
+      }
+
+      b = fresh[i];
+      _es_registrar_bind(pCtx, shard, aor, b, now + req[i].expires);
+      _es_registrar_journal(pCtx, b, 0);
+      __atomic_add_fetch(&pCtx->added, 1, __ATOMIC_RELAXED);
+   }
+
+   if (aor != NULL) {
+      _es_registrar_aor_release(shard, aor);
+   }
+
+   return SIP_OK;
+}
+
+int es_registrar_update(es_registrar_t *pCtx, struct osip_message *request)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   struct _es_registrar_req_s req[ES_REGISTRAR_MAX_CONTACTS];
+   struct _es_registrar_shard_s *shard = NULL;
+   char name[ES_REGISTRAR_AOR_LEN];
+   char callId[ES_REGISTRAR_CALLID_LEN];
+   osip_header_t *expiresHdr = NULL;
+   unsigned int expires = 0;
+   unsigned int minExpires = 0;
+   unsigned int maxExpires = 0;
+   unsigned int nb = 0;
+   unsigned int i = 0;
+   uint32_t hash = 0;
+   int wildcard = 0;
+   int code = SIP_OK;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_REGISTRAR_MAGIC) || (request == NULL)) {
+      return SIP_INTERNAL_SERVER_ERROR;
+   }
+
+   if ((request->to == NULL) || (es_registrar_aor(request->to->url, name, sizeof(name)) != ES_OK) ||
+       (request->call_id == NULL) || (request->call_id->number == NULL) ||
+       (request->cseq == NULL) || (request->cseq->number == NULL)) {
+      __atomic_add_fetch(&_pCtx->rejected, 1, __ATOMIC_RELAXED);
+      return SIP_BAD_REQUEST;
+   }
+
+   snprintf(callId, sizeof(callId), "%s%s%s", request->call_id->number,
+            (request->call_id->host != NULL) ? "@" : "",
+            (request->call_id->host != NULL) ? request->call_id->host : "");
+
+   minExpires = __atomic_load_n(&_pCtx->minExpires, __ATOMIC_RELAXED);
+   maxExpires = __atomic_load_n(&_pCtx->maxExpires, __ATOMIC_RELAXED);
+   expires = __atomic_load_n(&_pCtx->defaultExpires, __ATOMIC_RELAXED);
+   if ((osip_message_get_expires(request, 0, &expiresHdr) >= 0) && (expiresHdr != NULL) && (expiresHdr->hvalue != NULL)) {
+      expires = (unsigned int)strtoul(expiresHdr->hvalue, NULL, 10);
+   }
+
+   memset(req, 0, sizeof(req));
+
+   for (i = 0; (code == SIP_OK) && !osip_list_eol(&request->contacts, i); ++i) {
+      osip_contact_t *contact = (osip_contact_t *)osip_list_get(&request->contacts, i);
+      osip_generic_param_t *param = NULL;
+
+      /* "Contact: *" removes them all, alone and with Expires: 0 */
+      if ((contact->displayname != NULL) && (strcmp(contact->displayname, "*") == 0)) {
+         wildcard = 1;
+         if ((i != 0) || !osip_list_eol(&request->contacts, 1) || (expiresHdr == NULL) || (expires != 0)) {
+            code = SIP_BAD_REQUEST;
+         }
+         break;
+      }
+
+      if (nb == ES_REGISTRAR_MAX_CONTACTS) {
+         code = SIP_FORBIDDEN;
+         break;
+      }
+
+      if ((contact->url == NULL) || (osip_uri_to_str(contact->url, &req[nb].uri) != OSIP_SUCCESS)) {
+         code = SIP_BAD_REQUEST;
+         break;
+      }
+
+      req[nb].expires = expires;
+      if ((osip_contact_param_get_byname(contact, "expires", &param) >= 0) && (param != NULL) && (param->gvalue != NULL)) {
+         req[nb].expires = (unsigned int)strtoul(param->gvalue, NULL, 10);
+      }
+      nb++;
+
+      if (strlen(req[nb - 1].uri) >= ES_REGISTRAR_URI_LEN) {
+         code = SIP_BAD_REQUEST;
+      } else if ((req[nb - 1].expires != 0) && (req[nb - 1].expires < minExpires)) {
+         code = SIP_INTERVAL_TOO_BRIEF;
+      } else if (req[nb - 1].expires > maxExpires) {
+         req[nb - 1].expires = maxExpires;
+      }
+   }
+
+   /* No contact: a query, the response gives the bindings */
+   if ((code == SIP_OK) && ((nb != 0) || wildcard)) {
+      hash = _es_registrar_hash(name);
+      shard = _es_registrar_shard(_pCtx, hash);
+
+      pthread_mutex_lock(&shard->lock);
+      code = _es_registrar_apply(_pCtx, shard, hash, name, callId, (uint32_t)strtoul(request->cseq->number, NULL, 10),
+                                 req, nb, wildcard);
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   for (i = 0; i < nb; ++i) {
+      osip_free(req[i].uri);
+   }
+
+   if (code != SIP_OK) {
+      __atomic_add_fetch(&_pCtx->rejected, 1, __ATOMIC_RELAXED);
+   }
+
+   return code;
+}
+
+es_status es_registrar_answer(es_registrar_t *pCtx, struct osip_message *request, struct osip_message *response)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   struct es_registrar_contact_s contacts[ES_REGISTRAR_MAX_CONTACTS];
+   char name[ES_REGISTRAR_AOR_LEN];
+   char buf[ES_REGISTRAR_URI_LEN + 32];
+   unsigned int nb = 0;
+   unsigned int i = 0;
+
+   if ((_pCtx == NULL) || (request == NULL) || (response == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_REGISTRAR_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if (response->status_code == SIP_INTERVAL_TOO_BRIEF) {
+      snprintf(buf, sizeof(buf), "%u", __atomic_load_n(&_pCtx->minExpires, __ATOMIC_RELAXED));
+      return (osip_message_set_header(response, "Min-Expires", buf) == OSIP_SUCCESS) ? ES_OK : ES_ERROR_OUTOFRESOURCES;
+   }
+
+   if (!MSG_IS_STATUS_2XX(response) || (request->to == NULL) ||
+       (es_registrar_aor(request->to->url, name, sizeof(name)) != ES_OK)) {
+      return ES_OK;
+   }
+
+   nb = es_registrar_lookup(_pCtx, name, contacts, ES_REGISTRAR_MAX_CONTACTS);
+   for (i = 0; i < nb; ++i) {
+      snprintf(buf, sizeof(buf), "<%s>;expires=%u", contacts[i].uri, contacts[i].expires);
+      if (osip_message_set_contact(response, buf) != OSIP_SUCCESS) {
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   return ES_OK;
+}
+
+unsigned int es_registrar_lookup(es_registrar_t *pCtx, const char *aor, struct es_registrar_contact_s *contacts,
+                                 unsigned int max)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   struct _es_registrar_shard_s *shard = NULL;
+   struct _es_registrar_aor_s *obj = NULL;
+   struct _es_registrar_binding_s *b = NULL;
+   uint64_t now = _es_registrar_now();
+   unsigned int nb = 0;
+   uint32_t hash = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_REGISTRAR_MAGIC) || (aor == NULL) || (contacts == NULL)) {
+      return 0;
+   }
+
+   hash = _es_registrar_hash(aor);
+   shard = _es_registrar_shard(_pCtx, hash);
+
+   pthread_mutex_lock(&shard->lock);
+
+   obj = _es_registrar_find(shard, hash, aor);
+   for (b = (obj != NULL) ? obj->bindings : NULL; (b != NULL) && (nb < max); b = b->next) {
+      snprintf(contacts[nb].uri, sizeof(contacts[nb].uri), "%s", b->contact);
+      contacts[nb].expires = (b->timer.expire > now) ? (unsigned int)(b->timer.expire - now) : 0;
+      nb++;
+   }
+
+   pthread_mutex_unlock(&shard->lock);
+
+   return nb;
+}
+
+es_status es_registrar_save(es_registrar_t *pCtx, struct es_upgrade_buf_s *state)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   struct es_upgrade_buf_s rec;
+   uint64_t now = _es_registrar_now();
+   uint64_t nowNs = es_hist_now();
+   unsigned int saved = 0;
+   es_status ret = ES_OK;
+   unsigned int i = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_REGISTRAR_MAGIC) || (state == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   memset(&rec, 0, sizeof(rec));
+
+   for (i = 0; (ret == ES_OK) && (i < ES_REGISTRAR_SHARDS); ++i) {
+      struct _es_registrar_shard_s *shard = &_pCtx->shards[i];
+      unsigned int j = 0;
+
+      pthread_mutex_lock(&shard->lock);
+
+      for (j = 0; (ret == ES_OK) && (j <= shard->mask); ++j) {
+         struct _es_registrar_aor_s *aor = NULL;
+
+         for (aor = shard->buckets[j]; (ret == ES_OK) && (aor != NULL); aor = aor->next) {
+            struct _es_registrar_binding_s *b = NULL;
+
+            for (b = aor->bindings; (ret == ES_OK) && (b != NULL); b = b->next) {
+               ret = _es_registrar_binding_rec(b, &rec, now, nowNs);
+               if (ret == ES_OK) {
+                  ret = es_upgrade_buf_put(state, ES_UPGRADE_REC_REGISTRATION, rec.data, rec.len);
+               }
+               saved++;
+            }
+         }
+      }
+
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   es_upgrade_buf_free(&rec);
+
+   if (ret != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Registrations not saved: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "%u registration(s) saved", saved);
+   return ES_OK;
+}
+
+static es_status _es_registrar_restore_one(struct es_registrar_s *pCtx, uint16_t type, const uint8_t *data, size_t len,
+                                           uint64_t now, uint64_t nowNs, unsigned int elapsed)
+{
+   struct es_upgrade_tlv_s tlv;
+   struct _es_registrar_shard_s *shard = NULL;
+   struct _es_registrar_aor_s *aor = NULL;
+   struct _es_registrar_binding_s *b = NULL;
+   const char *name = NULL;
+   const char *contact = NULL;
+   const char *callId = NULL;
+   uint32_t cseq = 0;
+   uint32_t expires = 0;
+   uint64_t age = 0;
+   uint32_t hash = 0;
+   size_t offset = 0;
+   es_status ret = ES_OK;
+   int rc = 0;
+
+   while ((rc = es_upgrade_tlv_next(data, len, &offset, &tlv)) > 0) {
+      switch (tlv.type) {
+      case ES_REGISTRAR_REC_AOR:
+         name = es_upgrade_tlv_str(&tlv);
+         break;
+      case ES_REGISTRAR_REC_CONTACT:
+         contact = es_upgrade_tlv_str(&tlv);
+         break;
+      case ES_REGISTRAR_REC_CALL_ID:
+         callId = es_upgrade_tlv_str(&tlv);
+         break;
+      case ES_REGISTRAR_REC_CSEQ:
+         cseq = es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_REGISTRAR_REC_EXPIRES:
+         expires = es_upgrade_tlv_u32(&tlv);
+         break;
+      case ES_REGISTRAR_REC_AGE_S:
+         age = (uint64_t)es_upgrade_tlv_u32(&tlv) * 1000000000ULL;
+         break;
+      default:
+         /* Field of a later version */
+         break;
+      }
+   }
+
+   if ((rc < 0) || (name == NULL) || (contact == NULL) ||
+       ((type == ES_UPGRADE_REC_REGISTRATION) && (callId == NULL)) ||
+       (strlen(name) >= ES_REGISTRAR_AOR_LEN) || (strlen(contact) >= ES_REGISTRAR_URI_LEN)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* Time passed since it was written */
+   expires = (expires > elapsed) ? expires - elapsed : 0;
+   age += (uint64_t)elapsed * 1000000000ULL;
+
+   hash = _es_registrar_hash(name);
+   shard = _es_registrar_shard(pCtx, hash);
+
+   pthread_mutex_lock(&shard->lock);
+
+   aor = _es_registrar_find(shard, hash, name);
+   if ((aor == NULL) && (type == ES_UPGRADE_REC_REGISTRATION) && (expires != 0)) {
+      aor = _es_registrar_aor_new(shard, hash, name);
+      if (aor == NULL) {
+         ret = ES_ERROR_OUTOFRESOURCES;
+      }
+   }
+
+   if (aor != NULL) {
+      if ((b = _es_registrar_binding_find(aor, contact)) != NULL) {
+         _es_registrar_unbind(pCtx, shard, b);
+      }
+
+      /* Removed, or expired since */
+      if ((type != ES_UPGRADE_REC_REGISTRATION) || (expires == 0)) {
+         /* Nothing to add */
+      } else if ((aor->count >= ES_REGISTRAR_MAX_CONTACTS) ||
+                 ((b = _es_registrar_binding_new(contact, callId, cseq, (nowNs > age) ? (nowNs - age) : 0)) == NULL)) {
+         ret = ES_ERROR_OUTOFRESOURCES;
+      } else {
+         _es_registrar_bind(pCtx, shard, aor, b, now + expires);
+      }
+      _es_registrar_aor_release(shard, aor);
+   }
+
+   pthread_mutex_unlock(&shard->lock);
+
+   return ret;
+}
+
+es_status es_registrar_restore(es_registrar_t *pCtx, const uint8_t *data, size_t len, unsigned int elapsed)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+   struct es_upgrade_tlv_s tlv;
+   uint64_t now = _es_registrar_now();
+   uint64_t nowNs = es_hist_now();
+   unsigned int restored = 0;
+   unsigned int failed = 0;
+   size_t offset = 0;
+   int rc = 0;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_REGISTRAR_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   while ((rc = es_upgrade_tlv_next(data, len, &offset, &tlv)) > 0) {
+      /* Records of other modules are theirs */
+      if ((tlv.type != ES_UPGRADE_REC_REGISTRATION) && (tlv.type != ES_UPGRADE_REC_UNREGISTRATION)) {
+         continue;
+      }
+
+      if (_es_registrar_restore_one(_pCtx, tlv.type, tlv.value, tlv.len, now, nowNs, elapsed) == ES_OK) {
+         restored++;
+      } else {
+         failed++;
+      }
+   }
+
+   ESIP_TRACE(ESIP_LOG_INFO, "%u registration(s) restored, %u failed", restored, failed);
+
+   return ((rc < 0) || (failed != 0)) ? ES_ERROR_BADPARAM : ES_OK;
+}
+
+static int _es_registrar_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)arg;
+   unsigned int aors = 0;
+   unsigned int bindings = 0;
+   unsigned int buckets = 0;
+   unsigned int busiest = 0;
+   unsigned int i = 0;
+
+   if (argc > 1) {
+      es_cli_print(pCli, "Usage: show registrar [aor]");
+      return CLI_ERROR;
+   }
+
+   /* Bindings of one AOR */
+   if (argc == 1) {
+      struct es_registrar_contact_s contacts[ES_REGISTRAR_MAX_CONTACTS];
+      unsigned int nb = es_registrar_lookup(_pCtx, argv[0], contacts, ES_REGISTRAR_MAX_CONTACTS);
+
+      es_cli_print(pCli, "%u binding(s) for %s", nb, argv[0]);
+      for (i = 0; i < nb; ++i) {
+         es_cli_print(pCli, "  %-64s expires in %us", contacts[i].uri, contacts[i].expires);
+      }
+      return CLI_OK;
+   }
+
+   for (i = 0; i < ES_REGISTRAR_SHARDS; ++i) {
+      struct _es_registrar_shard_s *shard = &_pCtx->shards[i];
+
+      pthread_mutex_lock(&shard->lock);
+      aors += shard->aors;
+      bindings += shard->bindings;
+      buckets += shard->mask + 1;
+      if (shard->bindings > busiest) {
+         busiest = shard->bindings;
+      }
+      pthread_mutex_unlock(&shard->lock);
+   }
+
+   es_cli_print(pCli, "AORs %u, bindings %u (%u shards, %u buckets, busiest shard %u bindings)",
+                aors, bindings, ES_REGISTRAR_SHARDS, buckets, busiest);
+   es_cli_print(pCli, "Expires min %us, default %us, max %us",
+                __atomic_load_n(&_pCtx->minExpires, __ATOMIC_RELAXED),
+                __atomic_load_n(&_pCtx->defaultExpires, __ATOMIC_RELAXED),
+                __atomic_load_n(&_pCtx->maxExpires, __ATOMIC_RELAXED));
+   es_cli_print(pCli, "%12s %12s %12s %12s %12s", "added", "refreshed", "removed", "expired", "rejected");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->added, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->refreshed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->removed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->expired, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->rejected, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_registrar_cli_register(es_registrar_t *pCtx, es_cli_t *pCli)
+{
+   struct es_registrar_s *_pCtx = (struct es_registrar_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_REGISTRAR_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show registrar", "Show the registrar, or the bindings of an AOR [aor]",
+                              _es_registrar_cli_show, _pCtx);
+}
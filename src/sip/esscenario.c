@@ -0,0 +1,650 @@
+/*
+ * This file is part of esip.
+ *
+ * esip is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * esip is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with esip.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include <event2/event.h>
+
+#include <osip2/osip.h>
+
+#include <libcli.h>
+
+#include "eserror.h"
+#include "log.h"
+#include "escli.h"
+#include "eshist.h"
+#include "esmem.h"
+#include "eswheel.h"
+#include "esconfig.h"
+#include "esscenario.h"
+
+#define ES_SCENARIO_MAGIC        0x20141123
+
+#define ES_SCENARIO_METHOD_LEN   16
+#define ES_SCENARIO_PREFIX_LEN   32
+
+/** Steps of a line */
+#define ES_SCENARIO_MAX_STEPS    32
+
+/** Tick of the delays (ms) */
+#define ES_SCENARIO_TICK_MS      10
+
+/** Longest delay of a step (ms), an hour */
+#define ES_SCENARIO_MAX_DELAY    3600000U
+
+/** Chances are in basis points */
+#define ES_SCENARIO_ALWAYS       10000
+
+/**
+ * @brief A response of a scenario, 8 bytes
+ */
+struct _es_scenario_step_s {
+   uint16_t                  code;
+   /* Basis points, ES_SCENARIO_ALWAYS if not drawn */
+   uint16_t                  chance;
+   /* Ticks after the previous response */
+   uint32_t                  delay;
+};
+
+/**
+ * @brief A line: the requests it answers and its steps
+ */
+struct _es_scenario_line_s {
+   /* Empty for any method */
+   char                      method[ES_SCENARIO_METHOD_LEN];
+   char                      prefix[ES_SCENARIO_PREFIX_LEN];
+   unsigned int              prefixLen;
+   uint32_t                  first;
+   uint32_t                  nbSteps;
+};
+
+/**
+ * @brief Scenarios of a file, the steps of all lines in one array
+ * Lines of a method come first, longest prefix first.
+ */
+struct _es_scenario_table_s {
+   /* The context and each running scenario */
+   unsigned int              refs;
+   struct _es_scenario_line_s *lines;
+   unsigned int              nbLines;
+   struct _es_scenario_step_s *steps;
+   unsigned int              nbSteps;
+};
+
+/**
+ * @brief A running scenario
+ */
+struct _es_scenario_call_s {
+   /* First: the wheel gives it back */
+   struct es_wheel_entry_s   timer;
+   /* Running scenarios, freed on deinit */
+   struct _es_scenario_call_s *prev;
+   struct _es_scenario_call_s *next;
+   struct _es_scenario_table_s *table;
+   osip_transaction_t        *tr;
+   /* Next step, and the end of the line */
+   uint32_t                  step;
+   uint32_t                  end;
+};
+
+struct es_scenario_s {
+   /* Magic */
+   uint32_t                  magic;
+   struct es_scenario_stack_s stack;
+   /* Delays, the tick only runs while some are pending */
+   struct event              *tick;
+   es_wheel_t                *wheel;
+   /* NULL if none */
+   struct _es_scenario_table_s *table;
+   struct _es_scenario_call_s *calls;
+   /* Chances drawn, xorshift */
+   uint64_t                  rnd;
+   /* Counters, read by the CLI */
+   unsigned int              nbLines;
+   unsigned int              nbSteps;
+   unsigned int              running;
+   uint64_t                  started;
+   uint64_t                  unmatched;
+   uint64_t                  sent;
+   uint64_t                  skipped;
+   uint64_t                  delayed;
+   uint64_t                  dropped;
+};
+
+/*******************************************************************************
+                              Tables
+ ******************************************************************************/
+
+static void _es_scenario_table_unref(struct _es_scenario_table_s *table)
+{
+   if ((table == NULL) || (--table->refs != 0)) {
+      return;
+   }
+
+   es_mem_free(table->lines);
+   es_mem_free(table->steps);
+   es_mem_free(table);
+}
+
+/* Method first, then the longest prefix */
+static int _es_scenario_line_cmp(const void *a, const void *b)
+{
+   const struct _es_scenario_line_s *la = (const struct _es_scenario_line_s *)a;
+   const struct _es_scenario_line_s *lb = (const struct _es_scenario_line_s *)b;
+
+   if ((la->method[0] == '\0') != (lb->method[0] == '\0')) {
+      return (la->method[0] == '\0') ? 1 : -1;
+   }
+
+   return (int)lb->prefixLen - (int)la->prefixLen;
+}
+
+/* code[@delay ms][%chance] */
+static es_status _es_scenario_step_parse(const char *token, struct _es_scenario_step_s *step)
+{
+   char *end = NULL;
+   unsigned long code = strtoul(token, &end, 10);
+
+   if ((end == token) || (code < 100) || (code > 699)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   step->code = (uint16_t)code;
+   step->chance = ES_SCENARIO_ALWAYS;
+   step->delay = 0;
+
+   while (*end != '\0') {
+      const char *p = end + 1;
+
+      if (*end == '@') {
+         unsigned long ms = strtoul(p, &end, 10);
+         if ((end == p) || (ms > ES_SCENARIO_MAX_DELAY)) {
+            return ES_ERROR_BADPARAM;
+         }
+         step->delay = (uint32_t)((ms + ES_SCENARIO_TICK_MS - 1) / ES_SCENARIO_TICK_MS);
+      } else if (*end == '%') {
+         double pct = strtod(p, &end);
+         if ((end == p) || (pct < 0.0) || (pct > 100.0)) {
+            return ES_ERROR_BADPARAM;
+         }
+         step->chance = (uint16_t)(pct * (ES_SCENARIO_ALWAYS / 100) + 0.5);
+      } else {
+         return ES_ERROR_BADPARAM;
+      }
+   }
+
+   return ES_OK;
+}
+
+/* One line: method, prefix, steps; the last one a final response always sent */
+static es_status _es_scenario_line_parse(char *line, struct _es_scenario_line_s *l,
+                                         struct _es_scenario_step_s *steps, unsigned int *pNbSteps)
+{
+   char *save = NULL;
+   char *method = strtok_r(line, " \t\r\n", &save);
+   char *prefix = strtok_r(NULL, " \t\r\n", &save);
+   char *token = NULL;
+   unsigned int nb = 0;
+
+   if ((prefix == NULL) || (strlen(method) >= ES_SCENARIO_METHOD_LEN) || (strlen(prefix) >= ES_SCENARIO_PREFIX_LEN)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   memset(l, 0, sizeof(*l));
+   if (strcmp(method, "*") != 0) {
+      strcpy(l->method, method);
+   }
+   if (strcmp(prefix, "*") != 0) {
+      strcpy(l->prefix, prefix);
+      l->prefixLen = (unsigned int)strlen(prefix);
+   }
+
+   while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      /* Nothing after a final response always sent */
+      if ((nb == ES_SCENARIO_MAX_STEPS) ||
+          ((nb > 0) && (steps[nb - 1].code >= 200) && (steps[nb - 1].chance == ES_SCENARIO_ALWAYS)) ||
+          (_es_scenario_step_parse(token, &steps[nb]) != ES_OK)) {
+         return ES_ERROR_BADPARAM;
+      }
+      nb++;
+   }
+
+   if ((nb == 0) || (steps[nb - 1].code < 200) || (steps[nb - 1].chance != ES_SCENARIO_ALWAYS)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   l->nbSteps = nb;
+   *pNbSteps = nb;
+   return ES_OK;
+}
+
+/**
+ * @brief Read a scenario file, compiled into a table
+ */
+static es_status _es_scenario_load(const char *path, struct _es_scenario_table_s **ppTable)
+{
+   struct _es_scenario_table_s *table = NULL;
+   struct _es_scenario_step_s steps[ES_SCENARIO_MAX_STEPS];
+   char line[1024];
+   unsigned int lines = 0;
+   unsigned int lineNb = 0;
+   unsigned int errors = 0;
+   FILE *f = NULL;
+
+   f = fopen(path, "r");
+   if (f == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not open scenarios %s: %s", path, strerror(errno));
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   while (fgets(line, sizeof(line), f) != NULL) {
+      lines++;
+   }
+   rewind(f);
+
+   table = (struct _es_scenario_table_s *) es_mem_calloc(ES_MEM_SCENARIO, 1, sizeof(struct _es_scenario_table_s));
+   if (table != NULL) {
+      table->refs = 1;
+      table->lines = (struct _es_scenario_line_s *) es_mem_calloc(ES_MEM_SCENARIO, lines + 1,
+                                                                  sizeof(struct _es_scenario_line_s));
+      table->steps = (struct _es_scenario_step_s *) es_mem_calloc(ES_MEM_SCENARIO, (lines + 1) * ES_SCENARIO_MAX_STEPS,
+                                                                  sizeof(struct _es_scenario_step_s));
+   }
+   if ((table == NULL) || (table->lines == NULL) || (table->steps == NULL)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not load scenarios: no more memory");
+      if (table != NULL) {
+         _es_scenario_table_unref(table);
+      }
+      fclose(f);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   while ((fgets(line, sizeof(line), f) != NULL) && (lineNb < lines)) {
+      struct _es_scenario_line_s *l = &table->lines[table->nbLines];
+      unsigned int nb = 0;
+      char *p = NULL;
+
+      lineNb++;
+
+      if ((p = strchr(line, '#')) != NULL) {
+         *p = '\0';
+      }
+
+      if (line[strspn(line, " \t\r\n")] == '\0') {
+         continue;
+      }
+
+      if (_es_scenario_line_parse(line, l, steps, &nb) != ES_OK) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "%s:%u: expected method, prefix and code[@ms][%%chance] steps ending "
+                    "with a final response", path, lineNb);
+         errors++;
+         continue;
+      }
+
+      l->first = table->nbSteps;
+      memcpy(&table->steps[table->nbSteps], steps, nb * sizeof(steps[0]));
+      table->nbSteps += nb;
+      table->nbLines++;
+   }
+
+   fclose(f);
+
+   if (errors != 0) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Scenarios %s not applied: %u error(s)", path, errors);
+      _es_scenario_table_unref(table);
+      return ES_ERROR_BADPARAM;
+   }
+
+   /* Steps packed, as many as used */
+   if (table->nbSteps != 0) {
+      struct _es_scenario_step_s *packed = (struct _es_scenario_step_s *) es_mem_malloc(ES_MEM_SCENARIO,
+                                            table->nbSteps * sizeof(struct _es_scenario_step_s));
+      if (packed == NULL) {
+         ESIP_TRACE(ESIP_LOG_ERROR, "Can not load scenarios: no more memory");
+         _es_scenario_table_unref(table);
+         return ES_ERROR_OUTOFRESOURCES;
+      }
+      memcpy(packed, table->steps, table->nbSteps * sizeof(struct _es_scenario_step_s));
+      es_mem_free(table->steps);
+      table->steps = packed;
+   }
+
+   qsort(table->lines, table->nbLines, sizeof(table->lines[0]), _es_scenario_line_cmp);
+
+   *ppTable = table;
+   return ES_OK;
+}
+
+static const struct _es_scenario_line_s *_es_scenario_match(const struct _es_scenario_table_s *table,
+                                                            const osip_message_t *request)
+{
+   const char *user = ((request->req_uri != NULL) && (request->req_uri->username != NULL)) ?
+                      request->req_uri->username : "";
+   size_t userLen = strlen(user);
+   unsigned int i = 0;
+
+   for (i = 0; i < table->nbLines; ++i) {
+      const struct _es_scenario_line_s *l = &table->lines[i];
+
+      if ((l->method[0] != '\0') && ((request->sip_method == NULL) || (strcmp(l->method, request->sip_method) != 0))) {
+         continue;
+      }
+
+      if ((l->prefixLen <= userLen) && (memcmp(l->prefix, user, l->prefixLen) == 0)) {
+         return l;
+      }
+   }
+
+   return NULL;
+}
+
+/*******************************************************************************
+                              Running scenarios
+ ******************************************************************************/
+
+static inline uint64_t _es_scenario_now(void)
+{
+   return es_hist_now() / (ES_SCENARIO_TICK_MS * 1000000ULL);
+}
+
+/* Basis points drawn */
+static unsigned int _es_scenario_draw(struct es_scenario_s *pCtx)
+{
+   pCtx->rnd ^= pCtx->rnd << 13;
+   pCtx->rnd ^= pCtx->rnd >> 7;
+   pCtx->rnd ^= pCtx->rnd << 17;
+
+   return (unsigned int)((pCtx->rnd >> 32) % ES_SCENARIO_ALWAYS);
+}
+
+static void _es_scenario_call_free(struct es_scenario_s *pCtx, struct _es_scenario_call_s *call)
+{
+   es_wheel_remove(pCtx->wheel, &call->timer);
+
+   if (call->prev != NULL) {
+      call->prev->next = call->next;
+   } else {
+      pCtx->calls = call->next;
+   }
+   if (call->next != NULL) {
+      call->next->prev = call->prev;
+   }
+
+   if (call->tr != NULL) {
+      osip_transaction_set_reserved3(call->tr, NULL);
+   }
+
+   _es_scenario_table_unref(call->table);
+   es_mem_free(call);
+   __atomic_sub_fetch(&pCtx->running, 1, __ATOMIC_RELAXED);
+}
+
+/* Steps from the current one, until a delay or the end; due is set when
+   the delay of the current step already ran */
+static void _es_scenario_run(struct es_scenario_s *pCtx, struct _es_scenario_call_s *call, int due)
+{
+   while (call->step < call->end) {
+      const struct _es_scenario_step_s *step = &call->table->steps[call->step];
+
+      if (!due) {
+         if ((step->chance != ES_SCENARIO_ALWAYS) && (_es_scenario_draw(pCtx) >= step->chance)) {
+            __atomic_add_fetch(&pCtx->skipped, 1, __ATOMIC_RELAXED);
+            call->step++;
+            continue;
+         }
+
+         if (step->delay != 0) {
+            uint64_t now = _es_scenario_now();
+
+            /* An idle wheel jumps to now first */
+            if (es_wheel_count(pCtx->wheel) == 0) {
+               (void)es_wheel_advance(pCtx->wheel, now);
+            }
+            es_wheel_add(pCtx->wheel, &call->timer, now + step->delay);
+            if (!event_pending(pCtx->tick, EV_TIMEOUT, NULL)) {
+               struct timeval tv = { 0, ES_SCENARIO_TICK_MS * 1000 };
+               (void)event_add(pCtx->tick, &tv);
+            }
+            __atomic_add_fetch(&pCtx->delayed, 1, __ATOMIC_RELAXED);
+            return;
+         }
+      }
+
+      due = 0;
+      call->step++;
+      if (pCtx->stack.respond(pCtx->stack.arg, call->tr, step->code) == ES_OK) {
+         __atomic_add_fetch(&pCtx->sent, 1, __ATOMIC_RELAXED);
+      }
+
+      if (step->code >= 200) {
+         break;
+      }
+   }
+
+   _es_scenario_call_free(pCtx, call);
+}
+
+static void _es_scenario_expire_cb(struct es_wheel_entry_s *entry, void *arg)
+{
+   _es_scenario_run((struct es_scenario_s *)arg, (struct _es_scenario_call_s *)entry, 1);
+}
+
+static void _es_scenario_tick_cb(evutil_socket_t fd, short event, void *arg)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)arg;
+
+   (void)es_wheel_advance(_pCtx->wheel, _es_scenario_now());
+
+   /* Nothing pending: no more ticks */
+   if (es_wheel_count(_pCtx->wheel) == 0) {
+      (void)event_del(_pCtx->tick);
+   }
+}
+
+/*******************************************************************************
+                              Public functions
+ ******************************************************************************/
+
+es_status es_scenario_init(es_scenario_t **ppCtx, struct event_base *pBase, const struct es_scenario_stack_s *pStack)
+{
+   struct es_scenario_s *_pCtx = NULL;
+
+   if ((ppCtx == NULL) || (pBase == NULL) || (pStack == NULL) || (pStack->respond == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   _pCtx = (struct es_scenario_s *) es_mem_calloc(ES_MEM_SCENARIO, 1, sizeof(struct es_scenario_s));
+   if (_pCtx == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create scenarios: no more memory");
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   _pCtx->magic = ES_SCENARIO_MAGIC;
+   _pCtx->stack = *pStack;
+   _pCtx->rnd = ((uint64_t)osip_build_random_number() << 32) | osip_build_random_number() | 1;
+
+   if (es_wheel_init(&_pCtx->wheel, _es_scenario_now(), _es_scenario_expire_cb, _pCtx) != ES_OK) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create scenarios: no more memory");
+      es_scenario_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   /* Low priority: SIP messages first; added with the first delay */
+   _pCtx->tick = event_new(pBase, -1, EV_PERSIST, _es_scenario_tick_cb, _pCtx);
+   if ((_pCtx->tick == NULL) || (event_priority_set(_pCtx->tick, 1) != 0)) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not create scenario tick");
+      es_scenario_deinit(_pCtx);
+      return ES_ERROR_OUTOFRESOURCES;
+   }
+
+   *ppCtx = _pCtx;
+   return ES_OK;
+}
+
+es_status es_scenario_deinit(es_scenario_t *pCtx)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_SCENARIO_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->tick != NULL) {
+      event_free(_pCtx->tick);
+   }
+
+   while (_pCtx->calls != NULL) {
+      _es_scenario_call_free(_pCtx, _pCtx->calls);
+   }
+
+   if (_pCtx->wheel != NULL) {
+      es_wheel_deinit(_pCtx->wheel);
+   }
+
+   _es_scenario_table_unref(_pCtx->table);
+
+   _pCtx->magic = 0;
+   es_mem_free(_pCtx);
+
+   return ES_OK;
+}
+
+es_status es_scenario_configure(es_scenario_t *pCtx, const struct es_config_s *pCfg)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)pCtx;
+   struct _es_scenario_table_s *table = NULL;
+
+   if ((_pCtx == NULL) || (pCfg == NULL)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   if (_pCtx->magic != ES_SCENARIO_MAGIC) {
+      return ES_ERROR_INVALID_HANDLE;
+   }
+
+   if ((pCfg->responseScenarios[0] != '\0') && (_es_scenario_load(pCfg->responseScenarios, &table) != ES_OK)) {
+      return ES_ERROR_BADPARAM;
+   }
+
+   _es_scenario_table_unref(_pCtx->table);
+   _pCtx->table = table;
+   __atomic_store_n(&_pCtx->nbLines, (table != NULL) ? table->nbLines : 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&_pCtx->nbSteps, (table != NULL) ? table->nbSteps : 0, __ATOMIC_RELAXED);
+
+   if (table != NULL) {
+      ESIP_TRACE(ESIP_LOG_INFO, "%u scenario(s), %u step(s) from %s", table->nbLines, table->nbSteps,
+                 pCfg->responseScenarios);
+   }
+
+   return ES_OK;
+}
+
+es_status es_scenario_start(es_scenario_t *pCtx, struct osip_transaction *tr, struct osip_message *request)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)pCtx;
+   const struct _es_scenario_line_s *line = NULL;
+   struct _es_scenario_call_s *call = NULL;
+
+   if ((_pCtx == NULL) || (_pCtx->table == NULL) || (tr == NULL) || (request == NULL)) {
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   line = _es_scenario_match(_pCtx->table, request);
+   if (line == NULL) {
+      __atomic_add_fetch(&_pCtx->unmatched, 1, __ATOMIC_RELAXED);
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   call = (struct _es_scenario_call_s *) es_mem_calloc(ES_MEM_SCENARIO, 1, sizeof(struct _es_scenario_call_s));
+   if (call == NULL) {
+      ESIP_TRACE(ESIP_LOG_ERROR, "Can not start scenario: no more memory");
+      return ES_ERROR_NOT_FOUND;
+   }
+
+   call->table = _pCtx->table;
+   call->table->refs++;
+   call->tr = tr;
+   call->step = line->first;
+   call->end = line->first + line->nbSteps;
+   call->next = _pCtx->calls;
+   if (call->next != NULL) {
+      call->next->prev = call;
+   }
+   _pCtx->calls = call;
+   osip_transaction_set_reserved3(tr, call);
+
+   __atomic_add_fetch(&_pCtx->running, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&_pCtx->started, 1, __ATOMIC_RELAXED);
+
+   _es_scenario_run(_pCtx, call, 0);
+   return ES_OK;
+}
+
+void es_scenario_release(es_scenario_t *pCtx, struct osip_transaction *tr)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)pCtx;
+   struct _es_scenario_call_s *call = NULL;
+
+   if ((_pCtx == NULL) || (tr == NULL) || ((call = (struct _es_scenario_call_s *)osip_transaction_get_reserved3(tr)) == NULL)) {
+      return;
+   }
+
+   __atomic_add_fetch(&_pCtx->dropped, 1, __ATOMIC_RELAXED);
+   _es_scenario_call_free(_pCtx, call);
+}
+
+static int _es_scenario_cli_show(struct cli_def *pCli, char *argv[], int argc, void *arg)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)arg;
+
+   es_cli_print(pCli, "Scenarios %u, steps %u (%u bytes each), running %u (%u bytes each), tick %u ms",
+                __atomic_load_n(&_pCtx->nbLines, __ATOMIC_RELAXED), __atomic_load_n(&_pCtx->nbSteps, __ATOMIC_RELAXED),
+                (unsigned int)sizeof(struct _es_scenario_step_s), __atomic_load_n(&_pCtx->running, __ATOMIC_RELAXED),
+                (unsigned int)sizeof(struct _es_scenario_call_s), ES_SCENARIO_TICK_MS);
+   es_cli_print(pCli, "%12s %12s %12s %12s %12s %12s",
+                "started", "unmatched", "sent", "skipped", "delayed", "dropped");
+   es_cli_print(pCli, "%12llu %12llu %12llu %12llu %12llu %12llu",
+                (unsigned long long)__atomic_load_n(&_pCtx->started, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->unmatched, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->sent, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->skipped, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->delayed, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&_pCtx->dropped, __ATOMIC_RELAXED));
+
+   return CLI_OK;
+}
+
+es_status es_scenario_cli_register(es_scenario_t *pCtx, es_cli_t *pCli)
+{
+   struct es_scenario_s *_pCtx = (struct es_scenario_s *)pCtx;
+
+   if ((_pCtx == NULL) || (_pCtx->magic != ES_SCENARIO_MAGIC)) {
+      return ES_ERROR_NULLPTR;
+   }
+
+   return es_cli_register_cmd(pCli, "show scenarios", "Show the scripted responses", _es_scenario_cli_show, _pCtx);
+}
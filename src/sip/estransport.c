@@ -27,14 +27,25 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <event2/event.h>
 #include <event2/util.h>
 
 #include "eserror.h"
 #include "log.h"
+#include "escli.h"
+#include "esstats.h"
+#include "eshist.h"
+#include "esloop.h"
+#include "esprobe.h"
+#include "esconfig.h"
 
 #include "estransport.h"
+#include "escapture.h"
+#include "esrate.h"
+#include "esacl.h"
 
 /** Transport context magic */
 #define ES_TRANSPORT_MAGIC            0x20140921
@@ -42,6 +53,9 @@
 /** Default SIP port */
 #define ES_TRANSPORT_DEFAULT_PORT     5060
 
+/** Default datagrams read per socket event */
+#define ES_TRANSPORT_DEFAULT_BATCH    8
+
 /** Max packet size to read from network */
 #define ES_TRANSPORT_MAX_BUFFER_SIZE  2048 //Baby jumbo frame max frame size
 
@@ -56,6 +70,22 @@ struct es_transport_s {
   struct event_base                *base;
   /** */
   struct es_transport_callbacks_s  callbacks;
+  /** Local address, once bound */
+  struct sockaddr_in               local_addr;
+  /** SIP traffic capture */
+  es_capture_t                     *capture;
+  /** Limits per source, before the datagrams go up */
+  es_rate_t                        *rate;
+  /** Sources allowed, checked before the limits */
+  es_acl_t                         *acl;
+  /** Address to bind, empty for any */
+  char                             address[ES_CONFIG_STR_LEN];
+  /** Port to bind */
+  unsigned int                     port;
+  /** Datagrams read per socket event */
+  unsigned int                     batch;
+  /** Socket handed over, already bound */
+  int                              adopted;
 };
 
 /**
@@ -100,6 +130,9 @@ es_status es_transport_init(es_transport_t **pCtx, struct event_base *pBase)
   /* Base event loop */
   _pCtx->base = pBase;
 
+  _pCtx->port = ES_TRANSPORT_DEFAULT_PORT;
+  _pCtx->batch = ES_TRANSPORT_DEFAULT_BATCH;
+
   /* Set REUSEADDR ON */
   {
     int on = 1;
@@ -111,6 +144,24 @@ es_status es_transport_init(es_transport_t **pCtx, struct event_base *pBase)
   /* Set NONBLOCKING */
   evutil_make_socket_nonblocking(_pCtx->udp_socket);
 
+  /* Capture ring, off until enabled */
+  if (es_capture_init(&_pCtx->capture, NULL) != ES_OK) {
+    ESIP_TRACE(ESIP_LOG_WARNING, "Capture not available");
+    _pCtx->capture = NULL;
+  }
+
+  /* Rate limits, none until configured */
+  if (es_rate_init(&_pCtx->rate) != ES_OK) {
+    ESIP_TRACE(ESIP_LOG_WARNING, "Rate limits not available");
+    _pCtx->rate = NULL;
+  }
+
+  /* Every source allowed until configured */
+  if (es_acl_init(&_pCtx->acl) != ES_OK) {
+    ESIP_TRACE(ESIP_LOG_WARNING, "Source ACL not available");
+    _pCtx->acl = NULL;
+  }
+
   *pCtx = _pCtx;
   return ES_OK;
 }
@@ -136,6 +187,18 @@ es_status es_transport_destroy(es_transport_t *pCtx)
 
   close(_pCtx->udp_socket);
 
+  if (_pCtx->capture != NULL) {
+    es_capture_deinit(_pCtx->capture);
+  }
+
+  if (_pCtx->rate != NULL) {
+    es_rate_deinit(_pCtx->rate);
+  }
+
+  if (_pCtx->acl != NULL) {
+    es_acl_deinit(_pCtx->acl);
+  }
+
   memset(_pCtx, 0, sizeof(struct es_transport_s));
 
   free(_pCtx);
@@ -157,11 +220,18 @@ es_status es_transport_start(es_transport_t *pCtx)
     return ES_ERROR_NULLPTR;
   }
 
-  if (_es_bind_socket(_pCtx->udp_socket, NULL, ES_TRANSPORT_DEFAULT_PORT) != ES_OK) {
+  if (!_pCtx->adopted && _es_bind_socket(_pCtx->udp_socket, (_pCtx->address[0] != '\0') ? _pCtx->address : NULL, _pCtx->port) != ES_OK) {
     ESIP_TRACE(ESIP_LOG_ERROR, "Can not bind on socket");
     return ES_ERROR_NETWORK_PROBLEM;
   }
 
+  {
+    socklen_t len = sizeof(_pCtx->local_addr);
+    if (getsockname(_pCtx->udp_socket, (struct sockaddr *)&_pCtx->local_addr, &len) != 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not get local address");
+    }
+  }
+
   _pCtx->evudpsock = event_new(pCtx->base, _pCtx->udp_socket, (EV_READ|EV_PERSIST), _es_transport_ev, (void *)_pCtx);
   if (_pCtx->evudpsock == NULL) {
     ESIP_TRACE(ESIP_LOG_ERROR, "Can not create event for socket");
@@ -199,6 +269,7 @@ es_status es_transport_stop(es_transport_t *pCtx)
   }
 
   event_free(_pCtx->evudpsock);
+  _pCtx->evudpsock = NULL;
 
   return ES_OK;
 }
@@ -224,6 +295,117 @@ es_status es_transport_set_callbacks(es_transport_t *pCtx, struct es_transport_c
   return ES_OK;
 }
 
+es_status es_transport_configure(es_transport_t *pCtx, const struct es_config_s *pCfg)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+  es_status ret = ES_OK;
+  int size = 0;
+
+  if ((_pCtx == (struct es_transport_s *)0) || (pCfg == NULL)) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  /* The listener only changes before it is bound */
+  if (_pCtx->evudpsock == NULL) {
+    strcpy(_pCtx->address, pCfg->sipAddress);
+    _pCtx->port = pCfg->sipPort;
+  }
+
+  /* The kernel doubles the value, 0 keeps what is set */
+  if (pCfg->sipRcvBuf != 0) {
+    size = (int)pCfg->sipRcvBuf;
+    if (setsockopt(_pCtx->udp_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set receive buffer to %d", size);
+      ret = ES_ERROR_NETWORK_PROBLEM;
+    }
+  }
+
+  if (pCfg->sipSndBuf != 0) {
+    size = (int)pCfg->sipSndBuf;
+    if (setsockopt(_pCtx->udp_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+      ESIP_TRACE(ESIP_LOG_WARNING, "Can not set send buffer to %d", size);
+      ret = ES_ERROR_NETWORK_PROBLEM;
+    }
+  }
+
+  _pCtx->batch = (pCfg->sipBatch > 0) ? pCfg->sipBatch : 1;
+
+  if ((_pCtx->rate != NULL) && (es_rate_configure(_pCtx->rate, pCfg) != ES_OK)) {
+    ESIP_TRACE(ESIP_LOG_WARNING, "Rate limits not applied");
+    ret = ES_ERROR_OUTOFRANGE;
+  }
+
+  /* A bad file keeps the lists in use */
+  if ((_pCtx->acl != NULL) && (es_acl_configure(_pCtx->acl, pCfg) != ES_OK)) {
+    ESIP_TRACE(ESIP_LOG_WARNING, "Source ACL not applied");
+    ret = ES_ERROR_BADPARAM;
+  }
+
+  return ret;
+}
+
+es_status es_transport_adopt_socket(es_transport_t *pCtx, int fd)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+
+  if (_pCtx == (struct es_transport_s *)0) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if ((fd < 0) || (_pCtx->evudpsock != NULL)) {
+    return ES_ERROR_ILLEGAL_ACTION;
+  }
+
+  close(_pCtx->udp_socket);
+  _pCtx->udp_socket = fd;
+  _pCtx->adopted = 1;
+
+  evutil_make_socket_nonblocking(_pCtx->udp_socket);
+
+  return ES_OK;
+}
+
+es_status es_transport_pause(es_transport_t *pCtx, int pause)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+
+  if (_pCtx == (struct es_transport_s *)0) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->evudpsock == NULL) {
+    return ES_ERROR_UNINITIALIZED;
+  }
+
+  /* Sending goes on, only reading stops */
+  if (pause) {
+    event_del(_pCtx->evudpsock);
+  } else if (event_add(_pCtx->evudpsock, NULL) != 0) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Can not make socket event pending");
+    return ES_ERROR_UNKNOWN;
+  }
+
+  return ES_OK;
+}
+
 es_status es_transport_set_dscp(es_transport_t *pCtx, int dscp)
 {
   int tos = 0;
@@ -274,6 +456,72 @@ es_status es_transport_get_udp_socket(es_transport_t *pCtx, int *fd)
   return ES_ERROR_UNINITIALIZED;
 }
 
+es_status es_transport_get_capture(es_transport_t *pCtx, es_capture_t **ppCapture)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+
+  if (_pCtx == (struct es_transport_s *)0) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->capture == NULL) {
+    return ES_ERROR_NOTSUPPORTED;
+  }
+
+  *ppCapture = _pCtx->capture;
+  return ES_OK;
+}
+
+es_status es_transport_get_acl(es_transport_t *pCtx, es_acl_t **ppAcl)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+
+  if ((_pCtx == (struct es_transport_s *)0) || (ppAcl == NULL)) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->acl == NULL) {
+    return ES_ERROR_NOTSUPPORTED;
+  }
+
+  *ppAcl = _pCtx->acl;
+  return ES_OK;
+}
+
+es_status es_transport_get_rate(es_transport_t *pCtx, es_rate_t **ppRate)
+{
+  struct es_transport_s * _pCtx = (struct es_transport_s *)pCtx;
+
+  if ((_pCtx == (struct es_transport_s *)0) || (ppRate == NULL)) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->rate == NULL) {
+    return ES_ERROR_NOTSUPPORTED;
+  }
+
+  *ppRate = _pCtx->rate;
+  return ES_OK;
+}
+
 es_status es_transport_send(es_transport_t *pCtx, char *ip, int port, const char *msg, size_t size)
 {
   struct sockaddr_in saddr;
@@ -293,7 +541,64 @@ es_status es_transport_send(es_transport_t *pCtx, char *ip, int port, const char
   saddr.sin_addr.s_addr = inet_addr(ip);
   saddr.sin_port = htons(port);
 
-  sendto(_pCtx->udp_socket, msg, size, 0, (const struct sockaddr *)&saddr, sizeof(saddr));
+  if (sendto(_pCtx->udp_socket, msg, size, 0, (const struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+    ES_STATS_INC(ES_STATS_TX_ERRORS);
+    ESIP_TRACE(ESIP_LOG_WARNING, "Sending to %s:%d failed", ip, port);
+    return ES_ERROR_NETWORK_PROBLEM;
+  }
+
+  ES_STATS_INC(ES_STATS_TX_DATAGRAMS);
+  es_stats_add(ES_STATS_TX_BYTES, (int64_t)size);
+
+  es_capture_packet(_pCtx->capture, &_pCtx->local_addr, &saddr, msg, size);
+
+  return ES_OK;
+}
+
+es_status es_transport_sendv(es_transport_t *pCtx, const struct sockaddr_in *to, const struct iovec *iov, unsigned int nb)
+{
+  struct es_transport_s *_pCtx = (struct es_transport_s *)pCtx;
+  struct msghdr mh;
+  ssize_t size = 0;
+
+  if ((_pCtx == (struct es_transport_s *)0) || (to == NULL) || (iov == NULL)) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  if (_pCtx->magic != ES_TRANSPORT_MAGIC) {
+    ESIP_TRACE(ESIP_LOG_ERROR, "Transport Ctx not valid");
+    return ES_ERROR_NULLPTR;
+  }
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = (void *)to;
+  mh.msg_namelen = sizeof(struct sockaddr_in);
+  mh.msg_iov = (struct iovec *)iov;
+  mh.msg_iovlen = nb;
+
+  size = sendmsg(_pCtx->udp_socket, &mh, 0);
+  if (size < 0) {
+    ES_STATS_INC(ES_STATS_TX_ERRORS);
+    ESIP_TRACE(ESIP_LOG_WARNING, "Sending to %s:%d failed", inet_ntoa(to->sin_addr), ntohs(to->sin_port));
+    return ES_ERROR_NETWORK_PROBLEM;
+  }
+
+  ES_STATS_INC(ES_STATS_TX_DATAGRAMS);
+  es_stats_add(ES_STATS_TX_BYTES, (int64_t)size);
+
+  /* Joined only to be captured */
+  if (es_capture_enabled(_pCtx->capture)) {
+    char buf[ES_TRANSPORT_MAX_BUFFER_SIZE];
+    size_t len = 0;
+    unsigned int i = 0;
+
+    for (i = 0; (i < nb) && (len + iov[i].iov_len <= sizeof(buf)); ++i) {
+      memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+      len += iov[i].iov_len;
+    }
+    es_capture_packet(_pCtx->capture, &_pCtx->local_addr, to, buf, len);
+  }
 
   return ES_OK;
 }
@@ -318,6 +623,7 @@ static es_status _es_bind_socket(int sock, const char *ipv4addr, const unsigned
 static void _es_transport_ev(evutil_socket_t fd, short event, void *arg)
 {
   struct es_transport_s * _pCtx = (struct es_transport_s *)arg;
+  uint64_t cbTs = es_hist_now();
 
   if (_pCtx == (struct es_transport_s *)0) {
     ESIP_TRACE(ESIP_LOG_ERROR, "Transaction Ctx invalid");
@@ -331,26 +637,55 @@ static void _es_transport_ev(evutil_socket_t fd, short event, void *arg)
 
   if (event & EV_READ) {
     struct sockaddr_in remote_addr;
-    socklen_t len = sizeof(struct sockaddr_in);
-    char buf[ES_TRANSPORT_MAX_BUFFER_SIZE];
-    size_t buf_len = sizeof(buf);
-
-    buf_len = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)&remote_addr, &len);
-
-    buf[buf_len] = '\0';
-
-    ESIP_TRACE(ESIP_LOG_DEBUG, "Packet recieved from %s:%d [Len:%d]",
-        inet_ntoa(remote_addr.sin_addr),
-        ntohs(remote_addr.sin_port),
-        (unsigned int)buf_len);
-
-    if ((buf_len > 0) && (_pCtx->callbacks.msg_recv_cb != NULL)) {
-      _pCtx->callbacks.msg_recv_cb(_pCtx, buf, buf_len, _pCtx->callbacks.user_data);
-    }
-
-    if (_pCtx->callbacks.event_cb != NULL) {
-      _pCtx->callbacks.event_cb(_pCtx, 1, 0, _pCtx->callbacks.user_data);
+    socklen_t len = 0;
+    char buf[ES_TRANSPORT_MAX_BUFFER_SIZE + 1];
+    ssize_t buf_len = 0;
+    uint64_t rxTs = 0;
+    unsigned int n = 0;
+
+    /* Drain up to a batch, then give the other events a chance */
+    for (n = 0; n < _pCtx->batch; ++n) {
+      len = sizeof(struct sockaddr_in);
+      rxTs = es_hist_now();
+
+      buf_len = recvfrom(fd, buf, ES_TRANSPORT_MAX_BUFFER_SIZE, 0, (struct sockaddr *)&remote_addr, &len);
+      if (buf_len < 0) {
+        break;
+      }
+      es_hist_record_since(ES_HIST_RECV, rxTs);
+
+      buf[buf_len] = '\0';
+
+      ES_PROBE4(recv, buf, buf_len, remote_addr.sin_addr.s_addr, ntohs(remote_addr.sin_port));
+
+      ES_STATS_INC(ES_STATS_RX_DATAGRAMS);
+      es_stats_add(ES_STATS_RX_BYTES, (int64_t)buf_len);
+
+      /* A source not allowed or flooding costs a lookup, not a parse */
+      if ((_pCtx->acl != NULL) && !es_acl_allow(_pCtx->acl, (const struct sockaddr *)&remote_addr)) {
+        continue;
+      }
+      if ((_pCtx->rate != NULL) && !es_rate_allow(_pCtx->rate, &remote_addr, buf, (size_t)buf_len, rxTs)) {
+        continue;
+      }
+
+      es_capture_packet(_pCtx->capture, &remote_addr, &_pCtx->local_addr, buf, (size_t)buf_len);
+
+      ESIP_TRACE(ESIP_LOG_DEBUG, "Packet recieved from %s:%d [Len:%d]",
+          inet_ntoa(remote_addr.sin_addr),
+          ntohs(remote_addr.sin_port),
+          (unsigned int)buf_len);
+
+      if ((buf_len > 0) && (_pCtx->callbacks.msg_recv_cb != NULL)) {
+        _pCtx->callbacks.msg_recv_cb(_pCtx, buf, buf_len, &remote_addr, _pCtx->callbacks.user_data);
+      }
+
+      if (_pCtx->callbacks.event_cb != NULL) {
+        _pCtx->callbacks.event_cb(_pCtx, 1, 0, _pCtx->callbacks.user_data);
+      }
     }
   }
+
+  es_loop_cb_done(ES_HIST_CB_TRANSPORT, "transport", cbTs);
 }
 // vim: ts=2:sw=2
@@ -12,6 +12,24 @@ extern CU_SuiteInfo    osip_tests_suites[];
 
 extern CU_SuiteInfo    ev_tests_suites[];
 
+extern CU_SuiteInfo    hist_tests_suites[];
+
+extern CU_SuiteInfo    wheel_tests_suites[];
+
+extern CU_SuiteInfo    registrar_tests_suites[];
+
+extern CU_SuiteInfo    raw_tests_suites[];
+
+extern CU_SuiteInfo    auth_tests_suites[];
+
+extern CU_SuiteInfo    db_tests_suites[];
+
+extern CU_SuiteInfo    rate_tests_suites[];
+
+extern CU_SuiteInfo    acl_tests_suites[];
+
+extern CU_SuiteInfo    transaction_tests_suites[];
+
 /**
  * main
  * @brief The main function (first executed function)
@@ -36,6 +54,42 @@ int main(int argc, char * argv[])
     return CU_get_error();
   }
 
+  if (CUE_SUCCESS != CU_register_suites(hist_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(wheel_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(registrar_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(raw_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(auth_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(db_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(rate_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(acl_tests_suites)) {
+    return CU_get_error();
+  }
+
+  if (CUE_SUCCESS != CU_register_suites(transaction_tests_suites)) {
+    return CU_get_error();
+  }
+
   /* Run all tests using the CUnit Basic interface */
   CU_basic_set_mode(CU_BRM_VERBOSE);
 
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esconfig.h"
+#include "esacl.h"
+
+static es_acl_t     *   acl = NULL;
+static char             file[] = "/tmp/esip-tst-acl-XXXXXX";
+
+/* Write the rules then load them */
+static es_status _tst_acl_load(const char * rules)
+{
+  struct es_config_s cfg;
+  FILE          * f = fopen(file, "w");
+
+  if (f == NULL) {
+    return ES_ERROR_UNKNOWN;
+  }
+  fputs(rules, f);
+  fclose(f);
+
+  es_config_defaults(&cfg);
+  strcpy(cfg.aclFile, file);
+  return es_acl_configure(acl, &cfg);
+}
+
+static int _tst_acl_v4(const char * addr)
+{
+  struct sockaddr_in from;
+
+  memset(&from, 0, sizeof(from));
+  from.sin_family = AF_INET;
+  CU_ASSERT_FATAL(inet_pton(AF_INET, addr, &from.sin_addr) == 1);
+  return es_acl_allow(acl, (const struct sockaddr *) &from);
+}
+
+static int _tst_acl_v6(const char * addr)
+{
+  struct sockaddr_in6 from;
+
+  memset(&from, 0, sizeof(from));
+  from.sin6_family = AF_INET6;
+  CU_ASSERT_FATAL(inet_pton(AF_INET6, addr, &from.sin6_addr) == 1);
+  return es_acl_allow(acl, (const struct sockaddr *) &from);
+}
+
+static int init_suite_acl(void)
+{
+  int             fd = mkstemp(file);
+
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+  return (es_acl_init(&acl) != ES_OK);
+}
+
+static int clean_suite_acl(void)
+{
+  es_acl_deinit(acl);
+  acl = NULL;
+  unlink(file);
+  return 0;
+}
+
+static void test_acl_v4(void)
+{
+  CU_ASSERT_FATAL(_tst_acl_load("# lab\n"
+                                "allow 10.1.0.0/16\n"
+                                "deny 10.1.2.0/24\n"
+                                "allow 10.1.2.128/25\n"
+                                "allow 10.1.2.7     # a host\n"
+                                "deny 0.0.0.0/0\n"
+                                "allow 192.168.0.0/12\n"
+                                "deny 192.168.1.1/31\n") == ES_OK);
+
+  /* The longest prefix decides, on a byte boundary or not */
+  CU_ASSERT(_tst_acl_v4("10.1.0.1") == 1);
+  CU_ASSERT(_tst_acl_v4("10.1.2.1") == 0);
+  CU_ASSERT(_tst_acl_v4("10.1.2.6") == 0);
+  CU_ASSERT(_tst_acl_v4("10.1.2.7") == 1);
+  CU_ASSERT(_tst_acl_v4("10.1.2.8") == 0);
+  CU_ASSERT(_tst_acl_v4("10.1.2.127") == 0);
+  CU_ASSERT(_tst_acl_v4("10.1.2.128") == 1);
+  CU_ASSERT(_tst_acl_v4("10.1.2.255") == 1);
+  CU_ASSERT(_tst_acl_v4("10.1.3.0") == 1);
+
+  /* Host bits of a prefix are cleared */
+  CU_ASSERT(_tst_acl_v4("192.160.0.0") == 1);
+  CU_ASSERT(_tst_acl_v4("192.175.255.255") == 1);
+  CU_ASSERT(_tst_acl_v4("192.176.0.0") == 0);
+  CU_ASSERT(_tst_acl_v4("192.159.255.255") == 0);
+  CU_ASSERT(_tst_acl_v4("192.168.1.0") == 0);
+  CU_ASSERT(_tst_acl_v4("192.168.1.1") == 0);
+  CU_ASSERT(_tst_acl_v4("192.168.1.2") == 1);
+
+  /* Everything else */
+  CU_ASSERT(_tst_acl_v4("10.2.0.1") == 0);
+  CU_ASSERT(_tst_acl_v4("0.0.0.0") == 0);
+  CU_ASSERT(_tst_acl_v4("255.255.255.255") == 0);
+}
+
+static void test_acl_v6(void)
+{
+  CU_ASSERT_FATAL(_tst_acl_load("allow 2001:db8::/32\n"
+                                "deny 2001:db8:1::/48\n"
+                                "allow 2001:db8:1:2::1\n"
+                                "deny 2001:db8:8000::/33\n"
+                                "deny ::/0\n") == ES_OK);
+
+  CU_ASSERT(_tst_acl_v6("2001:db8::1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8:2::1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8:1::1") == 0);
+  CU_ASSERT(_tst_acl_v6("2001:db8:1:2::1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8:1:2::2") == 0);
+  CU_ASSERT(_tst_acl_v6("2001:db8:7fff:ffff::1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8:8000::1") == 0);
+  CU_ASSERT(_tst_acl_v6("2001:db9::1") == 0);
+  CU_ASSERT(_tst_acl_v6("::1") == 0);
+
+  /* The IPv4 sources have their own rules: none here */
+  CU_ASSERT(_tst_acl_v4("10.1.2.1") == 1);
+}
+
+static void test_acl_fallback(void)
+{
+  /* Without a /0 what matches nothing is allowed */
+  CU_ASSERT_FATAL(_tst_acl_load("deny 10.0.0.0/8\n"
+                                "deny 2001:db8::/32\n") == ES_OK);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 0);
+  CU_ASSERT(_tst_acl_v4("11.0.0.1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8::1") == 0);
+  CU_ASSERT(_tst_acl_v6("2001:db9::1") == 1);
+
+  /* With one, it is what the others get; the last of a prefix wins */
+  CU_ASSERT_FATAL(_tst_acl_load("allow 10.0.0.0/8\n"
+                                "allow 0.0.0.0/0\n"
+                                "deny 0.0.0.0/0\n"
+                                "allow ::/0\n") == ES_OK);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 1);
+  CU_ASSERT(_tst_acl_v4("11.0.0.1") == 0);
+  CU_ASSERT(_tst_acl_v6("2001:db8::1") == 1);
+}
+
+static void test_acl_reload(void)
+{
+  struct es_config_s cfg;
+
+  CU_ASSERT_FATAL(_tst_acl_load("deny 0.0.0.0/0\n") == ES_OK);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 0);
+
+  /* A file with an error is not applied, the previous rules stay */
+  CU_ASSERT(_tst_acl_load("allow 0.0.0.0/0\npermit 10.0.0.0/8\n") == ES_ERROR_BADPARAM);
+  CU_ASSERT(_tst_acl_load("allow 10.0.0.0/33\n") == ES_ERROR_BADPARAM);
+  CU_ASSERT(_tst_acl_load("allow 10.0.0.0/\n") == ES_ERROR_BADPARAM);
+  CU_ASSERT(_tst_acl_load("allow host.example.com\n") == ES_ERROR_BADPARAM);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 0);
+
+  es_config_defaults(&cfg);
+  strcpy(cfg.aclFile, "/nonexistent/acl");
+  CU_ASSERT(es_acl_configure(acl, &cfg) == ES_ERROR_NOT_FOUND);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 0);
+
+  /* No file: every source in */
+  cfg.aclFile[0] = '\0';
+  CU_ASSERT(es_acl_configure(acl, &cfg) == ES_OK);
+  CU_ASSERT(_tst_acl_v4("10.0.0.1") == 1);
+  CU_ASSERT(_tst_acl_v6("2001:db8::1") == 1);
+}
+
+static CU_TestInfo     all_acl_test[] = {
+  {"IPv4 longest prefix", test_acl_v4},
+  {"IPv6 longest prefix", test_acl_v6},
+  {"Default action", test_acl_fallback},
+  {"Reload", test_acl_reload},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    acl_tests_suites[] = {
+  {"Access List Tests", init_suite_acl, clean_suite_acl, all_acl_test},
+
+  CU_SUITE_INFO_NULL,
+};
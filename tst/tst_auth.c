@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+#include <osipparser2/osip_port.h>
+#include <osipparser2/osip_parser.h>
+#include <osipparser2/osip_md5.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "esauth.h"
+
+#define TST_AUTH_REALM      "esip"
+#define TST_AUTH_URI        "sip:example.com"
+#define TST_AUTH_CNONCE     "0a4f113b"
+
+static es_auth_t    *   auth = NULL;
+static struct es_config_s cfg;
+static char             users[] = "/tmp/esip-tst-users-XXXXXX";
+
+/* MD5 in hex of a formatted string */
+static void _tst_auth_md5(char hex[33], const char * fmt, ...)
+{
+  static const char digits[] = "0123456789abcdef";
+  osip_MD5_CTX    md5;
+  unsigned char   digest[16];
+  char            buf[512];
+  va_list         ap;
+  int             i = 0;
+
+  va_start(ap, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+
+  osip_MD5Init(&md5);
+  osip_MD5Update(&md5, (unsigned char *) buf, (unsigned int) strlen(buf));
+  osip_MD5Final(digest, &md5);
+
+  for (i = 0; i < 16; ++i) {
+    hex[2 * i] = digits[digest[i] >> 4];
+    hex[2 * i + 1] = digits[digest[i] & 0xf];
+  }
+  hex[32] = '\0';
+}
+
+/* A REGISTER, with the credentials of a user when nonce is set */
+static osip_message_t * _tst_auth_request(const char * user, const char * password, const char * nonce, unsigned int nc)
+{
+  osip_message_t * sip = NULL;
+  char            msg[1024];
+  char            hdr[512] = "";
+  char            ha1[33];
+  char            ha2[33];
+  char            response[33];
+
+  if (nonce != NULL) {
+    _tst_auth_md5(ha1, "%s:%s:%s", user, TST_AUTH_REALM, password);
+    _tst_auth_md5(ha2, "REGISTER:%s", TST_AUTH_URI);
+    _tst_auth_md5(response, "%s:%s:%08x:%s:auth:%s", ha1, nonce, nc, TST_AUTH_CNONCE, ha2);
+    snprintf(hdr, sizeof(hdr), "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", "
+             "response=\"%s\", qop=auth, nc=%08x, cnonce=\"%s\", algorithm=MD5\r\n",
+             user, TST_AUTH_REALM, nonce, TST_AUTH_URI, response, nc, TST_AUTH_CNONCE);
+  }
+
+  snprintf(msg, sizeof(msg), "REGISTER " TST_AUTH_URI " SIP/2.0\r\n"
+           "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK%u\r\n"
+           "From: <sip:%s@example.com>;tag=19\r\n"
+           "To: <sip:%s@example.com>\r\n"
+           "Call-ID: 70710@saturn\r\n"
+           "CSeq: %u REGISTER\r\n"
+           "Contact: <sip:%s@10.0.0.1>\r\n"
+           "%s"
+           "Content-Length: 0\r\n\r\n",
+           nc, user, user, nc + 1, user, hdr);
+
+  if (osip_message_init(&sip) != OSIP_SUCCESS) {
+    return NULL;
+  }
+  if (osip_message_parse(sip, msg, strlen(msg)) != OSIP_SUCCESS) {
+    osip_message_free(sip);
+    return NULL;
+  }
+  return sip;
+}
+
+static int _tst_auth_verify(es_auth_t * ctx, const char * password, const char * nonce, unsigned int nc)
+{
+  osip_message_t * sip = _tst_auth_request("alice", password, nonce, nc);
+  int             code = 0;
+
+  CU_ASSERT_FATAL(sip != NULL);
+  code = es_auth_verify(ctx, sip);
+  osip_message_free(sip);
+  return code;
+}
+
+/* Challenge of a 401 to a request, the nonce unquoted; 1 if stale */
+static int _tst_auth_challenge(es_auth_t * ctx, const char * password, const char * prev, unsigned int nc,
+                               char nonce[64])
+{
+  osip_message_t * sip = _tst_auth_request("alice", password, prev, nc);
+  osip_message_t * resp = NULL;
+  osip_www_authenticate_t * wa = NULL;
+  const char    * n = NULL;
+  int             stale = 0;
+
+  CU_ASSERT_FATAL(sip != NULL);
+  CU_ASSERT_FATAL(osip_message_init(&resp) == OSIP_SUCCESS);
+  osip_message_set_status_code(resp, SIP_UNAUTHORIZED);
+
+  CU_ASSERT(es_auth_answer(ctx, sip, resp) == ES_OK);
+  CU_ASSERT_FATAL(osip_message_get_www_authenticate(resp, 0, &wa) >= 0);
+  CU_ASSERT_FATAL(wa != NULL);
+
+  n = osip_www_authenticate_get_nonce(wa);
+  CU_ASSERT_FATAL((n != NULL) && (n[0] == '"') && (strlen(n) > 2) && (strlen(n) < 64));
+  snprintf(nonce, 64, "%.*s", (int) strlen(n) - 2, n + 1);
+
+  stale = (osip_www_authenticate_get_stale(wa) != NULL) &&
+          (strcasecmp(osip_www_authenticate_get_stale(wa), "TRUE") == 0);
+
+  osip_message_free(resp);
+  osip_message_free(sip);
+  return stale;
+}
+
+static int init_suite_auth(void)
+{
+  FILE          * f = NULL;
+  int             fd = -1;
+
+  parser_init();
+
+  fd = mkstemp(users);
+  if ((fd < 0) || ((f = fdopen(fd, "w")) == NULL)) {
+    return 1;
+  }
+  fprintf(f, "# users\nalice secret\n");
+  fclose(f);
+
+  es_config_defaults(&cfg);
+  strcpy(cfg.authRealm, TST_AUTH_REALM);
+  strcpy(cfg.authUsers, users);
+  cfg.authRegister = 1;
+  cfg.authNonceTtl = 1;
+
+  if (es_auth_init(&auth) != ES_OK) {
+    return 1;
+  }
+  return (es_auth_configure(auth, &cfg) != ES_OK);
+}
+
+static int clean_suite_auth(void)
+{
+  es_auth_deinit(auth);
+  auth = NULL;
+  unlink(users);
+  return 0;
+}
+
+static void test_auth_challenge(void)
+{
+  char            nonce[64];
+
+  CU_ASSERT(_tst_auth_verify(auth, NULL, NULL, 0) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_challenge(auth, NULL, NULL, 0, nonce) == 0);
+  CU_ASSERT(strlen(nonce) == 48);
+}
+
+static void test_auth_sign(void)
+{
+  char            nonce[64];
+
+  _tst_auth_challenge(auth, NULL, NULL, 0, nonce);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_OK);
+
+  /* Wrong password */
+  CU_ASSERT(_tst_auth_verify(auth, "wrong", nonce, 2) == SIP_FORBIDDEN);
+
+  /* Forged: any change to the time, sequence or signature */
+  nonce[3] = (nonce[3] == '0') ? '1' : '0';
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 3) == SIP_UNAUTHORIZED);
+  nonce[3] = (nonce[3] == '0') ? '1' : '0';
+  nonce[40] = (nonce[40] == 'a') ? 'b' : 'a';
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 3) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_challenge(auth, "secret", nonce, 3, nonce) == 0);
+}
+
+static void test_auth_replay(void)
+{
+  char            nonce[64];
+  char            next[64];
+
+  _tst_auth_challenge(auth, NULL, NULL, 0, nonce);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_OK);
+
+  /* Once per nonce-count, in any order */
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 3) == SIP_OK);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 2) == SIP_OK);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 3) == SIP_UNAUTHORIZED);
+
+  /* Past the counts followed the nonce is used up, 0 is never valid */
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 33) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 0) == SIP_BAD_REQUEST);
+
+  /* Used up is stale, even for a nonce given no count yet */
+  _tst_auth_challenge(auth, NULL, NULL, 0, next);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", next, 33) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_challenge(auth, "secret", next, 33, next) == 1);
+
+  /* A replay is challenged again as stale: the password was right */
+  CU_ASSERT(_tst_auth_challenge(auth, "secret", nonce, 1, next) == 1);
+  CU_ASSERT(strcmp(next, nonce) != 0);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", next, 1) == SIP_OK);
+}
+
+static void test_auth_stale(void)
+{
+  char            nonce[64];
+
+  _tst_auth_challenge(auth, NULL, NULL, 0, nonce);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_OK);
+
+  /* Past auth.nonce_ttl */
+  sleep(cfg.authNonceTtl + 1);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 2) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_challenge(auth, "secret", nonce, 2, nonce) == 1);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_OK);
+}
+
+static void test_auth_upgrade(void)
+{
+  struct es_upgrade_buf_s state;
+  es_auth_t     * next = NULL;
+  char            nonce[64];
+  char            fresh[64];
+
+  _tst_auth_challenge(auth, NULL, NULL, 0, nonce);
+  CU_ASSERT(_tst_auth_verify(auth, "secret", nonce, 1) == SIP_OK);
+
+  memset(&state, 0, sizeof(state));
+  CU_ASSERT_FATAL(es_auth_save(auth, &state) == ES_OK);
+  CU_ASSERT_FATAL(es_auth_init(&next) == ES_OK);
+  CU_ASSERT(es_auth_configure(next, &cfg) == ES_OK);
+  CU_ASSERT(es_auth_restore(next, state.data, state.len) == ES_OK);
+
+  /* Signed with the key handed over, but its nonce-counts were not */
+  CU_ASSERT(_tst_auth_verify(next, "secret", nonce, 2) == SIP_UNAUTHORIZED);
+  CU_ASSERT(_tst_auth_challenge(next, "secret", nonce, 2, fresh) == 1);
+  CU_ASSERT(_tst_auth_verify(next, "secret", fresh, 1) == SIP_OK);
+
+  /* Not the other way round: the old process never issued it */
+  CU_ASSERT(_tst_auth_verify(auth, "secret", fresh, 2) == SIP_UNAUTHORIZED);
+
+  es_auth_deinit(next);
+  es_upgrade_buf_free(&state);
+}
+
+static CU_TestInfo     all_auth_test[] = {
+  {"Challenge", test_auth_challenge},
+  {"Nonce signature", test_auth_sign},
+  {"Nonce-count replay", test_auth_replay},
+  {"Stale nonce", test_auth_stale},
+  {"Nonces handed over", test_auth_upgrade},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    auth_tests_suites[] = {
+  {"Digest Authentication Tests", init_suite_auth, clean_suite_auth, all_auth_test},
+
+  CU_SUITE_INFO_NULL,
+};
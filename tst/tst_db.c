@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esdb.h"
+
+/* Built in src/ before the tests */
+#ifndef TST_MKDB
+#define TST_MKDB        "../src/esip-mkdb"
+#endif
+
+#define TST_DB_USERS    1000
+
+static char             dir[] = "/tmp/esip-tst-db-XXXXXX";
+static char             csv[64];
+static char             file[64];
+
+/* HA1 of a user of the test, in hex */
+static void _tst_db_ha1(unsigned int i, char hex[33])
+{
+  unsigned int    j = 0;
+
+  for (j = 0; j < 16; ++j) {
+    snprintf(hex + 2 * j, 3, "%02x", (i * 31 + j * 7) & 0xff);
+  }
+}
+
+/* Write the CSV then run esip-mkdb over it */
+static int _tst_db_make(const char * lines, const char * realm)
+{
+  char            cmd[256];
+  FILE          * f = fopen(csv, "w");
+
+  if (f == NULL) {
+    return -1;
+  }
+  fputs(lines, f);
+  fclose(f);
+
+  snprintf(cmd, sizeof(cmd), "%s %s%s %s %s >/dev/null 2>&1", TST_MKDB,
+           (realm != NULL) ? "-r " : "", (realm != NULL) ? realm : "", csv, file);
+  return system(cmd);
+}
+
+static int init_suite_db(void)
+{
+  if (mkdtemp(dir) == NULL) {
+    return 1;
+  }
+  snprintf(csv, sizeof(csv), "%s/users.csv", dir);
+  snprintf(file, sizeof(file), "%s/users.db", dir);
+  return 0;
+}
+
+static int clean_suite_db(void)
+{
+  unlink(csv);
+  unlink(file);
+  rmdir(dir);
+  return 0;
+}
+
+static void test_db_round_trip(void)
+{
+  const struct es_db_record_s * rec = NULL;
+  es_db_t       * db = NULL;
+  char          * lines = NULL;
+  char            user[ES_DB_USER_LEN + 1];
+  char            ha1[33];
+  size_t          len = 0;
+  unsigned int    i = 0;
+  unsigned int    j = 0;
+
+  lines = (char *) malloc(TST_DB_USERS * 96 + 256);
+  CU_ASSERT_FATAL(lines != NULL);
+
+  /* Comments, blank lines, spaces around the fields, a route every third user */
+  len = (size_t) sprintf(lines, "# subscribers\n\n");
+  for (i = 0; i < TST_DB_USERS; ++i) {
+    _tst_db_ha1(i, ha1);
+    if (i % 3 == 0) {
+      len += (size_t) sprintf(lines + len, "+3312%07u, %s ,10.0.%u.%u:%u\n", i, ha1, i / 256, i % 256, 5000 + i);
+    } else {
+      len += (size_t) sprintf(lines + len, "+3312%07u,%s\n", i, ha1);
+    }
+  }
+  memset(user, 'u', ES_DB_USER_LEN);
+  user[ES_DB_USER_LEN] = '\0';
+  _tst_db_ha1(TST_DB_USERS, ha1);
+  sprintf(lines + len, "%s,%s,10.0.0.1\n", user, ha1);
+
+  CU_ASSERT_FATAL(_tst_db_make(lines, "example.com") == 0);
+  free(lines);
+
+  CU_ASSERT_FATAL(es_db_open(&db, file) == ES_OK);
+  CU_ASSERT(strcmp(es_db_realm(db), "example.com") == 0);
+
+  for (i = 0; i < TST_DB_USERS; ++i) {
+    snprintf(user, sizeof(user), "+3312%07u", i);
+    rec = es_db_lookup(db, user, strlen(user));
+    CU_ASSERT_FATAL(rec != NULL);
+    CU_ASSERT(rec->userLen == strlen(user));
+    CU_ASSERT(memcmp(rec->user, user, rec->userLen) == 0);
+
+    for (j = 0; j < 16; ++j) {
+      CU_ASSERT(rec->ha1[j] == ((i * 31 + j * 7) & 0xff));
+    }
+
+    if (i % 3 == 0) {
+      CU_ASSERT(rec->routeAddr == htonl((10U << 24) | ((i / 256) << 8) | (i % 256)));
+      CU_ASSERT(ntohs(rec->routePort) == 5000 + i);
+    } else {
+      CU_ASSERT(rec->routeAddr == 0);
+    }
+  }
+
+  /* Longest name, default port */
+  memset(user, 'u', ES_DB_USER_LEN);
+  rec = es_db_lookup(db, user, ES_DB_USER_LEN);
+  CU_ASSERT_FATAL(rec != NULL);
+  CU_ASSERT(rec->userLen == ES_DB_USER_LEN);
+  CU_ASSERT(ntohs(rec->routePort) == 5060);
+
+  /* Not there: another user, a prefix, longer than any */
+  CU_ASSERT(es_db_lookup(db, "alice", 5) == NULL);
+  CU_ASSERT(es_db_lookup(db, "+3312000000", 11) == NULL);
+  CU_ASSERT(es_db_lookup(db, "+33120000000 ", 13) == NULL);
+  CU_ASSERT(es_db_lookup(db, user, ES_DB_USER_LEN - 1) == NULL);
+
+  CU_ASSERT(es_db_close(db) == ES_OK);
+}
+
+static void test_db_empty(void)
+{
+  es_db_t       * db = NULL;
+
+  CU_ASSERT_FATAL(_tst_db_make("# nobody\n", NULL) == 0);
+  CU_ASSERT_FATAL(es_db_open(&db, file) == ES_OK);
+  CU_ASSERT(es_db_realm(db)[0] == '\0');
+  CU_ASSERT(es_db_lookup(db, "alice", 5) == NULL);
+  CU_ASSERT(es_db_close(db) == ES_OK);
+}
+
+static void test_db_bad(void)
+{
+  es_db_t       * db = NULL;
+
+  /* Refused by esip-mkdb */
+  CU_ASSERT(_tst_db_make("alice,0123\n", NULL) != 0);
+  CU_ASSERT(_tst_db_make("alice,0123456789abcdef0123456789abcdeg\n", NULL) != 0);
+  CU_ASSERT(_tst_db_make("alice,0123456789abcdef0123456789abcdef,10.0.0.1:0\n", NULL) != 0);
+  CU_ASSERT(_tst_db_make("alice,0123456789abcdef0123456789abcdef,host.example.com\n", NULL) != 0);
+  CU_ASSERT(_tst_db_make("alice,0123456789abcdef0123456789abcdef,10.0.0.1,x\n", NULL) != 0);
+
+  /* Not a database */
+  CU_ASSERT(es_db_open(&db, csv) == ES_ERROR_BADPARAM);
+  CU_ASSERT(es_db_open(&db, "/nonexistent/users.db") == ES_ERROR_NOT_FOUND);
+}
+
+static CU_TestInfo     all_db_test[] = {
+  {"esip-mkdb then lookup", test_db_round_trip},
+  {"No subscriber", test_db_empty},
+  {"Bad input", test_db_bad},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    db_tests_suites[] = {
+  {"Subscribers Database Tests", init_suite_db, clean_suite_db, all_db_test},
+
+  CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "eshist.h"
+
+static void test_hist_small(void)
+{
+  uint64_t        v = 0;
+
+  /* One bucket per value below the first sub-divided power of 2 */
+  for (v = 0; v < ES_HIST_SUB_COUNT; ++v) {
+    CU_ASSERT(es_hist_bucket(v) == v);
+    CU_ASSERT(es_hist_bucket_upper((unsigned int)v) == v);
+  }
+  CU_ASSERT(es_hist_bucket(ES_HIST_SUB_COUNT) == ES_HIST_SUB_COUNT);
+}
+
+static void test_hist_boundaries(void)
+{
+  unsigned int    b = 0;
+
+  /* The upper value of a bucket is in it, the next one in the next bucket */
+  for (b = 0; b < ES_HIST_BUCKETS - 1; ++b) {
+    uint64_t      upper = es_hist_bucket_upper(b);
+    CU_ASSERT(es_hist_bucket(upper) == b);
+    CU_ASSERT(es_hist_bucket(upper + 1) == b + 1);
+  }
+}
+
+static void test_hist_error(void)
+{
+  unsigned int    b = 0;
+
+  /* Width of a bucket stays within 1/16 of its lower value */
+  for (b = ES_HIST_SUB_COUNT + 1; b < ES_HIST_BUCKETS; ++b) {
+    uint64_t      lower = es_hist_bucket_upper(b - 1) + 1;
+    uint64_t      upper = es_hist_bucket_upper(b);
+    CU_ASSERT(upper >= lower);
+    CU_ASSERT((upper - lower + 1) * ES_HIST_SUB_COUNT <= lower);
+  }
+}
+
+static void test_hist_clamp(void)
+{
+  CU_ASSERT(es_hist_bucket(1ULL << (ES_HIST_MAX_MSB + 1)) == ES_HIST_BUCKETS - 1);
+  CU_ASSERT(es_hist_bucket(UINT64_MAX) == ES_HIST_BUCKETS - 1);
+  CU_ASSERT(es_hist_bucket((2ULL << ES_HIST_MAX_MSB) - 1) == ES_HIST_BUCKETS - 1);
+  CU_ASSERT(es_hist_bucket(1ULL << ES_HIST_MAX_MSB) < ES_HIST_BUCKETS - 1);
+}
+
+static void test_hist_percentile(void)
+{
+  struct es_hist_snapshot_s * snap = NULL;
+  uint64_t        p50 = 0;
+  uint64_t        i = 0;
+
+  snap = (struct es_hist_snapshot_s *) malloc(sizeof(struct es_hist_snapshot_s));
+  CU_ASSERT_FATAL(snap != NULL);
+
+  es_hist_snapshot(ES_HIST_POST, snap);
+  CU_ASSERT(snap->count == 0);
+  CU_ASSERT(es_hist_percentile(snap, 0.5) == 0);
+
+  for (i = 1; i <= 1000; ++i) {
+    es_hist_record(ES_HIST_POST, i * 1000);
+  }
+
+  es_hist_snapshot(ES_HIST_POST, snap);
+  CU_ASSERT(snap->count == 1000);
+  CU_ASSERT(snap->sum == 500500000);
+
+  p50 = es_hist_percentile(snap, 0.5);
+  CU_ASSERT(p50 >= 500000);
+  CU_ASSERT(p50 <= 500000 + 500000 / ES_HIST_SUB_COUNT);
+  CU_ASSERT(es_hist_percentile(snap, 1.0) >= 1000000);
+  CU_ASSERT(es_hist_percentile(snap, 0.0) >= 1000);
+  CU_ASSERT(es_hist_percentile(snap, 0.0) < 2000);
+
+  free(snap);
+}
+
+static CU_TestInfo     all_hist_test[] = {
+  {"Small values", test_hist_small},
+  {"Bucket boundaries", test_hist_boundaries},
+  {"Relative error", test_hist_error},
+  {"Clamp of large values", test_hist_clamp},
+  {"Percentiles", test_hist_percentile},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    hist_tests_suites[] = {
+  {"Latency Histogram Tests", NULL, NULL, all_hist_test},
+
+  CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esconfig.h"
+#include "esrate.h"
+
+#define TST_RATE_SEC    1000000000ULL
+
+static const char       invite[] = "INVITE sip:bob@example.com SIP/2.0\r\n";
+static const char       reg[] = "REGISTER sip:example.com SIP/2.0\r\n";
+static const char       resp[] = "SIP/2.0 200 OK\r\n";
+
+static es_rate_t    *   rate = NULL;
+
+static int _tst_rate_allow(uint32_t addr, const char * buf, uint64_t now)
+{
+  struct sockaddr_in from;
+
+  memset(&from, 0, sizeof(from));
+  from.sin_family = AF_INET;
+  from.sin_addr.s_addr = htonl(addr);
+  return es_rate_allow(rate, &from, buf, strlen(buf), now);
+}
+
+/* Datagrams let through of a flood at one time */
+static unsigned int _tst_rate_flood(uint32_t addr, const char * buf, uint64_t now, unsigned int nb)
+{
+  unsigned int    passed = 0;
+
+  while (nb-- > 0) {
+    passed += (unsigned int) _tst_rate_allow(addr, buf, now);
+  }
+  return passed;
+}
+
+static void _tst_rate_configure(unsigned int invites, unsigned int responses, unsigned int burst)
+{
+  struct es_config_s cfg;
+
+  es_config_defaults(&cfg);
+  cfg.rateInvite = invites;
+  cfg.rateResponse = responses;
+  cfg.rateBurst = burst;
+  CU_ASSERT_FATAL(es_rate_configure(rate, &cfg) == ES_OK);
+}
+
+static int init_suite_rate(void)
+{
+  return (es_rate_init(&rate) != ES_OK);
+}
+
+static int clean_suite_rate(void)
+{
+  es_rate_deinit(rate);
+  rate = NULL;
+  return 0;
+}
+
+static void test_rate_off(void)
+{
+  _tst_rate_configure(0, 0, 2);
+  CU_ASSERT(_tst_rate_flood(0x0a000001, invite, TST_RATE_SEC, 1000) == 1000);
+  CU_ASSERT(_tst_rate_flood(0x0a000001, resp, TST_RATE_SEC, 1000) == 1000);
+}
+
+static void test_rate_refill(void)
+{
+  uint64_t        t = 10 * TST_RATE_SEC;
+  uint32_t        a = 0x0a000002;
+
+  _tst_rate_configure(10, 0, 2);
+
+  /* A new source starts with burst seconds of tokens */
+  CU_ASSERT(_tst_rate_flood(a, invite, t, 100) == 20);
+
+  /* One token every 100 ms, partial ones kept */
+  CU_ASSERT(_tst_rate_allow(a, invite, t + TST_RATE_SEC / 20) == 0);
+  CU_ASSERT(_tst_rate_allow(a, invite, t + TST_RATE_SEC / 10) == 1);
+  CU_ASSERT(_tst_rate_allow(a, invite, t + TST_RATE_SEC / 10) == 0);
+  CU_ASSERT(_tst_rate_flood(a, invite, t + TST_RATE_SEC / 10 + TST_RATE_SEC, 100) == 10);
+
+  /* A long silence refills up to the burst only */
+  t += 100 * TST_RATE_SEC;
+  CU_ASSERT(_tst_rate_flood(a, invite, t, 100) == 20);
+
+  /* Unlimited classes are not counted */
+  CU_ASSERT(_tst_rate_flood(a, reg, t, 100) == 100);
+  CU_ASSERT(_tst_rate_flood(a, resp, t, 100) == 100);
+}
+
+static void test_rate_classes(void)
+{
+  uint64_t        t = 1000 * TST_RATE_SEC;
+  uint32_t        a = 0x0a000003;
+
+  _tst_rate_configure(5, 50, 1);
+
+  /* A bucket per class, a flood of one leaves the others */
+  CU_ASSERT(_tst_rate_flood(a, invite, t, 100) == 5);
+  CU_ASSERT(_tst_rate_flood(a, resp, t, 100) == 50);
+  CU_ASSERT(_tst_rate_flood(a, invite, t, 1) == 0);
+
+  /* And a bucket per source */
+  CU_ASSERT(_tst_rate_flood(a + 1, invite, t, 100) == 5);
+}
+
+static void test_rate_eviction(void)
+{
+  uint64_t        t = 2000 * TST_RATE_SEC;
+  uint32_t        a = 0x0b000001;
+  uint32_t        i = 0;
+
+  _tst_rate_configure(1, 0, 1);
+
+  /* The table full of sources seen at t */
+  for (i = 0; i < 8 * ES_RATE_SOURCES; ++i) {
+    _tst_rate_allow(0x0c000000 + i, invite, t);
+  }
+
+  /* The most recently seen source stays when others come */
+  CU_ASSERT(_tst_rate_flood(a, invite, t + 1, 2) == 1);
+  for (i = 0; i < 64; ++i) {
+    _tst_rate_allow(0x0d000000 + i, invite, t + 2);
+  }
+  CU_ASSERT(_tst_rate_allow(a, invite, t + 3) == 0);
+
+  /* Until enough newer ones took its place: it comes back full */
+  for (i = 0; i < 8 * ES_RATE_SOURCES; ++i) {
+    _tst_rate_allow(0x0e000000 + i, invite, t + 4);
+  }
+  CU_ASSERT(_tst_rate_allow(a, invite, t + 5) == 1);
+}
+
+static CU_TestInfo     all_rate_test[] = {
+  {"No limit", test_rate_off},
+  {"Token refill", test_rate_refill},
+  {"Classes and sources", test_rate_classes},
+  {"Least recently seen evicted", test_rate_eviction},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    rate_tests_suites[] = {
+  {"Rate Limiter Tests", init_suite_rate, clean_suite_rate, all_rate_test},
+
+  CU_SUITE_INFO_NULL,
+};
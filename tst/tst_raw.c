@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "esraw.h"
+
+static const char     req[] = "INVITE sip:bob@10.0.0.2:5070;transport=udp SIP/2.0\r\n"
+                              "Via: SIP/2.0/UDP 10.0.0.1:5062;branch=z9hG4bK1;rport=5064;received=192.168.1.1\r\n"
+                              "v: SIP/2.0/UDP 10.0.0.3;branch=z9hG4bK2\r\n"
+                              "From: \"Alice, A\" <sip:alice:secret@example.com>;tag=19\r\n"
+                              "To:   <sip:bob@example.com> \r\n"
+                              "Subject: a long\r\n"
+                              " subject\r\n"
+                              "Call-ID: 70710@saturn\r\n"
+                              "CSeq: 1 INVITE\r\n"
+                              "Content-Length: 4\r\n"
+                              "\r\n"
+                              "body";
+
+/* Value of a header as a string, for the asserts */
+static int _tst_raw_value(const struct es_raw_msg_s * msg, const struct es_raw_hdr_s * hdr, const char * expected)
+{
+  size_t          len = hdr->valueEnd - hdr->value;
+  return (len == strlen(expected)) && (memcmp(msg->buf + hdr->value, expected, len) == 0);
+}
+
+static void test_raw_request_line(void)
+{
+  struct es_raw_msg_s msg;
+
+  CU_ASSERT_FATAL(es_raw_parse(&msg, req, sizeof(req) - 1) == ES_OK);
+  CU_ASSERT(msg.request == 1);
+  CU_ASSERT(msg.methodLen == 6);
+  CU_ASSERT(strncmp(req + msg.uri, "sip:bob@10.0.0.2:5070;transport=udp", msg.uriEnd - msg.uri) == 0);
+  CU_ASSERT(msg.uriEnd - msg.uri == strlen("sip:bob@10.0.0.2:5070;transport=udp"));
+  CU_ASSERT(req[msg.lineEnd] == 'V');
+  CU_ASSERT(strcmp(req + msg.hdrEnd, "body") == 0);
+}
+
+static void test_raw_status_line(void)
+{
+  static const char resp[] = "SIP/2.0 180 Ringing\r\nCSeq: 1 INVITE\r\n\r\n";
+  static const char empty[] = "SIP/2.0 200 OK\r\n\r\n";
+  struct es_raw_msg_s msg;
+
+  CU_ASSERT_FATAL(es_raw_parse(&msg, resp, sizeof(resp) - 1) == ES_OK);
+  CU_ASSERT(msg.request == 0);
+  CU_ASSERT(msg.status == 180);
+  CU_ASSERT(msg.hdrEnd == sizeof(resp) - 1);
+
+  /* No header at all */
+  CU_ASSERT_FATAL(es_raw_parse(&msg, empty, sizeof(empty) - 1) == ES_OK);
+  CU_ASSERT(msg.status == 200);
+  CU_ASSERT(msg.hdrEnd == sizeof(empty) - 1);
+}
+
+static void test_raw_bad(void)
+{
+  static const char * const bad[] = {
+    "",
+    "\r\n\r\n",
+    "SIP/2.0 099 Bad\r\n\r\n",
+    "SIP/2.0 2x0 Bad\r\n\r\n",
+    "SIP/2.0 20\r\n\r\n",
+    "INVITE\r\n\r\n",
+    "INVITE sip:bob@example.com\r\n\r\n",
+    "INVITE  SIP/2.0\r\n\r\n",
+    "INVITE sip:bob@example.com SIP/3.0\r\n\r\n",
+    "INVITE sip:bob@example.com SIP/2.0\r\nCSeq: 1 INVITE\r\n",
+    NULL
+  };
+  struct es_raw_msg_s msg;
+  unsigned int    i = 0;
+
+  for (i = 0; bad[i] != NULL; ++i) {
+    CU_ASSERT(es_raw_parse(&msg, bad[i], strlen(bad[i])) == ES_ERROR_BADPARAM);
+  }
+}
+
+static void test_raw_headers(void)
+{
+  struct es_raw_msg_s msg;
+  struct es_raw_hdr_s hdr;
+  size_t          offset = 0;
+
+  CU_ASSERT_FATAL(es_raw_parse(&msg, req, sizeof(req) - 1) == ES_OK);
+
+  /* Full and compact forms, in order */
+  CU_ASSERT_FATAL(es_raw_header_next(&msg, "via", 'v', &offset, &hdr) == 1);
+  CU_ASSERT(hdr.start == msg.lineEnd);
+  CU_ASSERT(offset == hdr.end);
+  CU_ASSERT_FATAL(es_raw_header_next(&msg, "via", 'v', &offset, &hdr) == 1);
+  CU_ASSERT(_tst_raw_value(&msg, &hdr, "SIP/2.0/UDP 10.0.0.3;branch=z9hG4bK2"));
+  CU_ASSERT(es_raw_header_next(&msg, "via", 'v', &offset, &hdr) == 0);
+  CU_ASSERT(offset == msg.hdrEnd);
+
+  /* Spaces trimmed */
+  offset = 0;
+  CU_ASSERT_FATAL(es_raw_header_next(&msg, "TO", 't', &offset, &hdr) == 1);
+  CU_ASSERT(_tst_raw_value(&msg, &hdr, "<sip:bob@example.com>"));
+
+  /* A continuation line is part of the header */
+  offset = 0;
+  CU_ASSERT_FATAL(es_raw_header_next(&msg, "Subject", 's', &offset, &hdr) == 1);
+  CU_ASSERT(_tst_raw_value(&msg, &hdr, "a long\r\n subject"));
+  CU_ASSERT(strncmp(req + hdr.end, "Call-ID:", 8) == 0);
+
+  /* Not in the body */
+  offset = 0;
+  CU_ASSERT(es_raw_header_next(&msg, "Route", '\0', &offset, &hdr) == 0);
+}
+
+static void test_raw_values(void)
+{
+  static const char list[] = "SIP/2.0 200 OK\r\nContact: \"A, B\" <sip:a@h;x=1,2>;q=0.5 , <sip:b@h>\r\n\r\n";
+  struct es_raw_msg_s msg;
+  struct es_raw_hdr_s hdr;
+  size_t          offset = 0;
+  size_t          end = 0;
+  size_t          len = 0;
+  const char    * p = NULL;
+
+  CU_ASSERT_FATAL(es_raw_parse(&msg, list, sizeof(list) - 1) == ES_OK);
+  CU_ASSERT_FATAL(es_raw_header_next(&msg, "Contact", 'm', &offset, &hdr) == 1);
+
+  /* Commas quoted or in a URI do not end a value */
+  end = es_raw_value_end(&msg, hdr.value, hdr.valueEnd);
+  CU_ASSERT(end - hdr.value == strlen("\"A, B\" <sip:a@h;x=1,2>;q=0.5"));
+
+  /* Parameters of the URI are not the ones of the value */
+  CU_ASSERT(es_raw_param(list + hdr.value, end - hdr.value, "x", &len) == NULL);
+  p = es_raw_param(list + hdr.value, end - hdr.value, "Q", &len);
+  CU_ASSERT(p != NULL && len == 3 && strncmp(p, "0.5", 3) == 0);
+}
+
+static void test_raw_uri(void)
+{
+  static const char from[] = "\"Alice\" <sip:alice:secret@Example.com:5080;user=phone>;tag=19";
+  static const char anon[] = "sip:example.com";
+  struct sockaddr_in addr;
+  const char    * user = NULL;
+  const char    * host = NULL;
+  const char    * port = NULL;
+  size_t          userLen = 0;
+  size_t          hostLen = 0;
+  size_t          portLen = 0;
+
+  CU_ASSERT(es_raw_uri_user(from, sizeof(from) - 1, &user, &userLen) == ES_OK);
+  CU_ASSERT(userLen == 5 && strncmp(user, "alice", 5) == 0);
+  CU_ASSERT(es_raw_uri_user(anon, sizeof(anon) - 1, &user, &userLen) == ES_ERROR_NOT_FOUND);
+  CU_ASSERT(es_raw_uri_user("tel:123", 7, &user, &userLen) == ES_ERROR_BADPARAM);
+
+  CU_ASSERT(es_raw_uri_host(from, sizeof(from) - 1, &host, &hostLen, &port, &portLen) == ES_OK);
+  CU_ASSERT(hostLen == 11 && strncmp(host, "Example.com", 11) == 0);
+  CU_ASSERT(portLen == 4 && strncmp(port, "5080", 4) == 0);
+
+  CU_ASSERT(es_raw_uri_addr("<sip:bob@10.0.0.2:5070>", 23, &addr) == ES_OK);
+  CU_ASSERT(addr.sin_addr.s_addr == inet_addr("10.0.0.2"));
+  CU_ASSERT(ntohs(addr.sin_port) == 5070);
+  CU_ASSERT(es_raw_uri_addr("sip:10.0.0.2", 12, &addr) == ES_OK);
+  CU_ASSERT(ntohs(addr.sin_port) == 5060);
+  CU_ASSERT(es_raw_uri_addr("sip:10.0.0.2:70000", 18, &addr) == ES_ERROR_BADPARAM);
+  CU_ASSERT(es_raw_uri_addr(from, sizeof(from) - 1, &addr) == ES_ERROR_NOTSUPPORTED);
+}
+
+static void test_raw_via(void)
+{
+  static const char via[] = "SIP/2.0/UDP 10.0.0.1:5062;branch=z9hG4bK1";
+  static const char nat[] = "SIP/2.0/UDP 10.0.0.1:5062;rport=5064;received=192.168.1.1";
+  static const char rport[] = "SIP/2.0/UDP 10.0.0.1;rport";
+  struct sockaddr_in addr;
+
+  CU_ASSERT(es_raw_via_addr(via, sizeof(via) - 1, &addr) == ES_OK);
+  CU_ASSERT(addr.sin_addr.s_addr == inet_addr("10.0.0.1"));
+  CU_ASSERT(ntohs(addr.sin_port) == 5062);
+
+  /* received and rport win over the sent-by */
+  CU_ASSERT(es_raw_via_addr(nat, sizeof(nat) - 1, &addr) == ES_OK);
+  CU_ASSERT(addr.sin_addr.s_addr == inet_addr("192.168.1.1"));
+  CU_ASSERT(ntohs(addr.sin_port) == 5064);
+
+  /* rport without value: not filled yet */
+  CU_ASSERT(es_raw_via_addr(rport, sizeof(rport) - 1, &addr) == ES_OK);
+  CU_ASSERT(ntohs(addr.sin_port) == 5060);
+}
+
+/* Concatenate the iovec, NUL terminated */
+static size_t _tst_raw_flatten(const struct iovec * iov, unsigned int nb, char * out, size_t size)
+{
+  size_t          len = 0;
+  unsigned int    i = 0;
+
+  for (i = 0; i < nb; ++i) {
+    CU_ASSERT_FATAL(len + iov[i].iov_len < size);
+    memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  out[len] = '\0';
+  return len;
+}
+
+static void test_raw_splice(void)
+{
+  static const char buf[] = "0123456789";
+  struct es_raw_edits_s edits;
+  struct iovec    iov[ES_RAW_MAX_IOV];
+  char            out[64];
+  unsigned int    nb = 0;
+  size_t          len = 0;
+
+  /* No edit: the buffer itself */
+  es_raw_edits_init(&edits, buf, 10);
+  nb = es_raw_iov(&edits, iov, &len);
+  CU_ASSERT(nb == 1);
+  CU_ASSERT(iov[0].iov_base == (void *) buf);
+  CU_ASSERT(len == 10);
+
+  /* Given in any order, applied by offset, inserts at the same offset in order */
+  CU_ASSERT(es_raw_splice(&edits, 8, 2, "", 0) == ES_OK);
+  CU_ASSERT(es_raw_splice(&edits, 2, 3, "ab", 2) == ES_OK);
+  CU_ASSERT(es_raw_splice(&edits, 0, 0, "<", 1) == ES_OK);
+  CU_ASSERT(es_raw_splice(&edits, 0, 0, "[", 1) == ES_OK);
+  CU_ASSERT(es_raw_splice(&edits, 10, 0, ">", 1) == ES_OK);
+
+  nb = es_raw_iov(&edits, iov, &len);
+  CU_ASSERT(nb <= ES_RAW_MAX_IOV);
+  CU_ASSERT(_tst_raw_flatten(iov, nb, out, sizeof(out)) == len);
+  CU_ASSERT(strcmp(out, "<[01ab567>") == 0);
+
+  /* Overlaps and out of the buffer */
+  CU_ASSERT(es_raw_splice(&edits, 3, 1, "x", 1) == ES_ERROR_OUTOFRANGE);
+  CU_ASSERT(es_raw_splice(&edits, 7, 2, "x", 1) == ES_ERROR_OUTOFRANGE);
+  CU_ASSERT(es_raw_splice(&edits, 9, 2, "x", 1) == ES_ERROR_OUTOFRANGE);
+  CU_ASSERT(es_raw_splice(&edits, 5, 1, "x", 1) == ES_OK);
+  CU_ASSERT(edits.nb == 6);
+}
+
+static void test_raw_splice_max(void)
+{
+  static const char buf[] = "0123456789abcdefghij";
+  struct es_raw_edits_s edits;
+  struct iovec    iov[ES_RAW_MAX_IOV];
+  char            out[64];
+  unsigned int    i = 0;
+  size_t          len = 0;
+
+  /* Every other byte replaced: the most entries */
+  es_raw_edits_init(&edits, buf, sizeof(buf) - 1);
+  for (i = 0; i < ES_RAW_MAX_EDITS; ++i) {
+    CU_ASSERT(es_raw_splice(&edits, 2 * i + 1, 1, "-", 1) == ES_OK);
+  }
+  CU_ASSERT(es_raw_splice(&edits, 19, 0, "x", 1) == ES_ERROR_OUTOFRANGE);
+
+  CU_ASSERT_FATAL(es_raw_iov(&edits, iov, &len) == ES_RAW_MAX_IOV);
+  CU_ASSERT(_tst_raw_flatten(iov, ES_RAW_MAX_IOV, out, sizeof(out)) == len);
+  CU_ASSERT(strcmp(out, "0-2-4-6-8-a-c-e-ghij") == 0);
+}
+
+static CU_TestInfo     all_raw_test[] = {
+  {"Request line", test_raw_request_line},
+  {"Status line", test_raw_status_line},
+  {"Not SIP", test_raw_bad},
+  {"Headers", test_raw_headers},
+  {"Values and parameters", test_raw_values},
+  {"URIs", test_raw_uri},
+  {"Via", test_raw_via},
+  {"Splice", test_raw_splice},
+  {"Most edits", test_raw_splice_max},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    raw_tests_suites[] = {
+  {"Raw Message Tests", NULL, NULL, all_raw_test},
+
+  CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <osipparser2/osip_port.h>
+#include <osipparser2/osip_parser.h>
+
+#include <event2/event.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "essnap.h"
+#include "esconfig.h"
+#include "esupgrade.h"
+#include "esregistrar.h"
+
+#define TST_REG_AOR     "alice@example.com"
+
+static struct event_base * base = NULL;
+static es_registrar_t * registrar = NULL;
+static struct es_config_s cfg;
+
+/* Types of the journal records, in order */
+static uint16_t journal[8];
+static unsigned int journalNb = 0;
+
+static void _tst_reg_journal(void * arg, uint16_t type, const uint8_t * value, size_t len)
+{
+  if (journalNb < sizeof(journal) / sizeof(journal[0])) {
+    journal[journalNb] = type;
+  }
+  journalNb++;
+}
+
+/* Parse a REGISTER of alice, expires < 0 leaves the Expires header out */
+static osip_message_t * _tst_reg_msg(const char * callId, unsigned int cseq, const char * contacts, int expires)
+{
+  osip_message_t * sip = NULL;
+  char            msg[1024];
+  char            hdr[32] = "";
+
+  if (expires >= 0) {
+    snprintf(hdr, sizeof(hdr), "Expires: %d\r\n", expires);
+  }
+
+  snprintf(msg, sizeof(msg), "REGISTER sip:Example.COM SIP/2.0\r\n"
+           "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK%s%u\r\n"
+           "From: <sip:alice@Example.COM>;tag=19\r\n"
+           "To: <sip:alice@Example.COM>\r\n"
+           "Call-ID: %s\r\n"
+           "CSeq: %u REGISTER\r\n"
+           "%s"
+           "%s"
+           "Content-Length: 0\r\n\r\n",
+           callId, cseq, callId, cseq, contacts, hdr);
+
+  if (osip_message_init(&sip) != OSIP_SUCCESS) {
+    return NULL;
+  }
+  if (osip_message_parse(sip, msg, strlen(msg)) != OSIP_SUCCESS) {
+    osip_message_free(sip);
+    return NULL;
+  }
+  return sip;
+}
+
+static int _tst_reg(const char * callId, unsigned int cseq, const char * contacts, int expires)
+{
+  osip_message_t * sip = _tst_reg_msg(callId, cseq, contacts, expires);
+  int             code = 0;
+
+  CU_ASSERT_FATAL(sip != NULL);
+  code = es_registrar_update(registrar, sip);
+  osip_message_free(sip);
+  return code;
+}
+
+static unsigned int _tst_reg_count(void)
+{
+  struct es_registrar_contact_s contacts[ES_REGISTRAR_MAX_CONTACTS];
+  return es_registrar_lookup(registrar, TST_REG_AOR, contacts, ES_REGISTRAR_MAX_CONTACTS);
+}
+
+static int init_suite_registrar(void)
+{
+  parser_init();
+  es_config_defaults(&cfg);
+
+  /* The expiry tick runs at the low priority of the SIP loop */
+  base = event_base_new();
+  if ((base == NULL) || (event_base_priority_init(base, 2) != 0)) {
+    return 1;
+  }
+  if (es_registrar_init(&registrar, base) != ES_OK) {
+    return 1;
+  }
+  return (es_registrar_configure(registrar, &cfg) != ES_OK);
+}
+
+static int clean_suite_registrar(void)
+{
+  es_registrar_deinit(registrar);
+  registrar = NULL;
+  event_base_free(base);
+  base = NULL;
+  return 0;
+}
+
+static void test_registrar_bind(void)
+{
+  struct es_registrar_contact_s contacts[ES_REGISTRAR_MAX_CONTACTS];
+
+  CU_ASSERT(_tst_reg("c1", 1, "Contact: <sip:a0@10.0.0.1>\r\nContact: <sip:a1@10.0.0.1>;expires=120\r\n", 600) == SIP_OK);
+  CU_ASSERT(es_registrar_lookup(registrar, TST_REG_AOR, contacts, ES_REGISTRAR_MAX_CONTACTS) == 2);
+  CU_ASSERT(es_registrar_lookup(registrar, "alice@other.com", contacts, ES_REGISTRAR_MAX_CONTACTS) == 0);
+
+  /* A query changes nothing */
+  CU_ASSERT(_tst_reg("c1", 2, "", -1) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 2);
+}
+
+static void test_registrar_cseq(void)
+{
+  /* Same Call-ID and CSeq: a retransmission, nothing applied again */
+  CU_ASSERT(_tst_reg("c1", 1, "Contact: <sip:a0@10.0.0.1>\r\n", 0) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  /* Same Call-ID, older CSeq: out of order */
+  CU_ASSERT(_tst_reg("c1", 0, "Contact: <sip:a0@10.0.0.1>\r\n", 600) == SIP_INTERNAL_SERVER_ERROR);
+  CU_ASSERT(_tst_reg("c1", 0, "Contact: <sip:a0@10.0.0.1>\r\n", 0) == SIP_INTERNAL_SERVER_ERROR);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  /* Another Call-ID restarts the sequence */
+  CU_ASSERT(_tst_reg("c2", 1, "Contact: <sip:a0@10.0.0.1>\r\n", 600) == SIP_OK);
+  CU_ASSERT(_tst_reg("c2", 2, "Contact: <sip:a0@10.0.0.1>\r\n", 600) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 2);
+}
+
+static void test_registrar_too_brief(void)
+{
+  osip_message_t * sip = NULL;
+  osip_message_t * resp = NULL;
+  osip_header_t  * hdr = NULL;
+  char            min[16];
+
+  /* Nothing applied when one contact is too brief */
+  CU_ASSERT(_tst_reg("c3", 1, "Contact: <sip:a2@10.0.0.1>\r\nContact: <sip:a3@10.0.0.1>;expires=1\r\n", 600) ==
+            SIP_INTERVAL_TOO_BRIEF);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  sip = _tst_reg_msg("c3", 2, "Contact: <sip:a3@10.0.0.1>\r\n", 1);
+  CU_ASSERT_FATAL(sip != NULL);
+  CU_ASSERT(es_registrar_update(registrar, sip) == SIP_INTERVAL_TOO_BRIEF);
+
+  CU_ASSERT_FATAL(osip_message_init(&resp) == OSIP_SUCCESS);
+  osip_message_set_status_code(resp, SIP_INTERVAL_TOO_BRIEF);
+  CU_ASSERT(es_registrar_answer(registrar, sip, resp) == ES_OK);
+
+  snprintf(min, sizeof(min), "%u", cfg.registrarMinExpires);
+  CU_ASSERT(osip_message_header_get_byname(resp, "Min-Expires", 0, &hdr) >= 0);
+  CU_ASSERT(hdr != NULL && hdr->hvalue != NULL && strcmp(hdr->hvalue, min) == 0);
+
+  osip_message_free(resp);
+  osip_message_free(sip);
+
+  /* Removing a binding is never too brief */
+  CU_ASSERT(_tst_reg("c1", 3, "Contact: <sip:a1@10.0.0.1>;expires=0\r\n", -1) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 1);
+}
+
+static void test_registrar_wildcard(void)
+{
+  CU_ASSERT(_tst_reg("c4", 2, "Contact: <sip:a4@10.0.0.1>\r\n", 600) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  /* Alone and with Expires: 0 only */
+  CU_ASSERT(_tst_reg("c4", 3, "Contact: *\r\n", -1) == SIP_BAD_REQUEST);
+  CU_ASSERT(_tst_reg("c4", 3, "Contact: *\r\n", 600) == SIP_BAD_REQUEST);
+  CU_ASSERT(_tst_reg("c4", 3, "Contact: *\r\nContact: <sip:a5@10.0.0.1>\r\n", 0) == SIP_BAD_REQUEST);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  /* Older than a binding of the same Call-ID */
+  CU_ASSERT(_tst_reg("c4", 1, "Contact: *\r\n", 0) == SIP_INTERNAL_SERVER_ERROR);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  /* Same CSeq: already applied, the bindings stay */
+  CU_ASSERT(_tst_reg("c4", 2, "Contact: *\r\n", 0) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 2);
+
+  CU_ASSERT(_tst_reg("c4", 3, "Contact: *\r\n", 0) == SIP_OK);
+  CU_ASSERT(_tst_reg_count() == 0);
+
+  /* Nothing left to remove */
+  CU_ASSERT(_tst_reg("c5", 1, "Contact: *\r\n", 0) == SIP_OK);
+}
+
+static void test_registrar_journal(void)
+{
+  struct es_upgrade_journal_s j = { _tst_reg_journal, NULL };
+
+  CU_ASSERT_FATAL(es_registrar_set_journal(registrar, &j) == ES_OK);
+
+  journalNb = 0;
+  CU_ASSERT(_tst_reg("c6", 1, "Contact: <sip:a6@10.0.0.1>\r\n", 600) == SIP_OK);
+  CU_ASSERT(journalNb == 1);
+  CU_ASSERT(journal[0] == ES_UPGRADE_REC_REGISTRATION);
+
+  /* Another Call-ID: the old binding is removed in the journal too */
+  journalNb = 0;
+  CU_ASSERT(_tst_reg("c7", 1, "Contact: <sip:a6@10.0.0.1>\r\n", 600) == SIP_OK);
+  CU_ASSERT(journalNb == 2);
+  CU_ASSERT(journal[0] == ES_UPGRADE_REC_UNREGISTRATION);
+  CU_ASSERT(journal[1] == ES_UPGRADE_REC_REGISTRATION);
+  CU_ASSERT(_tst_reg_count() == 1);
+
+  /* Removed then given again in one request */
+  journalNb = 0;
+  CU_ASSERT(_tst_reg("c7", 2, "Contact: <sip:a6@10.0.0.1>;expires=0\r\nContact: <sip:a6@10.0.0.1>\r\n", 600) ==
+            SIP_OK);
+  CU_ASSERT(journalNb == 2);
+  CU_ASSERT(_tst_reg_count() == 1);
+
+  journalNb = 0;
+  CU_ASSERT(_tst_reg("c7", 3, "Contact: *\r\n", 0) == SIP_OK);
+  CU_ASSERT(journalNb == 1);
+  CU_ASSERT(_tst_reg_count() == 0);
+
+  CU_ASSERT(es_registrar_set_journal(registrar, NULL) == ES_OK);
+}
+
+static CU_TestInfo     all_registrar_test[] = {
+  {"Bind and query", test_registrar_bind},
+  {"Out of order CSeq", test_registrar_cseq},
+  {"Interval too brief", test_registrar_too_brief},
+  {"Contact: *", test_registrar_wildcard},
+  {"Journal", test_registrar_journal},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    registrar_tests_suites[] = {
+  {"Registrar Tests", init_suite_registrar, clean_suite_registrar, all_registrar_test},
+
+  CU_SUITE_INFO_NULL,
+};
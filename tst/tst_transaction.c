@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "escli.h"
+#include "esstats.h"
+#include "esosip.h"
+
+static struct event_base * base = NULL;
+static es_osip_t * stack = NULL;
+
+/* Feed a request from a client of 10.0.0.1 to the stack */
+static void _tst_tr_request(const char * method, const char * branch, unsigned int cseq)
+{
+  char msg[1024];
+  int  len = 0;
+
+  len = snprintf(msg, sizeof(msg), "%s sip:bob@127.0.0.1 SIP/2.0\r\n"
+                 "Via: SIP/2.0/UDP 10.0.0.1:5060;branch=z9hG4bK%s\r\n"
+                 "Max-Forwards: 70\r\n"
+                 "From: <sip:alice@10.0.0.1>;tag=19\r\n"
+                 "To: <sip:bob@127.0.0.1>\r\n"
+                 "Call-ID: %s@10.0.0.1\r\n"
+                 "CSeq: %u %s\r\n"
+                 "Contact: <sip:alice@10.0.0.1>\r\n"
+                 "Content-Length: 0\r\n\r\n",
+                 method, branch, branch, cseq, method);
+
+  CU_ASSERT_FATAL(es_osip_parse_msg(stack, msg, (unsigned int)len) == ES_OK);
+}
+
+static int64_t _tst_tr_created(void)
+{
+  int64_t values[ES_STATS_MAX];
+
+  es_stats_snapshot(values);
+  return values[ES_STATS_TR_CREATED];
+}
+
+static int init_suite_transaction(void)
+{
+  base = event_base_new();
+  if ((base == NULL) || (event_base_priority_init(base, 2) != 0)) {
+    return -1;
+  }
+  if (es_osip_init(&stack, base) != ES_OK) {
+    return -1;
+  }
+  return 0;
+}
+
+static int clean_suite_transaction(void)
+{
+  /* Run what the requests queued before the stack goes */
+  event_base_loop(base, EVLOOP_NONBLOCK);
+  es_osip_deinit(stack);
+  event_base_free(base);
+  return 0;
+}
+
+static void test_transaction_non_invite(void)
+{
+  int64_t created = _tst_tr_created();
+
+  _tst_tr_request("OPTIONS", "a1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 1);
+
+  /* Same branch: the retransmission goes to the transaction already there */
+  _tst_tr_request("OPTIONS", "a1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 1);
+
+  /* Answered now, still there to answer it again */
+  event_base_loop(base, EVLOOP_NONBLOCK);
+  _tst_tr_request("OPTIONS", "a1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 1);
+
+  /* A new branch is a new request */
+  _tst_tr_request("OPTIONS", "a2", 2);
+  CU_ASSERT(_tst_tr_created() == created + 2);
+}
+
+static void test_transaction_invite(void)
+{
+  int64_t created = _tst_tr_created();
+
+  _tst_tr_request("INVITE", "b1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 1);
+
+  _tst_tr_request("INVITE", "b1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 1);
+
+  /* CANCEL has the INVITE branch but a transaction of its own */
+  _tst_tr_request("CANCEL", "b1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 2);
+
+  _tst_tr_request("CANCEL", "b1", 1);
+  CU_ASSERT(_tst_tr_created() == created + 2);
+}
+
+static CU_TestInfo     all_transaction_test[] = {
+  {"Non INVITE retransmission", test_transaction_non_invite},
+  {"INVITE retransmission", test_transaction_invite},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    transaction_tests_suites[] = {
+  {"Transaction Tests", init_suite_transaction, clean_suite_transaction, all_transaction_test},
+
+  CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <CUnit/CUnit.h>
+#include <CUnit/TestDB.h>
+#include <CUnit/Basic.h>
+
+#include "eserror.h"
+#include "eswheel.h"
+
+#define TST_WHEEL_START   ((1ULL << 16) - 16)
+
+struct tst_timer_s {
+  struct es_wheel_entry_s entry;
+  uint64_t        fired_at;
+  int             fired;
+  int             rearm;
+};
+
+static es_wheel_t   *   wheel = NULL;
+static uint64_t         cur = 0;
+
+static void _tst_wheel_cb(struct es_wheel_entry_s * entry, void * arg)
+{
+  struct tst_timer_s * t = (struct tst_timer_s *) entry;
+
+  t->fired_at = cur;
+  t->fired++;
+
+  if (t->rearm > 0) {
+    t->rearm--;
+    es_wheel_add(wheel, &t->entry, cur);
+  }
+}
+
+static int init_suite_wheel(void)
+{
+  cur = TST_WHEEL_START;
+  return (es_wheel_init(&wheel, cur, _tst_wheel_cb, NULL) != ES_OK);
+}
+
+static int clean_suite_wheel(void)
+{
+  es_wheel_deinit(wheel);
+  wheel = NULL;
+  return 0;
+}
+
+static void test_wheel_cascade(void)
+{
+  /* Around the ends of the first and second wheels, from a start just below one */
+  static const uint64_t offsets[] = { 1, 2, 15, 16, 17, 255, 256, 257, 511, 4095,
+                                      65535, 65536, 65537, 65551, 65552, 131072, 200000 };
+  struct tst_timer_s timers[sizeof(offsets) / sizeof(offsets[0])];
+  unsigned int    n = sizeof(offsets) / sizeof(offsets[0]);
+  unsigned int    fired = 0;
+  unsigned int    i = 0;
+  uint64_t        start = cur;
+
+  memset(timers, 0, sizeof(timers));
+  for (i = 0; i < n; ++i) {
+    es_wheel_add(wheel, &timers[i].entry, start + offsets[i]);
+    CU_ASSERT(es_wheel_pending(&timers[i].entry));
+  }
+  CU_ASSERT(es_wheel_count(wheel) == n);
+
+  for (cur = start + 1; cur <= start + offsets[n - 1]; ++cur) {
+    fired += es_wheel_advance(wheel, cur);
+  }
+  --cur;
+
+  CU_ASSERT(fired == n);
+  CU_ASSERT(es_wheel_count(wheel) == 0);
+  for (i = 0; i < n; ++i) {
+    CU_ASSERT(timers[i].fired == 1);
+    CU_ASSERT(timers[i].fired_at == start + offsets[i]);
+    CU_ASSERT(!es_wheel_pending(&timers[i].entry));
+  }
+}
+
+static void test_wheel_last_level(void)
+{
+  struct tst_timer_s t;
+  uint64_t        expire = cur + (1ULL << (ES_WHEEL_BITS * 3)) + 3;
+
+  memset(&t, 0, sizeof(t));
+  es_wheel_add(wheel, &t.entry, expire);
+
+  cur = expire - 1;
+  CU_ASSERT(es_wheel_advance(wheel, cur) == 0);
+  CU_ASSERT(es_wheel_pending(&t.entry));
+
+  cur = expire;
+  CU_ASSERT(es_wheel_advance(wheel, cur) == 1);
+  CU_ASSERT(t.fired == 1);
+  CU_ASSERT(!es_wheel_pending(&t.entry));
+}
+
+static void test_wheel_past(void)
+{
+  struct tst_timer_s t;
+
+  memset(&t, 0, sizeof(t));
+  /* Already due: expired at the next tick */
+  es_wheel_add(wheel, &t.entry, cur - 5);
+  cur++;
+  CU_ASSERT(es_wheel_advance(wheel, cur) == 1);
+  CU_ASSERT(t.fired == 1);
+  CU_ASSERT(t.fired_at == cur);
+}
+
+static void test_wheel_move_remove(void)
+{
+  struct tst_timer_s a;
+  struct tst_timer_s b;
+  uint64_t        start = cur;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  es_wheel_add(wheel, &a.entry, start + 10);
+  es_wheel_add(wheel, &b.entry, start + 20);
+  es_wheel_add(wheel, &a.entry, start + 300);
+  CU_ASSERT(es_wheel_count(wheel) == 2);
+
+  es_wheel_remove(wheel, &b.entry);
+  es_wheel_remove(wheel, &b.entry);
+  CU_ASSERT(es_wheel_count(wheel) == 1);
+  CU_ASSERT(!es_wheel_pending(&b.entry));
+
+  for (cur = start + 1; cur <= start + 300; ++cur) {
+    es_wheel_advance(wheel, cur);
+  }
+  --cur;
+
+  CU_ASSERT(a.fired == 1);
+  CU_ASSERT(a.fired_at == start + 300);
+  CU_ASSERT(b.fired == 0);
+  CU_ASSERT(es_wheel_count(wheel) == 0);
+}
+
+static void test_wheel_rearm(void)
+{
+  struct tst_timer_s t;
+
+  memset(&t, 0, sizeof(t));
+  /* Added again from its callback at the current tick: runs at the next one */
+  t.rearm = 1;
+  es_wheel_add(wheel, &t.entry, cur + 1);
+
+  cur++;
+  CU_ASSERT(es_wheel_advance(wheel, cur) == 1);
+  CU_ASSERT(es_wheel_pending(&t.entry));
+
+  cur++;
+  CU_ASSERT(es_wheel_advance(wheel, cur) == 1);
+  CU_ASSERT(t.fired == 2);
+  CU_ASSERT(t.fired_at == cur);
+  CU_ASSERT(es_wheel_count(wheel) == 0);
+}
+
+static CU_TestInfo     all_wheel_test[] = {
+  {"Cascade across the wheels", test_wheel_cascade},
+  {"Last wheel", test_wheel_last_level},
+  {"Timer already due", test_wheel_past},
+  {"Move and remove", test_wheel_move_remove},
+  {"Added from the callback", test_wheel_rearm},
+
+  CU_TEST_INFO_NULL,
+};
+
+CU_SuiteInfo    wheel_tests_suites[] = {
+  {"Timing Wheel Tests", init_suite_wheel, clean_suite_wheel, all_wheel_test},
+
+  CU_SUITE_INFO_NULL,
+};